@@ -0,0 +1,166 @@
+#include "../include/checksum.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Checksum microbenchmark: checks every kernel against the scalar loop
+ * (odd lengths and unaligned starts included), then times each one across
+ * payload sizes from a ping probe to a 64 KB datagram. The CRC32C kernels
+ * used for payload verification get the same treatment.
+ *
+ *   make checksum_bench && ./checksum_bench [MB per measurement]
+ */
+
+#define BENCH_MAX_SIZE 65536
+#define BENCH_MAX_KERNELS 8
+
+static const size_t sizes[] = { 64, 128, 256, 512, 1024, 1500, 4096, 9000, 16384, 65536 };
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int verify(const checksum_kernel_t *kernels, int count, const unsigned char *data) {
+    int failures = 0;
+    for (size_t len = 0; len <= 2048; len++) {
+        for (size_t offset = 0; offset < 4; offset++) {
+            uint16_t expected = checksum_scalar(data + offset, len);
+            for (int k = 1; k < count; k++) {
+                if (kernels[k].fn(data + offset, len) != expected && failures++ < 10) {
+                    fprintf(stderr, "%s: mismatch at length %zu, offset %zu\n", kernels[k].name, len, offset);
+                }
+            }
+        }
+    }
+    for (int k = 1; k < count; k++) {
+        if (kernels[k].fn(data, BENCH_MAX_SIZE) != checksum_scalar(data, BENCH_MAX_SIZE) && failures++ < 10) {
+            fprintf(stderr, "%s: mismatch at length %d\n", kernels[k].name, BENCH_MAX_SIZE);
+        }
+    }
+    return failures;
+}
+
+static int verify_crc32c(const crc32c_kernel_t *kernels, int count, const unsigned char *data) {
+    int failures = 0;
+    for (size_t len = 0; len <= 8192; len += len < 64 ? 1 : 61) {
+        for (size_t offset = 0; offset < 4; offset++) {
+            uint32_t expected = kernels[0].fn(0, data + offset, len);
+            for (int k = 1; k < count; k++) {
+                if (kernels[k].fn(0, data + offset, len) != expected && failures++ < 10) {
+                    fprintf(stderr, "%s: CRC32C mismatch at length %zu, offset %zu\n", kernels[k].name, len, offset);
+                }
+            }
+        }
+    }
+    return failures;
+}
+
+// Same layout as the checksum table, for the block sizes a verified stream uses
+static void bench_crc32c(const unsigned char *data, double megabytes) {
+    crc32c_kernel_t kernels[BENCH_MAX_KERNELS];
+    int count = crc32c_kernels(kernels, BENCH_MAX_KERNELS);
+    if (kernels[0].fn(0, "123456789", 9) != 0xe3069283 || verify_crc32c(kernels, count, data) > 0) {
+        fprintf(stderr, "CRC32C kernels disagree\n");
+        return;
+    }
+    printf("\nCRC32C kernels agree; runtime selection: %s\n", crc32c_kernel_name());
+    printf("%8s", "bytes");
+    for (int k = 0; k < count; k++) printf(" %16s", kernels[k].name);
+    printf("   (ns per call, GB/s; best vs table)\n");
+
+    volatile uint32_t sink = 0;
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        size_t len = sizes[s];
+        long iterations = (long)(megabytes * 1024 * 1024 / len);
+        if (iterations < 1) iterations = 1;
+        double table_ns = 0, best_ns = 0;
+
+        printf("%8zu", len);
+        for (int k = 0; k < count; k++) {
+            for (long i = 0; i < iterations / 16 + 1; i++) sink ^= kernels[k].fn(0, data, len);
+            double start = now_seconds();
+            for (long i = 0; i < iterations; i++) sink ^= kernels[k].fn(0, data, len);
+            double ns = (now_seconds() - start) * 1e9 / iterations;
+            if (k == 0) table_ns = ns;
+            if (k == 0 || ns < best_ns) best_ns = ns;
+            printf(" %8.1f %6.2f ", ns, len / ns);
+        }
+        printf("  %.1fx\n", best_ns > 0 ? table_ns / best_ns : 0.0);
+    }
+    (void)sink;
+}
+
+int main(int argc, char *argv[]) {
+    double megabytes = argc > 1 ? atof(argv[1]) : 256;
+    if (megabytes <= 0) megabytes = 256;
+
+    unsigned char *data = malloc(BENCH_MAX_SIZE + 8);
+    if (!data) {
+        perror("Malloc failed");
+        return 1;
+    }
+    srand(1);
+    for (int i = 0; i < BENCH_MAX_SIZE + 8; i++) data[i] = rand() & 0xff;
+
+    checksum_kernel_t kernels[BENCH_MAX_KERNELS];
+    int count = checksum_kernels(kernels, BENCH_MAX_KERNELS);
+    if (verify(kernels, count, data) > 0) {
+        fprintf(stderr, "Kernels disagree with the scalar checksum\n");
+        free(data);
+        return 1;
+    }
+    printf("Checksum kernels agree with scalar; runtime selection: %s\n", checksum_kernel_name());
+
+    printf("%8s", "bytes");
+    for (int k = 0; k < count; k++) printf(" %16s", kernels[k].name);
+    printf("   (ns per call, GB/s; best vs scalar)\n");
+
+    volatile uint16_t sink = 0;
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        size_t len = sizes[s];
+        long iterations = (long)(megabytes * 1024 * 1024 / len);
+        if (iterations < 1) iterations = 1;
+        double scalar_ns = 0, best_ns = 0;
+
+        printf("%8zu", len);
+        for (int k = 0; k < count; k++) {
+            for (long i = 0; i < iterations / 16 + 1; i++) sink ^= kernels[k].fn(data, len);
+            double start = now_seconds();
+            for (long i = 0; i < iterations; i++) sink ^= kernels[k].fn(data, len);
+            double ns = (now_seconds() - start) * 1e9 / iterations;
+            if (k == 0) scalar_ns = ns;
+            if (k == 0 || ns < best_ns) best_ns = ns;
+            printf(" %8.1f %6.2f ", ns, len / ns);
+        }
+        printf("  %.1fx\n", best_ns > 0 ? scalar_ns / best_ns : 0.0);
+    }
+
+    // RFC 1624 update versus recomputing after a one-word change, as a ping probe does
+    unsigned char probe[1500];
+    memcpy(probe, data, sizeof(probe));
+    uint16_t check = checksum(probe, sizeof(probe));
+    long iterations = 10 * 1000 * 1000;
+    double start = now_seconds();
+    for (long i = 0; i < iterations; i++) {
+        uint16_t old_word, new_word = (uint16_t)i;
+        memcpy(&old_word, probe + 6, sizeof(old_word));
+        memcpy(probe + 6, &new_word, sizeof(new_word));
+        check = checksum_update16(check, old_word, new_word);
+    }
+    double update_ns = (now_seconds() - start) * 1e9 / iterations;
+    // 0x0000 and 0xffff are the two ones' complement zeros
+    uint16_t full = checksum(probe, sizeof(probe));
+    int consistent = check == full || (check == 0 && full == 0xffff) || (check == 0xffff && full == 0);
+    printf("RFC 1624 update of a 1500-byte probe: %.1f ns per call (%s)\n", update_ns,
+           consistent ? "matches a full recompute" : "MISMATCH");
+
+    bench_crc32c(data, megabytes);
+
+    free(data);
+    (void)sink;
+    return consistent ? 0 : 1;
+}
@@ -0,0 +1,139 @@
+#!/bin/sh
+#
+# Loopback regression run: starts a lan_speed server as a child on
+# 127.0.0.1, runs a fixed matrix of TCP and UDP uploads and downloads and
+# UDP pings, and compares each result with bench/baseline.txt. A result
+# slower than the tolerance band allows fails the run; one faster than the
+# band is reported, as the baseline is probably stale.
+#
+#   make bench                    compare against the baseline
+#   make bench-baseline           rewrite the baseline from this machine
+#
+# Environment: BENCH_TOLERANCE (percent, default 30), BENCH_DURATION (seconds
+# per throughput run, default 2), BENCH_RUNS (best of N, default 1; pings
+# take the best of BENCH_PING_RUNS, default 3, as they are short and noisy),
+# BENCH_UDP_RATE (-b for the UDP rows, default 200M), BENCH_PORT (default
+# 9890), BENCH_BASELINE, LAN_SPEED.
+#
+# The UDP rows are paced, as unpaced UDP on loopback mostly measures how
+# many datagrams the receiver drops. The server batches with the same -B as
+# the client and sends downloads at the client's -l and -b, which travel in
+# the control header.
+#
+# Throughput is compared in bits/s, where higher is better; the ping rows
+# compare RTT in ns, where lower is better. A baseline row may carry its own
+# band as a third column, which the p99 rows get since tail latency on a
+# shared host moves far more than the medians. A baseline records one
+# machine, so regenerate it before comparing on another.
+
+LAN_SPEED=${LAN_SPEED:-./lan_speed}
+BASELINE=${BENCH_BASELINE:-bench/baseline.txt}
+TOLERANCE=${BENCH_TOLERANCE:-30}
+DURATION=${BENCH_DURATION:-2}
+RUNS=${BENCH_RUNS:-1}
+PING_RUNS=${BENCH_PING_RUNS:-3}
+PORT=${BENCH_PORT:-9890}
+UDP_RATE=${BENCH_UDP_RATE:-200M}
+UDP_BATCH=32
+PING_COUNT=5000
+PING_INTERVAL=0.0001
+TAIL_TOLERANCE=200
+
+update=0
+if [ "$1" = "--update" ]; then
+    update=1
+elif [ -n "$1" ]; then
+    echo "Usage: $0 [--update]" >&2
+    exit 2
+fi
+if [ $update -eq 0 ] && [ ! -f "$BASELINE" ]; then
+    echo "No baseline at $BASELINE; run make bench-baseline first" >&2
+    exit 2
+fi
+
+results=$(mktemp)
+"$LAN_SPEED" -m server -p "$PORT" -B $UDP_BATCH -v error >/dev/null 2>&1 &
+server=$!
+trap 'kill $server 2>/dev/null; rm -f "$results"' EXIT INT TERM
+sleep 0.5
+if ! kill -0 $server 2>/dev/null; then
+    echo "Server failed to start on port $PORT" >&2
+    exit 2
+fi
+
+# Prints one field of the first summary record from the given side and stream 0
+summary_field() {
+    grep '"event":"summary"' | grep "\"side\":\"$1\"" | grep '"stream":0' | head -n 1 |
+        sed -n "s/.*\"$2\":\([0-9.]*\).*/\1/p"
+}
+
+# run NAME SIDE FIELD RUNS lan_speed-client-args...; keeps the best of RUNS
+run() {
+    name=$1 side=$2 field=$3 runs=$4
+    shift 4
+    best=
+    i=0
+    while [ $i -lt "$runs" ]; do
+        value=$("$LAN_SPEED" -m client -a 127.0.0.1 -p "$PORT" -f json "$@" 2>/dev/null | summary_field "$side" "$field")
+        if [ -n "$value" ]; then
+            case $name in
+                *_ns) best=$(awk -v a="$best" -v b="$value" 'BEGIN { print (a == "" || b + 0 < a + 0) ? b : a }') ;;
+                *) best=$(awk -v a="$best" -v b="$value" 'BEGIN { print (a == "" || b + 0 > a + 0) ? b : a }') ;;
+            esac
+        fi
+        i=$((i + 1))
+        sleep 0.2
+    done
+    echo "$name ${best:-0}" >> "$results"
+    printf '%-32s %s\n' "$name" "${best:-no result}"
+}
+
+for streams in 1 4; do
+    for write in 8K 128K; do
+        run "tcp_upload_L${write}_P${streams}_bps" server bits_per_second "$RUNS" -t upload -d "$DURATION" -L "$write" -P "$streams"
+        run "tcp_download_L${write}_P${streams}_bps" client bits_per_second "$RUNS" -t download -d "$DURATION" -L "$write" -P "$streams"
+    done
+done
+for length in 512 1472; do
+    run "udp_upload_l${length}_bps" server bits_per_second "$RUNS" -t upload -r udp -d "$DURATION" \
+        -B $UDP_BATCH -l "$length" -b "$UDP_RATE"
+    run "udp_download_l${length}_bps" client bits_per_second "$RUNS" -t download -r udp -d "$DURATION" \
+        -B $UDP_BATCH -l "$length" -b "$UDP_RATE"
+done
+for size in 64 1024; do
+    run "udp_ping_s${size}_p50_ns" client rtt_p50_ns "$PING_RUNS" -t ping -r udp -d $PING_COUNT -i $PING_INTERVAL -s "$size"
+    run "udp_ping_s${size}_p99_ns" client rtt_p99_ns "$PING_RUNS" -t ping -r udp -d $PING_COUNT -i $PING_INTERVAL -s "$size"
+done
+
+if [ $update -eq 1 ]; then
+    {
+        echo "# lan_speed loopback baseline: name value [tolerance %] (bits/s, or ns for *_ns)"
+        echo "# $(uname -srm), $(nproc) CPUs, ${DURATION} s per throughput run, UDP paced at $UDP_RATE"
+        awk -v tail=$TAIL_TOLERANCE '{ print $0 ($1 ~ /_p99_ns$/ ? " " tail : "") }' "$results"
+    } > "$BASELINE"
+    echo "Baseline written to $BASELINE"
+    exit 0
+fi
+
+echo
+awk -v tolerance="$TOLERANCE" '
+    FNR == NR {
+        if ($1 !~ /^#/ && NF >= 2) { base[$1] = $2; band[$1] = NF >= 3 ? $3 : tolerance }
+        next
+    }
+    {
+        name = $1; value = $2
+        if (!(name in base)) { printf "%-32s new, not in the baseline\n", name; next }
+        change = base[name] > 0 ? (value - base[name]) * 100 / base[name] : 0
+        better = name ~ /_ns$/ ? -change : change
+        status = "ok"
+        if (value == 0) { status = "FAIL: no result"; failed++ }
+        else if (better < -band[name]) { status = "FAIL: regression beyond " band[name] "%"; failed++ }
+        else if (better > band[name]) { status = "faster than the baseline, consider make bench-baseline" }
+        printf "%-32s %+7.1f%%  %s\n", name, change, status
+    }
+    END {
+        if (failed) { printf "%d of %d results regressed past their band\n", failed, FNR; exit 1 }
+        printf "No regressions past the bands (default %s%%)\n", tolerance
+    }
+' "$BASELINE" "$results"
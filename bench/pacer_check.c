@@ -0,0 +1,98 @@
+#include "../include/udp_flow.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+/*
+ * Pacer check: sends real datagrams to a discard socket on loopback under
+ * udp_pacer_wait and fails if the offered rate strays from the target by
+ * more than the tolerance. Each case charges the pacer one send's worth of
+ * bytes, the way the UDP senders do, from single 1472-byte datagrams up to
+ * batches of 32.
+ *
+ *   make pacer_check && ./pacer_check [seconds per case] [tolerance %]
+ */
+
+#define CHECK_DATAGRAM_MAX 32768
+
+typedef struct {
+    double bits_per_sec;
+    int datagram_size;
+    int batch;              // datagrams per pacer charge
+} pacer_case_t;
+
+static const pacer_case_t cases[] = {
+    { 10e6, 1472, 1 },
+    { 50e6, 1472, 1 },
+    { 200e6, 1472, 1 },
+    { 50e6, 32768, 1 },
+    { 200e6, 512, 32 },
+    { 500e6, 1472, 32 },
+};
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv) {
+    double seconds = argc > 1 ? atof(argv[1]) : 1.0;
+    double tolerance = argc > 2 ? atof(argv[2]) : 3.0;
+    if (seconds <= 0) seconds = 1.0;
+
+    // Nothing reads the sink; a full receive queue drops datagrams after sendto has counted them
+    int sink = socket(AF_INET, SOCK_DGRAM, 0);
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (sink < 0 || sock < 0 || bind(sink, (struct sockaddr*)&addr, sizeof(addr)) < 0 ||
+        getsockname(sink, (struct sockaddr*)&addr, &addr_len) < 0 ||
+        connect(sock, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        perror("Loopback socket setup failed");
+        return 2;
+    }
+
+    static char datagram[CHECK_DATAGRAM_MAX];
+    int failures = 0;
+    printf("%12s %8s %6s %14s %8s\n", "target", "bytes", "batch", "offered", "error");
+    for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+        const pacer_case_t *pc = &cases[c];
+        size_t charge = (size_t)pc->datagram_size * pc->batch;
+        udp_pacer_t pacer;
+        udp_pacer_init(&pacer, pc->bits_per_sec, charge);
+
+        long bytes = 0;
+        double start = now_seconds(), end = start + seconds, now = start;
+        while (now < end) {
+            udp_pacer_wait(&pacer, charge);
+            for (int i = 0; i < pc->batch; i++) {
+                if (send(sock, datagram, pc->datagram_size, 0) > 0) bytes += pc->datagram_size;
+            }
+            now = now_seconds();
+        }
+
+        double offered = bytes * 8.0 / (now - start);
+        double error = (offered - pc->bits_per_sec) * 100 / pc->bits_per_sec;
+        int ok = error >= -tolerance && error <= tolerance;
+        if (!ok) failures++;
+        printf("%9.0f Mb %8d %6d %11.2f Mb %+7.2f%%%s\n", pc->bits_per_sec / 1e6, pc->datagram_size,
+               pc->batch, offered / 1e6, error, ok ? "" : "  FAIL");
+    }
+    close(sock);
+    close(sink);
+
+    if (failures > 0) {
+        fprintf(stderr, "%d pacer cases missed their target by more than %.1f%%\n", failures, tolerance);
+        return 1;
+    }
+    printf("Pacer holds every target within %.1f%%\n", tolerance);
+    return 0;
+}
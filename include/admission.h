@@ -0,0 +1,21 @@
+#include "../include/control.h"
+
+#ifndef ADMISSION_H
+#define ADMISSION_H
+
+#define ADMISSION_GRACE_MS 5000         // session lifetime beyond the requested duration
+#define ADMISSION_MIN_RETRY_MS 100      // shortest retry-after given to a rejected client
+
+// Concurrent session limits; 0 means unlimited
+typedef struct {
+    int max_sessions;
+    int quota[CONTROL_TEST_BIDIR + 1];  // per control_test_t, index 0 unused
+} admission_limits_t;
+
+int admission_parse_quota(const char *text, admission_limits_t *limits);
+void admission_init(const admission_limits_t *limits);
+int admission_acquire(const control_header_t *header, int *retry_after_ms);
+void admission_release(int ticket);
+long admission_deadline_ms(const control_header_t *header);
+
+#endif
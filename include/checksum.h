@@ -0,0 +1,33 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef CHECKSUM_H
+#define CHECKSUM_H
+
+// An RFC 1071 Internet checksum over `len` bytes, already complemented
+typedef uint16_t (*checksum_fn)(const void *buf, size_t len);
+
+typedef struct {
+    const char *name;
+    checksum_fn fn;
+} checksum_kernel_t;
+
+uint16_t checksum(const void *buf, size_t len);
+const char *checksum_kernel_name(void);
+int checksum_kernels(checksum_kernel_t *out, int max);
+uint16_t checksum_scalar(const void *buf, size_t len);
+uint16_t checksum_update16(uint16_t check, uint16_t old_word, uint16_t new_word);
+
+// CRC32C (Castagnoli) over `len` bytes, continuing from `crc`; start from 0
+typedef uint32_t (*crc32c_fn)(uint32_t crc, const void *buf, size_t len);
+
+typedef struct {
+    const char *name;
+    crc32c_fn fn;
+} crc32c_kernel_t;
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+const char *crc32c_kernel_name(void);
+int crc32c_kernels(crc32c_kernel_t *out, int max);
+
+#endif
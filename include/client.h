@@ -1,11 +1,36 @@
+#include "../include/udp_batch.h"
+#include "../include/timestamping.h"
+#include "../include/uring.h"
+#include "../include/tuning.h"
+
 #ifndef CLIENT_H
 #define CLIENT_H
 
-void run_tcp_upload_test(char *address, int port, int duration);
-void run_tcp_download_test(char *address, int port, int duration);
-void run_udp_upload_test(char *address, int port, int duration);
-void run_udp_download_test(char *address, int port, int duration);
-void run_ping_test(char *address, int port, int size, int duration, int interval);
-void run_icmp_ping_test(char *address, int port, int size, int duration, int interval);
+#define RPM_IDLE_SECONDS 3          // idle RTT measured before the load starts
+#define RPM_WARMUP_SECONDS 1        // load before probing under it starts
+#define RPM_PROBE_INTERVAL 0.01     // default seconds between probes in an RPM test
+
+int client_status(void);
+void run_tcp_upload_test(char *address, int port, int duration, double report_interval, int streams,
+                         const io_engine_options_t *io, const tuning_options_t *tuning);
+void run_tcp_download_test(char *address, int port, int duration, double report_interval, int streams,
+                           const io_engine_options_t *io, const tuning_options_t *tuning);
+void run_tcp_bidir_test(char *address, int port, int duration, double report_interval, int streams,
+                        const io_engine_options_t *io, const tuning_options_t *tuning);
+void run_tcp_verify_compare(char *address, int port, int duration, double report_interval, int streams,
+                            const io_engine_options_t *io, const tuning_options_t *tuning, control_test_t test);
+void run_tcp_sweep(char *address, int port, int duration, int streams, const io_engine_options_t *io,
+                   const tuning_options_t *base, const tuning_grid_t *grid);
+void run_udp_upload_test(char *address, int port, int duration, double report_interval,
+                         const udp_batch_options_t *udp);
+void run_udp_download_test(char *address, int port, int duration, double report_interval,
+                           const udp_batch_options_t *udp);
+void run_udp_bidir_test(char *address, int port, int duration, double report_interval,
+                        const udp_batch_options_t *udp);
+void run_ping_test(char *address, int port, int size, int duration, double interval, tstamp_mode_t timestamping);
+void run_icmp_ping_test(char *address, int port, int size, int duration, double interval, tstamp_mode_t timestamping);
+void run_rpm_test(char *address, int port, int duration, double report_interval, int streams, int size,
+                  double interval, const io_engine_options_t *io, const tuning_options_t *tuning,
+                  control_test_t load);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,138 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include "../include/udp_flow.h"
+#include "../include/tcpinfo.h"
+#include "../include/integrity.h"
+
+#ifndef CONTROL_H
+#define CONTROL_H
+
+#define CONTROL_MAGIC 0x4c414e53        // "LANS"
+#define CONTROL_VERSION 6
+#define CONTROL_FLAG_RESULTS 0x1        // client wants a results block when the test ends
+#define CONTROL_FLAG_NODELAY 0x2        // TCP_NODELAY on both ends
+#define CONTROL_FLAG_VERIFY 0x4         // TCP payload travels as CRC32C-stamped blocks both ways
+#define CONTROL_CC_NAME 16              // TCP_CONGESTION name, as the kernel's TCP_CA_NAME_MAX
+#define CONTROL_UDP_DRAIN_MS 250        // UDP silence after the test duration that ends it early
+#define CONTROL_RESULTS_TIMEOUT_MS 3000 // how long a UDP client waits for the results block
+#define CONTROL_REPLY_TIMEOUT_MS 3000   // how long a UDP client waits for the server's reply
+#define CONTROL_PING_IDLE_MS 2000       // ping silence that ends the session, at the least
+#define CONTROL_PING_IDLE_INTERVALS 4   // and at least this many probe intervals of it
+
+typedef enum {
+    CONTROL_TEST_UPLOAD = 1,
+    CONTROL_TEST_DOWNLOAD = 2,
+    CONTROL_TEST_PING = 3,
+    CONTROL_TEST_RESULTS = 4,   // ping only: the client is done, reply with results
+    CONTROL_TEST_BIDIR = 5      // upload and download at once on one session
+} control_test_t;
+
+// Session header, the first thing a client sends on TCP or UDP; network byte order
+struct control_header {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t test;              // control_test_t
+    uint32_t duration;          // seconds; probe count for ping
+    uint32_t buffer_size;       // TCP write size or UDP datagram/probe size
+    uint16_t streams;           // parallel connections in this test
+    uint16_t stream_id;         // 1-based index of this connection
+    uint32_t flags;
+    uint32_t socket_buffer;     // TCP SO_SNDBUF and SO_RCVBUF on both ends, 0 for the default
+    uint16_t mss;               // TCP_MAXSEG, 0 for the default
+    uint16_t reserved;
+    char congestion[CONTROL_CC_NAME];   // TCP_CONGESTION, empty for the default
+    uint32_t interval_us;       // ping: time between probes, 0 if not given
+    uint64_t rate;              // UDP: bits per second the sender paces to, 0 for unpaced
+} __attribute__((packed));
+
+typedef enum {
+    CONTROL_ACCEPT = 0,
+    CONTROL_BUSY = 1,           // over a session limit; retry_after_ms says when to try again
+    CONTROL_UNSUPPORTED = 2     // this server cannot run the test, e.g. bidir on the event loops
+} control_status_t;
+
+// Server's answer to a session header, before any test payload; network byte order
+struct control_reply {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t status;            // control_status_t
+    uint32_t retry_after_ms;
+} __attribute__((packed));
+
+// Server-side measurement returned at the end of a test; network byte order
+struct control_results {
+    uint32_t magic;
+    uint16_t version;
+    uint16_t test;              // in a bidirectional test, the direction measured
+    uint64_t bytes;             // payload received (upload, ping) or sent (download)
+    uint64_t packets;           // UDP datagrams received, sent or echoed
+    uint64_t duration_us;       // first to last byte as seen by the server
+    uint64_t lost;              // UDP upload only, like udp_seq_stats_t
+    uint64_t out_of_order;
+    uint64_t duplicates;
+    uint64_t jitter_ns;
+    uint32_t tcp_samples;       // TCP only: the server's TCP_INFO summary, 0 samples if none
+    uint32_t cwnd_mean;
+    uint32_t cwnd_max;
+    uint32_t srtt_mean_us;
+    uint32_t srtt_max_us;
+    uint32_t rttvar_us;         // this and the rest as of the last sample
+    uint32_t rcv_rtt_us;
+    uint32_t retransmits;
+    uint64_t delivery_rate;
+    uint64_t busy_us;
+    uint64_t rwnd_limited_us;
+    uint64_t sndbuf_limited_us;
+    uint64_t verified_blocks;   // CONTROL_FLAG_VERIFY only: the receiver's integrity_stats_t
+    uint64_t corrupted_blocks;
+    uint64_t missing_blocks;
+    uint64_t misordered_blocks;
+} __attribute__((packed));
+
+typedef struct {
+    control_test_t test;
+    int duration;
+    int buffer_size;
+    int streams;
+    int stream_id;
+    unsigned int flags;
+    int socket_buffer;
+    int mss;
+    char congestion[CONTROL_CC_NAME];
+    long interval_us;
+    double rate;
+} control_header_t;
+
+typedef struct {
+    control_test_t test;
+    uint64_t bytes;
+    uint64_t packets;
+    uint64_t duration_us;
+    uint64_t lost;
+    uint64_t out_of_order;
+    uint64_t duplicates;
+    uint64_t jitter_ns;
+    tcpinfo_summary_t tcp;
+    integrity_stats_t integrity;
+} control_results_t;
+
+void control_header_init(control_header_t *h, control_test_t test, int duration, int buffer_size);
+const char *control_test_name(control_test_t test);
+void control_header_set_interval(control_header_t *h, double seconds);
+long control_ping_idle_ms(const control_header_t *h);
+int control_send_header(int sock, const control_header_t *h, const struct sockaddr *to, socklen_t to_len);
+int control_recv_header(int sock, control_header_t *h);
+int control_decode_header(const void *buf, size_t len, control_header_t *h);
+int control_send_reply(int sock, control_status_t status, int retry_after_ms,
+                       const struct sockaddr *to, socklen_t to_len);
+int control_decode_reply(const void *buf, size_t len, int *retry_after_ms);
+int control_recv_reply(int sock, int *retry_after_ms);
+void control_encode_results(const control_results_t *r, struct control_results *out);
+int control_send_results(int sock, const control_results_t *r, const struct sockaddr *to, socklen_t to_len);
+void control_results_from_seq(control_results_t *r, const udp_seq_stats_t *seq);
+int control_recv_results(int sock, control_results_t *r);
+int control_recv_results_udp(int sock, control_results_t *r, int timeout_ms);
+int control_decode_results(const void *buf, size_t len, control_results_t *r);
+
+#endif
@@ -0,0 +1,15 @@
+#include "../include/server.h"
+
+#ifndef EVENT_SERVER_H
+#define EVENT_SERVER_H
+
+#define EVENT_MAX_LOOPS 64
+#define EVENT_BATCH 64              // epoll events fetched per wakeup
+#define EVENT_BUDGET 16             // syscalls per session before yielding to the next one
+#define EVENT_TICK_MS 250           // idle sweep granularity
+#define EVENT_UDP_IDLE_MS 2000      // UDP uploads end after this much silence; pings use the header's interval
+#define EVENT_HANDSHAKE_MS 5000     // TCP sessions must name their test within this window
+
+void start_event_server(const server_options_t *options);
+
+#endif
@@ -0,0 +1,34 @@
+#include <stdint.h>
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+/*
+ * Log-linear latency histogram in nanoseconds. Values below 2^HIST_SUB_BITS
+ * are counted exactly; above that each power of two is split into
+ * 2^HIST_SUB_BITS linear sub-buckets, so any recorded value is reproduced to
+ * within 1/2^HIST_SUB_BITS (under 1%). Values beyond HIST_MAX_NS land in the
+ * top bucket. Memory is fixed at HIST_BUCKETS counters regardless of count.
+ */
+#define HIST_SUB_BITS 7
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 40                        // 2^40 ns, about 18 minutes
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+#define HIST_MAX_NS ((1ULL << HIST_MAX_BITS) - 1)
+
+typedef struct {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t min;
+    uint64_t max;
+    double sum;
+} histogram_t;
+
+void histogram_reset(histogram_t *h);
+void histogram_record(histogram_t *h, uint64_t value_ns);
+void histogram_merge(histogram_t *dst, const histogram_t *src);
+uint64_t histogram_percentile(const histogram_t *h, double percentile);
+double histogram_mean(const histogram_t *h);
+void histogram_print(const char *label, const histogram_t *h);
+
+#endif
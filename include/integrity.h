@@ -0,0 +1,50 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#ifndef INTEGRITY_H
+#define INTEGRITY_H
+
+#define INTEGRITY_BLOCK_SIZE 4096       // bytes per verified block, header included
+#define INTEGRITY_MAGIC 0x4c564659      // "LVFY"
+
+// Start of every block, network byte order; the CRC32C covers everything after `crc`
+struct integrity_block {
+    uint32_t magic;
+    uint32_t crc;
+    uint64_t sequence;          // block number in this stream, from 0
+} __attribute__((packed));
+
+// Receiver's account of one verified stream
+typedef struct {
+    uint64_t blocks;            // whole blocks checked, corrupted ones included
+    uint64_t corrupted;         // bad magic or CRC
+    uint64_t missing;           // sequence numbers skipped over
+    uint64_t misordered;        // sequence numbers older than one already seen
+} integrity_stats_t;
+
+// Sender: a buffer of whole blocks with a seeded pseudo-random payload, restamped each pass
+typedef struct {
+    char *buffer;
+    size_t size;                // a whole number of blocks
+    size_t offset;              // next byte to send
+    uint64_t next_sequence;
+} integrity_tx_t;
+
+// Receiver: holds a block that straddles two reads
+typedef struct {
+    char partial[INTEGRITY_BLOCK_SIZE];
+    size_t fill;
+    uint64_t expected;
+    integrity_stats_t stats;
+} integrity_rx_t;
+
+int integrity_tx_init(integrity_tx_t *tx, size_t write_size, uint64_t seed);
+const char *integrity_tx_data(const integrity_tx_t *tx, size_t max, size_t *len);
+void integrity_tx_advance(integrity_tx_t *tx, size_t sent);
+size_t integrity_tx_block_left(const integrity_tx_t *tx);
+void integrity_tx_free(integrity_tx_t *tx);
+void integrity_rx_init(integrity_rx_t *rx);
+void integrity_rx_feed(integrity_rx_t *rx, const char *data, size_t len);
+void integrity_print(const char *label, const integrity_stats_t *stats);
+
+#endif
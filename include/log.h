@@ -0,0 +1,54 @@
+#include <stdint.h>
+
+#ifndef LOG_H
+#define LOG_H
+
+#define LOG_RING_SLOTS 256              // records a thread may have waiting for the writer
+#define LOG_MAX_ARGS 8                  // conversions captured per record
+#define LOG_STRING_BYTES 128            // %s arguments, copied and truncated to fit
+#define LOG_LINE_MAX 1024
+#define LOG_WRITER_SLEEP_MS 5           // writer poll period while the rings are empty
+
+typedef enum {
+    LOG_LEVEL_ERROR,                    // to stderr
+    LOG_LEVEL_WARN,                     // to stderr
+    LOG_LEVEL_INFO,                     // to stdout, the default
+    LOG_LEVEL_DEBUG                     // to stdout, per-packet detail
+} log_level_t;
+
+typedef union {
+    long long i;
+    unsigned long long u;
+    double d;
+    const void *p;
+    uint32_t string;                    // offset into the record's string area
+} log_arg_t;
+
+/*
+ * One message as the hot path leaves it: the format pointer and the raw
+ * arguments, formatted later by the writer thread. The format must be a
+ * string literal, since the writer reads it after the caller has moved on.
+ */
+typedef struct {
+    const char *format;
+    uint64_t time_ns;                   // CLOCK_MONOTONIC, orders records across threads
+    uint8_t level;
+    uint8_t args;
+    uint16_t string_used;
+    int saved_errno;                    // for %m
+    log_arg_t arg[LOG_MAX_ARGS];
+    char strings[LOG_STRING_BYTES];
+} log_record_t;
+
+int log_start(log_level_t level);
+void log_flush(void);
+int log_parse_level(const char *name, log_level_t *level);
+void log_set_level(log_level_t level);
+void log_write(log_level_t level, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+#define log_error(...) log_write(LOG_LEVEL_ERROR, __VA_ARGS__)
+#define log_warn(...) log_write(LOG_LEVEL_WARN, __VA_ARGS__)
+#define log_info(...) log_write(LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_debug(...) log_write(LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+#endif
@@ -0,0 +1,52 @@
+#include <stdint.h>
+#include "../include/control.h"
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#define METRICS_CACHE_LINE 64
+#define METRICS_TESTS 6                 // indexed by control_test_t
+#define METRICS_DURATION_BUCKETS 9      // session duration bounds, the last one +Inf
+#define METRICS_RESPONSE_MAX (64 * 1024)
+
+typedef enum {
+    METRICS_TCP,
+    METRICS_UDP,
+    METRICS_ICMP,
+    METRICS_PROTOCOLS
+} metrics_protocol_t;
+
+typedef enum {
+    METRICS_FAIL_HEADER,        // missing, short or malformed control header
+    METRICS_FAIL_UNSUPPORTED,   // a test this server does not run
+    METRICS_FAIL_BUSY,          // turned away by admission control
+    METRICS_FAIL_SETUP,         // socket or reply errors before the test could start
+    METRICS_FAILURES
+} metrics_failure_t;
+
+/*
+ * One thread's counters. Only the owning thread writes them, with relaxed
+ * stores, so the data path never takes a lock or a locked instruction; the
+ * scraper reads them with relaxed loads and sums across threads.
+ */
+typedef struct {
+    uint64_t started[METRICS_PROTOCOLS][METRICS_TESTS];
+    uint64_t ended[METRICS_PROTOCOLS][METRICS_TESTS];
+    uint64_t duration_us[METRICS_PROTOCOLS][METRICS_TESTS];
+    uint64_t duration_buckets[METRICS_PROTOCOLS][METRICS_TESTS][METRICS_DURATION_BUCKETS];
+    uint64_t bytes_received[METRICS_PROTOCOLS];
+    uint64_t bytes_sent[METRICS_PROTOCOLS];
+    uint64_t packets_received[METRICS_PROTOCOLS];
+    uint64_t packets_sent[METRICS_PROTOCOLS];
+    uint64_t failures[METRICS_FAILURES];
+} metrics_counters_t;
+
+int metrics_start(int port);
+void metrics_session_start(metrics_protocol_t protocol, control_test_t test);
+void metrics_session_end(metrics_protocol_t protocol, control_test_t test, double seconds);
+void metrics_bytes(metrics_protocol_t protocol, long received, long sent);
+void metrics_packets(metrics_protocol_t protocol, long received, long sent);
+void metrics_failure(metrics_failure_t reason);
+int metrics_render(char *buf, size_t len);
+
+#endif
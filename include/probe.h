@@ -0,0 +1,72 @@
+#include "../include/histogram.h"
+#include "../include/timestamping.h"
+#include <time.h>
+#include <netinet/in.h>
+
+#ifndef PROBE_H
+#define PROBE_H
+
+#define PROBE_RING_SIZE 65536       // probes remembered for reply matching, power of two
+#define PROBE_TIMEOUT_MS 1000       // replies arriving later than this count as late
+#define PROBE_VERBOSE_INTERVAL 0.1  // print every probe when probing at least this slowly
+
+/*
+ * RTT bookkeeping shared by the ping paths. Samples go into an interval
+ * histogram that is folded into the whole-run histogram and reset every
+ * report_seconds, so memory stays fixed however many probes are sent.
+ * Jitter is the mean absolute difference between consecutive RTTs.
+ * report_seconds of 0 disables interval reports.
+ */
+typedef struct {
+    histogram_t *total;
+    histogram_t *interval;
+    int report_seconds;
+    const char *test;           // report record name for intervals, NULL for none
+    struct timespec start;
+    struct timespec interval_start;
+    double last_rtt;
+    double jitter_sum;
+    long jitter_count;
+} ping_stats_t;
+
+int ping_stats_init(ping_stats_t *stats, int report_seconds);
+void ping_stats_record(ping_stats_t *stats, double rtt_ms);
+void ping_stats_collect(ping_stats_t *stats);
+void ping_stats_finish(ping_stats_t *stats);
+double ping_stats_jitter(const ping_stats_t *stats);
+void ping_stats_free(ping_stats_t *stats);
+
+typedef struct {
+    int size;                   // UDP: datagram size, at least sizeof(struct packet); ICMP: payload bytes
+    long count;                 // probes to send, 0 to keep going until *stop is set
+    double interval;            // seconds between probe sends
+    int timeout_ms;
+    int verbose;                // print one line per reply
+    int quiet;                  // no interval lines, for probes running beside another test
+    tstamp_mode_t timestamping; // also measure RTT from kernel/NIC stamps
+    const char *name;           // test name in report records, NULL for none
+    volatile int *stop;
+    int icmp;                   // send ICMP echo requests on a socket from probe_icmp_socket
+    int icmp_raw;               // that socket is SOCK_RAW: replies carry an IP header and must match echo_id
+    uint16_t echo_id;           // echo identifier, network order; unprivileged sockets get theirs from the kernel
+} probe_options_t;
+
+typedef struct {
+    long sent;
+    long received;              // on-time replies, the ones in `stats`
+    long late;
+    long duplicates;
+    long lost;
+    ping_stats_t stats;
+    tstamp_mode_t timestamping; // mode actually in effect, TSTAMP_OFF if none
+    ping_stats_t kernel_stats;  // RTTs from TX/RX stamps, only when timestamping
+} probe_result_t;
+
+int probe_icmp_socket(const struct sockaddr_in *addr, probe_options_t *opt);
+int probe_run(int sock, const probe_options_t *opt, probe_result_t *result);
+void probe_result_free(probe_result_t *result);
+void probe_print_kernel_rtt(const ping_stats_t *user, ping_stats_t *kernel, tstamp_mode_t mode);
+void probe_report_sample(const char *test, uint64_t seq, int64_t rtt_ns);
+void probe_report_summary(const char *test, ping_stats_t *stats, long sent, long lost, long duplicates);
+
+#endif
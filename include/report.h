@@ -0,0 +1,83 @@
+#include <stdint.h>
+#include "../include/histogram.h"
+#include "../include/control.h"
+#include "../include/tcpinfo.h"
+
+#ifndef REPORT_H
+#define REPORT_H
+
+#define REPORT_QUEUE_LINES 4096     // formatted records buffered ahead of the writer thread
+#define REPORT_LINE_MAX 768
+
+typedef enum {
+    REPORT_TEXT,        // human-readable prose only (default)
+    REPORT_JSON,        // one JSON object per line
+    REPORT_CSV          // a header row, then one row per record
+} report_format_t;
+
+// Bits of report_record_t.fields saying which optional values are set
+enum {
+    REPORT_F_BYTES = 1 << 0,        // bytes and bits_per_second
+    REPORT_F_PACKETS = 1 << 1,      // packets
+    REPORT_F_UDP = 1 << 2,          // received, lost, out_of_order, duplicates, jitter_ns
+    REPORT_F_SAMPLE = 1 << 3,       // seq and rtt_ns
+    REPORT_F_RTT = 1 << 4,          // rtt_* summary and received/lost
+    REPORT_F_TCP = 1 << 5,          // TCP_INFO: cwnd, srtt_ns, ... sndbuf_limited_ns
+    REPORT_F_INTEGRITY = 1 << 6,    // verified_blocks, corrupted_blocks, missing_blocks, misordered_blocks
+    REPORT_F_RPM = 1 << 7           // rpm
+};
+
+/*
+ * One machine-readable record. Units are fixed: bytes, bits per second,
+ * seconds for start/end (relative to the start of the test) and nanoseconds
+ * for every latency.
+ */
+typedef struct {
+    const char *event;          // "interval", "summary", "sample" or "server"
+    const char *test;           // "tcp_upload", "udp_download", "ping", ...
+    const char *side;           // "client" or "server"
+    const char *direction;      // "up" or "down" in a bidirectional test, NULL otherwise
+    int stream;                 // 1-based stream, 0 for a whole test or sum
+    double start, end;
+    unsigned int fields;
+    long bytes;
+    double bits_per_second;
+    long packets;
+    long received;
+    long lost;
+    long out_of_order;
+    long duplicates;
+    int64_t jitter_ns;
+    uint64_t seq;
+    int64_t rtt_ns;
+    uint64_t rtt_min_ns, rtt_p50_ns, rtt_p99_ns, rtt_p999_ns, rtt_max_ns;
+    double rtt_mean_ns;
+    long cwnd;
+    int64_t srtt_ns, rttvar_ns, rcv_rtt_ns;
+    long retransmits;
+    double delivery_bits_per_second;
+    int64_t busy_ns, rwnd_limited_ns, sndbuf_limited_ns;
+    integrity_stats_t integrity;
+    const char *target;         // "address:port" in a multi-target run, NULL otherwise
+    double rpm;                 // round trips per minute at the median RTT
+} report_record_t;
+
+int report_parse_format(const char *name, report_format_t *format);
+int report_open(report_format_t format);
+int report_enabled(void);
+void report_close(void);
+
+void report_record_init(report_record_t *r, const char *event, const char *test, const char *side);
+void report_set_bytes(report_record_t *r, long bytes, double start, double end);
+void report_set_udp(report_record_t *r, const udp_seq_stats_t *now, const udp_seq_stats_t *prev);
+void report_set_rtt(report_record_t *r, const histogram_t *h);
+void report_set_tcp(report_record_t *r, const tcpinfo_t *now, const tcpinfo_t *prev);
+void report_set_integrity(report_record_t *r, const integrity_stats_t *stats);
+void report_set_results(report_record_t *r, const control_results_t *results, int udp);
+void report_emit(const report_record_t *r);
+
+void report_udp(const char *event, const char *test, const char *side, const char *direction,
+                double start, double end, const udp_seq_stats_t *now, const udp_seq_stats_t *prev);
+void report_results(const char *test, int stream, const control_results_t *results, int udp);
+
+#endif
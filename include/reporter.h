@@ -0,0 +1,37 @@
+#include <pthread.h>
+#include <time.h>
+
+#ifndef REPORTER_H
+#define REPORTER_H
+
+#define REPORTER_MIN_INTERVAL 0.01  // seconds, shortest supported reporting interval
+
+// Called on the reporter thread for interval `index` (1-based), which spans [start, end) seconds
+typedef void (*reporter_fn)(void *arg, int index, double start, double end);
+
+/*
+ * Wall-clock timing for a client test. A dedicated thread sleeps on a
+ * CLOCK_MONOTONIC timerfd armed at absolute interval boundaries, calls
+ * `report` at each one and sets *stop once `duration` seconds have passed.
+ * The measuring threads only bump counters and watch *stop.
+ */
+typedef struct {
+    double interval;
+    double duration;
+    reporter_fn report;
+    void *arg;
+    volatile int *stop;
+    struct timespec start;
+    double elapsed;             // seconds from start to the end of the last interval
+    int timer_fd;
+    int wake_fd;                // eventfd that ends the test early
+    pthread_t thread;
+} reporter_t;
+
+int reporter_start(reporter_t *r, double interval, double duration, reporter_fn report, void *arg,
+                   volatile int *stop);
+void reporter_stop(reporter_t *r);
+double reporter_join(reporter_t *r);
+double reporter_elapsed(const reporter_t *r);
+
+#endif
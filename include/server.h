@@ -1,13 +1,34 @@
 #include "../include/shared.h"
+#include "../include/zerocopy.h"
+#include "../include/udp_batch.h"
+#include "../include/admission.h"
+#include "../include/uring.h"
+#include "../include/tuning.h"
 
 #ifndef SERVER_H
 #define SERVER_H
 
-void start_server(int port);
-void handle_tcp_upload(int client_sock);
-void handle_tcp_download(int client_sock);
+typedef struct {
+    int port;
+    int event_loops;                    // 0 selects the thread-per-session server
+    int shard;                          // event loops own SO_REUSEPORT sockets, pinned per CPU
+    zerocopy_mode_t download_mode;
+    udp_batch_options_t udp;
+    admission_limits_t admission;
+    io_engine_options_t io;             // threaded server TCP data path
+    int metrics_port;                   // Prometheus metrics over HTTP, 0 for none
+} server_options_t;
+
+void start_server(const server_options_t *options);
+int create_socket(int type, int port);
+int create_reuseport_socket(int type, int port, int cpu);
+void *start_icmp_thread();
+void handle_tcp_upload(int client_sock, const control_header_t *header);
+void handle_tcp_download(int client_sock, const control_header_t *header);
+void handle_tcp_bidir(int client_sock, const control_header_t *header);
 void handle_udp_upload(client_data_t* data);
 void handle_udp_download(client_data_t* data);
+void handle_udp_bidir(client_data_t* data);
 void handle_ping(client_data_t* data);
 
 #endif
\ No newline at end of file
@@ -1,5 +1,9 @@
 #include <arpa/inet.h>
 #include <time.h>
+#include <stdint.h>
+#include "../include/control.h"
+#include "../include/report.h"
+#include "../include/checksum.h"
 
 #ifndef SHARED_H
 #define SHARED_H
@@ -12,13 +16,16 @@ typedef struct {
     int sockfd;
     struct sockaddr_in client_addr;
     socklen_t addr_len;
-    char test[10];
+    control_header_t header;
+    int ticket;                 // admission ticket, released when the session ends
 } client_data_t;
 
+// Header stamped at the front of every UDP test datagram, in network byte order
 struct packet {
-    struct timespec timestamp;  // Timestamp of when packet was sent
-    size_t length;
+    uint64_t sequence;          // Datagram sequence number, starting at 0
+    uint64_t timestamp_ns;      // CLOCK_REALTIME nanoseconds when the packet was sent
+    uint32_t length;            // Datagram length including this header
     char data[];                // Flexible array member for variable-size data
-};
+} __attribute__((packed));
 
 #endif
\ No newline at end of file
@@ -0,0 +1,51 @@
+#include "../include/tuning.h"
+#include <netinet/in.h>
+
+#ifndef TARGETS_H
+#define TARGETS_H
+
+#define TARGETS_MAX 4096                // entries one target file may hold
+#define TARGET_MAX_STREAMS 64           // TCP connections per target
+#define TARGET_CONNECT_TIMEOUT_MS 2000  // connect and admission reply, per connection
+#define TARGET_GRACE_MS 5000            // past its duration, how long a target may take to finish
+
+typedef enum {
+    TARGET_UPLOAD,
+    TARGET_DOWNLOAD,
+    TARGET_PING
+} target_test_t;
+
+/*
+ * One line of a target file:
+ *
+ *   address[:port] test [key=value ...]
+ *
+ * test is upload or download (TCP) or ping (UDP). Keys: duration (seconds),
+ * streams and write (TCP), count, interval and size (ping). Anything not
+ * given comes from the command line. '#' starts a comment.
+ */
+typedef struct {
+    char address[INET_ADDRSTRLEN];
+    int port;
+    target_test_t test;
+    int duration;
+    int streams;
+    int write_size;
+    long count;
+    double interval;
+    int size;
+    int line;                   // in the target file, for messages
+} target_spec_t;
+
+typedef struct {
+    int parallel;               // targets per wave, 0 for every target at once
+    double report_interval;
+    target_spec_t defaults;     // from -p, -d, -P, -L, -s and -i
+    tuning_options_t tuning;    // socket options for every TCP target
+} targets_options_t;
+
+int targets_parse_file(const char *path, const target_spec_t *defaults, target_spec_t **specs);
+const char *target_test_name(target_test_t test);
+void run_targets(const char *path, const targets_options_t *opt);
+
+#endif
@@ -0,0 +1,41 @@
+#include <stdint.h>
+
+#ifndef TCPINFO_H
+#define TCPINFO_H
+
+#define TCPINFO_INTERVAL_MS 100     // server-side sampling period during a TCP test
+
+// The TCP_INFO fields the reports use; counters are cumulative over the connection
+typedef struct {
+    uint32_t cwnd;              // congestion window, segments
+    uint32_t mss;
+    uint32_t srtt_us;           // sender's smoothed RTT
+    uint32_t rttvar_us;
+    uint32_t rcv_rtt_us;        // receiver's RTT estimate
+    uint32_t rcv_space;         // receiver's buffer autotuning target, bytes
+    uint32_t retransmits;
+    uint64_t delivery_rate;     // bytes/s, most recent sample
+    uint64_t pacing_rate;       // bytes/s
+    uint64_t busy_us;           // time with data in flight
+    uint64_t rwnd_limited_us;   // time stalled on the peer's receive window
+    uint64_t sndbuf_limited_us; // time stalled on our send buffer
+} tcpinfo_t;
+
+// Running summary of the samples taken over one test
+typedef struct {
+    uint32_t samples;
+    double cwnd_sum;
+    double srtt_sum_us;
+    uint32_t cwnd_max;
+    uint32_t srtt_max_us;
+    tcpinfo_t last;
+} tcpinfo_summary_t;
+
+int tcpinfo_read(int sock, tcpinfo_t *out);
+void tcpinfo_summary_add(tcpinfo_summary_t *s, const tcpinfo_t *info);
+int tcpinfo_sample(int sock, tcpinfo_summary_t *s);
+int tcpinfo_sample_due(int sock, tcpinfo_summary_t *s, long *next_ms);
+void tcpinfo_print_interval(const char *label, const tcpinfo_t *now, const tcpinfo_t *prev, double seconds);
+void tcpinfo_print_summary(const char *label, const tcpinfo_summary_t *s, double seconds);
+
+#endif
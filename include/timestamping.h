@@ -0,0 +1,27 @@
+#include <stdint.h>
+#include <sys/socket.h>
+
+#ifndef TIMESTAMPING_H
+#define TIMESTAMPING_H
+
+typedef enum {
+    TSTAMP_OFF,
+    TSTAMP_SOFTWARE,    // kernel stack stamps (SOF_TIMESTAMPING_*_SOFTWARE)
+    TSTAMP_HARDWARE     // NIC stamps, with software stamps alongside as a fallback
+} tstamp_mode_t;
+
+typedef struct {
+    int64_t sw_ns;      // 0 when the kernel did not supply one
+    int64_t hw_ns;
+} tstamp_t;
+
+#define TSTAMP_CONTROL_LEN 256      // cmsg space for one SCM_TIMESTAMPING plus extras
+
+int tstamp_parse_mode(const char *name, tstamp_mode_t *mode);
+const char *tstamp_mode_name(tstamp_mode_t mode);
+tstamp_mode_t tstamp_enable(int sock, tstamp_mode_t wanted);
+int tstamp_from_cmsg(struct msghdr *msg, tstamp_t *ts);
+int tstamp_read_tx(int sock, uint32_t *key, tstamp_t *ts);
+int64_t tstamp_rtt_ns(const tstamp_t *tx, const tstamp_t *rx);
+
+#endif
@@ -0,0 +1,43 @@
+#include "../include/control.h"
+
+#ifndef TUNING_H
+#define TUNING_H
+
+#define TUNING_MAX_WRITE (1 << 20)      // largest TCP write/read size a test may ask for
+#define TUNING_GRID_MAX 8               // values per sweep dimension
+#define TUNING_SWEEP_DURATION 3         // seconds per sweep point unless -d is given
+
+// Per-test TCP knobs; the client sends them in the control header and both ends apply them
+typedef struct {
+    int write_size;                     // bytes per send/recv, 0 for BUFFER_SIZE
+    int socket_buffer;                  // SO_SNDBUF and SO_RCVBUF, 0 for the system default
+    int mss;                            // TCP_MAXSEG, 0 for the path default
+    int nodelay;                        // TCP_NODELAY
+    char congestion[CONTROL_CC_NAME];   // TCP_CONGESTION, empty for the system default
+    int verify;                         // CRC32C-framed payload, checked by the receiver
+} tuning_options_t;
+
+// Values tried by the sweep; every combination runs as one short upload
+typedef struct {
+    int write_sizes[TUNING_GRID_MAX];
+    int write_count;
+    int buffers[TUNING_GRID_MAX];
+    int buffer_count;
+    char congestion[TUNING_GRID_MAX][CONTROL_CC_NAME];
+    int congestion_count;
+} tuning_grid_t;
+
+int tuning_parse_size(const char *text);
+int tuning_grid_add_sizes(int *values, int *count, const char *list);
+int tuning_grid_add_names(tuning_grid_t *grid, const char *list);
+void tuning_grid_defaults(tuning_grid_t *grid);
+int tuning_is_default(const tuning_options_t *t);
+void tuning_from_grid(tuning_options_t *t, const tuning_grid_t *grid);
+void tuning_to_header(const tuning_options_t *t, control_header_t *h);
+void tuning_from_header(const control_header_t *h, tuning_options_t *t);
+int tuning_write_size(const control_header_t *h);
+int tuning_apply(int sock, const tuning_options_t *t);
+void tuning_describe(const tuning_options_t *t, char *buf, size_t len);
+void tuning_print_effective(const char *label, int sock);
+
+#endif
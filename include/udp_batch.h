@@ -0,0 +1,51 @@
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "../include/udp_flow.h"
+#include "../include/control.h"
+
+#ifndef UDP_BATCH_H
+#define UDP_BATCH_H
+
+#define UDP_MTU_DATAGRAM 1472       // 1500-byte MTU minus IPv4 and UDP headers
+#define UDP_MAX_BATCH 1024
+#define UDP_GSO_MAX_BYTES 65000     // payload per GSO send, below the 65507 UDP limit
+#define UDP_GSO_MAX_SEGMENTS 64     // kernel limit on segments per GSO send
+#define UDP_GRO_BUFFER 65536
+#define UDP_MAX_DATAGRAM 65507      // the UDP payload limit
+#define UDP_BATCH_RESULTS 2         // results blocks kept; a bidirectional test ends with two
+
+typedef struct {
+    int datagram_size;      // payload bytes per datagram, 0 picks MTU-sized when batching
+                            // and BUFFER_SIZE otherwise
+    int batch;              // messages per sendmmsg/recvmmsg, 0 for one syscall per datagram
+    int offload;            // UDP_SEGMENT when sending, UDP_GRO when receiving
+    double rate;            // sender target in bits per second, 0 sends as fast as possible
+} udp_batch_options_t;
+
+typedef struct {
+    udp_batch_options_t opt;
+    int receive;
+    int segments;           // datagrams carried by each message (GSO), otherwise 1
+    size_t msg_bytes;       // buffer size behind each message
+    struct mmsghdr *msgs;
+    struct iovec *iov;
+    char *buffers;
+    char *control;          // per-message cmsg space for the UDP_GRO segment size
+    long bytes;
+    long packets;
+    long syscalls;
+    int have_results;       // receive only: control results blocks arrived, in order
+    control_results_t results[UDP_BATCH_RESULTS];
+} udp_batch_t;
+
+void udp_batch_options_for(udp_batch_options_t *opt, const udp_batch_options_t *server,
+                           const control_header_t *header);
+int udp_batch_init(udp_batch_t *b, const udp_batch_options_t *opt, int receive);
+int udp_batch_configure_socket(int sock, const udp_batch_options_t *opt, int receive);
+long udp_batch_send(udp_batch_t *b, int sock, const struct sockaddr_in *peer, socklen_t peer_len,
+                    uint64_t *sequence);
+long udp_batch_recv(udp_batch_t *b, int sock, udp_seq_stats_t *seq);
+size_t udp_batch_bytes(const udp_batch_t *b);
+void udp_batch_free(udp_batch_t *b);
+
+#endif
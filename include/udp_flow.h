@@ -0,0 +1,46 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#ifndef UDP_FLOW_H
+#define UDP_FLOW_H
+
+#define UDP_SEQ_WINDOW 4096         // sequences remembered for duplicate/reorder detection
+#define UDP_PACER_MAX_SPIN_NS 50000 // waits shorter than this spin instead of sleeping
+#define UDP_PACER_CATCHUP_NS 20000000 // lateness a sender may still make up, at the least
+#define UDP_PACER_CATCHUP_SENDS 4   // and at least this many sends of it
+
+typedef struct {
+    double rate;                // bytes per second, 0 for unpaced
+    double next_ns;             // CLOCK_MONOTONIC time the next send is due
+    double catchup_ns;          // how far behind schedule the sender may fall and still catch up
+} udp_pacer_t;
+
+typedef struct {
+    long received;
+    long bytes;
+    long lost;                  // gaps in the sequence not (yet) filled by late arrivals
+    long out_of_order;
+    long duplicates;
+    double jitter_ns;           // RFC 3550 interarrival jitter estimate
+    uint64_t next;              // one past the highest sequence seen
+    int have_transit;
+    int64_t last_transit_ns;
+    uint64_t window[UDP_SEQ_WINDOW / 64];
+} udp_seq_stats_t;
+
+double udp_parse_rate(const char *text);
+
+void udp_pacer_init(udp_pacer_t *p, double bits_per_sec, size_t burst_bytes);
+long udp_pacer_delay_ns(udp_pacer_t *p, size_t bytes);
+void udp_pacer_wait(udp_pacer_t *p, size_t bytes);
+
+void udp_flow_stamp(void *datagram, size_t len, uint64_t sequence, int64_t now_ns);
+int64_t udp_flow_now_ns(void);
+
+void udp_seq_init(udp_seq_stats_t *st);
+void udp_seq_record(udp_seq_stats_t *st, const void *datagram, size_t len, int64_t arrival_ns);
+void udp_seq_publish(udp_seq_stats_t *dst, const udp_seq_stats_t *src);
+void udp_seq_report(const char *label, const udp_seq_stats_t *now, udp_seq_stats_t *prev, double seconds);
+
+#endif
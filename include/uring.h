@@ -0,0 +1,57 @@
+#include <stddef.h>
+#include <linux/io_uring.h>
+
+#ifndef URING_H
+#define URING_H
+
+#define URING_DEFAULT_DEPTH 8       // writes kept in flight per sending stream
+#define URING_MAX_DEPTH 256
+#define URING_WAIT_MS 100           // longest single wait, so stop flags and deadlines are noticed
+#define URING_DRAIN_MS 1000         // grace for in-flight writes once sending stops
+#define URING_BUF_RING 64           // provided buffers shared by multishot receives, power of two
+
+typedef enum {
+    IO_ENGINE_SOCKET,       // blocking send()/recv() from one thread per stream
+    IO_ENGINE_URING         // one thread drives every stream through an io_uring
+} io_engine_t;
+
+typedef struct {
+    io_engine_t engine;
+    int depth;              // queue depth per sending stream
+    int sqpoll;             // kernel thread polls the submission queue
+    int multishot;          // receives use IORING_RECV_MULTISHOT with a provided-buffer ring
+} io_engine_options_t;
+
+typedef struct {
+    int sock;
+    int receive;            // 1: read until EOF, 0: write the payload until told to stop
+    int size;               // bytes per read or write, 0 for BUFFER_SIZE
+    long bytes;             // running total, published with relaxed atomic stores
+    int inflight;
+    int done;
+    int failed;             // ended by an error or cut off, rather than by EOF or a stop
+} uring_stream_t;
+
+typedef struct {
+    volatile int *stop;     // senders stop once this is set, may be NULL
+    long duration_ms;       // senders also stop after this long, 0 for no limit
+    long deadline_ms;       // every stream is cut off after this long, 0 for no limit
+} uring_limits_t;
+
+typedef struct {
+    long enters;            // io_uring_enter calls, the engine's only per-I/O syscalls
+    long submitted;
+    long completed;
+} uring_stats_t;
+
+// Called for every completed receive with the bytes it delivered
+typedef void (*uring_data_fn)(void *arg, int stream, const char *data, long n);
+
+int io_engine_parse(const char *text, io_engine_options_t *opt);
+const char *io_engine_name(const io_engine_options_t *opt);
+int uring_drive_streams(uring_stream_t *streams, int count, const io_engine_options_t *opt,
+                        const uring_limits_t *limits, uring_data_fn on_data, void *arg,
+                        uring_stats_t *stats);
+void io_engine_print_usage(const char *label, long syscalls, double cpu_seconds, double seconds);
+
+#endif
@@ -0,0 +1,32 @@
+#include <stddef.h>
+
+#ifndef ZEROCOPY_H
+#define ZEROCOPY_H
+
+#define ZEROCOPY_MAX_INFLIGHT 256   // MSG_ZEROCOPY sends allowed before reaping completions
+
+typedef enum {
+    ZC_COPY,            // plain send() from a user-space buffer
+    ZC_SENDFILE,        // sendfile() from a memfd payload
+    ZC_SPLICE,          // splice() memfd -> pipe -> socket
+    ZC_MSG_ZEROCOPY     // send(MSG_ZEROCOPY) with completions reaped from the error queue
+} zerocopy_mode_t;
+
+typedef struct {
+    zerocopy_mode_t mode;
+    int pipe_fd[2];
+    size_t pipe_bytes;          // spliced into the pipe but not yet into the socket
+    unsigned int zc_issued;
+    unsigned int zc_completed;
+    unsigned int zc_copied;     // completions where the kernel fell back to copying
+} zerocopy_sender_t;
+
+int zerocopy_parse_mode(const char *name, zerocopy_mode_t *mode);
+const char *zerocopy_mode_name(zerocopy_mode_t mode);
+int zerocopy_init_payload(size_t size);
+int zerocopy_sender_init(zerocopy_sender_t *zs, zerocopy_mode_t mode, int sock);
+long zerocopy_send(zerocopy_sender_t *zs, int sock, size_t len);
+void zerocopy_sender_close(zerocopy_sender_t *zs, int sock);
+double zerocopy_cpu_per_gb(double cpu_seconds, long bytes);
+
+#endif
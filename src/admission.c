@@ -0,0 +1,154 @@
+#include "../include/admission.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+/*
+ * Server-wide session accounting, shared by the threaded and the event-loop
+ * server. A session is admitted when its header arrives and holds a ticket
+ * until it ends; over the global limit or its test's quota it is turned away
+ * at once with a retry-after hint, the time until the earliest deadline among
+ * the sessions that stand in its way, rather than being served alongside them
+ * and skewing everyone's numbers.
+ */
+
+typedef struct {
+    int test;                   // 0 for a free slot
+    long deadline_ms;
+} admission_slot_t;
+
+static admission_limits_t limits;
+static admission_slot_t *slots;
+static int slot_count;
+static int active;
+static int active_per_test[CONTROL_TEST_BIDIR + 1];
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+
+static long now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000L + ts.tv_nsec / 1000000L;
+}
+
+// Parses "upload=4,download=4,ping=16"; tests left out stay unlimited
+int admission_parse_quota(const char *text, admission_limits_t *out) {
+    char *copy = strdup(text);
+    if (!copy) return -1;
+
+    int ret = 0;
+    char *save;
+    for (char *item = strtok_r(copy, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+        char *eq = strchr(item, '=');
+        if (!eq) {
+            ret = -1;
+            break;
+        }
+        *eq = '\0';
+        int test;
+        if (strcmp(item, "upload") == 0) {
+            test = CONTROL_TEST_UPLOAD;
+        } else if (strcmp(item, "download") == 0) {
+            test = CONTROL_TEST_DOWNLOAD;
+        } else if (strcmp(item, "ping") == 0) {
+            test = CONTROL_TEST_PING;
+        } else if (strcmp(item, "bidir") == 0) {
+            test = CONTROL_TEST_BIDIR;
+        } else {
+            ret = -1;
+            break;
+        }
+        out->quota[test] = atoi(eq + 1);
+    }
+    free(copy);
+    return ret;
+}
+
+void admission_init(const admission_limits_t *l) {
+    limits = *l;
+}
+
+/*
+ * How long a session may run: its requested duration plus a grace period
+ * for setup and the results exchange. For ping the duration is a probe
+ * count, budgeted at the header's probe interval, or one probe per second
+ * when the client did not send one.
+ */
+long admission_deadline_ms(const control_header_t *header) {
+    if (header->test == CONTROL_TEST_PING && header->interval_us > 0) {
+        return (long)((double)header->duration * header->interval_us / 1000) + ADMISSION_GRACE_MS;
+    }
+    return header->duration * 1000L + ADMISSION_GRACE_MS;
+}
+
+// Earliest deadline among active sessions of `test`, or of any test when 0
+static long earliest_deadline(int test) {
+    long earliest = 0;
+    for (int i = 0; i < slot_count; i++) {
+        if (!slots[i].test || (test && slots[i].test != test)) continue;
+        if (earliest == 0 || slots[i].deadline_ms < earliest) earliest = slots[i].deadline_ms;
+    }
+    return earliest;
+}
+
+/*
+ * Returns a ticket (> 0) for an admitted session, or 0 with *retry_after_ms
+ * set when the server is full for this test. The header must already have
+ * been checked to name an upload, download or ping.
+ */
+int admission_acquire(const control_header_t *header, int *retry_after_ms) {
+    int test = header->test;
+
+    pthread_mutex_lock(&lock);
+    long now = now_ms();
+    int full = limits.max_sessions > 0 && active >= limits.max_sessions;
+    int over_quota = limits.quota[test] > 0 && active_per_test[test] >= limits.quota[test];
+    if (full || over_quota) {
+        long wait = 0;
+        if (full) wait = earliest_deadline(0) - now;
+        if (over_quota) {
+            long quota_wait = earliest_deadline(test) - now;
+            if (quota_wait > wait) wait = quota_wait;
+        }
+        *retry_after_ms = wait > ADMISSION_MIN_RETRY_MS ? (int)wait : ADMISSION_MIN_RETRY_MS;
+        pthread_mutex_unlock(&lock);
+        printf("Rejected %s session: %s (retry after %d ms)\n", control_test_name(header->test),
+               full ? "server full" : "test quota reached", *retry_after_ms);
+        return 0;
+    }
+
+    int slot = 0;
+    while (slot < slot_count && slots[slot].test) slot++;
+    if (slot == slot_count) {
+        int grown = slot_count ? slot_count * 2 : 64;
+        admission_slot_t *more = realloc(slots, grown * sizeof(admission_slot_t));
+        if (!more) {
+            pthread_mutex_unlock(&lock);
+            perror("Malloc failed");
+            *retry_after_ms = ADMISSION_MIN_RETRY_MS;
+            return 0;
+        }
+        memset(more + slot_count, 0, (grown - slot_count) * sizeof(admission_slot_t));
+        slots = more;
+        slot_count = grown;
+    }
+    slots[slot].test = test;
+    slots[slot].deadline_ms = now + admission_deadline_ms(header);
+    active++;
+    active_per_test[test]++;
+    pthread_mutex_unlock(&lock);
+    return slot + 1;
+}
+
+void admission_release(int ticket) {
+    if (ticket <= 0) return;
+    pthread_mutex_lock(&lock);
+    admission_slot_t *slot = &slots[ticket - 1];
+    if (slot->test) {
+        active--;
+        active_per_test[slot->test]--;
+        slot->test = 0;
+    }
+    pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,352 @@
+#include "../include/checksum.h"
+#include <string.h>
+#include <pthread.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CHECKSUM_X86 1
+#endif
+#if defined(__aarch64__)
+#include <arm_acle.h>
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#define CHECKSUM_ARM64 1
+#endif
+
+/*
+ * Internet checksum kernels. The ones' complement sum does not care about
+ * word size, so the wide kernels add 32-bit words into 64-bit lanes, where
+ * nothing can overflow for any length we send, and fold to 16 bits once at
+ * the end. Words are summed in memory order on every path, so all kernels
+ * agree bit for bit with the scalar loop. The widest kernel the CPU
+ * supports is picked on first use.
+ */
+
+static uint16_t fold(uint64_t sum) {
+    sum = (sum & 0xffffffffULL) + (sum >> 32);
+    sum = (sum & 0xffffffffULL) + (sum >> 32);
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    return (uint16_t)~sum;
+}
+
+// Sum of the bytes a vector loop left over; `len` starts at an even offset
+static uint64_t sum_tail(const unsigned char *p, size_t len) {
+    uint64_t sum = 0;
+    for (; len > 1; len -= 2, p += 2) {
+        uint16_t word;
+        memcpy(&word, p, sizeof(word));
+        sum += word;
+    }
+    if (len == 1) sum += *p;
+    return sum;
+}
+
+// The original 16-bit loop, kept as the reference the others are measured against
+uint16_t checksum_scalar(const void *b, size_t len) {
+    const unsigned short *buf = b;
+    unsigned int sum = 0;
+
+    for (; len > 1; len -= 2)
+        sum += *buf++;
+    if (len == 1)
+        sum += *(const unsigned char *)buf;
+    sum = (sum >> 16) + (sum & 0xFFFF);
+    sum += (sum >> 16);
+    return (uint16_t)~sum;
+}
+
+// Portable fallback: 32-bit words into a 64-bit accumulator
+static uint16_t checksum_wide(const void *buf, size_t len) {
+    const unsigned char *p = buf;
+    uint64_t sum0 = 0, sum1 = 0;
+    for (; len >= 8; len -= 8, p += 8) {
+        uint32_t w[2];
+        memcpy(w, p, sizeof(w));
+        sum0 += w[0];
+        sum1 += w[1];
+    }
+    return fold(sum0 + sum1 + sum_tail(p, len));
+}
+
+#ifdef CHECKSUM_X86
+static uint64_t lanes_sum_128(__m128i acc) {
+    uint64_t lanes[2];
+    _mm_storeu_si128((__m128i*)lanes, acc);
+    return lanes[0] + lanes[1];
+}
+
+static uint16_t checksum_sse2(const void *buf, size_t len) {
+    const unsigned char *p = buf;
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc0 = zero, acc1 = zero;
+    for (; len >= 32; len -= 32, p += 32) {
+        __m128i a = _mm_loadu_si128((const __m128i*)p);
+        __m128i b = _mm_loadu_si128((const __m128i*)(p + 16));
+        acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(a, zero));
+        acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(a, zero));
+        acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(b, zero));
+        acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(b, zero));
+    }
+    for (; len >= 16; len -= 16, p += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)p);
+        acc0 = _mm_add_epi64(acc0, _mm_unpacklo_epi32(a, zero));
+        acc1 = _mm_add_epi64(acc1, _mm_unpackhi_epi32(a, zero));
+    }
+    return fold(lanes_sum_128(_mm_add_epi64(acc0, acc1)) + sum_tail(p, len));
+}
+
+__attribute__((target("avx2")))
+static uint16_t checksum_avx2(const void *buf, size_t len) {
+    const unsigned char *p = buf;
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i acc0 = zero, acc1 = zero;
+    for (; len >= 64; len -= 64, p += 64) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)p);
+        __m256i b = _mm256_loadu_si256((const __m256i*)(p + 32));
+        acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(a, zero));
+        acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(a, zero));
+        acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(b, zero));
+        acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(b, zero));
+    }
+    for (; len >= 32; len -= 32, p += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i*)p);
+        acc0 = _mm256_add_epi64(acc0, _mm256_unpacklo_epi32(a, zero));
+        acc1 = _mm256_add_epi64(acc1, _mm256_unpackhi_epi32(a, zero));
+    }
+    __m256i acc = _mm256_add_epi64(acc0, acc1);
+    __m128i half = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    return fold(lanes_sum_128(half) + sum_tail(p, len));
+}
+#endif
+
+// Every kernel this CPU can run, narrowest first; returns how many were stored
+int checksum_kernels(checksum_kernel_t *out, int max) {
+    checksum_kernel_t all[4];
+    int n = 0;
+    all[n++] = (checksum_kernel_t){ "scalar", checksum_scalar };
+    all[n++] = (checksum_kernel_t){ "wide", checksum_wide };
+#ifdef CHECKSUM_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) all[n++] = (checksum_kernel_t){ "sse2", checksum_sse2 };
+    if (__builtin_cpu_supports("avx2")) all[n++] = (checksum_kernel_t){ "avx2", checksum_avx2 };
+#endif
+    if (n > max) n = max;
+    memcpy(out, all, n * sizeof(checksum_kernel_t));
+    return n;
+}
+
+static checksum_kernel_t selected;
+static pthread_once_t select_once = PTHREAD_ONCE_INIT;
+
+static void select_kernel(void) {
+    checksum_kernel_t kernels[4];
+    int n = checksum_kernels(kernels, 4);
+    selected = kernels[n - 1];
+}
+
+uint16_t checksum(const void *buf, size_t len) {
+    pthread_once(&select_once, select_kernel);
+    return selected.fn(buf, len);
+}
+
+const char *checksum_kernel_name(void) {
+    pthread_once(&select_once, select_kernel);
+    return selected.name;
+}
+
+/*
+ * RFC 1624 eqn. 3: the new checksum after one 16-bit word changes,
+ * HC' = ~(~HC + ~m + m'), without touching the rest of the packet. Words are
+ * taken as they sit in memory, like the full checksum.
+ */
+uint16_t checksum_update16(uint16_t check, uint16_t old_word, uint16_t new_word) {
+    uint32_t sum = (uint16_t)~check + (uint32_t)(uint16_t)~old_word + new_word;
+    sum = (sum & 0xffff) + (sum >> 16);
+    sum = (sum & 0xffff) + (sum >> 16);
+    return (uint16_t)~sum;
+}
+
+/*
+ * CRC32C kernels for payload verification. The table kernel is slicing-by-8
+ * over the reflected Castagnoli polynomial; SSE4.2 and ARMv8 have the same
+ * CRC as an instruction, eight bytes at a time. As with the checksum, the
+ * best one is picked on first use.
+ */
+
+#define CRC32C_POLY 0x82f63b78      // Castagnoli, bit-reflected
+
+static uint32_t crc32c_table[8][256];
+static pthread_once_t crc32c_table_once = PTHREAD_ONCE_INIT;
+
+static void crc32c_build_table(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++) crc = (crc >> 1) ^ (CRC32C_POLY & -(crc & 1));
+        crc32c_table[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; i++) {
+        for (int t = 1; t < 8; t++) {
+            uint32_t prev = crc32c_table[t - 1][i];
+            crc32c_table[t][i] = (prev >> 8) ^ crc32c_table[0][prev & 0xff];
+        }
+    }
+}
+
+static uint32_t crc32c_sliced(uint32_t crc, const void *buf, size_t len) {
+    pthread_once(&crc32c_table_once, crc32c_build_table);
+    const unsigned char *p = buf;
+    crc = ~crc;
+    for (; len >= 8; len -= 8, p += 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, p, sizeof(lo));
+        memcpy(&hi, p + 4, sizeof(hi));
+        lo ^= crc;
+        crc = crc32c_table[7][lo & 0xff] ^ crc32c_table[6][(lo >> 8) & 0xff] ^
+              crc32c_table[5][(lo >> 16) & 0xff] ^ crc32c_table[4][lo >> 24] ^
+              crc32c_table[3][hi & 0xff] ^ crc32c_table[2][(hi >> 8) & 0xff] ^
+              crc32c_table[1][(hi >> 16) & 0xff] ^ crc32c_table[0][hi >> 24];
+    }
+    for (; len > 0; len--, p++) crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p) & 0xff];
+    return ~crc;
+}
+
+/*
+ * The CRC instruction has a latency of several cycles but issues every
+ * cycle, so the hardware kernels run three independent chains over
+ * consecutive CRC32C_LANE-byte stretches and merge them. Merging shifts a
+ * chain's state past the bytes after it, which is the same as feeding it
+ * that many zero bytes; that map is linear, so it is tabulated once per
+ * distance, a byte of state at a time.
+ */
+#define CRC32C_LANE 1360            // bytes per chain; three of them cover a 4 KB block
+
+static uint32_t crc32c_shift_lane[4][256];      // past CRC32C_LANE zero bytes
+static uint32_t crc32c_shift_two_lanes[4][256]; // past 2 * CRC32C_LANE
+static pthread_once_t crc32c_shift_once = PTHREAD_ONCE_INIT;
+
+static void crc32c_build_shift(uint32_t table[4][256], size_t zeros) {
+    uint32_t basis[32];
+    for (int bit = 0; bit < 32; bit++) {
+        uint32_t state = 1u << bit;
+        for (size_t i = 0; i < zeros; i++) state = (state >> 8) ^ crc32c_table[0][state & 0xff];
+        basis[bit] = state;
+    }
+    for (int byte = 0; byte < 4; byte++) {
+        for (int value = 0; value < 256; value++) {
+            uint32_t shifted = 0;
+            for (int bit = 0; bit < 8; bit++) {
+                if (value & (1 << bit)) shifted ^= basis[byte * 8 + bit];
+            }
+            table[byte][value] = shifted;
+        }
+    }
+}
+
+static void crc32c_build_shifts(void) {
+    pthread_once(&crc32c_table_once, crc32c_build_table);
+    crc32c_build_shift(crc32c_shift_lane, CRC32C_LANE);
+    crc32c_build_shift(crc32c_shift_two_lanes, 2 * CRC32C_LANE);
+}
+
+static uint32_t crc32c_shift(uint32_t table[4][256], uint32_t state) {
+    return table[0][state & 0xff] ^ table[1][(state >> 8) & 0xff] ^
+           table[2][(state >> 16) & 0xff] ^ table[3][state >> 24];
+}
+
+#if defined(CHECKSUM_X86) && defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const void *buf, size_t len) {
+    const unsigned char *p = buf;
+    uint32_t state = ~crc;
+    if (len >= 3 * CRC32C_LANE) pthread_once(&crc32c_shift_once, crc32c_build_shifts);
+    for (; len >= 3 * CRC32C_LANE; len -= 3 * CRC32C_LANE, p += 3 * CRC32C_LANE) {
+        uint64_t a = state, b = 0, c = 0;
+        for (size_t i = 0; i < CRC32C_LANE; i += 8) {
+            uint64_t wa, wb, wc;
+            memcpy(&wa, p + i, sizeof(wa));
+            memcpy(&wb, p + CRC32C_LANE + i, sizeof(wb));
+            memcpy(&wc, p + 2 * CRC32C_LANE + i, sizeof(wc));
+            a = _mm_crc32_u64(a, wa);
+            b = _mm_crc32_u64(b, wb);
+            c = _mm_crc32_u64(c, wc);
+        }
+        state = crc32c_shift(crc32c_shift_two_lanes, (uint32_t)a) ^
+                crc32c_shift(crc32c_shift_lane, (uint32_t)b) ^ (uint32_t)c;
+    }
+    uint64_t state64 = state;
+    for (; len >= 8; len -= 8, p += 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        state64 = _mm_crc32_u64(state64, word);
+    }
+    state = (uint32_t)state64;
+    for (; len > 0; len--, p++) state = _mm_crc32_u8(state, *p);
+    return ~state;
+}
+#endif
+
+#ifdef CHECKSUM_ARM64
+__attribute__((target("arch=armv8-a+crc")))
+static uint32_t crc32c_armv8(uint32_t crc, const void *buf, size_t len) {
+    const unsigned char *p = buf;
+    uint32_t state = ~crc;
+    if (len >= 3 * CRC32C_LANE) pthread_once(&crc32c_shift_once, crc32c_build_shifts);
+    for (; len >= 3 * CRC32C_LANE; len -= 3 * CRC32C_LANE, p += 3 * CRC32C_LANE) {
+        uint32_t a = state, b = 0, c = 0;
+        for (size_t i = 0; i < CRC32C_LANE; i += 8) {
+            uint64_t wa, wb, wc;
+            memcpy(&wa, p + i, sizeof(wa));
+            memcpy(&wb, p + CRC32C_LANE + i, sizeof(wb));
+            memcpy(&wc, p + 2 * CRC32C_LANE + i, sizeof(wc));
+            a = __crc32cd(a, wa);
+            b = __crc32cd(b, wb);
+            c = __crc32cd(c, wc);
+        }
+        state = crc32c_shift(crc32c_shift_two_lanes, a) ^ crc32c_shift(crc32c_shift_lane, b) ^ c;
+    }
+    for (; len >= 8; len -= 8, p += 8) {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        state = __crc32cd(state, word);
+    }
+    for (; len > 0; len--, p++) state = __crc32cb(state, *p);
+    return ~state;
+}
+#endif
+
+// Every CRC32C kernel this CPU can run, slowest first; returns how many were stored
+int crc32c_kernels(crc32c_kernel_t *out, int max) {
+    crc32c_kernel_t all[2];
+    int n = 0;
+    all[n++] = (crc32c_kernel_t){ "table", crc32c_sliced };
+#if defined(CHECKSUM_X86) && defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse4.2")) all[n++] = (crc32c_kernel_t){ "sse4.2", crc32c_sse42 };
+#endif
+#ifdef CHECKSUM_ARM64
+    if (getauxval(AT_HWCAP) & HWCAP_CRC32) all[n++] = (crc32c_kernel_t){ "armv8-crc", crc32c_armv8 };
+#endif
+    if (n > max) n = max;
+    memcpy(out, all, n * sizeof(crc32c_kernel_t));
+    return n;
+}
+
+static crc32c_kernel_t crc32c_selected;
+static pthread_once_t crc32c_select_once = PTHREAD_ONCE_INIT;
+
+static void crc32c_select_kernel(void) {
+    crc32c_kernel_t kernels[2];
+    int n = crc32c_kernels(kernels, 2);
+    crc32c_selected = kernels[n - 1];
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+    pthread_once(&crc32c_select_once, crc32c_select_kernel);
+    return crc32c_selected.fn(crc, buf, len);
+}
+
+const char *crc32c_kernel_name(void) {
+    pthread_once(&crc32c_select_once, crc32c_select_kernel);
+    return crc32c_selected.name;
+}
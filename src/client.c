@@ -1,17 +1,40 @@
 #include "../include/client.h"
 #include "../include/shared.h"
+#include "../include/probe.h"
+#include "../include/reporter.h"
+#include "../include/tuning.h"
+#include "../include/log.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <sys/time.h>
+#include <sys/resource.h>
 #include <time.h>
 #include <netinet/ip_icmp.h>
 #include <math.h>
 #include <netdb.h>
+#include <pthread.h>
+#include <errno.h>
+#include <signal.h>
 
-static int create_tcp_socket(char *address, int port) {
+static int refused;     // a server turned a session away or never answered
+
+// Exit status for client mode: non-zero once any session was refused
+int client_status(void) {
+    return refused ? EXIT_FAILURE : 0;
+}
+
+static void sleep_interval(double seconds) {
+    struct timespec ts;
+    ts.tv_sec = (time_t)seconds;
+    ts.tv_nsec = (long)((seconds - ts.tv_sec) * 1e9);
+    nanosleep(&ts, NULL);
+}
+
+// Tuning goes on before connect so the receive buffer also sets the offered window scale
+static int create_tcp_socket(char *address, int port, const tuning_options_t *tuning) {
     int client_sock;
     struct sockaddr_in server_addr;
 
@@ -20,6 +43,7 @@ static int create_tcp_socket(char *address, int port) {
         perror("Socket creation failed");
         exit(EXIT_FAILURE);
     }
+    tuning_apply(client_sock, tuning);
 
     memset(&server_addr,0,sizeof(server_addr));
     server_addr.sin_family = AF_INET;
@@ -49,7 +73,7 @@ static int create_tcp_socket(char *address, int port) {
     return client_sock;
 }
 
-static int create_udp_socket_and_send_test(char *address, int port, const char *test) {
+static int create_udp_socket_and_send_test(char *address, int port, const control_header_t *header) {
     int sock = socket(AF_INET, SOCK_DGRAM, 0);
     if (sock < 0) {
         perror("UDP Socket creation failed");
@@ -66,21 +90,48 @@ static int create_udp_socket_and_send_test(char *address, int port, const char *
         exit(EXIT_FAILURE);
     }
 
-    // Send test type
-    if (sendto(sock, test, strlen(test), 0, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+    // Send the control header
+    if (control_send_header(sock, header, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
         perror("Failed to send test type");
         close(sock);
         return -1;
     }
 
-    // Receive new_port from server
+    // Receive new_port from server, or a busy or unsupported reply in its place;
+    // a server that never answers ends the test instead of hanging it
+    struct timeval timeout = { CONTROL_REPLY_TIMEOUT_MS / 1000, CONTROL_REPLY_TIMEOUT_MS % 1000 * 1000 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    struct control_reply reply;
     unsigned short new_port;
+    int retry_after_ms;
     socklen_t addr_len = sizeof(server_addr);
-    if (recvfrom(sock, &new_port, sizeof(new_port), 0, (struct sockaddr*)&server_addr, &addr_len) <= 0) {
+    long len = recvfrom(sock, &reply, sizeof(reply), 0, (struct sockaddr*)&server_addr, &addr_len);
+    if (len <= 0) {
         perror("Failed to receive new port");
+        refused = 1;
+        close(sock);
+        return -1;
+    }
+    int status = control_decode_reply(&reply, len, &retry_after_ms);
+    if (status == CONTROL_BUSY) {
+        printf("Server busy: retry after %d ms\n", retry_after_ms);
+        refused = 1;
         close(sock);
         return -1;
     }
+    if (status == CONTROL_UNSUPPORTED) {
+        printf("Server does not support this test\n");
+        refused = 1;
+        close(sock);
+        return -1;
+    }
+    if (len != sizeof(new_port)) {
+        printf("Unexpected reply from server\n");
+        refused = 1;
+        close(sock);
+        return -1;
+    }
+    memcpy(&new_port, &reply, sizeof(new_port));
 
     // Now close and reopen socket bound to new_port?
     // Actually we don't need to reopen, just update server_addr to the new port:
@@ -89,379 +140,1298 @@ static int create_udp_socket_and_send_test(char *address, int port, const char *
     // Connect the socket to fix the remote address and avoid specifying it every time
     if (connect(sock, (struct sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
         perror("UDP connect failed");
+        refused = 1;
         close(sock);
         return -1;
     }
 
+    // The server acks from the session socket once it is ready for the test
+    len = recv(sock, &reply, sizeof(reply), 0);
+    if (len <= 0 || control_decode_reply(&reply, len, &retry_after_ms) != CONTROL_ACCEPT) {
+        perror("Failed to receive ack");
+        refused = 1;
+        close(sock);
+        return -1;
+    }
+    timeout.tv_sec = timeout.tv_usec = 0;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
     return sock;
 }
 
-void run_udp_upload_test(char *address, int port, int duration) {
-    int sock = create_udp_socket_and_send_test(address, port, "upload");
-    if (sock < 0) return;
+static void print_udp_result(const char *test, const char *verb, const udp_batch_t *batch, double seconds) {
+    double megabytes = (double)batch->bytes / (1024.0 * 1024.0);
+    printf("%s: %s %.2f MB in %.2f seconds (~%.2f MB/s, %.0f packets/s, %.0f syscalls/s)\n",
+           test, verb, megabytes, seconds,
+           seconds > 0 ? megabytes / seconds : 0.0,
+           seconds > 0 ? batch->packets / seconds : 0.0,
+           seconds > 0 ? batch->syscalls / seconds : 0.0);
+}
 
-    // Wait for ack
-    char ack[4];
-    if (recv(sock, ack, sizeof(ack), 0) <= 0) {
-        perror("Failed to receive ack");
-        close(sock);
+static void print_server_udp_result(const char *test, const control_results_t *results) {
+    double seconds = results->duration_us / 1e6;
+    uint64_t expected = results->packets + results->lost;
+    printf("%s: Server received %.2f MB in %.2f seconds (~%.2f Mbps), %llu/%llu lost (%.2f%%), "
+           "%llu out-of-order, %llu duplicates, jitter %.3f ms\n",
+           test, results->bytes / (1024.0 * 1024.0), seconds,
+           seconds > 0 ? results->bytes * 8.0 / seconds / 1e6 : 0.0,
+           (unsigned long long)results->lost, (unsigned long long)expected,
+           expected > 0 ? results->lost * 100.0 / expected : 0.0,
+           (unsigned long long)results->out_of_order, (unsigned long long)results->duplicates,
+           results->jitter_ns / 1e6);
+}
+
+// A download's losses, from the server's count of what it sent
+static void print_server_udp_sent(const char *test, const control_results_t *results, const udp_seq_stats_t *seq) {
+    long missing = (long)results->packets - seq->received;
+    printf("%s: Server sent %llu datagrams (%.2f MB), %ld not received (%.2f%%)\n",
+           test, (unsigned long long)results->packets, results->bytes / (1024.0 * 1024.0), missing,
+           results->packets > 0 ? missing * 100.0 / results->packets : 0.0);
+}
+
+typedef struct {
+    long bytes;         // published by the sender after each batch
+    long packets;
+    long last_bytes;    // reporter-side values at the previous interval
+    long last_packets;
+    const char *test;
+    const char *direction;
+} udp_send_report_t;
+
+static void udp_upload_interval(void *arg, int index, double start, double end) {
+    udp_send_report_t *rep = (udp_send_report_t*)arg;
+    long bytes = __atomic_load_n(&rep->bytes, __ATOMIC_RELAXED);
+    long packets = __atomic_load_n(&rep->packets, __ATOMIC_RELAXED);
+    double seconds = end - start;
+
+    printf("UDP Interval %d: Sent %.2f MB in %.2f seconds (~%.2f Mbps, %.0f packets/s)\n", index,
+           (bytes - rep->last_bytes) / (1024.0 * 1024.0), seconds,
+           (bytes - rep->last_bytes) * 8.0 / seconds / 1e6, (packets - rep->last_packets) / seconds);
+    report_record_t record;
+    report_record_init(&record, "interval", rep->test, "client");
+    record.direction = rep->direction;
+    report_set_bytes(&record, bytes - rep->last_bytes, start, end);
+    record.fields |= REPORT_F_PACKETS;
+    record.packets = packets - rep->last_packets;
+    report_emit(&record);
+
+    rep->last_bytes = bytes;
+    rep->last_packets = packets;
+}
+
+void run_udp_upload_test(char *address, int port, int duration, double report_interval,
+                         const udp_batch_options_t *udp) {
+    udp_batch_t batch;
+    if (udp_batch_init(&batch, udp, 0) < 0) return;
+
+    control_header_t header;
+    control_header_init(&header, CONTROL_TEST_UPLOAD, duration, batch.opt.datagram_size);
+    header.rate = batch.opt.rate;
+    int sock = create_udp_socket_and_send_test(address, port, &header);
+    if (sock < 0) {
+        udp_batch_free(&batch);
         return;
     }
 
-    char *data = malloc(BUFFER_SIZE);
-    memset(data, 'A', BUFFER_SIZE);
-
-    struct timeval start, now;
-    gettimeofday(&start, NULL);
-    long bytes_sent = 0;
-    while (1) {
-        gettimeofday(&now, NULL);
-        long elapsed = (now.tv_sec - start.tv_sec)*1000000L + (now.tv_usec - start.tv_usec);
-        double sec = elapsed / 1000000.0;
-        if (sec >= duration) {
-            break;
-        }
+    if (udp_batch_configure_socket(sock, udp, 0) < 0) {
+        udp_batch_free(&batch);
+        close(sock);
+        return;
+    }
 
-        if (send(sock, data, BUFFER_SIZE, 0) < 0) {
-            perror("UDP data send failed");
+    udp_pacer_t pacer;
+    udp_pacer_init(&pacer, udp->rate, udp_batch_bytes(&batch));
+    uint64_t sequence = 0;
+
+    volatile int stop = 0;
+    udp_send_report_t rep;
+    memset(&rep, 0, sizeof(rep));
+    rep.test = "udp_upload";
+    reporter_t reporter;
+    if (reporter_start(&reporter, report_interval, duration, udp_upload_interval, &rep, &stop) < 0) {
+        udp_batch_free(&batch);
+        close(sock);
+        return;
+    }
+    while (!stop) {
+        udp_pacer_wait(&pacer, udp_batch_bytes(&batch));
+        if (udp_batch_send(&batch, sock, NULL, 0, &sequence) < 0) {
+            log_error("UDP data send failed: %m");
+            reporter_stop(&reporter);
             break;
         }
-        bytes_sent += BUFFER_SIZE;
+        __atomic_store_n(&rep.bytes, batch.bytes, __ATOMIC_RELAXED);
+        __atomic_store_n(&rep.packets, batch.packets, __ATOMIC_RELAXED);
+    }
+    double sec = reporter_join(&reporter);
+
+    print_udp_result("UDP Upload Test", "Sent", &batch, sec);
+    printf("UDP Upload Test: %llu datagrams sent (offered %.2f Mbps)\n",
+           (unsigned long long)sequence, sec > 0 ? batch.bytes * 8.0 / sec / 1e6 : 0.0);
+    report_record_t record;
+    report_record_init(&record, "summary", "udp_upload", "client");
+    report_set_bytes(&record, batch.bytes, 0.0, sec);
+    record.fields |= REPORT_F_PACKETS;
+    record.packets = (long)sequence;
+    report_emit(&record);
+
+    // The server's view is the one that counts: what actually arrived
+    control_results_t results;
+    if (control_recv_results_udp(sock, &results, CONTROL_RESULTS_TIMEOUT_MS) == 0) {
+        print_server_udp_result("UDP Upload Test", &results);
+        report_results("udp_upload", 0, &results, 1);
+    } else {
+        printf("UDP Upload Test: no results from server\n");
     }
 
-    double megabytes = (double)bytes_sent / (1024.0 * 1024.0);
-
-    printf("UDP Upload Test: Sent %.2f MB in %d seconds\n", megabytes, duration);
-
-    free(data);
+    udp_batch_free(&batch);
     close(sock);
 }
 
-void run_udp_download_test(char *address, int port, int duration) {
-    int sock = create_udp_socket_and_send_test(address, port, "download");
-    if (sock < 0) return;
+typedef struct {
+    udp_seq_stats_t live;       // published by the receiver after each batch
+    udp_seq_stats_t prev;       // reporter-side snapshot at the previous interval
+    const char *test;
+    const char *direction;
+} udp_recv_report_t;
+
+static void udp_download_interval(void *arg, int index, double start, double end) {
+    udp_recv_report_t *rep = (udp_recv_report_t*)arg;
+    udp_seq_stats_t now;
+    udp_seq_init(&now);
+    udp_seq_publish(&now, &rep->live);
+
+    char label[32];
+    snprintf(label, sizeof(label), "UDP Interval %d", index);
+    report_udp("interval", rep->test, "client", rep->direction, start, end, &now, &rep->prev);
+    udp_seq_report(label, &now, &rep->prev, end - start);
+}
 
-    // Wait for ack
-    char ack[4];
-    if (recv(sock, ack, sizeof(ack), 0) <= 0) {
-        perror("Failed to receive ack");
+void run_udp_download_test(char *address, int port, int duration, double report_interval,
+                           const udp_batch_options_t *udp) {
+    udp_batch_t batch;
+    if (udp_batch_init(&batch, udp, 1) < 0) return;
+
+    control_header_t header;
+    control_header_init(&header, CONTROL_TEST_DOWNLOAD, duration, batch.opt.datagram_size);
+    header.rate = batch.opt.rate;   // the server sends at the client's -l and -b
+    int sock = create_udp_socket_and_send_test(address, port, &header);
+    if (sock < 0) {
+        udp_batch_free(&batch);
+        return;
+    }
+
+    if (udp_batch_configure_socket(sock, udp, 1) < 0) {
+        udp_batch_free(&batch);
         close(sock);
         return;
     }
 
-    char *buffer = malloc(BUFFER_SIZE);
-    struct timeval start, now;
-    gettimeofday(&start, NULL);
-    long bytes_received = 0;
+    // Wake up regularly so the end of the test is noticed even when nothing arrives
+    struct timeval timeout;
+    timeout.tv_sec = 0;
+    timeout.tv_usec = 100000;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    udp_seq_stats_t seq, prev;
+    udp_seq_init(&seq);
+    udp_recv_report_t *rep = calloc(1, sizeof(udp_recv_report_t));
+    if (!rep) {
+        perror("Malloc failed");
+        udp_batch_free(&batch);
+        close(sock);
+        return;
+    }
+    rep->test = "udp_download";
 
-    while (1) {
+    volatile int stop = 0;
+    reporter_t reporter;
+    if (reporter_start(&reporter, report_interval, duration, udp_download_interval, rep, &stop) < 0) {
+        free(rep);
+        udp_batch_free(&batch);
+        close(sock);
+        return;
+    }
+    while (!stop) {
+        if (udp_batch_recv(&batch, sock, &seq) < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) continue;
+            log_error("UDP receive failed: %m");
+            reporter_stop(&reporter);
+            break;
+        }
+        udp_seq_publish(&rep->live, &seq);
+    }
+    double seconds = reporter_join(&reporter);
+    free(rep);
+
+    print_udp_result("UDP Download Test", "Received", &batch, seconds);
+    udp_seq_init(&prev);
+    report_udp("summary", "udp_download", "client", NULL, 0.0, seconds, &seq, &prev);
+    udp_seq_report("UDP Download Test", &seq, &prev, seconds);
+
+    // The results block trails the server's data, so drain up to it; losses
+    // at the tail of the test leave no sequence gap, the sender's count catches them
+    struct timeval drain_start, now;
+    gettimeofday(&drain_start, NULL);
+    while (!batch.have_results) {
         gettimeofday(&now, NULL);
-        long elapsed = (now.tv_sec - start.tv_sec)*1000000L + (now.tv_usec - start.tv_usec);
-        double sec = elapsed / 1000000.0;
-        if (sec >= duration) {
+        if ((now.tv_sec - drain_start.tv_sec)*1000L + (now.tv_usec - drain_start.tv_usec)/1000L >=
+            CONTROL_RESULTS_TIMEOUT_MS) {
             break;
         }
-
-        int bytes = recv(sock, buffer, BUFFER_SIZE, 0);
-        if (bytes > 0) {
-            bytes_received += bytes;
-        } else if (bytes < 0) {
-            perror("UDP receive failed");
+        if (udp_batch_recv(&batch, sock, &seq) < 0 &&
+            errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
             break;
         }
     }
+    if (batch.have_results) {
+        print_server_udp_sent("UDP Download Test", &batch.results[0], &seq);
+        report_results("udp_download", 0, &batch.results[0], 0);
+    } else {
+        printf("UDP Download Test: no results from server\n");
+    }
 
-    double megabytes = (double)bytes_received / (1024.0 * 1024.0);
-    double mbps = 0.0;
+    udp_batch_free(&batch);
+    close(sock);
+}
 
-    gettimeofday(&now, NULL);
+typedef struct {
+    udp_send_report_t send;
+    udp_recv_report_t recv;
+} udp_bidir_report_t;
 
-    long total_time = (now.tv_sec - start.tv_sec)*1000000L+(now.tv_usec - start.tv_usec);
-    double total_seconds = total_time / 1000000.0;
+// Both directions are sampled at the same boundary, so they share one timeline
+static void udp_bidir_interval(void *arg, int index, double start, double end) {
+    udp_bidir_report_t *rep = (udp_bidir_report_t*)arg;
+    udp_upload_interval(&rep->send, index, start, end);
+    udp_download_interval(&rep->recv, index, start, end);
+}
 
-    if (total_time > 0) {
-        mbps = megabytes / total_seconds;
+typedef struct {
+    int sock;
+    udp_batch_t batch;
+    udp_seq_stats_t seq;
+    udp_recv_report_t *rep;
+    volatile int *stop;
+} udp_receiver_t;
+
+static void *udp_receiver(void *arg) {
+    udp_receiver_t *receiver = (udp_receiver_t*)arg;
+    while (!*receiver->stop) {
+        if (udp_batch_recv(&receiver->batch, receiver->sock, &receiver->seq) < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) continue;
+            log_error("UDP receive failed: %m");
+            break;
+        }
+        udp_seq_publish(&receiver->rep->live, &receiver->seq);
     }
+    return NULL;
+}
 
+/*
+ * Sends and receives at once on one session: this thread sends paced
+ * datagrams while a receiver thread counts the server's. The server answers
+ * with two results blocks once the upload has gone quiet, one per
+ * direction: what it received, and how many datagrams it sent.
+ */
+void run_udp_bidir_test(char *address, int port, int duration, double report_interval,
+                        const udp_batch_options_t *udp) {
+    udp_batch_t batch;
+    udp_receiver_t receiver;
+    if (udp_batch_init(&batch, udp, 0) < 0) return;
+    if (udp_batch_init(&receiver.batch, udp, 1) < 0) {
+        udp_batch_free(&batch);
+        return;
+    }
 
-    printf("UDP Download Test: Received %.2f MB in %d seconds (~%.2f MB/s)\n",
-           megabytes, duration, mbps);
+    control_header_t header;
+    control_header_init(&header, CONTROL_TEST_BIDIR, duration, batch.opt.datagram_size);
+    header.rate = batch.opt.rate;
+    int sock = create_udp_socket_and_send_test(address, port, &header);
+    if (sock < 0) {
+        udp_batch_free(&receiver.batch);
+        udp_batch_free(&batch);
+        return;
+    }
+    udp_bidir_report_t *rep = calloc(1, sizeof(udp_bidir_report_t));
+    if (!rep || udp_batch_configure_socket(sock, udp, 0) < 0 || udp_batch_configure_socket(sock, udp, 1) < 0) {
+        if (!rep) perror("Malloc failed");
+        free(rep);
+        udp_batch_free(&receiver.batch);
+        udp_batch_free(&batch);
+        close(sock);
+        return;
+    }
+    rep->send.test = rep->recv.test = "udp_bidir";
+    rep->send.direction = "up";
+    rep->recv.direction = "down";
 
-    free(buffer);
+    // Wake up regularly so the end of the test is noticed even when nothing arrives
+    struct timeval timeout;
+    timeout.tv_sec = 0;
+    timeout.tv_usec = 100000;
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    udp_pacer_t pacer;
+    udp_pacer_init(&pacer, udp->rate, udp_batch_bytes(&batch));
+    uint64_t sequence = 0;
+
+    volatile int stop = 0;
+    receiver.sock = sock;
+    receiver.rep = &rep->recv;
+    receiver.stop = &stop;
+    udp_seq_init(&receiver.seq);
+    reporter_t reporter;
+    pthread_t thread;
+    if (reporter_start(&reporter, report_interval, duration, udp_bidir_interval, rep, &stop) < 0) {
+        free(rep);
+        udp_batch_free(&receiver.batch);
+        udp_batch_free(&batch);
+        close(sock);
+        return;
+    }
+    int receiving = pthread_create(&thread, NULL, udp_receiver, &receiver) == 0;
+    if (!receiving) {
+        perror("Failed to create receiver thread");
+        reporter_stop(&reporter);
+    }
+    while (!stop) {
+        udp_pacer_wait(&pacer, udp_batch_bytes(&batch));
+        if (udp_batch_send(&batch, sock, NULL, 0, &sequence) < 0) {
+            log_error("UDP data send failed: %m");
+            reporter_stop(&reporter);
+            break;
+        }
+        __atomic_store_n(&rep->send.bytes, batch.bytes, __ATOMIC_RELAXED);
+        __atomic_store_n(&rep->send.packets, batch.packets, __ATOMIC_RELAXED);
+    }
+    double seconds = reporter_join(&reporter);
+    if (receiving) pthread_join(thread, NULL);
+    free(rep);
+
+    print_udp_result("UDP Bidir Upload Test", "Sent", &batch, seconds);
+    print_udp_result("UDP Bidir Download Test", "Received", &receiver.batch, seconds);
+    report_record_t record;
+    report_record_init(&record, "summary", "udp_bidir", "client");
+    record.direction = "up";
+    report_set_bytes(&record, batch.bytes, 0.0, seconds);
+    record.fields |= REPORT_F_PACKETS;
+    record.packets = (long)sequence;
+    report_emit(&record);
+    udp_seq_stats_t prev;
+    udp_seq_init(&prev);
+    report_udp("summary", "udp_bidir", "client", "down", 0.0, seconds, &receiver.seq, &prev);
+    udp_seq_report("UDP Bidir Download Test", &receiver.seq, &prev, seconds);
+
+    // Drain up to both results blocks
+    struct timeval drain_start, now;
+    gettimeofday(&drain_start, NULL);
+    while (receiver.batch.have_results < 2) {
+        gettimeofday(&now, NULL);
+        if ((now.tv_sec - drain_start.tv_sec)*1000L + (now.tv_usec - drain_start.tv_usec)/1000L >=
+            CONTROL_RESULTS_TIMEOUT_MS) {
+            break;
+        }
+        if (udp_batch_recv(&receiver.batch, sock, &receiver.seq) < 0 &&
+            errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            break;
+        }
+    }
+    // Each block names the direction it measures
+    control_results_t results[2];
+    int have[2] = { 0, 0 };
+    for (int i = 0; i < receiver.batch.have_results; i++) {
+        int down = receiver.batch.results[i].test == CONTROL_TEST_DOWNLOAD;
+        results[down] = receiver.batch.results[i];
+        have[down] = 1;
+    }
+    if (have[0]) {
+        print_server_udp_result("UDP Bidir Upload Test", &results[0]);
+        report_results("udp_bidir", 0, &results[0], 1);
+    }
+    if (have[1]) {
+        print_server_udp_sent("UDP Bidir Download Test", &results[1], &receiver.seq);
+        report_results("udp_bidir", 0, &results[1], 0);
+    }
+    if (!have[0] || !have[1]) {
+        printf("UDP Bidir Test: no results from server for %s\n",
+               !have[0] && !have[1] ? "either direction" : have[0] ? "the download" : "the upload");
+    }
+
+    udp_batch_free(&receiver.batch);
+    udp_batch_free(&batch);
     close(sock);
 }
 
-void run_tcp_upload_test(char *address, int port, int duration) {
-    int client_sock = create_tcp_socket(address, port);
-    send(client_sock, "upload", strlen("upload"), 0);
+typedef struct {
+    int id;
+    int sock;
+    int download;
+    int size;           // bytes per send/recv
+    volatile int *stop;
+    long bytes;         // running total, written by the worker, sampled by the reporter
+    long calls;         // send/recv system calls made by the worker
+    long received;      // download bytes seen so far, including the trailer
+    char tail[sizeof(struct control_results)];
+    int have_results;
+    control_results_t results;
+    tcpinfo_summary_t tcp;  // client-side TCP_INFO, sampled by the reporter
+    int verify;             // CRC32C-framed payload
+    integrity_rx_t *rx;     // verified downloads: the receiving worker's checker
+} tcp_stream_t;
+
+// Keeps the last bytes of a download: the server ends it with its results block
+static void tcp_stream_keep_tail(tcp_stream_t *stream, const char *data, long n) {
+    const long tail_size = sizeof(stream->tail);
+    if (n >= tail_size) {
+        memcpy(stream->tail, data + n - tail_size, tail_size);
+    } else {
+        memmove(stream->tail, stream->tail + n, tail_size - n);
+        memcpy(stream->tail + tail_size - n, data, n);
+    }
+    stream->received += n;
+}
 
-    char *data = malloc(BUFFER_SIZE);
-    memset(data, 'A', BUFFER_SIZE);
-    struct timespec start_time, end_time;
-    double total_elapsed_time = 0;
-    while (total_elapsed_time < 0.1) {
-        clock_gettime(CLOCK_MONOTONIC, &start_time);
-        long bytes_sent_i = send(client_sock, data, BUFFER_SIZE, 0);
-        if (bytes_sent_i < 0) {
-            perror("Data send failed");
-            break;
+// Decodes the trailer once a download has hit EOF and returns the payload byte count
+static long tcp_stream_finish_download(tcp_stream_t *stream) {
+    const long tail_size = sizeof(stream->tail);
+    if (stream->received >= tail_size &&
+        control_decode_results(stream->tail, tail_size, &stream->results) == 0) {
+        stream->have_results = 1;
+        return stream->received - tail_size;
+    }
+    return stream->received;
+}
+
+/*
+ * Upload workers send until stopped. Download workers read until the server
+ * closes, keeping the last bytes of the stream: the server ends a download
+ * with its results block as a trailer. With verification on, uploads send
+ * stamped blocks and downloads check every block they read.
+ */
+static void *tcp_stream_worker(void *arg) {
+    tcp_stream_t *stream = (tcp_stream_t*)arg;
+    char *data = malloc(stream->size);
+    memset(data, 'A', stream->size);
+    long total = 0;
+    integrity_tx_t tx;
+    int verify_send = stream->verify && !stream->download;
+    if (verify_send && integrity_tx_init(&tx, stream->size, (uint64_t)stream->id) < 0) {
+        free(data);
+        return NULL;
+    }
+
+    while (stream->download || !*stream->stop) {
+        long n;
+        if (stream->download) {
+            n = recv(stream->sock, data, stream->size, 0);
+        } else if (verify_send) {
+            size_t len;
+            const char *block = integrity_tx_data(&tx, stream->size, &len);
+            n = send(stream->sock, block, len, MSG_NOSIGNAL);
+            if (n > 0) integrity_tx_advance(&tx, n);
+        } else {
+            n = send(stream->sock, data, stream->size, MSG_NOSIGNAL);
         }
-        clock_gettime(CLOCK_MONOTONIC, &end_time);
-        double time_taken = (end_time.tv_sec - start_time.tv_sec) +
-                            (end_time.tv_nsec - start_time.tv_nsec) / 1e9;
-        total_elapsed_time += time_taken;
-    }
-
-    total_elapsed_time = 0;
-    long bytes_sent = 0;
-    int iteration = 1;
-    while (total_elapsed_time < duration) {
-        clock_gettime(CLOCK_MONOTONIC, &start_time);
-        long bytes_sent_i = send(client_sock, data, BUFFER_SIZE, 0);
-        if (bytes_sent_i < 0) {
-            perror("Data send failed");
+        stream->calls++;
+        if (n <= 0) {
+            if (!*stream->stop && !(stream->download && n == 0)) {
+                log_error("%s: %m", stream->download ? "Data recieve failed" : "Data send failed");
+            }
             break;
         }
-        clock_gettime(CLOCK_MONOTONIC, &end_time);
-        bytes_sent += bytes_sent_i;
-        double time_taken = (end_time.tv_sec - start_time.tv_sec) +
-                            (end_time.tv_nsec - start_time.tv_nsec) / 1e9;
-
-        total_elapsed_time += time_taken;
-        if (total_elapsed_time >= iteration) {
-            double iter_elapsed_time = total_elapsed_time - iteration + 1;
-            double megabytes = (double)bytes_sent / (1024.0 * 1024.0);
-
-            printf("Upload Test: Sent %.2f MB in %.2f seconds (~%.2f MB/S)\n",
-                    megabytes, iter_elapsed_time, (megabytes / iter_elapsed_time));
-            iteration++;
-            bytes_sent = 0;
+        if (stream->download) {
+            tcp_stream_keep_tail(stream, data, n);
+            if (stream->rx) integrity_rx_feed(stream->rx, data, n);
         }
+        total += n;
+        __atomic_store_n(&stream->bytes, total, __ATOMIC_RELAXED);
     }
 
+    if (stream->download) {
+        __atomic_store_n(&stream->bytes, tcp_stream_finish_download(stream), __ATOMIC_RELAXED);
+    }
+    if (verify_send) integrity_tx_free(&tx);
     free(data);
-    close(client_sock);
-}
-
-void run_tcp_download_test(char *address, int port, int duration) {
-    int client_sock = create_tcp_socket(address, port);
-    send(client_sock, "download", strlen("download"), 0);
-
-    char *data = malloc(BUFFER_SIZE);
-    struct timespec start_time, end_time;
-    double total_elapsed_time = 0;
-    long bytes_recieved = 0;
-    int iteration = 1;
-    while (total_elapsed_time < duration) {
-        clock_gettime(CLOCK_MONOTONIC, &start_time);
-        long bytes_recieved_i = recv(client_sock, data, BUFFER_SIZE, 0);
-        if (bytes_recieved_i < 0) {
-            perror("Data recieve failed");
-            break;
-        }
-        clock_gettime(CLOCK_MONOTONIC, &end_time);
-        bytes_recieved += bytes_recieved_i;
-        double time_taken = (end_time.tv_sec - start_time.tv_sec) +
-                            (end_time.tv_nsec - start_time.tv_nsec) / 1e9;
-        total_elapsed_time += time_taken;
-        if (total_elapsed_time >= iteration) {
-            double iter_elapsed_time = total_elapsed_time - iteration + 1;
-            double megabytes = (double)bytes_recieved / (1024.0 * 1024.0);
-
-            printf("Download Test: Recieved %.2f MB in %.6f seconds (~%.2f MB/S)\n",
-                    megabytes, iter_elapsed_time, (megabytes / iter_elapsed_time));
-            iteration++;
-            bytes_recieved = 0;
+    return NULL;
+}
+
+typedef struct {
+    tcp_stream_t *stream;
+    uring_stream_t *ring;
+    int streams;
+    const io_engine_options_t *io;
+    volatile int *stop;
+    uring_stats_t stats;
+} tcp_uring_driver_t;
+
+static void tcp_uring_on_data(void *arg, int index, const char *data, long n) {
+    tcp_uring_driver_t *driver = (tcp_uring_driver_t*)arg;
+    tcp_stream_keep_tail(&driver->stream[index], data, n);
+}
+
+// Drives every stream of the test from this one thread through an io_uring
+static void *tcp_uring_driver(void *arg) {
+    tcp_uring_driver_t *driver = (tcp_uring_driver_t*)arg;
+    uring_limits_t limits = { driver->stop, 0, 0 };
+
+    if (uring_drive_streams(driver->ring, driver->streams, driver->io, &limits,
+                            tcp_uring_on_data, driver, &driver->stats) < 0) {
+        return NULL;
+    }
+    for (int i = 0; i < driver->streams; i++) {
+        tcp_stream_t *stream = &driver->stream[i];
+        if (stream->download) {
+            __atomic_store_n(&driver->ring[i].bytes, tcp_stream_finish_download(stream), __ATOMIC_RELAXED);
         }
     }
+    return NULL;
+}
 
-    free(data);
-    close(client_sock);
+typedef enum {
+    TCP_UPLOAD,
+    TCP_DOWNLOAD,
+    TCP_BIDIR           // both at once: a sending and a receiving worker share each connection
+} tcp_direction_t;
+
+static const char *tcp_direction_name(int download, int bidir) {
+    if (bidir) return download ? "Bidir Download" : "Bidir Upload";
+    return download ? "Download" : "Upload";
 }
 
-void run_ping_test(char *address, int port, int size, int duration, int interval) {
-    int sock = create_udp_socket_and_send_test(address, port, "ping");
-    if (sock < 0) return;
+// Direction tag for machine-readable records; only bidirectional tests carry one
+static const char *tcp_direction_tag(int download, int bidir) {
+    if (!bidir) return NULL;
+    return download ? "down" : "up";
+}
 
-    // Wait for ack (not yet, first we must send size after ack)
-    // Actually we first receive ack from handle_udp_client once connected:
-    char ack[4];
-    if (recv(sock, ack, sizeof(ack), 0) <= 0) {
-        perror("Failed to receive ack");
-        close(sock);
-        return;
+static void print_stream_interval(const char *label, const char *name, int download, double megabytes,
+                                  double seconds) {
+    printf("%s%s%s Test: %s %.2f MB in %.2f seconds (~%.2f MB/S)\n", label, *label ? " " : "", name,
+           download ? "Recieved" : "Sent",
+           megabytes, seconds, seconds > 0 ? megabytes / seconds : 0.0);
+}
+
+static void print_server_result(const char *label, const char *name, int download, double megabytes,
+                                double seconds) {
+    printf("%s%s%s Test: Server %s %.2f MB in %.2f seconds (~%.2f MB/S)\n", label, *label ? " " : "", name,
+           download ? "sent" : "received",
+           megabytes, seconds, seconds > 0 ? megabytes / seconds : 0.0);
+}
+
+typedef struct {
+    tcp_stream_t *stream;
+    uring_stream_t *ring;   // the byte counters live here under the io_uring engine
+    long *last;         // each stream's byte counter at the previous interval
+    int streams;        // connections; the first `streams` entries own the sockets
+    int count;          // entries: twice the connections in a bidirectional test
+    int bidir;
+    const char *name;
+    const char *test;
+    long total_bytes[2];    // indexed by direction: 0 sent, 1 received
+} tcp_report_t;
+
+static void tcp_stream_label(char *label, size_t len, const tcp_stream_t *stream, int streams,
+                             const char *name, const char *what) {
+    if (streams > 1) {
+        snprintf(label, len, "[%2d] %s Test: %s", stream->id, name, what);
+    } else {
+        snprintf(label, len, "%s Test: %s", name, what);
     }
+}
 
-    // Now send the packet size
-    if (send(sock, &size, sizeof(size), 0) < 0) {
-        perror("Send packet size failed");
-        close(sock);
-        return;
+// Reads each connection's TCP_INFO alongside its byte counter
+static void tcp_stream_sample_info(tcp_report_t *rep, double start, double end) {
+    for (int i = 0; i < rep->streams; i++) {
+        tcp_stream_t *stream = &rep->stream[i];
+        tcpinfo_t prev = stream->tcp.last;
+        if (tcpinfo_sample(stream->sock, &stream->tcp) < 0) continue;
+
+        char label[64];
+        tcp_stream_label(label, sizeof(label), stream, rep->streams, rep->name, "TCP_INFO");
+        tcpinfo_print_interval(label, &stream->tcp.last, &prev, end - start);
+        report_record_t record;
+        report_record_init(&record, "tcp_info", rep->test, "client");
+        record.stream = stream->id;
+        report_set_bytes(&record, 0, start, end);
+        report_set_tcp(&record, &stream->tcp.last, &prev);
+        report_emit(&record);
     }
+}
 
-    char data[size];
-    memset(data, 'A', size);
+/*
+ * Samples every stream's byte counter and prints per-stream and summed
+ * rates. Both directions of a bidirectional test are read at the same
+ * instant, so their intervals share one timeline.
+ */
+static void tcp_stream_interval(void *arg, int index, double start, double end) {
+    (void)index;
+    tcp_report_t *rep = (tcp_report_t*)arg;
+    double seconds = end - start;
+    report_record_t record;
+
+    long interval_bytes[2] = { 0, 0 };
+    for (int i = 0; i < rep->count; i++) {
+        tcp_stream_t *stream = &rep->stream[i];
+        long bytes = __atomic_load_n(rep->ring ? &rep->ring[i].bytes : &stream->bytes, __ATOMIC_RELAXED);
+        long delta = bytes - rep->last[i];
+        rep->last[i] = bytes;
+        interval_bytes[stream->download] += delta;
+        if (rep->streams > 1) {
+            char label[16];
+            snprintf(label, sizeof(label), "[%2d]", stream->id);
+            print_stream_interval(label, tcp_direction_name(stream->download, rep->bidir), stream->download,
+                                  delta / (1024.0 * 1024.0), seconds);
+            report_record_init(&record, "interval", rep->test, "client");
+            record.stream = stream->id;
+            record.direction = tcp_direction_tag(stream->download, rep->bidir);
+            report_set_bytes(&record, delta, start, end);
+            report_emit(&record);
+        }
+    }
+    for (int download = 0; download < 2; download++) {
+        if (!rep->bidir && download != rep->stream[0].download) continue;
+        rep->total_bytes[download] += interval_bytes[download];
+        print_stream_interval(rep->streams > 1 ? "[SUM]" : "", tcp_direction_name(download, rep->bidir), download,
+                              interval_bytes[download] / (1024.0 * 1024.0), seconds);
+        report_record_init(&record, "interval", rep->test, "client");
+        record.direction = tcp_direction_tag(download, rep->bidir);
+        report_set_bytes(&record, interval_bytes[download], start, end);
+        report_emit(&record);
+    }
+    tcp_stream_sample_info(rep, start, end);
+}
 
-    struct timespec start_time, end_time;
-    float packets_lost = 0.0;
-    double rtts[duration];
+/*
+ * Verification results per stream: the client's checker for what it
+ * received, the server's results block for what it received.
+ */
+static void tcp_stream_print_integrity(const tcp_report_t *rep) {
+    char label[64];
+    report_record_t record;
+    for (int i = 0; i < rep->count; i++) {
+        const tcp_stream_t *stream = &rep->stream[i];
+        const char *direction = tcp_direction_tag(stream->download, rep->bidir);
+        if (stream->rx) {
+            tcp_stream_label(label, sizeof(label), stream, rep->streams,
+                             tcp_direction_name(1, rep->bidir), "Client Integrity");
+            integrity_print(label, &stream->rx->stats);
+            report_record_init(&record, "summary", rep->test, "client");
+            record.stream = rep->streams > 1 ? stream->id : 0;
+            record.direction = direction;
+            report_set_integrity(&record, &stream->rx->stats);
+            report_emit(&record);
+        } else if (i < rep->streams && stream->have_results) {
+            // The upload results carry the server's counts; report_results already emitted them
+            tcp_stream_label(label, sizeof(label), stream, rep->streams,
+                             tcp_direction_name(0, rep->bidir), "Server Integrity");
+            integrity_print(label, &stream->results.integrity);
+        }
+    }
+}
 
-    for (int i = 0; i < duration; i++) {
-        sleep(interval);
-        clock_gettime(CLOCK_MONOTONIC, &start_time);
+/*
+ * Runs a TCP upload, download or both over `streams` parallel connections.
+ * Each direction of each connection is driven by its own worker thread, or
+ * all of them by a single io_uring driver thread under that engine; a
+ * reporter thread samples their byte counters every report_interval seconds
+ * and ends the test after `duration` seconds of wall-clock time. At the end
+ * each connection yields the server's own byte count and timing, which for
+ * uploads is the receiver-side goodput. Returns the goodput in bits/s; a
+ * bidirectional test adds the download the client received to the upload.
+ */
+static double run_tcp_stream_test(char *address, int port, int duration, double report_interval,
+                                  int streams, const io_engine_options_t *io,
+                                  const tuning_options_t *tuning, tcp_direction_t direction) {
+    static const char *names[] = { "Upload", "Download", "Bidir" };
+    static const char *tests[] = { "tcp_upload", "tcp_download", "tcp_bidir" };
+    static const control_test_t control_tests[] = { CONTROL_TEST_UPLOAD, CONTROL_TEST_DOWNLOAD, CONTROL_TEST_BIDIR };
+    const char *name = names[direction];
+    const char *test = tests[direction];
+    int bidir = direction == TCP_BIDIR;
+    // Results come from the server's receiving side, except in a plain download
+    int server_sent = direction == TCP_DOWNLOAD;
+    report_record_t record;
+    volatile int stop = 0;
+
+    if (streams < 1) streams = 1;
+    int count = bidir ? 2 * streams : streams;
+
+    // io_uring sends one registered payload over and over; stamped blocks need the socket engine
+    io_engine_options_t socket_io;
+    if (tuning->verify && io->engine == IO_ENGINE_URING) {
+        printf("%s Test: payload verification runs on the socket engine\n", name);
+        socket_io = *io;
+        socket_io.engine = IO_ENGINE_SOCKET;
+        io = &socket_io;
+    }
 
-        if (send(sock, data, size, 0) < 0) {
-            packets_lost++;
-            perror("Ping send failed");
-            continue;
+    tcp_stream_t *stream = calloc(count, sizeof(tcp_stream_t));
+    pthread_t *threads = calloc(count, sizeof(pthread_t));
+    long *last = calloc(count, sizeof(long));
+    uring_stream_t *ring = io->engine == IO_ENGINE_URING ? calloc(count, sizeof(uring_stream_t)) : NULL;
+    if (!stream || !threads || !last || (io->engine == IO_ENGINE_URING && !ring)) {
+        perror("Malloc failed");
+        exit(EXIT_FAILURE);
+    }
+    // Ring writes cannot carry MSG_NOSIGNAL, so a reset connection must not kill us
+    if (ring) signal(SIGPIPE, SIG_IGN);
+
+    for (int i = 0; i < streams; i++) {
+        stream[i].id = i + 1;
+        stream[i].sock = create_tcp_socket(address, port, tuning);
+        stream[i].download = direction == TCP_DOWNLOAD;
+        stream[i].size = tuning->write_size > 0 ? tuning->write_size : BUFFER_SIZE;
+        stream[i].stop = &stop;
+        stream[i].verify = tuning->verify;
+
+        control_header_t header;
+        control_header_init(&header, control_tests[direction], duration, BUFFER_SIZE);
+        tuning_to_header(tuning, &header);
+        header.streams = streams;
+        header.stream_id = i + 1;
+        if (control_send_header(stream[i].sock, &header, NULL, 0) < 0) {
+            perror("Failed to send test type");
         }
+    }
+    // The receiving half of each bidirectional connection
+    for (int i = streams; i < count; i++) {
+        stream[i] = stream[i - streams];
+        stream[i].download = 1;
+    }
+    for (int i = 0; tuning->verify && i < count; i++) {
+        if (!stream[i].download) continue;
+        stream[i].rx = malloc(sizeof(integrity_rx_t));
+        if (!stream[i].rx) {
+            perror("Malloc failed");
+            exit(EXIT_FAILURE);
+        }
+        integrity_rx_init(stream[i].rx);
+    }
+    for (int i = 0; ring && i < count; i++) {
+        ring[i].sock = stream[i].sock;
+        ring[i].receive = stream[i].download;
+        ring[i].size = stream[i].size;
+    }
 
-        if (recv(sock, data, size, 0) < 0) {
-            packets_lost++;
-            perror("Ping receive failed");
-            continue;
+    // Every stream must be admitted before any of them starts
+    int busy = 0;
+    for (int i = 0; i < streams; i++) {
+        int retry_after_ms;
+        int status = control_recv_reply(stream[i].sock, &retry_after_ms);
+        if (status == CONTROL_BUSY) {
+            printf("[%2d] Server busy: retry after %d ms\n", stream[i].id, retry_after_ms);
+            busy = 1;
+        } else if (status == CONTROL_UNSUPPORTED) {
+            printf("[%2d] Server does not support this test\n", stream[i].id);
+            busy = 1;
+        } else if (status != CONTROL_ACCEPT) {
+            printf("[%2d] No reply from server\n", stream[i].id);
+            busy = 1;
         }
+    }
+    if (busy) {
+        refused = 1;
+        for (int i = 0; i < streams; i++) close(stream[i].sock);
+        for (int i = 0; i < count; i++) free(stream[i].rx);
+        free(ring);
+        free(last);
+        free(threads);
+        free(stream);
+        return 0.0;
+    }
 
-        clock_gettime(CLOCK_MONOTONIC, &end_time);
-        double rtt = (end_time.tv_sec - start_time.tv_sec) +
-                     (end_time.tv_nsec - start_time.tv_nsec)/1e9;
-        rtt *= 1000;
-        rtts[i] = rtt;
-        printf("Ping %d: RTT = %.4f ms\n", i + 1, rtt);
+    if (!tuning_is_default(tuning)) {
+        char description[128];
+        tuning_describe(tuning, description, sizeof(description));
+        printf("%s Test: %s\n", name, description);
+        tuning_print_effective("Client socket", stream[0].sock);
     }
 
-    double jitter = 0;
-    int valid_count = duration - (int)packets_lost;
-    if (valid_count > 1) {
-        for (int i = 1; i < duration; i++) {
-            jitter += fabs(rtts[i] - rtts[i-1]);
+    tcp_report_t rep = { stream, ring, last, streams, count, bidir, name, test, { 0, 0 } };
+    tcp_uring_driver_t driver = { stream, ring, count, io, &stop, { 0, 0, 0 } };
+    reporter_t reporter;
+    double prev_elapsed = 0;
+    int started = 0, threads_needed = ring ? 1 : count;
+    struct rusage usage_start, usage_end;
+    getrusage(RUSAGE_SELF, &usage_start);
+    if (reporter_start(&reporter, report_interval, duration, tcp_stream_interval, &rep, &stop) == 0) {
+        for (int i = 0; i < threads_needed; i++) {
+            int err = ring ? pthread_create(&threads[i], NULL, tcp_uring_driver, &driver)
+                           : pthread_create(&threads[i], NULL, tcp_stream_worker, &stream[i]);
+            if (err != 0) {
+                perror("Failed to create stream thread");
+                break;
+            }
+            started++;
         }
-        jitter /= (valid_count - 1);
+        if (started != threads_needed) reporter_stop(&reporter);
+        prev_elapsed = reporter_join(&reporter);
     }
-    printf("Jitter: %.4f\n", jitter);
-    printf("Packet Loss: %.2f%%\n", (packets_lost/(float)duration)*100);
 
-    close(sock);
+    // Senders half-close so the server sees the end and answers with its
+    // results; receivers run until the server closes after its trailer.
+    // Workers stuck in send are woken by the shutdown.
+    stop = 1;
+    for (int i = 0; i < count; i++) {
+        if (!stream[i].download) {
+            shutdown(stream[i].sock, SHUT_WR);
+        } else if (started != threads_needed) {
+            shutdown(stream[i].sock, SHUT_RDWR);
+        }
+    }
+    for (int i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    getrusage(RUSAGE_SELF, &usage_end);
+    for (int i = 0; i < streams; i++) {
+        if (direction == TCP_UPLOAD) {
+            stream[i].have_results = control_recv_results(stream[i].sock, &stream[i].results) == 0;
+        } else if (bidir) {
+            // The trailer arrived on the receiving half
+            stream[i].have_results = stream[i + streams].have_results;
+            stream[i].results = stream[i + streams].results;
+        }
+    }
+    for (int i = 0; i < streams; i++) {
+        tcpinfo_sample(stream[i].sock, &stream[i].tcp);
+        close(stream[i].sock);
+    }
+
+    for (int download = 0; download < 2; download++) {
+        if (!bidir && download != server_sent) continue;
+        long total_bytes = rep.total_bytes[download];
+        if (streams > 1 && prev_elapsed > 0) {
+            double megabytes = (double)total_bytes / (1024.0 * 1024.0);
+            printf("[SUM] %s Test: Total %.2f MB over %d streams in %.2f seconds (~%.2f MB/S)\n",
+                   tcp_direction_name(download, bidir), megabytes, streams, prev_elapsed,
+                   megabytes / prev_elapsed);
+        }
+        report_record_init(&record, "summary", test, "client");
+        record.direction = tcp_direction_tag(download, bidir);
+        report_set_bytes(&record, total_bytes, 0.0, prev_elapsed);
+        report_emit(&record);
+    }
+
+    long syscalls = driver.stats.enters;
+    for (int i = 0; i < count; i++) syscalls += stream[i].calls;
+    double cpu_seconds = (usage_end.ru_utime.tv_sec - usage_start.ru_utime.tv_sec) +
+                         (usage_end.ru_stime.tv_sec - usage_start.ru_stime.tv_sec) +
+                         (usage_end.ru_utime.tv_usec - usage_start.ru_utime.tv_usec) / 1e6 +
+                         (usage_end.ru_stime.tv_usec - usage_start.ru_stime.tv_usec) / 1e6;
+    char label[64];
+    snprintf(label, sizeof(label), "%s Test: %s engine", name, io_engine_name(io));
+    io_engine_print_usage(label, syscalls, cpu_seconds, prev_elapsed);
+
+    const char *server_name = tcp_direction_name(server_sent, bidir);
+    long server_bytes = 0;
+    double server_seconds = 0;
+    int reported = 0;
+    for (int i = 0; i < streams; i++) {
+        if (!stream[i].have_results) continue;
+        double seconds = stream[i].results.duration_us / 1e6;
+        if (streams > 1) {
+            char label[16];
+            snprintf(label, sizeof(label), "[%2d]", stream[i].id);
+            print_server_result(label, server_name, server_sent, stream[i].results.bytes / (1024.0 * 1024.0),
+                                seconds);
+            report_results(test, stream[i].id, &stream[i].results, 0);
+        }
+        server_bytes += stream[i].results.bytes;
+        if (seconds > server_seconds) server_seconds = seconds;
+        reported++;
+    }
+    if (reported > 0) {
+        print_server_result(streams > 1 ? "[SUM]" : "", server_name, server_sent,
+                            server_bytes / (1024.0 * 1024.0), server_seconds);
+        if (streams > 1) {
+            report_record_init(&record, "summary", test, "server");
+            record.direction = tcp_direction_tag(server_sent, bidir);
+            report_set_bytes(&record, server_bytes, 0.0, server_seconds);
+            report_emit(&record);
+        } else {
+            report_results(test, 0, &stream[0].results, 0);
+        }
+    }
+    if (reported < streams) {
+        printf("%s Test: no results from server for %d of %d streams\n", name, streams - reported, streams);
+    }
+    for (int i = 0; i < streams; i++) {
+        char label[64];
+        tcp_stream_label(label, sizeof(label), &stream[i], streams, name, "Client TCP_INFO");
+        tcpinfo_print_summary(label, &stream[i].tcp, prev_elapsed);
+        if (!stream[i].have_results) continue;
+        tcp_stream_label(label, sizeof(label), &stream[i], streams, name, "Server TCP_INFO");
+        tcpinfo_print_summary(label, &stream[i].results.tcp, stream[i].results.duration_us / 1e6);
+    }
+    if (tuning->verify) tcp_stream_print_integrity(&rep);
+    for (int i = 0; i < count; i++) free(stream[i].rx);
+
+    free(ring);
+    free(last);
+    free(threads);
+    free(stream);
+
+    // Receiver-side goodput when every stream reported, otherwise what the client measured
+    long total_bytes = rep.total_bytes[server_sent];
+    double goodput = reported == streams && server_seconds > 0 ? server_bytes * 8.0 / server_seconds :
+                     prev_elapsed > 0 ? total_bytes * 8.0 / prev_elapsed : 0.0;
+    if (bidir && prev_elapsed > 0) goodput += rep.total_bytes[1] * 8.0 / prev_elapsed;
+    return goodput;
 }
 
-void run_icmp_ping_test(char *address, int port, int size, int duration, int interval) {
+void run_tcp_upload_test(char *address, int port, int duration, double report_interval, int streams,
+                         const io_engine_options_t *io, const tuning_options_t *tuning) {
+    run_tcp_stream_test(address, port, duration, report_interval, streams, io, tuning, TCP_UPLOAD);
+}
 
-    int sock;
-    struct sockaddr_in server_addr;
-    struct hostent *host;
-    char send_packet[sizeof(struct icmphdr) + size];
-    char recv_packet[BUFFER_SIZE];
-    struct icmphdr *icmp_hdr;
-    struct iphdr *recv_ip;
-    int bytes_received;
+void run_tcp_download_test(char *address, int port, int duration, double report_interval, int streams,
+                           const io_engine_options_t *io, const tuning_options_t *tuning) {
+    run_tcp_stream_test(address, port, duration, report_interval, streams, io, tuning, TCP_DOWNLOAD);
+}
 
-    // Create raw socket for ICMP
-    if ((sock = socket(AF_INET, SOCK_RAW, IPPROTO_ICMP)) < 0) {
-        perror("ICMP socket creation failed. Need to run as root.");
-        return; // Exit gracefully without calling exit()
+void run_tcp_bidir_test(char *address, int port, int duration, double report_interval, int streams,
+                        const io_engine_options_t *io, const tuning_options_t *tuning) {
+    run_tcp_stream_test(address, port, duration, report_interval, streams, io, tuning, TCP_BIDIR);
+}
+
+/*
+ * Runs the same TCP test twice, first with plain payload and then with
+ * verified blocks, so the cost of stamping and checking every block shows
+ * as the difference in receiver-side goodput. Both passes use the socket
+ * engine, since verification cannot run on io_uring.
+ */
+void run_tcp_verify_compare(char *address, int port, int duration, double report_interval, int streams,
+                            const io_engine_options_t *io, const tuning_options_t *tuning, control_test_t test) {
+    tcp_direction_t direction = test == CONTROL_TEST_DOWNLOAD ? TCP_DOWNLOAD
+                              : test == CONTROL_TEST_BIDIR ? TCP_BIDIR : TCP_UPLOAD;
+    io_engine_options_t socket_io = *io;
+    socket_io.engine = IO_ENGINE_SOCKET;
+    tuning_options_t pass = *tuning;
+    double rate[2];
+
+    for (int verify = 0; verify < 2; verify++) {
+        printf("--- %s payload ---\n", verify ? "Verified" : "Unverified");
+        pass.verify = verify;
+        rate[verify] = run_tcp_stream_test(address, port, duration, report_interval, streams, &socket_io, &pass,
+                                           direction);
     }
+    printf("Verification cost: %.2f Mbps unverified, %.2f Mbps verified (%+.1f%%, CRC32C %s)\n",
+           rate[0] / 1e6, rate[1] / 1e6, rate[0] > 0 ? (rate[1] - rate[0]) * 100.0 / rate[0] : 0.0,
+           crc32c_kernel_name());
+}
 
-    // Set socket timeout (2 seconds)
-    struct timeval timeout;
-    timeout.tv_sec = 2;
-    timeout.tv_usec = 0;
-    if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0) {
-        perror("setsockopt failed");
+typedef struct {
+    tuning_options_t tuning;
+    double bits_per_second;
+} sweep_point_t;
+
+static int compare_sweep_points(const void *a, const void *b) {
+    double x = ((const sweep_point_t*)a)->bits_per_second;
+    double y = ((const sweep_point_t*)b)->bits_per_second;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+/*
+ * Runs one `duration`-second upload for every combination of write size,
+ * socket buffer size and congestion-control algorithm in the grid, then
+ * ranks them by the server's receiver-side goodput. MSS and TCP_NODELAY
+ * stay fixed at whatever `base` asks for.
+ */
+void run_tcp_sweep(char *address, int port, int duration, int streams, const io_engine_options_t *io,
+                   const tuning_options_t *base, const tuning_grid_t *grid) {
+    int total = grid->write_count * grid->buffer_count * grid->congestion_count;
+    sweep_point_t *points = calloc(total, sizeof(sweep_point_t));
+    if (!points) {
+        perror("Malloc failed");
+        return;
+    }
+
+    char description[128];
+    int n = 0;
+    for (int w = 0; w < grid->write_count; w++) {
+        for (int b = 0; b < grid->buffer_count; b++) {
+            for (int c = 0; c < grid->congestion_count; c++) {
+                sweep_point_t *point = &points[n++];
+                point->tuning = *base;
+                point->tuning.write_size = grid->write_sizes[w];
+                point->tuning.socket_buffer = grid->buffers[b];
+                strcpy(point->tuning.congestion, grid->congestion[c]);
+
+                tuning_describe(&point->tuning, description, sizeof(description));
+                printf("Sweep %d/%d: %s\n", n, total, description);
+                point->bits_per_second = run_tcp_stream_test(address, port, duration, duration, streams,
+                                                             io, &point->tuning, TCP_UPLOAD);
+                if (n < total) sleep_interval(0.2);
+            }
+        }
+    }
+
+    qsort(points, total, sizeof(sweep_point_t), compare_sweep_points);
+    printf("Sweep results, %d seconds per point, best first:\n", duration);
+    for (int i = 0; i < total; i++) {
+        tuning_describe(&points[i].tuning, description, sizeof(description));
+        printf("  %10.2f Mbps  %s\n", points[i].bits_per_second / 1e6, description);
+    }
+    if (total > 0 && points[0].bits_per_second > 0) {
+        tuning_describe(&points[0].tuning, description, sizeof(description));
+        printf("Best configuration: %s (%.2f Mbps)\n", description, points[0].bits_per_second / 1e6);
+    }
+    free(points);
+}
+
+void run_ping_test(char *address, int port, int size, int duration, double interval, tstamp_mode_t timestamping) {
+    // Probes carry a struct packet header, so they cannot be smaller than it
+    if (size < (int)sizeof(struct packet)) size = sizeof(struct packet);
+
+    control_header_t header;
+    control_header_init(&header, CONTROL_TEST_PING, duration, size);
+    control_header_set_interval(&header, interval);
+    int sock = create_udp_socket_and_send_test(address, port, &header);
+    if (sock < 0) return;
+
+    probe_options_t opt;
+    memset(&opt, 0, sizeof(opt));
+    opt.size = size;
+    opt.count = duration;
+    opt.interval = interval;
+    opt.timeout_ms = PROBE_TIMEOUT_MS;
+    opt.verbose = interval >= PROBE_VERBOSE_INTERVAL;
+    opt.timestamping = timestamping;
+    opt.name = "ping";
+
+    probe_result_t result;
+    if (probe_run(sock, &opt, &result) < 0) {
         close(sock);
         return;
     }
 
-    // Resolve host
-    host = gethostbyname(address);
+    ping_stats_finish(&result.stats);
+    printf("Jitter: %.4f\n", ping_stats_jitter(&result.stats));
+    printf("Probes: %ld sent, %ld replies, %ld late (> %d ms), %ld duplicates\n",
+           result.sent, result.received, result.late, opt.timeout_ms, result.duplicates);
+    printf("Packet Loss: %.2f%%\n", result.sent > 0 ? result.lost * 100.0 / result.sent : 0.0);
+    if (result.timestamping != TSTAMP_OFF) {
+        probe_print_kernel_rtt(&result.stats, &result.kernel_stats, result.timestamping);
+    }
+    probe_report_summary("ping", &result.stats, result.sent, result.lost, result.duplicates);
+    if (result.timestamping != TSTAMP_OFF && result.kernel_stats.total->total > 0) {
+        probe_report_summary("ping_kernel", &result.kernel_stats, result.sent, result.lost, result.duplicates);
+    }
+
+    // The server's echo count splits the loss between the two directions
+    control_header_t request;
+    control_results_t results;
+    control_header_init(&request, CONTROL_TEST_RESULTS, 0, 0);
+    if (control_send_header(sock, &request, NULL, 0) == 0 &&
+        control_recv_results_udp(sock, &results, PROBE_TIMEOUT_MS) == 0) {
+        long echoed = (long)results.packets;
+        printf("Server echoed %ld of %ld probes (forward loss %ld, return loss %ld)\n",
+               echoed, result.sent, result.sent - echoed, echoed - result.received - result.late);
+        report_results("ping", 0, &results, 0);
+    } else {
+        printf("Ping: no results from server\n");
+    }
+
+    probe_result_free(&result);
+    close(sock);
+}
+
+void run_icmp_ping_test(char *address, int port, int size, int duration, double interval, tstamp_mode_t timestamping) {
+    (void)port;     // ICMP has no ports; the server's raw socket answers echo requests to the host
+    struct hostent *host = gethostbyname(address);
     if (!host) {
         fprintf(stderr, "Failed to resolve hostname: %s\n", address);
-        close(sock);
         return;
     }
-
+    struct sockaddr_in server_addr;
     memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
-    // While port is not used by ICMP, we keep it consistent.
-    server_addr.sin_port = htons(port);
     memcpy(&server_addr.sin_addr, host->h_addr, host->h_length);
 
-    // Prepare ICMP Echo Request
-    icmp_hdr = (struct icmphdr*)send_packet;
-    icmp_hdr->type = ICMP_ECHO;
-    icmp_hdr->code = 0;
-    icmp_hdr->un.echo.id = getpid();
-    icmp_hdr->un.echo.sequence = 0;
-    memset(send_packet + sizeof(struct icmphdr), 'A', size);
-    icmp_hdr->checksum = 0;
-    icmp_hdr->checksum = calculate_checksum((unsigned short*)send_packet, sizeof(send_packet));
-
-    int sent_packets = 0;
-    int received_packets = 0;
-    double rtts[1000]; // Ensure 1000 is large enough for your duration
-    int max_rtts = (int)(sizeof(rtts) / sizeof(rtts[0]));
-
-    for (int i = 0; i < duration; i++) {
-        // Increment sequence number each iteration
-        icmp_hdr->un.echo.sequence = i + 1;
-        icmp_hdr->checksum = 0;
-        icmp_hdr->checksum = calculate_checksum((unsigned short*)send_packet, sizeof(send_packet));
-
-        struct timeval send_time, recv_time;
-        gettimeofday(&send_time, NULL);
-
-        // Send ICMP Echo Request
-        if (sendto(sock, send_packet, sizeof(send_packet), 0, 
-                   (struct sockaddr*)&server_addr, sizeof(server_addr)) <= 0) {
-            perror("Ping send failed");
-            // Don't break here, continue to next iteration
-            sleep(interval);
-            continue;
-        }
-        sent_packets++;
-
-        socklen_t addr_len = sizeof(server_addr);
-        bytes_received = recvfrom(sock, recv_packet, sizeof(recv_packet), 0,
-                                  (struct sockaddr*)&server_addr, &addr_len);
-        if (bytes_received <= 0) {
-            printf("Ping %d: Request timed out.\n", i + 1);
-            sleep(interval);
-            continue;
-        }
+    probe_options_t opt;
+    memset(&opt, 0, sizeof(opt));
+    opt.size = size;
+    opt.count = duration;
+    opt.interval = interval;
+    opt.timeout_ms = PROBE_TIMEOUT_MS;
+    opt.verbose = interval >= PROBE_VERBOSE_INTERVAL;
+    opt.timestamping = timestamping;
+    opt.name = "icmp_ping";
+
+    int sock = probe_icmp_socket(&server_addr, &opt);
+    if (sock < 0) return;
+    printf("ICMP echo over %s socket\n", opt.icmp_raw ? "a raw" : "an unprivileged datagram");
 
-        gettimeofday(&recv_time, NULL);
+    probe_result_t result;
+    if (probe_run(sock, &opt, &result) < 0) {
+        close(sock);
+        return;
+    }
 
-        // Parse received packet
-        recv_ip = (struct iphdr*)recv_packet;
-        int ip_header_len = recv_ip->ihl * 4;
-        struct icmphdr *recv_icmp = (struct icmphdr*)(recv_packet + ip_header_len);
+    ping_stats_finish(&result.stats);
+    printf("Jitter: %.4f ms\n", ping_stats_jitter(&result.stats));
+    printf("Probes: %ld sent, %ld replies, %ld late (> %d ms), %ld duplicates\n",
+           result.sent, result.received, result.late, opt.timeout_ms, result.duplicates);
+    printf("Packet Loss: %.2f%%\n", result.sent > 0 ? result.lost * 100.0 / result.sent : 0.0);
+    if (result.timestamping != TSTAMP_OFF) {
+        probe_print_kernel_rtt(&result.stats, &result.kernel_stats, result.timestamping);
+    }
+    probe_report_summary("icmp_ping", &result.stats, result.sent, result.lost, result.duplicates);
+    if (result.timestamping != TSTAMP_OFF && result.kernel_stats.total->total > 0) {
+        probe_report_summary("icmp_ping_kernel", &result.kernel_stats, result.sent, result.lost, result.duplicates);
+    }
 
-        if (recv_icmp->type == ICMP_ECHOREPLY && recv_icmp->un.echo.id == getpid()) {
-            double rtt = (recv_time.tv_sec - send_time.tv_sec) +
-                         (recv_time.tv_usec - send_time.tv_usec)/1e6;
-            rtt *= 1000.0; // Convert to milliseconds
-            if (received_packets < max_rtts) {
-                rtts[received_packets++] = rtt;
-            }
-            printf("Ping %d: RTT = %.4f ms\n", i + 1, rtt);
-        } else {
-            printf("Ping %d: Received non-echo reply or mismatched ID.\n", i + 1);
-        }
+    probe_result_free(&result);
+    close(sock);
+}
+
+/*
+ * Latency under load. A UDP probe stream first measures the idle RTT for
+ * RPM_IDLE_SECONDS. Then TCP streams saturate the path in the chosen
+ * direction for `duration` seconds while a second probe stream, on its own
+ * ping session and thread, keeps measuring. Loaded probing starts
+ * RPM_WARMUP_SECONDS into the load, once the queues have had time to fill,
+ * and ends through the probe engine's stop flag when the load does.
+ * Responsiveness is in round trips per minute at the median RTT.
+ */
+typedef struct {
+    int sock;
+    probe_options_t opt;
+    probe_result_t result;
+    double delay;               // seconds of load before probing starts
+    int status;
+} rpm_prober_t;
+
+static void *rpm_prober(void *arg) {
+    rpm_prober_t *p = (rpm_prober_t*)arg;
+    // A load shorter than the warm-up leaves nothing to measure
+    for (double waited = 0; waited < p->delay && !*p->opt.stop; waited += 0.05) sleep_interval(0.05);
+    p->status = *p->opt.stop ? -1 : probe_run(p->sock, &p->opt, &p->result);
+    return NULL;
+}
+
+// One ping session per phase; `seconds` bounds it on the server side
+static int rpm_open_probe(char *address, int port, int seconds, int size, double interval, const char *name,
+                          rpm_prober_t *p) {
+    // A ping header's duration is a probe count, which the server budgets at the interval
+    int count = interval > 0 ? (int)(seconds / interval + 0.5) : seconds;
+    control_header_t header;
+    control_header_init(&header, CONTROL_TEST_PING, count, size);
+    control_header_set_interval(&header, interval);
+    memset(p, 0, sizeof(*p));
+    p->status = -1;
+    p->sock = create_udp_socket_and_send_test(address, port, &header);
+    if (p->sock < 0) return -1;
+    p->opt.size = size;
+    p->opt.interval = interval;
+    p->opt.timeout_ms = PROBE_TIMEOUT_MS;
+    p->opt.quiet = 1;
+    p->opt.name = name;
+    return 0;
+}
 
-        sleep(interval);
+// Ends the server's ping session now rather than after its silence timeout
+static void rpm_close_probe(rpm_prober_t *p) {
+    control_header_t request;
+    control_results_t results;
+    control_header_init(&request, CONTROL_TEST_RESULTS, 0, 0);
+    if (control_send_header(p->sock, &request, NULL, 0) == 0) {
+        control_recv_results_udp(p->sock, &results, PROBE_TIMEOUT_MS);
     }
+    close(p->sock);
+}
 
-    // Calculate Jitter
-    double jitter = 0.0;
-    if (received_packets > 1) {
-        for (int i = 1; i < received_packets; i++) {
-            jitter += fabs(rtts[i] - rtts[i-1]);
-        }
-        jitter /= (received_packets - 1);
+static double rpm_from(const histogram_t *h) {
+    uint64_t p50 = histogram_percentile(h, 50.0);
+    return p50 > 0 ? 60e9 / p50 : 0.0;
+}
+
+static void rpm_report(const char *test, probe_result_t *result) {
+    if (!report_enabled()) return;
+    report_record_t r;
+    report_record_init(&r, "summary", test, "client");
+    report_set_rtt(&r, result->stats.total);
+    r.fields |= REPORT_F_PACKETS | REPORT_F_RPM;
+    r.packets = result->sent;
+    r.lost = result->lost;
+    r.duplicates = result->duplicates;
+    r.jitter_ns = (int64_t)(ping_stats_jitter(&result->stats) * 1e6);
+    r.rpm = rpm_from(result->stats.total);
+    report_emit(&r);
+}
+
+void run_rpm_test(char *address, int port, int duration, double report_interval, int streams, int size,
+                  double interval, const io_engine_options_t *io, const tuning_options_t *tuning,
+                  control_test_t load) {
+    if (size < (int)sizeof(struct packet)) size = sizeof(struct packet);
+    tcp_direction_t direction = load == CONTROL_TEST_UPLOAD ? TCP_UPLOAD :
+                                load == CONTROL_TEST_DOWNLOAD ? TCP_DOWNLOAD : TCP_BIDIR;
+    double warmup = duration > RPM_WARMUP_SECONDS ? RPM_WARMUP_SECONDS : 0;
+    printf("Responsiveness: idle RTT for %d s, then %s load on %d TCP stream%s for %d s, "
+           "a %d-byte probe every %.3f ms\n", RPM_IDLE_SECONDS, control_test_name(load), streams,
+           streams == 1 ? "" : "s", duration, size, interval * 1e3);
+
+    rpm_prober_t idle, loaded;
+    if (rpm_open_probe(address, port, RPM_IDLE_SECONDS, size, interval, "rpm_idle", &idle) < 0) return;
+    idle.opt.count = (long)(RPM_IDLE_SECONDS / interval);
+    if (idle.opt.count < 1) idle.opt.count = 1;
+    idle.status = probe_run(idle.sock, &idle.opt, &idle.result);
+    rpm_close_probe(&idle);
+    if (idle.status < 0) return;
+    ping_stats_collect(&idle.result.stats);
+    if (idle.result.stats.total->total == 0) {
+        printf("Responsiveness: no replies to the idle probes\n");
+        probe_result_free(&idle.result);
+        return;
     }
 
-    printf("Jitter: %.4f ms\n", jitter);
-    double packet_loss = (sent_packets == 0) ? 0.0 : ((double)(sent_packets - received_packets)/sent_packets)*100.0;
-    printf("Packet Loss: %.2f%%\n", packet_loss);
+    volatile int stop = 0;
+    if (rpm_open_probe(address, port, duration, size, interval, "rpm_loaded", &loaded) < 0) {
+        probe_result_free(&idle.result);
+        return;
+    }
+    loaded.opt.stop = &stop;
+    loaded.delay = warmup;
+    pthread_t prober;
+    if (pthread_create(&prober, NULL, rpm_prober, &loaded) != 0) {
+        perror("Failed to create probe thread");
+        rpm_close_probe(&loaded);
+        probe_result_free(&idle.result);
+        return;
+    }
+    double goodput = run_tcp_stream_test(address, port, duration, report_interval, streams, io, tuning, direction);
+    stop = 1;
+    pthread_join(prober, NULL);
+    rpm_close_probe(&loaded);
+
+    histogram_t *idle_rtt = idle.result.stats.total;
+    histogram_print("Idle RTT", idle_rtt);
+    rpm_report("rpm_idle", &idle.result);
+    if (loaded.status < 0) {
+        printf("Responsiveness: no probes under load\n");
+        probe_result_free(&idle.result);
+        return;
+    }
+    ping_stats_collect(&loaded.result.stats);
+    histogram_t *loaded_rtt = loaded.result.stats.total;
+    if (loaded_rtt->total == 0) {
+        printf("Responsiveness: no replies to the probes under load (%ld sent)\n", loaded.result.sent);
+    } else {
+        histogram_print("Loaded RTT", loaded_rtt);
+        double idle_p50 = histogram_percentile(idle_rtt, 50.0), loaded_p50 = histogram_percentile(loaded_rtt, 50.0);
+        double idle_p99 = histogram_percentile(idle_rtt, 99.0), loaded_p99 = histogram_percentile(loaded_rtt, 99.0);
+        printf("Probes under load: %ld sent, %ld replies, %ld late (> %d ms), %.2f%% lost\n",
+               loaded.result.sent, loaded.result.received, loaded.result.late, PROBE_TIMEOUT_MS,
+               loaded.result.sent > 0 ? loaded.result.lost * 100.0 / loaded.result.sent : 0.0);
+        printf("RTT inflation: p50 %+.4f ms (%.1fx idle), p99 %+.4f ms (%.1fx idle), at %.2f Mbps of load\n",
+               (loaded_p50 - idle_p50) / 1e6, idle_p50 > 0 ? loaded_p50 / idle_p50 : 0.0,
+               (loaded_p99 - idle_p99) / 1e6, idle_p99 > 0 ? loaded_p99 / idle_p99 : 0.0, goodput / 1e6);
+    }
+    printf("Responsiveness: %.0f RPM idle, %.0f RPM under %s load\n", rpm_from(idle_rtt),
+           rpm_from(loaded_rtt), control_test_name(load));
+    rpm_report("rpm_loaded", &loaded.result);
 
-    close(sock);
+    probe_result_free(&loaded.result);
+    probe_result_free(&idle.result);
 }
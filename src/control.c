@@ -0,0 +1,286 @@
+#include "../include/control.h"
+#include "../include/shared.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+#include <poll.h>
+#include <time.h>
+
+/*
+ * Control protocol. A session opens with one fixed-size control_header, sent
+ * as its own datagram on UDP and read with MSG_WAITALL on TCP, so test
+ * payload can never be mistaken for part of it. The server answers with a
+ * control_reply that either admits the session or turns it away as busy
+ * before any payload moves. When the test ends the
+ * server answers with one control_results block carrying its own measurement:
+ * on TCP after the upload's half-close or as the trailer of a download, on
+ * UDP as a final datagram on the session socket.
+ */
+
+void control_header_init(control_header_t *h, control_test_t test, int duration, int buffer_size) {
+    memset(h, 0, sizeof(*h));
+    h->test = test;
+    h->duration = duration;
+    h->buffer_size = buffer_size;
+    h->streams = 1;
+    h->stream_id = 1;
+    h->flags = CONTROL_FLAG_RESULTS;
+}
+
+void control_header_set_interval(control_header_t *h, double seconds) {
+    double us = seconds * 1e6;
+    h->interval_us = us <= 0 ? 0 : us >= UINT32_MAX ? UINT32_MAX : (long)us;
+}
+
+// How long a ping session may go without a probe before the server ends it
+long control_ping_idle_ms(const control_header_t *h) {
+    long idle_ms = h->interval_us / 1000 * CONTROL_PING_IDLE_INTERVALS;
+    return idle_ms > CONTROL_PING_IDLE_MS ? idle_ms : CONTROL_PING_IDLE_MS;
+}
+
+const char *control_test_name(control_test_t test) {
+    switch (test) {
+        case CONTROL_TEST_UPLOAD: return "upload";
+        case CONTROL_TEST_DOWNLOAD: return "download";
+        case CONTROL_TEST_PING: return "ping";
+        case CONTROL_TEST_RESULTS: return "results";
+        case CONTROL_TEST_BIDIR: return "bidir";
+        default: return "unknown";
+    }
+}
+
+static int send_all(int sock, const void *buf, size_t len, const struct sockaddr *to, socklen_t to_len) {
+    const char *p = buf;
+    while (len > 0) {
+        long n = sendto(sock, p, len, MSG_NOSIGNAL, to, to_len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Pass a NULL `to` on connected sockets
+int control_send_header(int sock, const control_header_t *h, const struct sockaddr *to, socklen_t to_len) {
+    struct control_header wire;
+    wire.magic = htonl(CONTROL_MAGIC);
+    wire.version = htons(CONTROL_VERSION);
+    wire.test = htons(h->test);
+    wire.duration = htonl(h->duration);
+    wire.buffer_size = htonl(h->buffer_size);
+    wire.streams = htons(h->streams);
+    wire.stream_id = htons(h->stream_id);
+    wire.flags = htonl(h->flags);
+    wire.socket_buffer = htonl(h->socket_buffer);
+    wire.mss = htons(h->mss);
+    wire.reserved = 0;
+    memcpy(wire.congestion, h->congestion, sizeof(wire.congestion));
+    wire.congestion[sizeof(wire.congestion) - 1] = '\0';
+    wire.interval_us = htonl((uint32_t)h->interval_us);
+    wire.rate = htobe64(h->rate > 0 ? (uint64_t)h->rate : 0);
+    return send_all(sock, &wire, sizeof(wire), to, to_len);
+}
+
+// Returns 0 for a valid header, -1 (with a message for a version mismatch) otherwise
+int control_decode_header(const void *buf, size_t len, control_header_t *h) {
+    struct control_header wire;
+    if (len != sizeof(wire)) return -1;
+    memcpy(&wire, buf, sizeof(wire));
+    if (ntohl(wire.magic) != CONTROL_MAGIC) return -1;
+    if (ntohs(wire.version) != CONTROL_VERSION) {
+        printf("Unsupported control protocol version %u\n", ntohs(wire.version));
+        return -1;
+    }
+
+    h->test = (control_test_t)ntohs(wire.test);
+    h->duration = ntohl(wire.duration);
+    h->buffer_size = ntohl(wire.buffer_size);
+    h->streams = ntohs(wire.streams);
+    h->stream_id = ntohs(wire.stream_id);
+    h->flags = ntohl(wire.flags);
+    h->socket_buffer = ntohl(wire.socket_buffer);
+    h->mss = ntohs(wire.mss);
+    memcpy(h->congestion, wire.congestion, sizeof(h->congestion));
+    h->congestion[sizeof(h->congestion) - 1] = '\0';
+    h->interval_us = ntohl(wire.interval_us);
+    h->rate = (double)be64toh(wire.rate);
+    if (h->test < CONTROL_TEST_UPLOAD || h->test > CONTROL_TEST_BIDIR) return -1;
+    return 0;
+}
+
+// Blocking read of exactly one header from a TCP socket
+int control_recv_header(int sock, control_header_t *h) {
+    struct control_header wire;
+    long n = recv(sock, &wire, sizeof(wire), MSG_WAITALL);
+    if (n != (long)sizeof(wire)) return -1;
+    return control_decode_header(&wire, sizeof(wire), h);
+}
+
+int control_send_reply(int sock, control_status_t status, int retry_after_ms,
+                       const struct sockaddr *to, socklen_t to_len) {
+    struct control_reply wire;
+    wire.magic = htonl(CONTROL_MAGIC);
+    wire.version = htons(CONTROL_VERSION);
+    wire.status = htons(status);
+    wire.retry_after_ms = htonl(retry_after_ms > 0 ? retry_after_ms : 0);
+    return send_all(sock, &wire, sizeof(wire), to, to_len);
+}
+
+// Returns the control_status_t of a valid reply, -1 otherwise
+int control_decode_reply(const void *buf, size_t len, int *retry_after_ms) {
+    struct control_reply wire;
+    if (len != sizeof(wire)) return -1;
+    memcpy(&wire, buf, sizeof(wire));
+    if (ntohl(wire.magic) != CONTROL_MAGIC) return -1;
+    if (ntohs(wire.version) != CONTROL_VERSION) {
+        printf("Unsupported control protocol version %u\n", ntohs(wire.version));
+        return -1;
+    }
+    *retry_after_ms = ntohl(wire.retry_after_ms);
+    int status = ntohs(wire.status);
+    return status == CONTROL_BUSY || status == CONTROL_UNSUPPORTED ? status : CONTROL_ACCEPT;
+}
+
+int control_recv_reply(int sock, int *retry_after_ms) {
+    struct control_reply wire;
+    long n = recv(sock, &wire, sizeof(wire), MSG_WAITALL);
+    if (n != (long)sizeof(wire)) return -1;
+    return control_decode_reply(&wire, sizeof(wire), retry_after_ms);
+}
+
+void control_encode_results(const control_results_t *r, struct control_results *out) {
+    out->magic = htonl(CONTROL_MAGIC);
+    out->version = htons(CONTROL_VERSION);
+    out->test = htons(r->test);
+    out->bytes = htobe64(r->bytes);
+    out->packets = htobe64(r->packets);
+    out->duration_us = htobe64(r->duration_us);
+    out->lost = htobe64(r->lost);
+    out->out_of_order = htobe64(r->out_of_order);
+    out->duplicates = htobe64(r->duplicates);
+    out->jitter_ns = htobe64(r->jitter_ns);
+
+    const tcpinfo_summary_t *tcp = &r->tcp;
+    out->tcp_samples = htonl(tcp->samples);
+    out->cwnd_mean = htonl(tcp->samples ? (uint32_t)(tcp->cwnd_sum / tcp->samples) : 0);
+    out->cwnd_max = htonl(tcp->cwnd_max);
+    out->srtt_mean_us = htonl(tcp->samples ? (uint32_t)(tcp->srtt_sum_us / tcp->samples) : 0);
+    out->srtt_max_us = htonl(tcp->srtt_max_us);
+    out->rttvar_us = htonl(tcp->last.rttvar_us);
+    out->rcv_rtt_us = htonl(tcp->last.rcv_rtt_us);
+    out->retransmits = htonl(tcp->last.retransmits);
+    out->delivery_rate = htobe64(tcp->last.delivery_rate);
+    out->busy_us = htobe64(tcp->last.busy_us);
+    out->rwnd_limited_us = htobe64(tcp->last.rwnd_limited_us);
+    out->sndbuf_limited_us = htobe64(tcp->last.sndbuf_limited_us);
+
+    out->verified_blocks = htobe64(r->integrity.blocks);
+    out->corrupted_blocks = htobe64(r->integrity.corrupted);
+    out->missing_blocks = htobe64(r->integrity.missing);
+    out->misordered_blocks = htobe64(r->integrity.misordered);
+}
+
+int control_send_results(int sock, const control_results_t *r, const struct sockaddr *to, socklen_t to_len) {
+    struct control_results wire;
+    control_encode_results(r, &wire);
+    return send_all(sock, &wire, sizeof(wire), to, to_len);
+}
+
+int control_decode_results(const void *buf, size_t len, control_results_t *r) {
+    struct control_results wire;
+    if (len != sizeof(wire)) return -1;
+    memcpy(&wire, buf, sizeof(wire));
+    if (ntohl(wire.magic) != CONTROL_MAGIC || ntohs(wire.version) != CONTROL_VERSION) return -1;
+
+    r->test = (control_test_t)ntohs(wire.test);
+    r->bytes = be64toh(wire.bytes);
+    r->packets = be64toh(wire.packets);
+    r->duration_us = be64toh(wire.duration_us);
+    r->lost = be64toh(wire.lost);
+    r->out_of_order = be64toh(wire.out_of_order);
+    r->duplicates = be64toh(wire.duplicates);
+    r->jitter_ns = be64toh(wire.jitter_ns);
+
+    // Means travel as such; the summary's sums are rebuilt from them
+    tcpinfo_summary_t *tcp = &r->tcp;
+    memset(tcp, 0, sizeof(*tcp));
+    tcp->samples = ntohl(wire.tcp_samples);
+    tcp->cwnd_sum = (double)ntohl(wire.cwnd_mean) * tcp->samples;
+    tcp->cwnd_max = ntohl(wire.cwnd_max);
+    tcp->srtt_sum_us = (double)ntohl(wire.srtt_mean_us) * tcp->samples;
+    tcp->srtt_max_us = ntohl(wire.srtt_max_us);
+    tcp->last.rttvar_us = ntohl(wire.rttvar_us);
+    tcp->last.rcv_rtt_us = ntohl(wire.rcv_rtt_us);
+    tcp->last.retransmits = ntohl(wire.retransmits);
+    tcp->last.delivery_rate = be64toh(wire.delivery_rate);
+    tcp->last.busy_us = be64toh(wire.busy_us);
+    tcp->last.rwnd_limited_us = be64toh(wire.rwnd_limited_us);
+    tcp->last.sndbuf_limited_us = be64toh(wire.sndbuf_limited_us);
+
+    r->integrity.blocks = be64toh(wire.verified_blocks);
+    r->integrity.corrupted = be64toh(wire.corrupted_blocks);
+    r->integrity.missing = be64toh(wire.missing_blocks);
+    r->integrity.misordered = be64toh(wire.misordered_blocks);
+    return 0;
+}
+
+// Fills the UDP upload fields from the receiver's sequence accounting
+void control_results_from_seq(control_results_t *r, const udp_seq_stats_t *seq) {
+    r->bytes = seq->bytes;
+    r->packets = seq->received;
+    r->lost = seq->lost > 0 ? seq->lost : 0;
+    r->out_of_order = seq->out_of_order;
+    r->duplicates = seq->duplicates;
+    r->jitter_ns = (uint64_t)seq->jitter_ns;
+}
+
+// Blocking read of the results block from a TCP socket, bounded by its SO_RCVTIMEO
+int control_recv_results(int sock, control_results_t *r) {
+    struct control_results wire;
+    long n = recv(sock, &wire, sizeof(wire), MSG_WAITALL);
+    if (n != (long)sizeof(wire)) return -1;
+    return control_decode_results(&wire, sizeof(wire), r);
+}
+
+/*
+ * Waits up to timeout_ms for the results datagram on a connected UDP socket,
+ * discarding any late echoes or other datagrams still queued ahead of it.
+ */
+int control_recv_results_udp(int sock, control_results_t *r, int timeout_ms) {
+    char buffer[BUFFER_SIZE];
+    struct timespec start, now;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while (1) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long left = timeout_ms - ((now.tv_sec - start.tv_sec) * 1000L +
+                                  (now.tv_nsec - start.tv_nsec) / 1000000L);
+        if (left <= 0) return -1;
+
+        struct pollfd pfd = { sock, POLLIN, 0 };
+        int ready = poll(&pfd, 1, (int)left);
+        if (ready < 0 && errno != EINTR) return -1;
+        if (ready <= 0) continue;
+        if ((pfd.revents & POLLERR) && !(pfd.revents & POLLIN)) {
+            // Leftover TX timestamps or ICMP errors; drop them so poll blocks again
+            char control[256];
+            struct msghdr msg;
+            memset(&msg, 0, sizeof(msg));
+            msg.msg_control = control;
+            msg.msg_controllen = sizeof(control);
+            if (recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0 && errno == ECONNREFUSED) return -1;
+            continue;
+        }
+
+        long n = recv(sock, buffer, sizeof(buffer), MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) continue;
+            return -1;
+        }
+        if (control_decode_results(buffer, n, r) == 0) return 0;
+    }
+}
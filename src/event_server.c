@@ -0,0 +1,953 @@
+#define _GNU_SOURCE
+#include "../include/event_server.h"
+#include "../include/server.h"
+#include "../include/shared.h"
+#include "../include/metrics.h"
+#include "../include/log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <signal.h>
+#include <sched.h>
+
+/*
+ * Event-loop server core. A fixed set of loops multiplexes every socket with
+ * edge-triggered epoll instead of spawning one blocking thread per session.
+ * Loop 0 additionally owns the TCP listener and the UDP control socket and
+ * hands new sessions to the loops round-robin through a locked queue plus an
+ * eventfd wakeup, so each session is only ever touched by its owning loop.
+ *
+ * Sessions share their loop's receive scratch buffer and UDP batch buffers;
+ * the only per-session memory is event_session_t itself.
+ *
+ * In sharded mode there is no handoff: every loop is pinned to its own CPU
+ * and owns its own SO_REUSEPORT listener and UDP control socket, so the
+ * kernel spreads connections and handshakes across loops and each session
+ * stays on the loop that accepted it.
+ */
+
+typedef enum {
+    SESS_LISTENER,
+    SESS_UDP_CONTROL,
+    SESS_WAKEUP,
+    SESS_TIMER,
+    SESS_TCP_HANDSHAKE,
+    SESS_TCP_UPLOAD,
+    SESS_TCP_DOWNLOAD,
+    SESS_TCP_RESULTS,                   // download over, writing the results trailer
+    SESS_UDP_UPLOAD,
+    SESS_UDP_DOWNLOAD,
+    SESS_PING,
+    SESS_CLOSED
+} session_state_t;
+
+typedef struct event_session {
+    int fd;
+    session_state_t state;
+    int queued;                         // on the loop's ready or paced list
+    struct event_session *next_ready;
+    long wake_ns;                       // when a paced session may send again
+    struct event_session *prev, *next;  // loop's list of live sessions
+    struct event_session *next_handoff;
+    struct sockaddr_in peer;
+    socklen_t peer_len;
+    long bytes;
+    long packets;
+    long syscalls;
+    int packet_size;
+    control_header_t header;
+    int ticket;                         // admission ticket, 0 until admitted
+    int control_len;                    // bytes of `control` read (header) or written (results)
+    char control[sizeof(struct control_results)];
+    zerocopy_sender_t sender;
+    udp_pacer_t pacer;
+    udp_batch_t *tx;                    // UDP download at another size than the loop's, else NULL
+    udp_seq_stats_t *seq;               // UDP upload only: [0] running totals, [1] last interval
+    uint64_t sequence;
+    tcpinfo_summary_t tcp;              // TCP only: TCP_INFO samples for the results block
+    long next_sample_ms;
+    struct timespec start;
+    struct timespec last_active;
+    struct timespec last_report;
+} event_session_t;
+
+typedef struct {
+    int id;
+    int epfd;
+    int wakeup_fd;
+    int timer_fd;
+    pthread_t thread;
+    char *scratch;
+    udp_batch_t udp_rx;
+    udp_batch_t udp_tx;
+    event_session_t *ready_head, *ready_tail;
+    event_session_t *paced;             // sessions waiting on their pacer, unordered
+    event_session_t sessions;           // sentinel of the live session list
+    pthread_mutex_t handoff_lock;
+    event_session_t *handoff;
+    event_session_t listener, control, wakeup, timer;
+    int cpu;                            // pinned CPU, -1 when not sharded
+    long opened;                        // read by loop 0 for stats
+    long active;
+    long sent;
+    long received;
+    long last_opened;                   // loop 0's snapshot at the previous stats line
+    long last_sent;
+    long last_received;
+} event_loop_t;
+
+static event_loop_t loops_state[EVENT_MAX_LOOPS];
+static server_options_t event_options;
+static int loop_count;
+static int next_loop;
+static long stats_last_opened;
+static long stats_last_sent;
+static double stats_last_cpu;
+static long stats_base_rss;
+static int stats_tick;
+
+static long elapsed_ms(const struct timespec *from, const struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) * 1000L + (to->tv_nsec - from->tv_nsec) / 1000000L;
+}
+
+static long timespec_to_ns(const struct timespec *ts) {
+    return ts->tv_sec * 1000000000L + ts->tv_nsec;
+}
+
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0) return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static long current_rss_bytes(void) {
+    long pages = 0, rss = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (!f) return 0;
+    if (fscanf(f, "%ld %ld", &pages, &rss) != 2) rss = 0;
+    fclose(f);
+    return rss * sysconf(_SC_PAGESIZE);
+}
+
+static void loop_register(event_loop_t *loop, event_session_t *s, int fd, unsigned int events) {
+    struct epoll_event ev;
+    memset(&ev, 0, sizeof(ev));
+    ev.events = events;
+    ev.data.ptr = s;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        log_error("epoll_ctl failed: %m");
+    }
+}
+
+static void make_ready(event_loop_t *loop, event_session_t *s) {
+    if (s->queued) return;
+    s->queued = 1;
+    s->next_ready = NULL;
+    if (loop->ready_tail) {
+        loop->ready_tail->next_ready = s;
+    } else {
+        loop->ready_head = s;
+    }
+    loop->ready_tail = s;
+}
+
+static metrics_protocol_t session_protocol(const event_session_t *s) {
+    return s->state == SESS_UDP_UPLOAD || s->state == SESS_UDP_DOWNLOAD || s->state == SESS_PING ?
+           METRICS_UDP : METRICS_TCP;
+}
+
+static void session_close(event_loop_t *loop, event_session_t *s) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    // UDP uploads end on silence and downloads on their trailer; count neither
+    if (s->state == SESS_UDP_UPLOAD || s->state == SESS_TCP_RESULTS) now = s->last_active;
+    long time_diff = elapsed_ms(&s->start, &now) * 1000L;
+    double mbps = time_diff > 0 ? (s->bytes * 8.0) / time_diff : 0.0;
+
+    control_results_t results;
+    memset(&results, 0, sizeof(results));
+    results.test = s->header.test;
+    results.bytes = s->bytes;
+    results.packets = s->packets;
+    results.duration_us = time_diff;
+    int send_results = (s->header.flags & CONTROL_FLAG_RESULTS) != 0;
+
+    if (s->state == SESS_TCP_UPLOAD) {
+        printf("TCP Upload Test: Received %ld bytes in %ld microseconds (~%.2f Mbps)\n",
+               s->bytes, time_diff, mbps);
+        tcpinfo_sample(s->fd, &s->tcp);
+        tcpinfo_print_summary("TCP Upload Test: TCP_INFO", &s->tcp, time_diff / 1e6);
+        results.tcp = s->tcp;
+        // The send buffer of an upload is empty, so this small write cannot block
+        if (send_results) control_send_results(s->fd, &results, NULL, 0);
+        report_results("tcp_upload", s->header.stream_id, &results, 0);
+    } else if (s->state == SESS_TCP_DOWNLOAD || s->state == SESS_TCP_RESULTS) {
+        printf("Download Test: Sent %ld bytes in %ld microseconds (~%.2f Mbps, %s)\n",
+               s->bytes, time_diff, mbps, zerocopy_mode_name(s->sender.mode));
+        if (s->state == SESS_TCP_DOWNLOAD) {
+            zerocopy_sender_close(&s->sender, s->fd);
+            tcpinfo_sample(s->fd, &s->tcp);
+        }
+        tcpinfo_print_summary("Download Test: TCP_INFO", &s->tcp, time_diff / 1e6);
+        results.tcp = s->tcp;
+        report_results("tcp_download", s->header.stream_id, &results, 0);
+    } else if (s->state == SESS_UDP_UPLOAD) {
+        printf("UDP Upload Test: Received %ld bytes in %ld microseconds (~%.2f Mbps, %.0f packets/s, %.0f syscalls/s)\n",
+               s->bytes, time_diff, mbps,
+               time_diff > 0 ? s->packets * 1e6 / time_diff : 0.0,
+               time_diff > 0 ? s->syscalls * 1e6 / time_diff : 0.0);
+        udp_seq_init(&s->seq[1]);
+        udp_seq_report("UDP Upload Test", &s->seq[0], &s->seq[1], time_diff / 1e6);
+        control_results_from_seq(&results, &s->seq[0]);
+        if (send_results) control_send_results(s->fd, &results, (struct sockaddr*)&s->peer, s->peer_len);
+        report_results("udp_upload", 0, &results, 1);
+    } else if (s->state == SESS_UDP_DOWNLOAD) {
+        printf("UDP Download Test completed sending (%.0f packets/s, %.0f syscalls/s).\n",
+               time_diff > 0 ? s->packets * 1e6 / time_diff : 0.0,
+               time_diff > 0 ? s->syscalls * 1e6 / time_diff : 0.0);
+        results.packets = s->sequence;
+        if (send_results) control_send_results(s->fd, &results, (struct sockaddr*)&s->peer, s->peer_len);
+        report_results("udp_download", 0, &results, 0);
+    } else if (s->state == SESS_PING) {
+        printf("Ping test ended (%ld probes echoed).\n", s->packets);
+        report_results("ping", 0, &results, 0);
+    }
+
+    if (s->ticket) metrics_session_end(session_protocol(s), s->header.test, time_diff / 1e6);
+    close(s->fd);
+    admission_release(s->ticket);
+    s->ticket = 0;
+    free(s->seq);
+    s->seq = NULL;
+    if (s->tx) udp_batch_free(s->tx);
+    free(s->tx);
+    s->tx = NULL;
+    s->prev->next = s->next;
+    s->next->prev = s->prev;
+    s->state = SESS_CLOSED;
+    __atomic_store_n(&loop->active, loop->active - 1, __ATOMIC_RELAXED);
+
+    // Freed by the ready list, after any events already fetched for it are skipped
+    make_ready(loop, s);
+}
+
+static void make_paced(event_loop_t *loop, event_session_t *s) {
+    s->queued = 1;
+    s->next_ready = loop->paced;
+    loop->paced = s;
+}
+
+// Moves paced sessions whose wait is over to the ready list; returns the next wake time
+static long release_paced(event_loop_t *loop, long now_ns) {
+    long next_wake = 0;
+    event_session_t **link = &loop->paced;
+    while (*link) {
+        event_session_t *s = *link;
+        if (s->wake_ns <= now_ns) {
+            *link = s->next_ready;
+            s->queued = 0;
+            make_ready(loop, s);
+        } else {
+            if (next_wake == 0 || s->wake_ns < next_wake) next_wake = s->wake_ns;
+            link = &s->next_ready;
+        }
+    }
+    return next_wake;
+}
+
+static void loop_adopt(event_loop_t *loop, event_session_t *s) {
+    clock_gettime(CLOCK_MONOTONIC, &s->start);
+    s->last_active = s->last_report = s->start;
+    s->next = loop->sessions.next;
+    s->prev = &loop->sessions;
+    loop->sessions.next->prev = s;
+    loop->sessions.next = s;
+    __atomic_store_n(&loop->opened, loop->opened + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&loop->active, loop->active + 1, __ATOMIC_RELAXED);
+
+    unsigned int events = EPOLLIN | EPOLLRDHUP | EPOLLET;
+    if (s->state == SESS_TCP_DOWNLOAD || s->state == SESS_UDP_DOWNLOAD) events |= EPOLLOUT;
+    loop_register(loop, s, s->fd, events);
+
+    // Edge-triggered: data that arrived before registration raises no event
+    make_ready(loop, s);
+}
+
+static void handoff_session(event_session_t *s) {
+    event_loop_t *loop = &loops_state[next_loop];
+    next_loop = (next_loop + 1) % loop_count;
+
+    pthread_mutex_lock(&loop->handoff_lock);
+    s->next_handoff = loop->handoff;
+    loop->handoff = s;
+    pthread_mutex_unlock(&loop->handoff_lock);
+
+    uint64_t one = 1;
+    if (write(loop->wakeup_fd, &one, sizeof(one)) < 0) {
+        log_error("eventfd write failed: %m");
+    }
+}
+
+// Sharded loops keep what they accept; otherwise sessions are spread round-robin
+static void dispatch_new_session(event_loop_t *loop, event_session_t *s) {
+    if (event_options.shard) {
+        loop_adopt(loop, s);
+    } else {
+        handoff_session(s);
+    }
+}
+
+static void drain_handoff(event_loop_t *loop) {
+    uint64_t count;
+    while (read(loop->wakeup_fd, &count, sizeof(count)) > 0) {}
+
+    pthread_mutex_lock(&loop->handoff_lock);
+    event_session_t *s = loop->handoff;
+    loop->handoff = NULL;
+    pthread_mutex_unlock(&loop->handoff_lock);
+
+    while (s) {
+        event_session_t *next = s->next_handoff;
+        loop_adopt(loop, s);
+        s = next;
+    }
+}
+
+static void accept_tcp(event_loop_t *loop) {
+    while (1) {
+        int client_sock = accept(loop->listener.fd, NULL, NULL);
+        if (client_sock < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) log_error("Accept failed: %m");
+            return;
+        }
+        set_nonblocking(client_sock);
+
+        event_session_t *s = calloc(1, sizeof(event_session_t));
+        if (!s) {
+            perror("Malloc failed");
+            close(client_sock);
+            continue;
+        }
+        s->fd = client_sock;
+        s->state = SESS_TCP_HANDSHAKE;
+        dispatch_new_session(loop, s);
+    }
+}
+
+// Same negotiation as start_udp_thread: reply with a dedicated ephemeral port
+static void accept_udp(event_loop_t *loop) {
+    int server_sock = loop->control.fd;
+    while (1) {
+        struct control_header request;
+        control_header_t header;
+        struct sockaddr_in client_addr;
+        socklen_t addr_len = sizeof(client_addr);
+        int len = recvfrom(server_sock, &request, sizeof(request), 0,
+                           (struct sockaddr*)&client_addr, &addr_len);
+        if (len < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) log_error("Receive failed: %m");
+            return;
+        }
+        if (control_decode_header(&request, len, &header) < 0) {
+            log_warn("Invalid control header");
+            metrics_failure(METRICS_FAIL_HEADER);
+            continue;
+        }
+
+        session_state_t state;
+        if (header.test == CONTROL_TEST_UPLOAD) {
+            state = SESS_UDP_UPLOAD;
+        } else if (header.test == CONTROL_TEST_DOWNLOAD) {
+            state = SESS_UDP_DOWNLOAD;
+        } else if (header.test == CONTROL_TEST_PING &&
+                   header.buffer_size > 0 && header.buffer_size <= BUFFER_SIZE) {
+            state = SESS_PING;
+        } else if (header.test == CONTROL_TEST_BIDIR) {
+            log_warn("Bidirectional tests need the threaded server");
+            metrics_failure(METRICS_FAIL_UNSUPPORTED);
+            control_send_reply(server_sock, CONTROL_UNSUPPORTED, 0, (struct sockaddr*)&client_addr, addr_len);
+            continue;
+        } else {
+            log_warn("Unknown test type: %s", control_test_name(header.test));
+            metrics_failure(METRICS_FAIL_UNSUPPORTED);
+            continue;
+        }
+
+        int client_sock = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, 0);
+        if (client_sock < 0) {
+            log_error("Failed to create client-specific UDP socket: %m");
+            metrics_failure(METRICS_FAIL_SETUP);
+            continue;
+        }
+
+        struct sockaddr_in temp_addr;
+        memset(&temp_addr, 0, sizeof(temp_addr));
+        temp_addr.sin_family = AF_INET;
+        temp_addr.sin_port = 0;
+        temp_addr.sin_addr.s_addr = INADDR_ANY;
+        socklen_t temp_len = sizeof(temp_addr);
+        if (bind(client_sock, (struct sockaddr*)&temp_addr, sizeof(temp_addr)) < 0 ||
+            getsockname(client_sock, (struct sockaddr*)&temp_addr, &temp_len) < 0) {
+            log_error("Bind failed for client-specific socket: %m");
+            metrics_failure(METRICS_FAIL_SETUP);
+            close(client_sock);
+            continue;
+        }
+
+        // Downloads go out at the client's datagram size and rate
+        udp_batch_options_t opt = event_options.udp;
+        if (state == SESS_UDP_DOWNLOAD) udp_batch_options_for(&opt, &event_options.udp, &header);
+        if (state == SESS_UDP_UPLOAD || state == SESS_UDP_DOWNLOAD) {
+            if (udp_batch_configure_socket(client_sock, &opt, state == SESS_UDP_UPLOAD) < 0) {
+                metrics_failure(METRICS_FAIL_SETUP);
+                close(client_sock);
+                continue;
+            }
+        }
+
+        int retry_after_ms;
+        int ticket = admission_acquire(&header, &retry_after_ms);
+        if (!ticket) {
+            control_send_reply(server_sock, CONTROL_BUSY, retry_after_ms, (struct sockaddr*)&client_addr, addr_len);
+            metrics_failure(METRICS_FAIL_BUSY);
+            close(client_sock);
+            continue;
+        }
+
+        unsigned short new_port = ntohs(temp_addr.sin_port);
+        if (sendto(server_sock, &new_port, sizeof(new_port), 0,
+                   (struct sockaddr*)&client_addr, addr_len) < 0 ||
+            control_send_reply(client_sock, CONTROL_ACCEPT, 0, (struct sockaddr*)&client_addr, addr_len) < 0) {
+            log_error("Failed to send new port: %m");
+            metrics_failure(METRICS_FAIL_SETUP);
+            admission_release(ticket);
+            close(client_sock);
+            continue;
+        }
+
+        event_session_t *s = calloc(1, sizeof(event_session_t));
+        if (s && state == SESS_UDP_UPLOAD) {
+            s->seq = calloc(2, sizeof(udp_seq_stats_t));
+            if (!s->seq) {
+                free(s);
+                s = NULL;
+            }
+        }
+        if (s && state == SESS_UDP_DOWNLOAD && opt.datagram_size > 0 &&
+            opt.datagram_size != loop->udp_tx.opt.datagram_size) {
+            s->tx = malloc(sizeof(udp_batch_t));
+            if (!s->tx || udp_batch_init(s->tx, &opt, 0) < 0) {
+                free(s->tx);
+                free(s);
+                s = NULL;
+            }
+        }
+        if (!s) {
+            perror("Malloc failed");
+            metrics_failure(METRICS_FAIL_SETUP);
+            admission_release(ticket);
+            close(client_sock);
+            continue;
+        }
+        s->ticket = ticket;
+        udp_pacer_init(&s->pacer, opt.rate, udp_batch_bytes(s->tx ? s->tx : &loop->udp_tx));
+        s->fd = client_sock;
+        s->state = state;
+        s->header = header;
+        // Ping reads must also fit a results request
+        s->packet_size = header.buffer_size < (int)sizeof(struct control_header) ?
+                         (int)sizeof(struct control_header) : header.buffer_size;
+        s->peer = client_addr;
+        s->peer_len = addr_len;
+        metrics_session_start(METRICS_UDP, header.test);
+        dispatch_new_session(loop, s);
+    }
+}
+
+// Returns 1 once the control header is in, 0 to wait for more bytes, -1 on error
+static int read_handshake(event_session_t *s) {
+    const int size = sizeof(struct control_header);
+    int n = recv(s->fd, s->control + s->control_len, size - s->control_len, 0);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+    if (n <= 0) {
+        metrics_failure(METRICS_FAIL_HEADER);
+        return -1;
+    }
+
+    s->control_len += n;
+    if (s->control_len < size) return 0;
+    if (control_decode_header(s->control, size, &s->header) < 0) {
+        log_warn("Invalid control header");
+        metrics_failure(METRICS_FAIL_HEADER);
+        return -1;
+    }
+    if (s->header.flags & CONTROL_FLAG_VERIFY) {
+        log_warn("Payload verification needs the threaded server");
+        metrics_failure(METRICS_FAIL_UNSUPPORTED);
+        control_send_reply(s->fd, CONTROL_UNSUPPORTED, 0, NULL, 0);
+        return -1;
+    }
+
+    if (s->header.test == CONTROL_TEST_UPLOAD) {
+        s->state = SESS_TCP_UPLOAD;
+    } else if (s->header.test == CONTROL_TEST_DOWNLOAD) {
+        s->state = SESS_TCP_DOWNLOAD;
+    } else if (s->header.test == CONTROL_TEST_BIDIR) {
+        log_warn("Bidirectional tests need the threaded server");
+        metrics_failure(METRICS_FAIL_UNSUPPORTED);
+        control_send_reply(s->fd, CONTROL_UNSUPPORTED, 0, NULL, 0);
+        return -1;
+    } else {
+        log_warn("Unknown TCP test type: %s", control_test_name(s->header.test));
+        metrics_failure(METRICS_FAIL_UNSUPPORTED);
+        return -1;
+    }
+
+    tuning_options_t tuning;
+    tuning_from_header(&s->header, &tuning);
+    tuning_apply(s->fd, &tuning);
+
+    // A fresh socket's send buffer is empty, so the reply cannot block
+    int retry_after_ms;
+    s->ticket = admission_acquire(&s->header, &retry_after_ms);
+    if (control_send_reply(s->fd, s->ticket ? CONTROL_ACCEPT : CONTROL_BUSY, retry_after_ms, NULL, 0) < 0 ||
+        !s->ticket) {
+        metrics_failure(s->ticket ? METRICS_FAIL_SETUP : METRICS_FAIL_BUSY);
+        admission_release(s->ticket);
+        s->ticket = 0;
+        s->state = SESS_TCP_HANDSHAKE;
+        return -1;
+    }
+    metrics_session_start(METRICS_TCP, s->header.test);
+    return 1;
+}
+
+// Ends a TCP download: the results block goes out as a trailer once the socket has room
+static void start_results_trailer(event_session_t *s) {
+    control_results_t results;
+    memset(&results, 0, sizeof(results));
+    results.test = CONTROL_TEST_DOWNLOAD;
+    results.bytes = s->bytes;
+    results.duration_us = elapsed_ms(&s->start, &s->last_active) * 1000L;
+    tcpinfo_sample(s->fd, &s->tcp);
+    results.tcp = s->tcp;
+    control_encode_results(&results, (struct control_results*)s->control);
+    s->control_len = 0;
+    zerocopy_sender_close(&s->sender, s->fd);
+    s->state = SESS_TCP_RESULTS;
+}
+
+/*
+ * Runs one session for at most EVENT_BUDGET syscalls. Returns 1 if it stopped
+ * on the budget (and must be revisited), 2 if its pacer asked it to wait
+ * until wake_ns, 0 if it hit EAGAIN, -1 to close.
+ */
+static int session_run(event_loop_t *loop, event_session_t *s) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    if (s->state == SESS_TCP_HANDSHAKE) {
+        int ret = read_handshake(s);
+        if (ret <= 0) return ret;
+        s->last_active = now;
+        clock_gettime(CLOCK_MONOTONIC, &s->start);
+        if (s->state == SESS_TCP_DOWNLOAD) {
+            if (zerocopy_sender_init(&s->sender, event_options.download_mode, s->fd) < 0) {
+                s->state = SESS_TCP_HANDSHAKE;
+                return -1;
+            }
+            struct epoll_event ev;
+            memset(&ev, 0, sizeof(ev));
+            ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+            ev.data.ptr = s;
+            epoll_ctl(loop->epfd, EPOLL_CTL_MOD, s->fd, &ev);
+        }
+    }
+
+    if (s->state == SESS_TCP_UPLOAD || s->state == SESS_TCP_DOWNLOAD) {
+        tcpinfo_sample_due(s->fd, &s->tcp, &s->next_sample_ms);
+    }
+
+    for (int i = 0; i < EVENT_BUDGET; i++) {
+        long n;
+        switch (s->state) {
+            case SESS_TCP_UPLOAD:
+                n = recv(s->fd, loop->scratch, tuning_write_size(&s->header), 0);
+                if (n == 0) return -1;
+                break;
+            case SESS_UDP_UPLOAD: {
+                long packets = loop->udp_rx.packets;
+                n = udp_batch_recv(&loop->udp_rx, s->fd, &s->seq[0]);
+                s->packets += loop->udp_rx.packets - packets;
+                metrics_packets(METRICS_UDP, loop->udp_rx.packets - packets, 0);
+                s->syscalls++;
+                break;
+            }
+            case SESS_TCP_DOWNLOAD:
+                if (s->header.duration > 0 && elapsed_ms(&s->start, &now) >= s->header.duration * 1000L) {
+                    if (!(s->header.flags & CONTROL_FLAG_RESULTS)) return -1;
+                    start_results_trailer(s);
+                    continue;
+                }
+                n = zerocopy_send(&s->sender, s->fd, tuning_write_size(&s->header));
+                if (n > 0) __atomic_store_n(&loop->sent, loop->sent + n, __ATOMIC_RELAXED);
+                break;
+            case SESS_TCP_RESULTS:
+                n = send(s->fd, s->control + s->control_len,
+                         sizeof(struct control_results) - s->control_len, MSG_NOSIGNAL);
+                if (n > 0) {
+                    s->control_len += n;
+                    if (s->control_len == (int)sizeof(struct control_results)) return -1;
+                    continue;
+                }
+                break;
+            case SESS_UDP_DOWNLOAD: {
+                // Stay quiet until the sweep sends the results block and closes
+                if (elapsed_ms(&s->start, &now) > s->header.duration * 1000L) return 0;
+                udp_batch_t *tx = s->tx ? s->tx : &loop->udp_tx;
+                long delay = udp_pacer_delay_ns(&s->pacer, udp_batch_bytes(tx));
+                if (delay > 0) {
+                    s->wake_ns = timespec_to_ns(&now) + delay;
+                    return 2;
+                }
+                n = udp_batch_send(tx, s->fd, &s->peer, s->peer_len, &s->sequence);
+                if (n > 0) s->packets += n / tx->opt.datagram_size;
+                if (n > 0) metrics_packets(METRICS_UDP, 0, n / tx->opt.datagram_size);
+                s->syscalls++;
+                if (n > 0) __atomic_store_n(&loop->sent, loop->sent + n, __ATOMIC_RELAXED);
+                break;
+            }
+            case SESS_PING: {
+                control_header_t request;
+                n = recvfrom(s->fd, loop->scratch, s->packet_size, 0,
+                             (struct sockaddr*)&s->peer, &s->peer_len);
+                if (n > 0 && control_decode_header(loop->scratch, n, &request) == 0 &&
+                    request.test == CONTROL_TEST_RESULTS) {
+                    control_results_t results;
+                    memset(&results, 0, sizeof(results));
+                    results.test = CONTROL_TEST_PING;
+                    results.bytes = s->bytes;
+                    results.packets = s->packets;
+                    control_send_results(s->fd, &results, (struct sockaddr*)&s->peer, s->peer_len);
+                    return -1;
+                }
+                if (n > 0 && sendto(s->fd, loop->scratch, n, MSG_NOSIGNAL,
+                                    (struct sockaddr*)&s->peer, s->peer_len) < 0) {
+                    log_error("Send failed: %m");
+                    return -1;
+                }
+                if (n > 0) s->packets++;
+                break;
+            }
+            default:
+                return -1;
+        }
+
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            // Clients may hang up on a download early; that needs no message
+            if (s->state != SESS_TCP_DOWNLOAD && s->state != SESS_TCP_RESULTS) log_error("Session I/O failed: %m");
+            return -1;
+        }
+        s->bytes += n;
+        s->last_active = now;
+        if (s->state == SESS_TCP_UPLOAD || s->state == SESS_UDP_UPLOAD) {
+            __atomic_store_n(&loop->received, loop->received + n, __ATOMIC_RELAXED);
+            metrics_bytes(session_protocol(s), n, 0);
+        } else if (s->state == SESS_PING) {
+            metrics_bytes(METRICS_UDP, n, n);
+            metrics_packets(METRICS_UDP, 1, 1);
+        } else {
+            metrics_bytes(session_protocol(s), 0, n);
+        }
+    }
+    return 1;
+}
+
+static void session_dispatch(event_loop_t *loop, event_session_t *s) {
+    int ret = session_run(loop, s);
+    if (ret < 0) {
+        session_close(loop, s);
+    } else if (ret == 2) {
+        make_paced(loop, s);
+    } else if (ret > 0) {
+        make_ready(loop, s);
+    }
+}
+
+static double process_cpu_seconds(void) {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+           (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+static void report_stats(void) {
+    long opened = 0, active = 0, sent = 0;
+    for (int i = 0; i < loop_count; i++) {
+        opened += __atomic_load_n(&loops_state[i].opened, __ATOMIC_RELAXED);
+        active += __atomic_load_n(&loops_state[i].active, __ATOMIC_RELAXED);
+        sent += __atomic_load_n(&loops_state[i].sent, __ATOMIC_RELAXED);
+    }
+    double cpu = process_cpu_seconds();
+
+    long per_sec = opened - stats_last_opened;
+    long sent_delta = sent - stats_last_sent;
+    double cpu_delta = cpu - stats_last_cpu;
+    stats_last_opened = opened;
+    stats_last_sent = sent;
+    stats_last_cpu = cpu;
+    if (per_sec == 0 && active == 0) return;
+
+    size_t stack_size = 0;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_getstacksize(&attr, &stack_size);
+    pthread_attr_destroy(&attr);
+
+    long rss_delta = current_rss_bytes() - stats_base_rss;
+    printf("Event server: %ld sessions/sec, %ld active, %zu bytes state/session, "
+           "%ld bytes RSS/session (threaded model: %zu byte stack + %d byte buffer/session)\n",
+           per_sec, active, sizeof(event_session_t),
+           active > 0 && rss_delta > 0 ? rss_delta / active : 0L,
+           stack_size, BUFFER_SIZE);
+    if (sent_delta > 0) {
+        printf("Event server: sent %.2f Mbps, %.3f CPU s/GB sent (%s)\n",
+               sent_delta * 8.0 / 1e6, zerocopy_cpu_per_gb(cpu_delta, sent_delta),
+               zerocopy_mode_name(event_options.download_mode));
+    }
+    if (!event_options.shard) return;
+
+    // One line per shard, to check that the kernel is spreading the load
+    for (int i = 0; i < loop_count; i++) {
+        event_loop_t *loop = &loops_state[i];
+        long loop_opened = __atomic_load_n(&loop->opened, __ATOMIC_RELAXED);
+        long loop_sent = __atomic_load_n(&loop->sent, __ATOMIC_RELAXED);
+        long loop_received = __atomic_load_n(&loop->received, __ATOMIC_RELAXED);
+        printf("Shard %d (cpu %d): %ld active, %ld new, sent %.2f Mbps, received %.2f Mbps\n",
+               i, loop->cpu, __atomic_load_n(&loop->active, __ATOMIC_RELAXED),
+               loop_opened - loop->last_opened, (loop_sent - loop->last_sent) * 8.0 / 1e6,
+               (loop_received - loop->last_received) * 8.0 / 1e6);
+        loop->last_opened = loop_opened;
+        loop->last_sent = loop_sent;
+        loop->last_received = loop_received;
+    }
+}
+
+static void sweep_sessions(event_loop_t *loop) {
+    uint64_t expirations;
+    while (read(loop->timer_fd, &expirations, sizeof(expirations)) > 0) {}
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    event_session_t *s = loop->sessions.next;
+    while (s != &loop->sessions) {
+        event_session_t *next = s->next;
+        long idle = elapsed_ms(&s->last_active, &now);
+        long elapsed = elapsed_ms(&s->start, &now);
+        long duration_ms = s->header.duration * 1000L;
+        if ((s->state == SESS_TCP_HANDSHAKE && idle > EVENT_HANDSHAKE_MS) ||
+            (s->state == SESS_UDP_UPLOAD && idle > EVENT_UDP_IDLE_MS) ||
+            (s->state == SESS_PING && idle > control_ping_idle_ms(&s->header)) ||
+            (s->state == SESS_UDP_UPLOAD && elapsed >= duration_ms && idle >= CONTROL_UDP_DRAIN_MS) ||
+            (s->state == SESS_UDP_DOWNLOAD && elapsed > duration_ms + CONTROL_UDP_DRAIN_MS) ||
+            (s->state != SESS_TCP_HANDSHAKE && elapsed > admission_deadline_ms(&s->header))) {
+            session_close(loop, s);
+        } else if (s->state == SESS_UDP_UPLOAD && elapsed_ms(&s->last_report, &now) >= 1000) {
+            printf("[%s:%d] ", inet_ntoa(s->peer.sin_addr), ntohs(s->peer.sin_port));
+            report_udp("interval", "udp_upload", "server", NULL, elapsed_ms(&s->start, &s->last_report) / 1e3,
+                       elapsed / 1e3, &s->seq[0], &s->seq[1]);
+            udp_seq_report("UDP Interval", &s->seq[0], &s->seq[1], elapsed_ms(&s->last_report, &now) / 1e3);
+            s->last_report = now;
+        }
+        s = next;
+    }
+
+    if (loop->id == 0 && ++stats_tick * EVENT_TICK_MS >= 1000) {
+        stats_tick = 0;
+        report_stats();
+        fflush(stdout);
+    }
+}
+
+static void *event_loop_thread(void *arg) {
+    event_loop_t *loop = (event_loop_t*)arg;
+    struct epoll_event events[EVENT_BATCH];
+
+    if (loop->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(loop->cpu, &set);
+        int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+        if (err != 0) {
+            fprintf(stderr, "Failed to pin event loop %d to cpu %d: %s\n", loop->id, loop->cpu, strerror(err));
+        }
+    }
+
+    while (1) {
+        struct timespec now, timeout = { 0, 0 };
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long next_wake = release_paced(loop, timespec_to_ns(&now));
+        if (!loop->ready_head && next_wake > 0) {
+            long wait_ns = next_wake - timespec_to_ns(&now);
+            timeout.tv_sec = wait_ns / 1000000000L;
+            timeout.tv_nsec = wait_ns % 1000000000L;
+        }
+        // Block indefinitely only when nothing is runnable or paced
+        int idle = !loop->ready_head && next_wake == 0;
+        int n = epoll_pwait2(loop->epfd, events, EVENT_BATCH, idle ? NULL : &timeout, NULL);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait failed");
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            event_session_t *s = (event_session_t*)events[i].data.ptr;
+            if (s == &loop->listener) {
+                accept_tcp(loop);
+            } else if (s == &loop->control) {
+                accept_udp(loop);
+            } else if (s == &loop->wakeup) {
+                drain_handoff(loop);
+            } else if (s == &loop->timer) {
+                sweep_sessions(loop);
+            } else if (s->state != SESS_CLOSED && !s->queued) {
+                session_dispatch(loop, s);
+            }
+        }
+
+        // Give every session that ran out of budget one more turn, in order
+        event_session_t *tail = loop->ready_tail;
+        while (loop->ready_head) {
+            event_session_t *s = loop->ready_head;
+            loop->ready_head = s->next_ready;
+            if (!loop->ready_head) loop->ready_tail = NULL;
+            s->queued = 0;
+
+            if (s->state == SESS_CLOSED) {
+                free(s);
+            } else {
+                session_dispatch(loop, s);
+            }
+            if (s == tail) break;
+        }
+    }
+    return NULL;
+}
+
+static void init_loop(event_loop_t *loop, int id) {
+    memset(loop, 0, sizeof(*loop));
+    loop->id = id;
+    loop->cpu = -1;
+    loop->sessions.next = loop->sessions.prev = &loop->sessions;
+    pthread_mutex_init(&loop->handoff_lock, NULL);
+
+    loop->epfd = epoll_create1(0);
+    loop->wakeup_fd = eventfd(0, EFD_NONBLOCK);
+    loop->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    loop->scratch = malloc(TUNING_MAX_WRITE);
+    if (loop->epfd < 0 || loop->wakeup_fd < 0 || loop->timer_fd < 0 || !loop->scratch ||
+        udp_batch_init(&loop->udp_rx, &event_options.udp, 1) < 0 ||
+        udp_batch_init(&loop->udp_tx, &event_options.udp, 0) < 0) {
+        perror("Event loop setup failed");
+        exit(EXIT_FAILURE);
+    }
+
+    struct itimerspec tick;
+    memset(&tick, 0, sizeof(tick));
+    tick.it_interval.tv_nsec = EVENT_TICK_MS * 1000000L;
+    tick.it_value = tick.it_interval;
+    timerfd_settime(loop->timer_fd, 0, &tick, NULL);
+
+    loop->wakeup.fd = loop->wakeup_fd;
+    loop->timer.fd = loop->timer_fd;
+    loop_register(loop, &loop->wakeup, loop->wakeup_fd, EPOLLIN | EPOLLET);
+    loop_register(loop, &loop->timer, loop->timer_fd, EPOLLIN | EPOLLET);
+}
+
+void start_event_server(const server_options_t *options) {
+    event_options = *options;
+    admission_init(&options->admission);
+    int port = options->port;
+
+    // Sharded: one loop per CPU this process may run on, unless -e says otherwise
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) < 0) {
+        perror("sched_getaffinity failed");
+        CPU_SET(0, &allowed);
+    }
+    int loops = options->event_loops;
+    if (loops < 1) loops = options->shard ? CPU_COUNT(&allowed) : 1;
+    if (loops > EVENT_MAX_LOOPS) loops = EVENT_MAX_LOOPS;
+    loop_count = loops;
+
+    if (zerocopy_init_payload(TUNING_MAX_WRITE) < 0) {
+        exit(EXIT_FAILURE);
+    }
+    // sendfile and splice have no MSG_NOSIGNAL; a client hanging up must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+    if (options->metrics_port > 0 && metrics_start(options->metrics_port) < 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    int cpu = -1;
+    for (int i = 0; i < loops; i++) {
+        event_loop_t *loop = &loops_state[i];
+        init_loop(loop, i);
+        if (!options->shard && i > 0) continue;
+
+        // Loops take the allowed CPUs in order, wrapping if there are more loops
+        if (options->shard) {
+            do {
+                cpu = (cpu + 1) % CPU_SETSIZE;
+            } while (!CPU_ISSET(cpu, &allowed));
+            loop->cpu = cpu;
+        }
+        loop->listener.fd = options->shard ? create_reuseport_socket(SOCK_STREAM, port, cpu)
+                                           : create_socket(SOCK_STREAM, port);
+        loop->control.fd = options->shard ? create_reuseport_socket(SOCK_DGRAM, port, cpu)
+                                          : create_socket(SOCK_DGRAM, port);
+        if (listen(loop->listener.fd, SOMAXCONN) < 0) {
+            perror("Listen failed");
+            exit(EXIT_FAILURE);
+        }
+        set_nonblocking(loop->listener.fd);
+        set_nonblocking(loop->control.fd);
+        loop_register(loop, &loop->listener, loop->listener.fd, EPOLLIN | EPOLLET);
+        loop_register(loop, &loop->control, loop->control.fd, EPOLLIN | EPOLLET);
+    }
+    event_loop_t *first = &loops_state[0];
+    stats_base_rss = current_rss_bytes();
+
+    printf("Server listening on port %d (%d event loops%s)...\n", port, loops,
+           options->shard ? ", sharded with SO_REUSEPORT" : "");
+
+    pthread_t icmp_thread;
+    if (pthread_create(&icmp_thread, NULL, start_icmp_thread, NULL) != 0) {
+        perror("Failed to create ICMP server thread");
+    }
+
+    for (int i = 1; i < loops; i++) {
+        if (pthread_create(&loops_state[i].thread, NULL, event_loop_thread, &loops_state[i]) != 0) {
+            perror("Failed to create event loop thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+    event_loop_thread(first);
+}
@@ -0,0 +1,80 @@
+#include "../include/histogram.h"
+#include <stdio.h>
+#include <string.h>
+
+static int bucket_index(uint64_t value) {
+    if (value > HIST_MAX_NS) value = HIST_MAX_NS;
+    if (value < HIST_SUB_COUNT) return (int)value;
+
+    int msb = 63 - __builtin_clzll(value);
+    int shift = msb - HIST_SUB_BITS;
+    int sub = (int)((value >> shift) & (HIST_SUB_COUNT - 1));
+    return (shift + 1) * HIST_SUB_COUNT + sub;
+}
+
+// Midpoint of the value range covered by a bucket
+static uint64_t bucket_value(int index) {
+    if (index < HIST_SUB_COUNT) return index;
+
+    int shift = index / HIST_SUB_COUNT - 1;
+    uint64_t sub = index % HIST_SUB_COUNT;
+    uint64_t low = (HIST_SUB_COUNT + sub) << shift;
+    return low + ((1ULL << shift) >> 1);
+}
+
+void histogram_reset(histogram_t *h) {
+    memset(h, 0, sizeof(*h));
+}
+
+void histogram_record(histogram_t *h, uint64_t value_ns) {
+    h->counts[bucket_index(value_ns)]++;
+    if (h->total == 0 || value_ns < h->min) h->min = value_ns;
+    if (value_ns > h->max) h->max = value_ns;
+    h->total++;
+    h->sum += value_ns;
+}
+
+void histogram_merge(histogram_t *dst, const histogram_t *src) {
+    if (src->total == 0) return;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        dst->counts[i] += src->counts[i];
+    }
+    if (dst->total == 0 || src->min < dst->min) dst->min = src->min;
+    if (src->max > dst->max) dst->max = src->max;
+    dst->total += src->total;
+    dst->sum += src->sum;
+}
+
+// Smallest recorded value such that `percentile` percent of samples are at or below it
+uint64_t histogram_percentile(const histogram_t *h, double percentile) {
+    if (h->total == 0) return 0;
+    if (percentile >= 100.0) return h->max;
+
+    uint64_t rank = (uint64_t)(percentile / 100.0 * h->total + 0.5);
+    if (rank == 0) rank = 1;
+
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->counts[i];
+        if (seen >= rank) {
+            uint64_t value = bucket_value(i);
+            // Bucket midpoints can fall outside what was actually observed
+            if (value < h->min) value = h->min;
+            if (value > h->max) value = h->max;
+            return value;
+        }
+    }
+    return h->max;
+}
+
+double histogram_mean(const histogram_t *h) {
+    return h->total > 0 ? h->sum / h->total : 0.0;
+}
+
+void histogram_print(const char *label, const histogram_t *h) {
+    printf("%s: %llu samples, RTT min/avg/p50/p99/p99.9/max = %.4f/%.4f/%.4f/%.4f/%.4f/%.4f ms\n",
+           label, (unsigned long long)h->total,
+           h->min / 1e6, histogram_mean(h) / 1e6,
+           histogram_percentile(h, 50.0) / 1e6, histogram_percentile(h, 99.0) / 1e6,
+           histogram_percentile(h, 99.9) / 1e6, h->max / 1e6);
+}
@@ -0,0 +1,136 @@
+#include "../include/integrity.h"
+#include "../include/checksum.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+#include <arpa/inet.h>
+
+/*
+ * Payload verification for TCP streams. The sender cuts its byte stream
+ * into fixed-size blocks, each a header (magic, CRC32C, sequence) and a
+ * pseudo-random payload drawn from a per-stream seed. The receiver follows
+ * the block boundaries across reads, whatever sizes recv returns, and
+ * checks each block as soon as it is whole. A partial block at the end of
+ * the stream is not counted: an upload stops mid-block, and a download
+ * ends with the server's results trailer.
+ */
+
+#define CRC_OFFSET offsetof(struct integrity_block, sequence)
+
+static uint64_t splitmix64(uint64_t *state) {
+    uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+static void stamp_block(char *block, uint64_t sequence) {
+    struct integrity_block header;
+    header.magic = htonl(INTEGRITY_MAGIC);
+    header.sequence = htobe64(sequence);
+    memcpy(block, &header, sizeof(header));
+    header.crc = htonl(crc32c(0, block + CRC_OFFSET, INTEGRITY_BLOCK_SIZE - CRC_OFFSET));
+    memcpy(block, &header, sizeof(header));
+}
+
+static void stamp_buffer(integrity_tx_t *tx) {
+    for (size_t off = 0; off < tx->size; off += INTEGRITY_BLOCK_SIZE) {
+        stamp_block(tx->buffer + off, tx->next_sequence++);
+    }
+}
+
+// Sends go out `write_size` bytes at a time; the buffer rounds that up to whole blocks
+int integrity_tx_init(integrity_tx_t *tx, size_t write_size, uint64_t seed) {
+    memset(tx, 0, sizeof(*tx));
+    size_t blocks = (write_size + INTEGRITY_BLOCK_SIZE - 1) / INTEGRITY_BLOCK_SIZE;
+    tx->size = (blocks > 0 ? blocks : 1) * INTEGRITY_BLOCK_SIZE;
+    tx->buffer = malloc(tx->size);
+    if (!tx->buffer) {
+        perror("Malloc failed");
+        return -1;
+    }
+    uint64_t state = seed;
+    for (size_t off = 0; off < tx->size; off += sizeof(uint64_t)) {
+        uint64_t word = splitmix64(&state);
+        memcpy(tx->buffer + off, &word, sizeof(word));
+    }
+    stamp_buffer(tx);
+    return 0;
+}
+
+// The next bytes to send, at most `max` of them
+const char *integrity_tx_data(const integrity_tx_t *tx, size_t max, size_t *len) {
+    size_t left = tx->size - tx->offset;
+    *len = max > 0 && max < left ? max : left;
+    return tx->buffer + tx->offset;
+}
+
+// Call with what send accepted; the blocks are restamped once all of them are out
+void integrity_tx_advance(integrity_tx_t *tx, size_t sent) {
+    tx->offset += sent;
+    if (tx->offset >= tx->size) {
+        tx->offset = 0;
+        stamp_buffer(tx);
+    }
+}
+
+// Bytes that complete the block under way, so a stream can end on a boundary
+size_t integrity_tx_block_left(const integrity_tx_t *tx) {
+    return (INTEGRITY_BLOCK_SIZE - tx->offset % INTEGRITY_BLOCK_SIZE) % INTEGRITY_BLOCK_SIZE;
+}
+
+void integrity_tx_free(integrity_tx_t *tx) {
+    free(tx->buffer);
+    tx->buffer = NULL;
+}
+
+void integrity_rx_init(integrity_rx_t *rx) {
+    memset(rx, 0, sizeof(*rx));
+}
+
+static void verify_block(integrity_rx_t *rx, const char *block) {
+    struct integrity_block header;
+    memcpy(&header, block, sizeof(header));
+    rx->stats.blocks++;
+    if (ntohl(header.magic) != INTEGRITY_MAGIC ||
+        ntohl(header.crc) != crc32c(0, block + CRC_OFFSET, INTEGRITY_BLOCK_SIZE - CRC_OFFSET)) {
+        // Take it to be the block that was due, so one bad block costs one count
+        rx->stats.corrupted++;
+        rx->expected++;
+        return;
+    }
+    uint64_t sequence = be64toh(header.sequence);
+    if (sequence < rx->expected) {
+        rx->stats.misordered++;
+        return;
+    }
+    rx->stats.missing += sequence - rx->expected;
+    rx->expected = sequence + 1;
+}
+
+// Verifies whole blocks in place and keeps the remainder for the next read
+void integrity_rx_feed(integrity_rx_t *rx, const char *data, size_t len) {
+    if (rx->fill > 0) {
+        size_t take = INTEGRITY_BLOCK_SIZE - rx->fill;
+        if (take > len) take = len;
+        memcpy(rx->partial + rx->fill, data, take);
+        rx->fill += take;
+        data += take;
+        len -= take;
+        if (rx->fill < INTEGRITY_BLOCK_SIZE) return;
+        verify_block(rx, rx->partial);
+        rx->fill = 0;
+    }
+    for (; len >= INTEGRITY_BLOCK_SIZE; len -= INTEGRITY_BLOCK_SIZE, data += INTEGRITY_BLOCK_SIZE) {
+        verify_block(rx, data);
+    }
+    memcpy(rx->partial, data, len);
+    rx->fill = len;
+}
+
+void integrity_print(const char *label, const integrity_stats_t *stats) {
+    printf("%s: %llu blocks verified, %llu corrupted, %llu missing, %llu misordered (CRC32C %s)\n", label,
+           (unsigned long long)stats->blocks, (unsigned long long)stats->corrupted,
+           (unsigned long long)stats->missing, (unsigned long long)stats->misordered, crc32c_kernel_name());
+}
@@ -3,19 +3,75 @@
 #include <string.h>
 #include <unistd.h>
 #include "../include/server.h"
+#include "../include/event_server.h"
 #include "../include/client.h"
+#include "../include/reporter.h"
+#include "../include/targets.h"
+#include "../include/log.h"
 
 void print_usage() {
     printf("Usage: lan_speed [options]\n");
     printf("Options:\n");
     printf("  -m, --mode       Mode of operation: server or client\n");
-    printf("  -t, --test       Test type: upload, download, ping\n");
+    printf("  -t, --test       Test type: upload, download, bidir (both at once on one session),\n");
+    printf("                   ping, sweep (TCP uploads across the -L, -w and -C grids, best\n");
+    printf("                   configuration last), or rpm (UDP RTT idle, then under TCP load)\n");
     printf("  -r, --protocol   Protocol used for tests:\n");
-    printf("                   For upload/download: tcp or udp (default: tcp)\n");
-    printf("                   For ping: udp or icmp (default: udp)\n");
+    printf("                   For upload/download/bidir: tcp or udp (default: tcp)\n");
+    printf("                   For ping: udp or icmp (default: udp); icmp uses an unprivileged\n");
+    printf("                   socket where net.ipv4.ping_group_range allows, else needs root\n");
     printf("  -s, --size       Packet size in bytes for ping test (default: 64)\n");
     printf("  -d, --duration   Test duration in seconds (packets number for ping) (default: 10)\n");
-    printf("  -i, --interval   Interval Between Pings in Seconds (default: 1)\n");
+    printf("  -i, --interval   Interval Between Pings in Seconds, fractions allowed (e.g. 0.0001)\n");
+    printf("                   (default: 1; rpm: %.2f)\n", RPM_PROBE_INTERVAL);
+    printf("  -D, --load       rpm: direction of the TCP load, upload, download or bidir\n");
+    printf("                   (default: bidir); -d sets its seconds and -P its streams\n");
+    printf("  -b, --bitrate    UDP sender target rate in bits/s, K/M/G suffixes allowed\n");
+    printf("                   (default: 0, unpaced)\n");
+    printf("  -B, --batch      UDP messages per sendmmsg/recvmmsg; enables MTU-sized datagrams\n");
+    printf("                   (default: 0, one %d-byte datagram per syscall)\n", BUFFER_SIZE);
+    printf("  -l, --length     UDP datagram payload size in bytes (default: 1472 when batching)\n");
+    printf("  -g, --offload    Use UDP_SEGMENT (GSO) when sending and UDP_GRO when receiving\n");
+    printf("  -T, --timestamp  Ping: also report RTT from kernel stamps: sw, or hw (NIC stamps,\n");
+    printf("                   falling back to sw where the device has none)\n");
+    printf("  -I, --report     Seconds between interval reports for upload/download, down to\n");
+    printf("                   %.2f; the test itself always runs -d seconds (default: 1)\n", REPORTER_MIN_INTERVAL);
+    printf("  -L, --write      TCP bytes per send/recv, K/M suffixes allowed; a comma list for\n");
+    printf("                   sweep (default: %d; sweep: 8K,32K,128K)\n", BUFFER_SIZE);
+    printf("  -w, --window     TCP SO_SNDBUF and SO_RCVBUF on both ends, or a list for sweep\n");
+    printf("                   (default: system default; sweep: default,256K,4M)\n");
+    printf("  -C, --congestion TCP congestion control on both ends, or a list for sweep\n");
+    printf("                   (default: system default; sweep: every available algorithm)\n");
+    printf("  -M, --mss        TCP_MAXSEG on both ends (default: path default)\n");
+    printf("  -N, --nodelay    TCP_NODELAY on both ends\n");
+    printf("  -V, --verify     TCP payload as CRC32C-stamped blocks checked by the receiver: on,\n");
+    printf("                   or compare (the test runs unverified, then verified)\n");
+    printf("  -P, --parallel   Number of parallel TCP streams for upload/download/bidir\n");
+    printf("                   (default: 1)\n");
+    printf("  -e, --event-loops Server: serve all sessions from N epoll event loops\n");
+    printf("                   instead of one thread per session (default: 0, threaded)\n");
+    printf("  -z, --zerocopy   Server: TCP download sender: copy, sendfile, splice or zerocopy\n");
+    printf("                   (MSG_ZEROCOPY) (default: copy)\n");
+    printf("  -A, --shard      Server: event loops, one per CPU unless -e is given, each pinned\n");
+    printf("                   and with its own SO_REUSEPORT TCP and UDP sockets\n");
+    printf("  -S, --sessions   Server: maximum concurrent test sessions, each TCP stream\n");
+    printf("                   counting as one; others get a busy reply (default: 0, unlimited)\n");
+    printf("  -Q, --quota      Server: per-test session limits, e.g. upload=4,download=4,ping=16\n");
+    printf("  -X, --metrics    Server: serve Prometheus metrics over HTTP on this port, at /metrics\n");
+    printf("  -u, --engine     TCP data path: socket (a thread per stream, blocking calls) or\n");
+    printf("                   uring (one io_uring for every stream); append ,sqpoll for a kernel\n");
+    printf("                   submission thread and ,multishot for multishot receives\n");
+    printf("                   (default: socket)\n");
+    printf("  -q, --depth      io_uring writes kept in flight per stream (default: %d)\n", URING_DEFAULT_DEPTH);
+    printf("  -F, --targets    Client: run the targets listed in a file instead of -a/-t, one per\n");
+    printf("                   line: address[:port] upload|download|ping [duration= streams= write=\n");
+    printf("                   count= interval= size=]; unset values come from the options above\n");
+    printf("  -J, --jobs       Client with -F: targets per wave, each wave starting when the last\n");
+    printf("                   one ends (default: 0, every target at once)\n");
+    printf("  -f, --format     Results on stdout as text, json (JSON Lines) or csv; in json/csv\n");
+    printf("                   modes the prose output moves to stderr (default: text)\n");
+    printf("  -v, --verbosity  Log level: error, warn, info or debug; SIGUSR1 raises it and\n");
+    printf("                   SIGUSR2 lowers it while running (default: info)\n");
     printf("  -h, --help       Display this help message\n");
     exit(0);
 }
@@ -28,10 +84,30 @@ int main(int argc, char *argv[]) {
     int port = 8080;
     int size = 64;
     int duration = 10;
-    int interval = 1;
+    double interval = 1;
+    int streams = 1;
+    double report_interval = 1;
+    tstamp_mode_t timestamping = TSTAMP_OFF;
+    report_format_t format = REPORT_TEXT;
+    server_options_t server_options;
+    memset(&server_options, 0, sizeof(server_options));
+    server_options.download_mode = ZC_COPY;
+    udp_batch_options_t *udp = &server_options.udp;
+    io_engine_options_t *io = &server_options.io;
+    tuning_options_t tuning;
+    tuning_grid_t grid;
+    int duration_given = 0;
+    int interval_given = 0;
+    control_test_t load = CONTROL_TEST_BIDIR;
+    int verify_compare = 0;
+    char *target_file = NULL;
+    int jobs = 0;
+    log_level_t log_level = LOG_LEVEL_INFO;
+    memset(&tuning, 0, sizeof(tuning));
+    memset(&grid, 0, sizeof(grid));
 
     int opt;
-    while ((opt = getopt(argc, argv, "m:t:r:a:p:s:d:i:h")) != -1) {
+    while ((opt = getopt(argc, argv, "m:t:r:a:p:s:d:i:P:e:z:b:B:l:T:f:I:S:Q:u:q:L:w:C:M:V:F:J:X:v:D:NAgh")) != -1) {
         switch (opt) {
             case 'm': mode = optarg; break;
             case 't': test = optarg; break;
@@ -39,8 +115,99 @@ int main(int argc, char *argv[]) {
             case 'a': address = optarg; break;
             case 'p': port = atoi(optarg); break;
             case 's': size = atoi(optarg); break;
-            case 'd': duration = atoi(optarg); break;
-            case 'i': interval = atoi(optarg); break;
+            case 'd': duration = atoi(optarg); duration_given = 1; break;
+            case 'i': interval = atof(optarg); interval_given = 1; break;
+            case 'D':
+                if (strcmp(optarg, "upload") == 0) {
+                    load = CONTROL_TEST_UPLOAD;
+                } else if (strcmp(optarg, "download") == 0) {
+                    load = CONTROL_TEST_DOWNLOAD;
+                } else if (strcmp(optarg, "bidir") == 0) {
+                    load = CONTROL_TEST_BIDIR;
+                } else {
+                    fprintf(stderr, "Error: Invalid load direction: %s\n", optarg);
+                    print_usage();
+                }
+                break;
+            case 'P': streams = atoi(optarg); break;
+            case 'F': target_file = optarg; break;
+            case 'J': jobs = atoi(optarg); break;
+            case 'I': report_interval = atof(optarg); break;
+            case 'b': udp->rate = udp_parse_rate(optarg); break;
+            case 'B': udp->batch = atoi(optarg); break;
+            case 'l': udp->datagram_size = atoi(optarg); break;
+            case 'g': udp->offload = 1; break;
+            case 'e': server_options.event_loops = atoi(optarg); break;
+            case 'A': server_options.shard = 1; break;
+            case 'S': server_options.admission.max_sessions = atoi(optarg); break;
+            case 'X': server_options.metrics_port = atoi(optarg); break;
+            case 'Q':
+                if (admission_parse_quota(optarg, &server_options.admission) < 0) {
+                    fprintf(stderr, "Error: Invalid session quota: %s\n", optarg);
+                    print_usage();
+                }
+                break;
+            case 'q': io->depth = atoi(optarg); break;
+            case 'M': tuning.mss = atoi(optarg); break;
+            case 'N': tuning.nodelay = 1; break;
+            case 'V':
+                if (strcmp(optarg, "on") == 0) {
+                    tuning.verify = 1;
+                } else if (strcmp(optarg, "compare") == 0) {
+                    verify_compare = 1;
+                } else {
+                    fprintf(stderr, "Error: Invalid verify mode: %s\n", optarg);
+                    print_usage();
+                }
+                break;
+            case 'L':
+                if (tuning_grid_add_sizes(grid.write_sizes, &grid.write_count, optarg) < 0) {
+                    fprintf(stderr, "Error: Invalid write size: %s\n", optarg);
+                    print_usage();
+                }
+                break;
+            case 'w':
+                if (tuning_grid_add_sizes(grid.buffers, &grid.buffer_count, optarg) < 0) {
+                    fprintf(stderr, "Error: Invalid socket buffer size: %s\n", optarg);
+                    print_usage();
+                }
+                break;
+            case 'C':
+                if (tuning_grid_add_names(&grid, optarg) < 0) {
+                    fprintf(stderr, "Error: Invalid congestion control list: %s\n", optarg);
+                    print_usage();
+                }
+                break;
+            case 'u':
+                if (io_engine_parse(optarg, io) < 0) {
+                    fprintf(stderr, "Error: Invalid I/O engine: %s\n", optarg);
+                    print_usage();
+                }
+                break;
+            case 'z':
+                if (zerocopy_parse_mode(optarg, &server_options.download_mode) < 0) {
+                    fprintf(stderr, "Error: Invalid zero-copy mode: %s\n", optarg);
+                    print_usage();
+                }
+                break;
+            case 'T':
+                if (tstamp_parse_mode(optarg, &timestamping) < 0) {
+                    fprintf(stderr, "Error: Invalid timestamping mode: %s\n", optarg);
+                    print_usage();
+                }
+                break;
+            case 'f':
+                if (report_parse_format(optarg, &format) < 0) {
+                    fprintf(stderr, "Error: Invalid output format: %s\n", optarg);
+                    print_usage();
+                }
+                break;
+            case 'v':
+                if (log_parse_level(optarg, &log_level) < 0) {
+                    fprintf(stderr, "Error: Invalid log level: %s\n", optarg);
+                    print_usage();
+                }
+                break;
             case 'h':
             default: print_usage();
         }
@@ -51,8 +218,36 @@ int main(int argc, char *argv[]) {
         print_usage();
     }
 
+    if (report_open(format) < 0 || log_start(log_level) < 0) {
+        return 1;
+    }
+
     if (strcmp(mode, "server") == 0) {
-        start_server(port);
+        server_options.port = port;
+        if (server_options.event_loops > 0 || server_options.shard) {
+            start_event_server(&server_options);
+        } else {
+            start_server(&server_options);
+        }
+    } else if (strcmp(mode, "client") == 0 && target_file) {
+        if (tuning.verify || verify_compare) {
+            fprintf(stderr, "Error: Payload verification is not available with -F.\n");
+            print_usage();
+        }
+        tuning_from_grid(&tuning, &grid);
+        targets_options_t targets;
+        memset(&targets, 0, sizeof(targets));
+        targets.parallel = jobs;
+        targets.report_interval = report_interval < REPORTER_MIN_INTERVAL ? REPORTER_MIN_INTERVAL : report_interval;
+        targets.tuning = tuning;
+        targets.defaults.port = port;
+        targets.defaults.duration = duration;
+        targets.defaults.streams = streams < 1 ? 1 : streams > TARGET_MAX_STREAMS ? TARGET_MAX_STREAMS : streams;
+        targets.defaults.write_size = tuning.write_size > 0 ? tuning.write_size : BUFFER_SIZE;
+        targets.defaults.count = duration;
+        targets.defaults.interval = interval;
+        targets.defaults.size = size;
+        run_targets(target_file, &targets);
     } else if (strcmp(mode, "client") == 0) {
         // Client mode requires both mode and test type
         if (!test || !address) {
@@ -60,6 +255,7 @@ int main(int argc, char *argv[]) {
             print_usage();
         }
 
+        tuning_from_grid(&tuning, &grid);
         if (strcmp(test, "ping") == 0) {
             if (strcmp(protocol, "udp") != 0 && strcmp(protocol, "icmp") != 0) {
                 fprintf(stderr, "Error: Invalid protocol for ping. Use udp or icmp.\n");
@@ -67,31 +263,71 @@ int main(int argc, char *argv[]) {
             }
         } else {
             if (strcmp(protocol, "tcp") != 0 && strcmp(protocol, "udp") != 0) {
-                fprintf(stderr, "Error: Invalid protocol for upload/download. Use tcp or udp.\n");
+                fprintf(stderr, "Error: Invalid protocol for upload/download/bidir. Use tcp or udp.\n");
+                print_usage();
+            }
+            if (strcmp(test, "rpm") == 0 && strcmp(protocol, "tcp") != 0) {
+                fprintf(stderr, "Error: The rpm test loads the path with TCP; it probes with UDP itself.\n");
                 print_usage();
             }
         }
+        if ((tuning.verify || verify_compare) && (strcmp(protocol, "tcp") != 0 || strcmp(test, "ping") == 0)) {
+            fprintf(stderr, "Error: Payload verification covers TCP tests only.\n");
+            print_usage();
+        }
+        if (verify_compare && (strcmp(test, "sweep") == 0 || strcmp(test, "rpm") == 0)) {
+            fprintf(stderr, "Error: -V compare needs upload, download or bidir.\n");
+            print_usage();
+        }
 
         // Handle the test type for client mode
         if (strcmp(test, "upload") == 0) {
-            if (strcmp(protocol, "tcp") == 0) {
-                run_tcp_upload_test(address, port, duration);
+            if (verify_compare) {
+                run_tcp_verify_compare(address, port, duration, report_interval, streams, io, &tuning,
+                                       CONTROL_TEST_UPLOAD);
+            } else if (strcmp(protocol, "tcp") == 0) {
+                run_tcp_upload_test(address, port, duration, report_interval, streams, io, &tuning);
             }
             else {
-                run_udp_upload_test(address, port, duration);
+                run_udp_upload_test(address, port, duration, report_interval, udp);
             }
         } else if (strcmp(test, "download") == 0) {
-            if (strcmp(protocol, "tcp") == 0) {
-                run_tcp_download_test(address, port, duration);
+            if (verify_compare) {
+                run_tcp_verify_compare(address, port, duration, report_interval, streams, io, &tuning,
+                                       CONTROL_TEST_DOWNLOAD);
+            } else if (strcmp(protocol, "tcp") == 0) {
+                run_tcp_download_test(address, port, duration, report_interval, streams, io, &tuning);
+            }
+            else {
+                run_udp_download_test(address, port, duration, report_interval, udp);
+            }
+        } else if (strcmp(test, "bidir") == 0) {
+            if (verify_compare) {
+                run_tcp_verify_compare(address, port, duration, report_interval, streams, io, &tuning,
+                                       CONTROL_TEST_BIDIR);
+            } else if (strcmp(protocol, "tcp") == 0) {
+                run_tcp_bidir_test(address, port, duration, report_interval, streams, io, &tuning);
             }
             else {
-                run_udp_download_test(address, port, duration);
+                run_udp_bidir_test(address, port, duration, report_interval, udp);
+            }
+        } else if (strcmp(test, "sweep") == 0) {
+            if (strcmp(protocol, "tcp") != 0) {
+                fprintf(stderr, "Error: The sweep runs TCP uploads only.\n");
+                print_usage();
             }
+            tuning_grid_defaults(&grid);
+            run_tcp_sweep(address, port, duration_given ? duration : TUNING_SWEEP_DURATION, streams, io,
+                          &tuning, &grid);
+        } else if (strcmp(test, "rpm") == 0) {
+            double probe_interval = interval_given && interval > 0 ? interval : RPM_PROBE_INTERVAL;
+            run_rpm_test(address, port, duration, report_interval, streams, size, probe_interval, io,
+                         &tuning, load);
         } else if (strcmp(test, "ping") == 0) {
              if (strcmp(protocol, "icmp") == 0) {
-                run_icmp_ping_test(address, port, size, duration, interval);
+                run_icmp_ping_test(address, port, size, duration, interval, timestamping);
             } else {
-                run_ping_test(address, port, size, duration, interval);
+                run_ping_test(address, port, size, duration, interval, timestamping);
             }
         } else {
             fprintf(stderr, "Invalid test type: %s\n", test);
@@ -102,6 +338,7 @@ int main(int argc, char *argv[]) {
         print_usage();
     }
 
-    return 0;
+    report_close();
+    return client_status();
 }
 
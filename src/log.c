@@ -0,0 +1,454 @@
+#define _GNU_SOURCE
+#include "../include/log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+/*
+ * Asynchronous logging. A thread that logs gets its own single-producer
+ * ring the first time it does; log_write copies the format pointer and the
+ * arguments into the next slot and publishes it with a release store, so a
+ * data path never takes the stdio lock or waits on a slow terminal. One
+ * writer thread drains every ring, formats the records and writes them out.
+ * A full ring drops the record and counts it rather than blocking, and the
+ * count is reported on stderr.
+ *
+ * Rings follow the threads the way metrics slots do: a pthread key
+ * destructor marks the ring orphaned, the writer drains what is left and
+ * hands it to the next thread that logs. The level can be changed while
+ * running: SIGUSR1 logs one level more, SIGUSR2 one level less.
+ */
+
+#define LOG_CACHE_LINE 64
+
+typedef struct log_ring {
+    log_record_t slot[LOG_RING_SLOTS];
+    uint64_t head __attribute__((aligned(LOG_CACHE_LINE)));    // written by the owner
+    uint64_t tail __attribute__((aligned(LOG_CACHE_LINE)));    // written by the drain
+    struct log_ring *next;              // registry list, never shrinks
+    int in_use;
+    int orphaned;                       // owner exited, free once drained
+    uint64_t drain_head;                // the drain's snapshot of head
+    int drain_orphaned;
+} log_ring_t;
+
+typedef enum {
+    LEN_NONE, LEN_HH, LEN_H, LEN_L, LEN_LL, LEN_Z, LEN_J, LEN_T, LEN_LD
+} length_t;
+
+// One printf conversion, as parsed from the format
+typedef struct {
+    char flags[8];
+    int width;                          // -1 when absent
+    int precision;                      // -1 when absent
+    int width_star;
+    int precision_star;
+    length_t length;
+    char conversion;
+} conversion_t;
+
+static const char *level_names[] = { "error", "warn", "info", "debug" };
+
+static int started;
+static int current_level = LOG_LEVEL_INFO;
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t drain_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t ring_key;
+static log_ring_t *rings;
+static __thread log_ring_t *local;
+static unsigned long dropped, dropped_reported;
+static time_t dropped_reported_at;
+
+// Parses the conversion after a '%'; returns the character after it, or NULL if unsupported
+static const char *parse_conversion(const char *p, conversion_t *c) {
+    memset(c, 0, sizeof(*c));
+    c->width = c->precision = -1;
+
+    size_t flags = strspn(p, "-+ #0'");
+    if (flags >= sizeof(c->flags)) return NULL;
+    memcpy(c->flags, p, flags);
+    p += flags;
+
+    if (*p == '*') {
+        c->width_star = 1;
+        p++;
+    } else if (*p >= '0' && *p <= '9') {
+        c->width = (int)strtol(p, (char**)&p, 10);
+    }
+    if (*p == '.') {
+        p++;
+        if (*p == '*') {
+            c->precision_star = 1;
+            p++;
+        } else {
+            c->precision = (int)strtol(p, (char**)&p, 10);
+        }
+    }
+
+    if (p[0] == 'h' && p[1] == 'h') { c->length = LEN_HH; p += 2; }
+    else if (p[0] == 'l' && p[1] == 'l') { c->length = LEN_LL; p += 2; }
+    else if (*p == 'h') { c->length = LEN_H; p++; }
+    else if (*p == 'l') { c->length = LEN_L; p++; }
+    else if (*p == 'z') { c->length = LEN_Z; p++; }
+    else if (*p == 'j') { c->length = LEN_J; p++; }
+    else if (*p == 't') { c->length = LEN_T; p++; }
+    else if (*p == 'L') { c->length = LEN_LD; p++; }
+
+    if (!*p || !strchr("diouxXcfFeEgGaAspm", *p)) return NULL;
+    c->conversion = *p;
+    return p + 1;
+}
+
+static int conversion_args(const conversion_t *c) {
+    return c->width_star + c->precision_star + (c->conversion != 'm');
+}
+
+/*
+ * Walks the conversions the way printf would and keeps each argument at its
+ * promoted type. Strings are copied, since the caller's buffer may be gone by
+ * the time the writer gets to the record. Past LOG_MAX_ARGS the rest of the
+ * message is cut off.
+ */
+static void capture(log_record_t *r, log_level_t level, const char *format, int saved_errno, va_list ap) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    r->format = format;
+    r->time_ns = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+    r->level = level;
+    r->args = 0;
+    r->string_used = 0;
+    r->saved_errno = saved_errno;
+
+    for (const char *p = format; *p; ) {
+        if (*p++ != '%') continue;
+        if (*p == '%') {
+            p++;
+            continue;
+        }
+        conversion_t c;
+        const char *next = parse_conversion(p, &c);
+        if (!next || r->args + conversion_args(&c) > LOG_MAX_ARGS) return;
+        p = next;
+
+        if (c.width_star) r->arg[r->args++].i = va_arg(ap, int);
+        if (c.precision_star) r->arg[r->args++].i = va_arg(ap, int);
+
+        log_arg_t *a = &r->arg[r->args];
+        switch (c.conversion) {
+            case 'd': case 'i':
+                switch (c.length) {
+                    case LEN_HH: a->i = (signed char)va_arg(ap, int); break;
+                    case LEN_H: a->i = (short)va_arg(ap, int); break;
+                    case LEN_L: a->i = va_arg(ap, long); break;
+                    case LEN_LL: a->i = va_arg(ap, long long); break;
+                    case LEN_Z: a->i = va_arg(ap, ssize_t); break;
+                    case LEN_J: a->i = va_arg(ap, intmax_t); break;
+                    case LEN_T: a->i = va_arg(ap, ptrdiff_t); break;
+                    default: a->i = va_arg(ap, int); break;
+                }
+                break;
+            case 'o': case 'u': case 'x': case 'X':
+                switch (c.length) {
+                    case LEN_HH: a->u = (unsigned char)va_arg(ap, unsigned int); break;
+                    case LEN_H: a->u = (unsigned short)va_arg(ap, unsigned int); break;
+                    case LEN_L: a->u = va_arg(ap, unsigned long); break;
+                    case LEN_LL: a->u = va_arg(ap, unsigned long long); break;
+                    case LEN_Z: a->u = va_arg(ap, size_t); break;
+                    case LEN_J: a->u = va_arg(ap, uintmax_t); break;
+                    case LEN_T: a->u = (unsigned long long)va_arg(ap, ptrdiff_t); break;
+                    default: a->u = va_arg(ap, unsigned int); break;
+                }
+                break;
+            case 'c':
+                a->i = va_arg(ap, int);
+                break;
+            case 'p':
+                a->p = va_arg(ap, void*);
+                break;
+            case 's': {
+                const char *s = va_arg(ap, const char*);
+                if (!s) s = "(null)";
+                size_t room = LOG_STRING_BYTES - r->string_used;
+                size_t len = strnlen(s, room > 0 ? room - 1 : 0);
+                // A full area ends in the last string's terminator, which reads as ""
+                a->string = room > 0 ? r->string_used : LOG_STRING_BYTES - 1;
+                if (room > 0) {
+                    memcpy(r->strings + r->string_used, s, len);
+                    r->strings[r->string_used + len] = '\0';
+                    r->string_used += len + 1;
+                }
+                break;
+            }
+            case 'm':
+                continue;
+            default:
+                a->d = c.length == LEN_LD ? (double)va_arg(ap, long double) : va_arg(ap, double);
+                break;
+        }
+        r->args++;
+    }
+}
+
+// Formats a captured record one conversion at a time
+static int render(const log_record_t *r, char *line, size_t len) {
+    size_t used = 0;
+    int index = 0;
+    const char *p = r->format;
+
+    while (*p && used < len - 1) {
+        if (*p != '%') {
+            line[used++] = *p++;
+            continue;
+        }
+        if (p[1] == '%') {
+            line[used++] = '%';
+            p += 2;
+            continue;
+        }
+        conversion_t c;
+        const char *next = parse_conversion(p + 1, &c);
+        if (!next || index + conversion_args(&c) > r->args) break;
+        p = next;
+
+        int width = c.width_star ? (int)r->arg[index++].i : c.width;
+        int precision = c.precision_star ? (int)r->arg[index++].i : c.precision;
+        char spec[48], errbuf[128];
+        int n = snprintf(spec, sizeof(spec), "%%%s", c.flags);
+        // A negative width from '*' reads back as the '-' flag, as printf treats it
+        if (c.width_star || width >= 0) n += snprintf(spec + n, sizeof(spec) - n, "%d", width);
+        if (precision >= 0) n += snprintf(spec + n, sizeof(spec) - n, ".%d", precision);
+
+        const log_arg_t *a = &r->arg[index];
+        size_t room = len - used;
+        int written;
+        switch (c.conversion) {
+            case 'd': case 'i': case 'o': case 'u': case 'x': case 'X':
+                snprintf(spec + n, sizeof(spec) - n, "ll%c", c.conversion);
+                written = strchr("di", c.conversion) ? snprintf(line + used, room, spec, a->i)
+                                                     : snprintf(line + used, room, spec, a->u);
+                break;
+            case 'c':
+                snprintf(spec + n, sizeof(spec) - n, "c");
+                written = snprintf(line + used, room, spec, (int)a->i);
+                break;
+            case 'p':
+                snprintf(spec + n, sizeof(spec) - n, "p");
+                written = snprintf(line + used, room, spec, a->p);
+                break;
+            case 's':
+                snprintf(spec + n, sizeof(spec) - n, "s");
+                written = snprintf(line + used, room, spec, r->strings + a->string);
+                break;
+            case 'm':
+                snprintf(spec + n, sizeof(spec) - n, "s");
+                written = snprintf(line + used, room, spec, strerror_r(r->saved_errno, errbuf, sizeof(errbuf)));
+                break;
+            default:
+                snprintf(spec + n, sizeof(spec) - n, "%c", c.conversion);
+                written = snprintf(line + used, room, spec, a->d);
+                break;
+        }
+        if (c.conversion != 'm') index++;
+        if (written < 0) break;
+        used += (size_t)written < room ? (size_t)written : room - 1;
+    }
+    line[used] = '\0';
+    return (int)used;
+}
+
+static void emit(const log_record_t *r) {
+    char line[LOG_LINE_MAX];
+    render(r, line, sizeof(line));
+    FILE *out = r->level <= LOG_LEVEL_WARN ? stderr : stdout;
+    // stderr is unbuffered; flush stdout first so lines already printed stay ahead
+    if (out == stderr) fflush(stdout);
+    fputs(line, out);
+    fputc('\n', out);
+}
+
+static void retire_ring(void *arg) {
+    log_ring_t *ring = (log_ring_t*)arg;
+    __atomic_store_n(&ring->orphaned, 1, __ATOMIC_RELEASE);
+}
+
+static log_ring_t *local_ring(void) {
+    if (local) return local;
+
+    pthread_mutex_lock(&registry_lock);
+    log_ring_t *ring = rings;
+    while (ring && ring->in_use) ring = ring->next;
+    if (!ring) {
+        ring = aligned_alloc(LOG_CACHE_LINE, sizeof(log_ring_t));
+        if (ring) {
+            memset(ring, 0, sizeof(*ring));
+            ring->next = rings;
+            __atomic_store_n(&rings, ring, __ATOMIC_RELEASE);
+        }
+    }
+    if (ring) ring->in_use = 1;
+    pthread_mutex_unlock(&registry_lock);
+    if (!ring) return NULL;
+
+    pthread_setspecific(ring_key, ring);
+    local = ring;
+    return ring;
+}
+
+/*
+ * The only consumer of every ring; callers hold drain_lock. Records go out
+ * oldest first across all rings, so a session thread's lines stay behind
+ * the accept that started it. Rings that were orphaned before the pass and
+ * are now empty go back to the free list.
+ */
+static int drain(void) {
+    int written = 0;
+    log_ring_t *first = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+
+    // Orphaned is read before head, so an orphaned ring found empty stays empty
+    for (log_ring_t *ring = first; ring; ring = ring->next) {
+        ring->drain_orphaned = __atomic_load_n(&ring->orphaned, __ATOMIC_ACQUIRE);
+        ring->drain_head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    }
+
+    while (1) {
+        log_ring_t *oldest = NULL;
+        for (log_ring_t *ring = first; ring; ring = ring->next) {
+            if (ring->tail == ring->drain_head) continue;
+            if (!oldest || ring->slot[ring->tail % LOG_RING_SLOTS].time_ns <
+                           oldest->slot[oldest->tail % LOG_RING_SLOTS].time_ns) {
+                oldest = ring;
+            }
+        }
+        if (!oldest) break;
+        emit(&oldest->slot[oldest->tail % LOG_RING_SLOTS]);
+        __atomic_store_n(&oldest->tail, oldest->tail + 1, __ATOMIC_RELEASE);
+        written++;
+    }
+
+    for (log_ring_t *ring = first; ring; ring = ring->next) {
+        if (!ring->drain_orphaned) continue;
+        pthread_mutex_lock(&registry_lock);
+        ring->orphaned = 0;
+        ring->in_use = 0;
+        pthread_mutex_unlock(&registry_lock);
+    }
+    if (written) {
+        fflush(stdout);
+        fflush(stderr);
+    }
+    return written;
+}
+
+// At most once a second, so a flood of drops does not become a flood of lines
+static void report_dropped(int force) {
+    unsigned long now_dropped = __atomic_load_n(&dropped, __ATOMIC_RELAXED);
+    time_t now = time(NULL);
+    if (now_dropped == dropped_reported || (!force && now == dropped_reported_at)) return;
+    fprintf(stderr, "Log: %lu records dropped, output could not keep up\n", now_dropped - dropped_reported);
+    dropped_reported = now_dropped;
+    dropped_reported_at = now;
+}
+
+static void *log_writer(void *arg) {
+    (void)arg;
+    struct timespec idle = { 0, LOG_WRITER_SLEEP_MS * 1000000L };
+    while (1) {
+        pthread_mutex_lock(&drain_lock);
+        int written = drain();
+        report_dropped(0);
+        pthread_mutex_unlock(&drain_lock);
+        if (!written) nanosleep(&idle, NULL);
+    }
+    return NULL;
+}
+
+static void change_level(int sig) {
+    int level = __atomic_load_n(&current_level, __ATOMIC_RELAXED);
+    if (sig == SIGUSR1 && level < LOG_LEVEL_DEBUG) level++;
+    if (sig == SIGUSR2 && level > LOG_LEVEL_ERROR) level--;
+    __atomic_store_n(&current_level, level, __ATOMIC_RELAXED);
+}
+
+// Writes out whatever the rings hold; also runs at exit
+void log_flush(void) {
+    if (!started) return;
+    pthread_mutex_lock(&drain_lock);
+    drain();
+    report_dropped(1);
+    pthread_mutex_unlock(&drain_lock);
+}
+
+int log_start(log_level_t level) {
+    log_set_level(level);
+    if (pthread_key_create(&ring_key, retire_ring) != 0) {
+        perror("Failed to create log key");
+        return -1;
+    }
+
+    pthread_t writer;
+    if (pthread_create(&writer, NULL, log_writer, NULL) != 0) {
+        perror("Failed to create log writer thread");
+        return -1;
+    }
+    pthread_detach(writer);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = change_level;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGUSR1, &sa, NULL);
+    sigaction(SIGUSR2, &sa, NULL);
+
+    atexit(log_flush);
+    __atomic_store_n(&started, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+int log_parse_level(const char *name, log_level_t *level) {
+    for (int i = LOG_LEVEL_ERROR; i <= LOG_LEVEL_DEBUG; i++) {
+        if (strcmp(name, level_names[i]) == 0) {
+            *level = (log_level_t)i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+void log_set_level(log_level_t level) {
+    __atomic_store_n(&current_level, (int)level, __ATOMIC_RELAXED);
+}
+
+void log_write(log_level_t level, const char *format, ...) {
+    if ((int)level > __atomic_load_n(&current_level, __ATOMIC_RELAXED)) return;
+
+    int saved_errno = errno;
+    va_list ap;
+    va_start(ap, format);
+    log_ring_t *ring = __atomic_load_n(&started, __ATOMIC_ACQUIRE) ? local_ring() : NULL;
+    if (!ring) {
+        // Before log_start, or out of memory: format in place as printf would
+        log_record_t record;
+        capture(&record, level, format, saved_errno, ap);
+        emit(&record);
+        fflush(record.level <= LOG_LEVEL_WARN ? stderr : stdout);
+    } else {
+        uint64_t head = ring->head;
+        if (head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= LOG_RING_SLOTS) {
+            __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+        } else {
+            capture(&ring->slot[head % LOG_RING_SLOTS], level, format, saved_errno, ap);
+            __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+        }
+    }
+    va_end(ap);
+    errno = saved_errno;
+}
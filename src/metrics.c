@@ -0,0 +1,322 @@
+#include "../include/metrics.h"
+#include "../include/server.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/socket.h>
+
+/*
+ * Server metrics for Prometheus. Every thread that counts anything gets its
+ * own cache-line-aligned slot the first time it does, so counting is a
+ * relaxed load and store to a line no other thread writes. When the thread
+ * exits, a pthread key destructor folds its slot into the retired totals and
+ * frees it for the next thread; the threaded server starts a thread per
+ * session, so slots are reused rather than piling up. A scrape takes the
+ * registry lock and sums the retired totals with every live slot.
+ *
+ * Nothing is counted until metrics_start has run, so a server without -X
+ * pays one predictable branch per call.
+ */
+
+typedef struct metrics_slot {
+    metrics_counters_t counters;
+    struct metrics_slot *next;          // registry list, never shrinks
+    int in_use;
+} __attribute__((aligned(METRICS_CACHE_LINE))) metrics_slot_t;
+
+static const double duration_bounds[METRICS_DURATION_BUCKETS - 1] = { 0.1, 0.5, 1, 2.5, 5, 10, 30, 60 };
+
+// The sessions each protocol can run, in output order
+static const struct {
+    metrics_protocol_t protocol;
+    control_test_t test;
+} session_kinds[] = {
+    { METRICS_TCP, CONTROL_TEST_UPLOAD },
+    { METRICS_TCP, CONTROL_TEST_DOWNLOAD },
+    { METRICS_TCP, CONTROL_TEST_BIDIR },
+    { METRICS_UDP, CONTROL_TEST_UPLOAD },
+    { METRICS_UDP, CONTROL_TEST_DOWNLOAD },
+    { METRICS_UDP, CONTROL_TEST_BIDIR },
+    { METRICS_UDP, CONTROL_TEST_PING },
+};
+
+static const char *protocol_names[METRICS_PROTOCOLS] = { "tcp", "udp", "icmp" };
+static const char *failure_names[METRICS_FAILURES] = { "invalid_header", "unsupported", "busy", "setup" };
+
+static int enabled;
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t slot_key;
+static metrics_slot_t *slots;
+static metrics_counters_t retired;
+static __thread metrics_slot_t *local;
+
+static void add_counters(metrics_counters_t *dst, const metrics_counters_t *src) {
+    uint64_t *d = (uint64_t*)dst;
+    const uint64_t *s = (const uint64_t*)src;
+    for (size_t i = 0; i < sizeof(*dst) / sizeof(uint64_t); i++) d[i] += __atomic_load_n(&s[i], __ATOMIC_RELAXED);
+}
+
+static void retire_slot(void *arg) {
+    metrics_slot_t *slot = (metrics_slot_t*)arg;
+    pthread_mutex_lock(&registry_lock);
+    add_counters(&retired, &slot->counters);
+    memset(&slot->counters, 0, sizeof(slot->counters));
+    slot->in_use = 0;
+    pthread_mutex_unlock(&registry_lock);
+}
+
+static metrics_counters_t *local_counters(void) {
+    if (local) return &local->counters;
+
+    pthread_mutex_lock(&registry_lock);
+    metrics_slot_t *slot = slots;
+    while (slot && slot->in_use) slot = slot->next;
+    if (!slot) {
+        slot = aligned_alloc(METRICS_CACHE_LINE, sizeof(metrics_slot_t));
+        if (slot) {
+            memset(slot, 0, sizeof(*slot));
+            slot->next = slots;
+            slots = slot;
+        }
+    }
+    if (slot) slot->in_use = 1;
+    pthread_mutex_unlock(&registry_lock);
+    if (!slot) return NULL;
+
+    pthread_setspecific(slot_key, slot);
+    local = slot;
+    return &slot->counters;
+}
+
+// Single writer: a plain add published with a relaxed store, no locked instruction
+static inline void bump(uint64_t *counter, uint64_t n) {
+    __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+static int valid_test(control_test_t test) {
+    return test > 0 && test < METRICS_TESTS;
+}
+
+void metrics_session_start(metrics_protocol_t protocol, control_test_t test) {
+    metrics_counters_t *c;
+    if (!enabled || !valid_test(test) || !(c = local_counters())) return;
+    bump(&c->started[protocol][test], 1);
+}
+
+void metrics_session_end(metrics_protocol_t protocol, control_test_t test, double seconds) {
+    metrics_counters_t *c;
+    if (!enabled || !valid_test(test) || !(c = local_counters())) return;
+    int bucket = 0;
+    while (bucket < METRICS_DURATION_BUCKETS - 1 && seconds > duration_bounds[bucket]) bucket++;
+    bump(&c->duration_buckets[protocol][test][bucket], 1);
+    bump(&c->duration_us[protocol][test], seconds > 0 ? (uint64_t)(seconds * 1e6) : 0);
+    bump(&c->ended[protocol][test], 1);
+}
+
+void metrics_bytes(metrics_protocol_t protocol, long received, long sent) {
+    metrics_counters_t *c;
+    if (!enabled || !(c = local_counters())) return;
+    if (received > 0) bump(&c->bytes_received[protocol], received);
+    if (sent > 0) bump(&c->bytes_sent[protocol], sent);
+}
+
+void metrics_packets(metrics_protocol_t protocol, long received, long sent) {
+    metrics_counters_t *c;
+    if (!enabled || !(c = local_counters())) return;
+    if (received > 0) bump(&c->packets_received[protocol], received);
+    if (sent > 0) bump(&c->packets_sent[protocol], sent);
+}
+
+void metrics_failure(metrics_failure_t reason) {
+    metrics_counters_t *c;
+    if (!enabled || !(c = local_counters())) return;
+    bump(&c->failures[reason], 1);
+}
+
+typedef struct {
+    char *buf;
+    size_t len;
+    size_t used;
+} metrics_out_t;
+
+static void out(metrics_out_t *o, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+static void out(metrics_out_t *o, const char *fmt, ...) {
+    if (o->used >= o->len) return;
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(o->buf + o->used, o->len - o->used, fmt, ap);
+    va_end(ap);
+    o->used = n < 0 ? o->len : o->used + n;
+}
+
+static void out_header(metrics_out_t *o, const char *name, const char *type, const char *help) {
+    out(o, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+static void out_per_protocol(metrics_out_t *o, const char *name, const char *help,
+                             const uint64_t *values, int first, int last) {
+    out_header(o, name, "counter", help);
+    for (int p = first; p <= last; p++) {
+        out(o, "%s{protocol=\"%s\"} %llu\n", name, protocol_names[p], (unsigned long long)values[p]);
+    }
+}
+
+// Formats the Prometheus text exposition; returns its length, or -1 if `len` is too small
+int metrics_render(char *buf, size_t len) {
+    metrics_counters_t total;
+    pthread_mutex_lock(&registry_lock);
+    total = retired;
+    for (metrics_slot_t *slot = slots; slot; slot = slot->next) {
+        if (slot->in_use) add_counters(&total, &slot->counters);
+    }
+    pthread_mutex_unlock(&registry_lock);
+
+    metrics_out_t o = { buf, len, 0 };
+    const int kinds = sizeof(session_kinds) / sizeof(session_kinds[0]);
+
+    out_header(&o, "lan_speed_sessions_active", "gauge", "Test sessions in progress.");
+    for (int k = 0; k < kinds; k++) {
+        int p = session_kinds[k].protocol, t = session_kinds[k].test;
+        // Start and end may be counted on different threads and summed a moment apart
+        int64_t active = (int64_t)(total.started[p][t] - total.ended[p][t]);
+        out(&o, "lan_speed_sessions_active{protocol=\"%s\",test=\"%s\"} %lld\n", protocol_names[p],
+            control_test_name(t), (long long)(active > 0 ? active : 0));
+    }
+    out_header(&o, "lan_speed_sessions_total", "counter", "Test sessions admitted.");
+    for (int k = 0; k < kinds; k++) {
+        int p = session_kinds[k].protocol, t = session_kinds[k].test;
+        out(&o, "lan_speed_sessions_total{protocol=\"%s\",test=\"%s\"} %llu\n", protocol_names[p],
+            control_test_name(t), (unsigned long long)total.started[p][t]);
+    }
+    out_header(&o, "lan_speed_session_duration_seconds", "histogram", "Duration of finished test sessions.");
+    for (int k = 0; k < kinds; k++) {
+        int p = session_kinds[k].protocol, t = session_kinds[k].test;
+        const char *labels[2] = { protocol_names[p], control_test_name(t) };
+        uint64_t cumulative = 0;
+        for (int b = 0; b < METRICS_DURATION_BUCKETS; b++) {
+            cumulative += total.duration_buckets[p][t][b];
+            if (b < METRICS_DURATION_BUCKETS - 1) {
+                out(&o, "lan_speed_session_duration_seconds_bucket{protocol=\"%s\",test=\"%s\",le=\"%g\"} %llu\n",
+                    labels[0], labels[1], duration_bounds[b], (unsigned long long)cumulative);
+            } else {
+                out(&o, "lan_speed_session_duration_seconds_bucket{protocol=\"%s\",test=\"%s\",le=\"+Inf\"} %llu\n",
+                    labels[0], labels[1], (unsigned long long)cumulative);
+            }
+        }
+        out(&o, "lan_speed_session_duration_seconds_sum{protocol=\"%s\",test=\"%s\"} %.6f\n", labels[0], labels[1],
+            total.duration_us[p][t] / 1e6);
+        out(&o, "lan_speed_session_duration_seconds_count{protocol=\"%s\",test=\"%s\"} %llu\n", labels[0],
+            labels[1], (unsigned long long)total.ended[p][t]);
+    }
+
+    out_per_protocol(&o, "lan_speed_received_bytes_total", "Test payload bytes received.",
+                     total.bytes_received, METRICS_TCP, METRICS_ICMP);
+    out_per_protocol(&o, "lan_speed_sent_bytes_total", "Test payload bytes sent.",
+                     total.bytes_sent, METRICS_TCP, METRICS_ICMP);
+    out_per_protocol(&o, "lan_speed_received_packets_total", "Datagrams received.",
+                     total.packets_received, METRICS_UDP, METRICS_ICMP);
+    out_per_protocol(&o, "lan_speed_sent_packets_total", "Datagrams sent.",
+                     total.packets_sent, METRICS_UDP, METRICS_ICMP);
+
+    out_header(&o, "lan_speed_handshake_failures_total", "counter", "Sessions that ended before their test started.");
+    for (int f = 0; f < METRICS_FAILURES; f++) {
+        out(&o, "lan_speed_handshake_failures_total{reason=\"%s\"} %llu\n", failure_names[f],
+            (unsigned long long)total.failures[f]);
+    }
+    return o.used < o.len ? (int)o.used : -1;
+}
+
+static void send_all(int sock, const char *data, size_t len) {
+    while (len > 0) {
+        long n = send(sock, data, len, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return;
+        data += n;
+        len -= n;
+    }
+}
+
+// One request per connection: GET /metrics (or /) gets the exposition, anything else a 404
+static void serve_scrape(int sock, char *body) {
+    char request[1024];
+    long n = recv(sock, request, sizeof(request) - 1, 0);
+    if (n <= 0) return;
+    request[n] = '\0';
+
+    char header[160];
+    if (strncmp(request, "GET /metrics ", 13) != 0 && strncmp(request, "GET / ", 6) != 0) {
+        const char *missing = "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+        send_all(sock, missing, strlen(missing));
+        return;
+    }
+    int len = metrics_render(body, METRICS_RESPONSE_MAX);
+    if (len < 0) len = 0;
+    int header_len = snprintf(header, sizeof(header),
+                              "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                              "Content-Length: %d\r\nConnection: close\r\n\r\n", len);
+    send_all(sock, header, header_len);
+    send_all(sock, body, len);
+}
+
+static void *metrics_thread(void *arg) {
+    int listener = *(int*)arg;
+    free(arg);
+    char *body = malloc(METRICS_RESPONSE_MAX);
+    if (!body) {
+        perror("Malloc failed");
+        close(listener);
+        return NULL;
+    }
+    while (1) {
+        int sock = accept(listener, NULL, NULL);
+        if (sock < 0) {
+            if (errno != EINTR) perror("Metrics accept failed");
+            continue;
+        }
+        // A scraper that connects and says nothing must not stall the next one
+        struct timeval timeout = { 1, 0 };
+        setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        serve_scrape(sock, body);
+        close(sock);
+    }
+    return NULL;
+}
+
+// Turns counting on and serves the metrics over HTTP on `port`
+int metrics_start(int port) {
+    if (pthread_key_create(&slot_key, retire_slot) != 0) {
+        perror("Failed to create the metrics key");
+        return -1;
+    }
+    int *listener = malloc(sizeof(int));
+    if (!listener) {
+        perror("Malloc failed");
+        return -1;
+    }
+    *listener = create_socket(SOCK_STREAM, port);
+    if (listen(*listener, 16) < 0) {
+        perror("Metrics listen failed");
+        close(*listener);
+        free(listener);
+        return -1;
+    }
+    enabled = 1;
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, metrics_thread, listener) != 0) {
+        perror("Failed to create metrics thread");
+        close(*listener);
+        free(listener);
+        enabled = 0;
+        return -1;
+    }
+    pthread_detach(thread);
+    printf("Metrics on http://0.0.0.0:%d/metrics\n", port);
+    return 0;
+}
@@ -0,0 +1,488 @@
+#include "../include/probe.h"
+#include "../include/shared.h"
+#include "../include/udp_flow.h"
+#include "../include/log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <math.h>
+#include <endian.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <netinet/ip.h>
+#include <netinet/ip_icmp.h>
+
+#define PROBE_SPIN_NS 50000         // waits shorter than this spin instead of sleeping
+
+int ping_stats_init(ping_stats_t *stats, int report_seconds) {
+    memset(stats, 0, sizeof(*stats));
+    stats->report_seconds = report_seconds;
+    stats->total = malloc(sizeof(histogram_t));
+    stats->interval = malloc(sizeof(histogram_t));
+    if (!stats->total || !stats->interval) {
+        perror("Malloc failed");
+        free(stats->total);
+        free(stats->interval);
+        return -1;
+    }
+    histogram_reset(stats->total);
+    histogram_reset(stats->interval);
+    clock_gettime(CLOCK_MONOTONIC, &stats->interval_start);
+    stats->start = stats->interval_start;
+    return 0;
+}
+
+static double since_start(const ping_stats_t *stats, const struct timespec *ts) {
+    return (ts->tv_sec - stats->start.tv_sec) + (ts->tv_nsec - stats->start.tv_nsec) / 1e9;
+}
+
+static void ping_stats_flush(ping_stats_t *stats, int print) {
+    if (stats->interval->total == 0) return;
+    if (print) histogram_print("Interval", stats->interval);
+    if (print && stats->test && report_enabled()) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        report_record_t r;
+        report_record_init(&r, "interval", stats->test, "client");
+        r.start = since_start(stats, &stats->interval_start);
+        r.end = since_start(stats, &now);
+        report_set_rtt(&r, stats->interval);
+        report_emit(&r);
+    }
+    histogram_merge(stats->total, stats->interval);
+    histogram_reset(stats->interval);
+}
+
+void ping_stats_record(ping_stats_t *stats, double rtt_ms) {
+    if (stats->total->total + stats->interval->total > 0) {
+        stats->jitter_sum += fabs(rtt_ms - stats->last_rtt);
+        stats->jitter_count++;
+    }
+    stats->last_rtt = rtt_ms;
+    histogram_record(stats->interval, (uint64_t)(rtt_ms * 1e6));
+
+    if (stats->report_seconds <= 0) return;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (now.tv_sec - stats->interval_start.tv_sec >= stats->report_seconds) {
+        ping_stats_flush(stats, 1);
+        stats->interval_start = now;
+    }
+}
+
+// Folds the open interval into the totals without printing anything
+void ping_stats_collect(ping_stats_t *stats) {
+    ping_stats_flush(stats, 0);
+}
+
+void ping_stats_finish(ping_stats_t *stats) {
+    ping_stats_flush(stats, 0);
+    histogram_print("Summary", stats->total);
+}
+
+double ping_stats_jitter(const ping_stats_t *stats) {
+    return stats->jitter_count > 0 ? stats->jitter_sum / stats->jitter_count : 0.0;
+}
+
+void ping_stats_free(ping_stats_t *stats) {
+    free(stats->total);
+    free(stats->interval);
+    stats->total = stats->interval = NULL;
+}
+
+/*
+ * Prints the kernel-stamped RTT next to the user-space one. The gap between
+ * the two medians is what the host adds: syscalls, scheduler wakeups and
+ * socket queueing on both the send and the receive side.
+ */
+void probe_print_kernel_rtt(const ping_stats_t *user, ping_stats_t *kernel, tstamp_mode_t mode) {
+    ping_stats_flush(kernel, 0);
+    char label[64];
+    snprintf(label, sizeof(label), "Kernel RTT (%s stamps)", tstamp_mode_name(mode));
+    if (kernel->total->total == 0) {
+        printf("%s: no samples, the kernel returned no TX/RX stamps\n", label);
+        return;
+    }
+    histogram_print(label, kernel->total);
+    printf("Host stack overhead: %.4f ms at p50, %.4f ms mean\n",
+           ((double)histogram_percentile(user->total, 50.0) -
+            (double)histogram_percentile(kernel->total, 50.0)) / 1e6,
+           (histogram_mean(user->total) - histogram_mean(kernel->total)) / 1e6);
+}
+
+void probe_report_sample(const char *test, uint64_t seq, int64_t rtt_ns) {
+    if (!test || !report_enabled()) return;
+    report_record_t r;
+    report_record_init(&r, "sample", test, "client");
+    r.fields |= REPORT_F_SAMPLE;
+    r.seq = seq;
+    r.rtt_ns = rtt_ns;
+    report_emit(&r);
+}
+
+void probe_report_summary(const char *test, ping_stats_t *stats, long sent, long lost, long duplicates) {
+    if (!report_enabled()) return;
+    ping_stats_flush(stats, 0);
+    report_record_t r;
+    report_record_init(&r, "summary", test, "client");
+    report_set_rtt(&r, stats->total);
+    r.fields |= REPORT_F_PACKETS;
+    r.packets = sent;
+    r.lost = lost;
+    r.duplicates = duplicates;
+    r.jitter_ns = (int64_t)(ping_stats_jitter(stats) * 1e6);
+    report_emit(&r);
+}
+
+/*
+ * Pipelined probe engine. The calling thread sends probes on an absolute
+ * CLOCK_MONOTONIC schedule while a receiver thread matches echoed replies to
+ * their probe by the sequence number in the struct packet header. Send times
+ * live in a ring indexed by sequence, so any number of probes can be in
+ * flight; a reply whose slot has since been reused, or that arrives after
+ * timeout_ms, is counted as late rather than as an RTT sample or a loss.
+ * With timestamping on, the receiver also collects the kernel's RX stamp from
+ * each reply and the TX stamps from the error queue, giving a second RTT per
+ * probe that excludes the user-space send and wakeup paths.
+ *
+ * In ICMP mode the probe is an echo request and the 16-bit echo sequence is
+ * the low half of the probe sequence, which is exactly the ring index. Only
+ * that word changes between probes, so the checksum is patched per send. A
+ * raw socket sees every echo reply to this host, so those are also matched
+ * on the echo identifier; an unprivileged ICMP socket gets only its own.
+ */
+
+enum { SLOT_EMPTY, SLOT_OUTSTANDING, SLOT_ANSWERED };
+
+typedef struct {
+    uint64_t seq;
+    int64_t send_ns;
+    int state;
+    // Kernel stamps, only touched by the receiver once the slot is in use
+    tstamp_t tx, rx;
+    int have_rx;
+    int kernel_done;
+} probe_slot_t;
+
+typedef struct {
+    int sock;
+    const probe_options_t *opt;
+    probe_result_t *result;
+    probe_slot_t *ring;
+    uint64_t *key_seq;          // SOF_TIMESTAMPING_OPT_ID key -> probe sequence
+    int sending_done;
+    int64_t last_send_ns;
+} probe_engine_t;
+
+static int64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void wait_until(int64_t target_ns) {
+    int64_t now;
+    while ((now = monotonic_ns()) < target_ns) {
+        if (target_ns - now > PROBE_SPIN_NS) {
+            int64_t wake = target_ns - PROBE_SPIN_NS / 2;
+            struct timespec ts = { wake / 1000000000LL, wake % 1000000000LL };
+            clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+        }
+    }
+}
+
+/*
+ * Records the kernel RTT once both stamps for a probe are in. In hardware
+ * mode the software TX stamp can arrive before the hardware one, so a probe
+ * whose reply was stamped by the NIC waits for the NIC's TX stamp too.
+ */
+static void probe_try_kernel_rtt(probe_engine_t *engine, probe_slot_t *slot) {
+    if (slot->kernel_done || !slot->have_rx) return;
+    if (slot->rx.hw_ns ? !slot->tx.hw_ns : !slot->tx.sw_ns) return;
+
+    int64_t rtt_ns = tstamp_rtt_ns(&slot->tx, &slot->rx);
+    if (rtt_ns <= 0) return;
+    slot->kernel_done = 1;
+    ping_stats_record(&engine->result->kernel_stats, rtt_ns / 1e6);
+}
+
+static void probe_drain_tx_stamps(probe_engine_t *engine) {
+    uint32_t key;
+    tstamp_t ts;
+    int rc;
+    while ((rc = tstamp_read_tx(engine->sock, &key, &ts)) > 0) {
+        if (rc != 1) continue;
+        uint64_t seq = __atomic_load_n(&engine->key_seq[key & (PROBE_RING_SIZE - 1)], __ATOMIC_ACQUIRE);
+        probe_slot_t *slot = &engine->ring[seq & (PROBE_RING_SIZE - 1)];
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != seq) continue;
+        if (ts.sw_ns) slot->tx.sw_ns = ts.sw_ns;
+        if (ts.hw_ns) slot->tx.hw_ns = ts.hw_ns;
+        probe_try_kernel_rtt(engine, slot);
+    }
+}
+
+/*
+ * Finds the probe sequence a reply answers, or returns -1 for anything that
+ * is not one of our replies. ICMP replies only carry the ring index, which
+ * the slot's own sequence completes.
+ */
+static int probe_match_reply(probe_engine_t *engine, const char *buffer, long n, uint64_t *seq) {
+    const probe_options_t *opt = engine->opt;
+    if (!opt->icmp) {
+        if (n < (long)sizeof(struct packet)) return -1;
+        *seq = be64toh(((const struct packet*)buffer)->sequence);
+        return 0;
+    }
+
+    if (opt->icmp_raw) {
+        if (n < (long)sizeof(struct iphdr)) return -1;
+        long ip_header_len = ((const struct iphdr*)buffer)->ihl * 4;
+        buffer += ip_header_len;
+        n -= ip_header_len;
+    }
+    if (n < (long)sizeof(struct icmphdr)) return -1;
+    const struct icmphdr *icmp = (const struct icmphdr*)buffer;
+    if (icmp->type != ICMP_ECHOREPLY) return -1;
+    if (opt->icmp_raw && icmp->un.echo.id != opt->echo_id) return -1;
+    uint16_t index = ntohs(icmp->un.echo.sequence);
+    *seq = __atomic_load_n(&engine->ring[index & (PROBE_RING_SIZE - 1)].seq, __ATOMIC_ACQUIRE);
+    return (uint16_t)*seq == index ? 0 : -1;
+}
+
+static void *probe_receiver(void *arg) {
+    probe_engine_t *engine = (probe_engine_t*)arg;
+    const probe_options_t *opt = engine->opt;
+    probe_result_t *result = engine->result;
+    int64_t timeout_ns = (int64_t)opt->timeout_ms * 1000000LL;
+    int stamping = result->timestamping != TSTAMP_OFF;
+    char *buffer = malloc(BUFFER_SIZE);
+    if (!buffer) {
+        perror("Malloc failed");
+        return NULL;
+    }
+
+    char control[TSTAMP_CONTROL_LEN];
+    struct iovec iov = { buffer, BUFFER_SIZE };
+    struct msghdr msg;
+
+    while (1) {
+        if (__atomic_load_n(&engine->sending_done, __ATOMIC_ACQUIRE) &&
+            monotonic_ns() - engine->last_send_ns > timeout_ns) {
+            break;
+        }
+
+        if (stamping) {
+            // TX stamps raise POLLERR; poll so they are read even with no reply queued
+            struct pollfd pfd = { engine->sock, POLLIN, 0 };
+            if (poll(&pfd, 1, 100) <= 0) continue;
+            if (pfd.revents & POLLERR) probe_drain_tx_stamps(engine);
+            if (!(pfd.revents & POLLIN)) continue;
+        }
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        long n = recvmsg(engine->sock, &msg, stamping ? MSG_DONTWAIT : 0);
+        int64_t now = monotonic_ns();
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                log_error("Ping receive failed: %m");
+            }
+            continue;
+        }
+        uint64_t seq;
+        if (probe_match_reply(engine, buffer, n, &seq) < 0) continue;
+        probe_slot_t *slot = &engine->ring[seq & (PROBE_RING_SIZE - 1)];
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != seq) {
+            result->late++;     // slot already reused by a newer probe
+            continue;
+        }
+        int expected = SLOT_OUTSTANDING;
+        if (!__atomic_compare_exchange_n(&slot->state, &expected, SLOT_ANSWERED, 0,
+                                         __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            if (expected == SLOT_ANSWERED) result->duplicates++;
+            continue;
+        }
+
+        // The sender may have reused the slot between the seq check and the
+        // CAS, which then claimed the newer probe; give that probe back
+        int64_t rtt_ns = now - __atomic_load_n(&slot->send_ns, __ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != seq) {
+            expected = SLOT_ANSWERED;
+            __atomic_compare_exchange_n(&slot->state, &expected, SLOT_OUTSTANDING, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+            result->late++;
+            continue;
+        }
+        if (rtt_ns <= 0) continue;
+        if (rtt_ns > timeout_ns) {
+            result->late++;
+            continue;
+        }
+
+        result->received++;
+        ping_stats_record(&result->stats, rtt_ns / 1e6);
+        if (stamping && tstamp_from_cmsg(&msg, &slot->rx)) {
+            slot->have_rx = 1;
+            probe_try_kernel_rtt(engine, slot);
+        }
+        probe_report_sample(opt->name, seq, rtt_ns);
+        if (opt->verbose) {
+            log_info("Ping %llu: RTT = %.4f ms", (unsigned long long)seq + 1, rtt_ns / 1e6);
+        }
+    }
+
+    if (stamping) probe_drain_tx_stamps(engine);
+    free(buffer);
+    return NULL;
+}
+
+/*
+ * Opens an ICMP socket connected to `addr` for probe_run and sets the ICMP
+ * fields of `opt`. An unprivileged SOCK_DGRAM socket is tried first; it
+ * works where net.ipv4.ping_group_range includes one of our groups, and the
+ * kernel fills in the identifier and checksum. Otherwise a raw socket is
+ * used, which needs root or CAP_NET_RAW.
+ */
+int probe_icmp_socket(const struct sockaddr_in *addr, probe_options_t *opt) {
+    static uint16_t next_id;
+    opt->icmp = 1;
+    opt->icmp_raw = 0;
+    int sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_ICMP);
+    if (sock < 0) {
+        sock = socket(AF_INET, SOCK_RAW, IPPROTO_ICMP);
+        if (sock < 0) {
+            perror("ICMP socket creation failed. Need root, CAP_NET_RAW or a group in net.ipv4.ping_group_range");
+            return -1;
+        }
+        opt->icmp_raw = 1;
+    }
+    // Distinct per run as well as per process, so concurrent probers on one host keep apart
+    opt->echo_id = htons((uint16_t)(getpid() + __atomic_fetch_add(&next_id, 0x6d2b, __ATOMIC_RELAXED)));
+
+    if (connect(sock, (const struct sockaddr*)addr, sizeof(*addr)) < 0) {
+        perror("ICMP connect failed");
+        close(sock);
+        return -1;
+    }
+    return sock;
+}
+
+/*
+ * Sends opt->count probes (or until *opt->stop) on `sock`, which must be
+ * connected to an echo service, or come from probe_icmp_socket. Fills
+ * `result`; the caller releases it with probe_result_free.
+ */
+int probe_run(int sock, const probe_options_t *opt, probe_result_t *result) {
+    memset(result, 0, sizeof(*result));
+    int size = opt->size < (int)sizeof(struct packet) ? (int)sizeof(struct packet) : opt->size;
+    if (opt->icmp) size = (opt->size > 0 ? opt->size : 0) + (int)sizeof(struct icmphdr);
+    if (size > BUFFER_SIZE) size = BUFFER_SIZE;
+
+    if (ping_stats_init(&result->stats, opt->quiet ? 0 : opt->verbose ? 10 : 1) < 0) return -1;
+    if (ping_stats_init(&result->kernel_stats, 0) < 0) {
+        ping_stats_free(&result->stats);
+        return -1;
+    }
+    result->stats.test = opt->name;
+
+    probe_engine_t engine;
+    memset(&engine, 0, sizeof(engine));
+    engine.sock = sock;
+    engine.opt = opt;
+    engine.result = result;
+    engine.ring = calloc(PROBE_RING_SIZE, sizeof(probe_slot_t));
+    engine.key_seq = calloc(PROBE_RING_SIZE, sizeof(uint64_t));
+    char *data = malloc(size);
+    if (!engine.ring || !engine.key_seq || !data) {
+        perror("Malloc failed");
+        free(engine.ring);
+        free(engine.key_seq);
+        free(data);
+        probe_result_free(result);
+        return -1;
+    }
+    memset(data, 'A', size);
+    struct icmphdr *icmp = (struct icmphdr*)data;
+    if (opt->icmp) {
+        icmp->type = ICMP_ECHO;
+        icmp->code = 0;
+        icmp->un.echo.id = opt->echo_id;
+        icmp->un.echo.sequence = 0;
+        icmp->checksum = 0;
+        icmp->checksum = checksum(data, size);
+    }
+
+    // Let the receiver notice the end of the run without a reply arriving
+    struct timeval timeout = { 0, 100000 };
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    // Enabled only now so the OPT_ID key counts probe sends from zero
+    result->timestamping = tstamp_enable(sock, opt->timestamping);
+
+    pthread_t receiver;
+    if (pthread_create(&receiver, NULL, probe_receiver, &engine) != 0) {
+        perror("Failed to create probe receiver thread");
+        free(engine.ring);
+        free(engine.key_seq);
+        free(data);
+        probe_result_free(result);
+        return -1;
+    }
+
+    int64_t interval_ns = (int64_t)(opt->interval * 1e9);
+    int64_t start = monotonic_ns();
+    for (long i = 0; opt->count == 0 || i < opt->count; i++) {
+        if (opt->stop && *opt->stop) break;
+        wait_until(start + i * interval_ns);
+
+        probe_slot_t *slot = &engine.ring[i & (PROBE_RING_SIZE - 1)];
+        __atomic_store_n(&slot->state, SLOT_EMPTY, __ATOMIC_RELEASE);
+        memset(&slot->tx, 0, sizeof(slot->tx));
+        memset(&slot->rx, 0, sizeof(slot->rx));
+        slot->have_rx = slot->kernel_done = 0;
+        // The kernel keys TX stamps by successful sends, which is result->sent
+        __atomic_store_n(&engine.key_seq[result->sent & (PROBE_RING_SIZE - 1)], (uint64_t)i, __ATOMIC_RELEASE);
+        __atomic_store_n(&slot->seq, (uint64_t)i, __ATOMIC_RELEASE);
+        if (opt->icmp) {
+            uint16_t old_sequence = icmp->un.echo.sequence;
+            icmp->un.echo.sequence = htons((uint16_t)i);
+            icmp->checksum = checksum_update16(icmp->checksum, old_sequence, icmp->un.echo.sequence);
+        } else {
+            udp_flow_stamp(data, size, i, udp_flow_now_ns());
+        }
+        __atomic_store_n(&slot->send_ns, monotonic_ns(), __ATOMIC_RELAXED);
+        __atomic_store_n(&slot->state, SLOT_OUTSTANDING, __ATOMIC_RELEASE);
+
+        if (send(sock, data, size, 0) < 0) {
+            __atomic_store_n(&slot->state, SLOT_EMPTY, __ATOMIC_RELEASE);
+            log_error("Ping send failed: %m");
+            continue;
+        }
+        result->sent++;
+    }
+
+    engine.last_send_ns = monotonic_ns();
+    __atomic_store_n(&engine.sending_done, 1, __ATOMIC_RELEASE);
+    pthread_join(receiver, NULL);
+    // The per-reply lines go out before the caller prints the summary
+    log_flush();
+
+    result->lost = result->sent - result->received - result->late;
+    if (result->lost < 0) result->lost = 0;
+
+    free(engine.ring);
+    free(engine.key_seq);
+    free(data);
+    return 0;
+}
+
+void probe_result_free(probe_result_t *result) {
+    ping_stats_free(&result->stats);
+    ping_stats_free(&result->kernel_stats);
+}
@@ -0,0 +1,389 @@
+#include "../include/report.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/uio.h>
+
+/*
+ * Machine-readable output. Measurement threads format a record into a line
+ * and drop it into a bounded in-memory queue; a writer thread owns the
+ * output descriptor, so a slow pipe or terminal can never stall a test.
+ * When the queue is full the record is counted as dropped instead.
+ *
+ * In JSON and CSV modes the original stdout carries records only: the
+ * descriptor is duplicated for the writer and fd 1 is pointed at stderr, so
+ * every existing human-readable line still appears, just on stderr.
+ */
+
+#define REPORT_WRITE_BATCH 64
+
+static report_format_t format = REPORT_TEXT;
+static int out_fd = -1;
+static char *lines;
+static int *line_len;
+static unsigned long head, tail;    // head: next slot to fill, tail: next to write
+static unsigned long dropped;
+static int closing;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ready = PTHREAD_COND_INITIALIZER;
+static pthread_t writer;
+
+static const char *csv_columns =
+    "timestamp,event,test,side,direction,stream,start,end,bytes,bits_per_second,packets,received,lost,"
+    "out_of_order,duplicates,jitter_ns,seq,rtt_ns,rtt_min_ns,rtt_mean_ns,rtt_p50_ns,rtt_p99_ns,"
+    "rtt_p999_ns,rtt_max_ns,cwnd,srtt_ns,rttvar_ns,rcv_rtt_ns,retransmits,delivery_bits_per_second,"
+    "busy_ns,rwnd_limited_ns,sndbuf_limited_ns,verified_blocks,corrupted_blocks,missing_blocks,"
+    "misordered_blocks,target,rpm\n";
+
+int report_parse_format(const char *name, report_format_t *out) {
+    if (strcmp(name, "text") == 0) {
+        *out = REPORT_TEXT;
+    } else if (strcmp(name, "json") == 0) {
+        *out = REPORT_JSON;
+    } else if (strcmp(name, "csv") == 0) {
+        *out = REPORT_CSV;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+int report_enabled(void) {
+    return format != REPORT_TEXT;
+}
+
+// Writes every byte behind `iov`, resuming after short writes; -1 on error
+static int write_all(int fd, struct iovec *iov, int count) {
+    while (count > 0) {
+        long n = writev(fd, iov, count);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        while (count > 0 && (size_t)n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (char*)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 0;
+}
+
+static void *report_writer(void *arg) {
+    (void)arg;
+    struct iovec iov[REPORT_WRITE_BATCH];
+
+    pthread_mutex_lock(&lock);
+    while (1) {
+        while (head == tail && !closing) {
+            pthread_cond_wait(&ready, &lock);
+        }
+        if (head == tail) break;
+
+        // Slots between tail and head are not touched by producers until tail moves
+        unsigned long first = tail;
+        int count = head - tail > REPORT_WRITE_BATCH ? REPORT_WRITE_BATCH : (int)(head - tail);
+        pthread_mutex_unlock(&lock);
+
+        for (int i = 0; i < count; i++) {
+            unsigned long slot = (first + i) % REPORT_QUEUE_LINES;
+            iov[i].iov_base = lines + slot * REPORT_LINE_MAX;
+            iov[i].iov_len = line_len[slot];
+        }
+        if (write_all(out_fd, iov, count) < 0) {
+            perror("Report write failed");
+        }
+
+        pthread_mutex_lock(&lock);
+        tail = first + count;
+    }
+    pthread_mutex_unlock(&lock);
+    return NULL;
+}
+
+static void enqueue(const char *line, int len) {
+    if (len <= 0) return;
+    if (len > REPORT_LINE_MAX) len = REPORT_LINE_MAX;
+
+    pthread_mutex_lock(&lock);
+    if (head - tail >= REPORT_QUEUE_LINES) {
+        dropped++;
+    } else {
+        unsigned long slot = head % REPORT_QUEUE_LINES;
+        memcpy(lines + slot * REPORT_LINE_MAX, line, len);
+        line_len[slot] = len;
+        head++;
+        pthread_cond_signal(&ready);
+    }
+    pthread_mutex_unlock(&lock);
+}
+
+int report_open(report_format_t requested) {
+    if (requested == REPORT_TEXT) return 0;
+
+    lines = malloc((size_t)REPORT_QUEUE_LINES * REPORT_LINE_MAX);
+    line_len = calloc(REPORT_QUEUE_LINES, sizeof(int));
+    if (!lines || !line_len) {
+        perror("Malloc failed");
+        free(lines);
+        free(line_len);
+        return -1;
+    }
+
+    fflush(stdout);
+    out_fd = dup(STDOUT_FILENO);
+    if (out_fd < 0 || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+        perror("Failed to redirect stdout for reports");
+        if (out_fd >= 0) close(out_fd);
+        return -1;
+    }
+    format = requested;
+    if (pthread_create(&writer, NULL, report_writer, NULL) != 0) {
+        perror("Failed to create report writer thread");
+        // Put stdout back so the run still prints, as text
+        dup2(out_fd, STDOUT_FILENO);
+        close(out_fd);
+        format = REPORT_TEXT;
+        return -1;
+    }
+    if (format == REPORT_CSV) enqueue(csv_columns, strlen(csv_columns));
+    return 0;
+}
+
+// Flushes queued records and stops the writer; call before exiting
+void report_close(void) {
+    if (format == REPORT_TEXT) return;
+
+    pthread_mutex_lock(&lock);
+    closing = 1;
+    pthread_cond_signal(&ready);
+    pthread_mutex_unlock(&lock);
+    pthread_join(writer, NULL);
+
+    if (dropped > 0) {
+        fprintf(stderr, "Report: %lu records dropped, output could not keep up\n", dropped);
+    }
+    close(out_fd);
+    format = REPORT_TEXT;
+}
+
+void report_record_init(report_record_t *r, const char *event, const char *test, const char *side) {
+    memset(r, 0, sizeof(*r));
+    r->event = event;
+    r->test = test;
+    r->side = side;
+}
+
+void report_set_bytes(report_record_t *r, long bytes, double start, double end) {
+    r->fields |= REPORT_F_BYTES;
+    r->bytes = bytes;
+    r->start = start;
+    r->end = end;
+    r->bits_per_second = end > start ? bytes * 8.0 / (end - start) : 0.0;
+}
+
+// Counters for the span between `prev` and `now`; pass a zeroed `prev` for totals
+void report_set_udp(report_record_t *r, const udp_seq_stats_t *now, const udp_seq_stats_t *prev) {
+    r->fields |= REPORT_F_UDP;
+    r->received = now->received - prev->received;
+    r->lost = now->lost - prev->lost;
+    r->out_of_order = now->out_of_order - prev->out_of_order;
+    r->duplicates = now->duplicates - prev->duplicates;
+    r->jitter_ns = (int64_t)now->jitter_ns;
+}
+
+void report_set_rtt(report_record_t *r, const histogram_t *h) {
+    r->fields |= REPORT_F_RTT;
+    r->received = h->total;
+    r->rtt_min_ns = h->min;
+    r->rtt_mean_ns = histogram_mean(h);
+    r->rtt_p50_ns = histogram_percentile(h, 50.0);
+    r->rtt_p99_ns = histogram_percentile(h, 99.0);
+    r->rtt_p999_ns = histogram_percentile(h, 99.9);
+    r->rtt_max_ns = h->max;
+}
+
+// TCP_INFO state as of `now`; counters as the change since `prev`, or cumulative without one
+void report_set_tcp(report_record_t *r, const tcpinfo_t *now, const tcpinfo_t *prev) {
+    tcpinfo_t zero;
+    memset(&zero, 0, sizeof(zero));
+    if (!prev) prev = &zero;
+    r->fields |= REPORT_F_TCP;
+    r->cwnd = now->cwnd;
+    r->srtt_ns = now->srtt_us * 1000LL;
+    r->rttvar_ns = now->rttvar_us * 1000LL;
+    r->rcv_rtt_ns = now->rcv_rtt_us * 1000LL;
+    r->retransmits = now->retransmits - prev->retransmits;
+    r->delivery_bits_per_second = now->delivery_rate * 8.0;
+    r->busy_ns = (now->busy_us - prev->busy_us) * 1000LL;
+    r->rwnd_limited_ns = (now->rwnd_limited_us - prev->rwnd_limited_us) * 1000LL;
+    r->sndbuf_limited_ns = (now->sndbuf_limited_us - prev->sndbuf_limited_us) * 1000LL;
+}
+
+void report_set_integrity(report_record_t *r, const integrity_stats_t *stats) {
+    r->fields |= REPORT_F_INTEGRITY;
+    r->integrity = *stats;
+}
+
+typedef struct {
+    const char *name;
+    char value[32];
+    int present;
+    int quoted;
+} report_field_t;
+
+static void field_str(report_field_t *f, const char *name, const char *value) {
+    f->name = name;
+    snprintf(f->value, sizeof(f->value), "%s", value ? value : "");
+    f->present = value != NULL;
+    f->quoted = 1;
+}
+
+static void field_num(report_field_t *f, const char *name, int present, const char *fmt, ...)
+    __attribute__((format(printf, 4, 5)));
+
+static void field_num(report_field_t *f, const char *name, int present, const char *fmt, ...) {
+    f->name = name;
+    f->present = present;
+    f->quoted = 0;
+    if (!present) return;
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(f->value, sizeof(f->value), fmt, ap);
+    va_end(ap);
+}
+
+void report_emit(const report_record_t *r) {
+    if (format == REPORT_TEXT) return;
+
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    int bytes = (r->fields & REPORT_F_BYTES) != 0;
+    int udp = (r->fields & REPORT_F_UDP) != 0;
+    int rtt = (r->fields & REPORT_F_RTT) != 0;
+    int sample = (r->fields & REPORT_F_SAMPLE) != 0;
+    int tcp = (r->fields & REPORT_F_TCP) != 0;
+    int integrity = (r->fields & REPORT_F_INTEGRITY) != 0;
+
+    // Same order as csv_columns
+    report_field_t f[39];
+    int n = 0;
+    field_num(&f[n++], "timestamp", 1, "%.6f", now.tv_sec + now.tv_nsec / 1e9);
+    field_str(&f[n++], "event", r->event);
+    field_str(&f[n++], "test", r->test);
+    field_str(&f[n++], "side", r->side);
+    field_str(&f[n++], "direction", r->direction);
+    field_num(&f[n++], "stream", 1, "%d", r->stream);
+    field_num(&f[n++], "start", r->end > 0, "%.6f", r->start);
+    field_num(&f[n++], "end", r->end > 0, "%.6f", r->end);
+    field_num(&f[n++], "bytes", bytes, "%ld", r->bytes);
+    field_num(&f[n++], "bits_per_second", bytes, "%.0f", r->bits_per_second);
+    field_num(&f[n++], "packets", (r->fields & REPORT_F_PACKETS) != 0, "%ld", r->packets);
+    field_num(&f[n++], "received", udp || rtt, "%ld", r->received);
+    field_num(&f[n++], "lost", udp || rtt, "%ld", r->lost);
+    field_num(&f[n++], "out_of_order", udp, "%ld", r->out_of_order);
+    field_num(&f[n++], "duplicates", udp || rtt, "%ld", r->duplicates);
+    field_num(&f[n++], "jitter_ns", udp || rtt, "%lld", (long long)r->jitter_ns);
+    field_num(&f[n++], "seq", sample, "%llu", (unsigned long long)r->seq);
+    field_num(&f[n++], "rtt_ns", sample, "%lld", (long long)r->rtt_ns);
+    field_num(&f[n++], "rtt_min_ns", rtt, "%llu", (unsigned long long)r->rtt_min_ns);
+    field_num(&f[n++], "rtt_mean_ns", rtt, "%.0f", r->rtt_mean_ns);
+    field_num(&f[n++], "rtt_p50_ns", rtt, "%llu", (unsigned long long)r->rtt_p50_ns);
+    field_num(&f[n++], "rtt_p99_ns", rtt, "%llu", (unsigned long long)r->rtt_p99_ns);
+    field_num(&f[n++], "rtt_p999_ns", rtt, "%llu", (unsigned long long)r->rtt_p999_ns);
+    field_num(&f[n++], "rtt_max_ns", rtt, "%llu", (unsigned long long)r->rtt_max_ns);
+    field_num(&f[n++], "cwnd", tcp, "%ld", r->cwnd);
+    field_num(&f[n++], "srtt_ns", tcp, "%lld", (long long)r->srtt_ns);
+    field_num(&f[n++], "rttvar_ns", tcp, "%lld", (long long)r->rttvar_ns);
+    field_num(&f[n++], "rcv_rtt_ns", tcp, "%lld", (long long)r->rcv_rtt_ns);
+    field_num(&f[n++], "retransmits", tcp, "%ld", r->retransmits);
+    field_num(&f[n++], "delivery_bits_per_second", tcp, "%.0f", r->delivery_bits_per_second);
+    field_num(&f[n++], "busy_ns", tcp, "%lld", (long long)r->busy_ns);
+    field_num(&f[n++], "rwnd_limited_ns", tcp, "%lld", (long long)r->rwnd_limited_ns);
+    field_num(&f[n++], "sndbuf_limited_ns", tcp, "%lld", (long long)r->sndbuf_limited_ns);
+    field_num(&f[n++], "verified_blocks", integrity, "%llu", (unsigned long long)r->integrity.blocks);
+    field_num(&f[n++], "corrupted_blocks", integrity, "%llu", (unsigned long long)r->integrity.corrupted);
+    field_num(&f[n++], "missing_blocks", integrity, "%llu", (unsigned long long)r->integrity.missing);
+    field_num(&f[n++], "misordered_blocks", integrity, "%llu", (unsigned long long)r->integrity.misordered);
+    field_str(&f[n++], "target", r->target);
+    field_num(&f[n++], "rpm", (r->fields & REPORT_F_RPM) != 0, "%.0f", r->rpm);
+
+    char line[REPORT_LINE_MAX];
+    int len = 0;
+    if (format == REPORT_JSON) {
+        len += snprintf(line + len, sizeof(line) - len, "{");
+        int first = 1;
+        for (int i = 0; i < n && len < (int)sizeof(line); i++) {
+            if (!f[i].present) continue;
+            len += snprintf(line + len, sizeof(line) - len, "%s\"%s\":%s%s%s", first ? "" : ",",
+                            f[i].name, f[i].quoted ? "\"" : "", f[i].value, f[i].quoted ? "\"" : "");
+            first = 0;
+        }
+        if (len < (int)sizeof(line)) len += snprintf(line + len, sizeof(line) - len, "}\n");
+    } else {
+        for (int i = 0; i < n && len < (int)sizeof(line); i++) {
+            len += snprintf(line + len, sizeof(line) - len, "%s%s", i ? "," : "",
+                            f[i].present ? f[i].value : "");
+        }
+        if (len < (int)sizeof(line)) len += snprintf(line + len, sizeof(line) - len, "\n");
+    }
+    if (len >= (int)sizeof(line)) len = sizeof(line) - 1;
+    enqueue(line, len);
+}
+
+// One UDP receiver record for the span between `prev` and `now`
+void report_udp(const char *event, const char *test, const char *side, const char *direction,
+                double start, double end, const udp_seq_stats_t *now, const udp_seq_stats_t *prev) {
+    if (format == REPORT_TEXT) return;
+    report_record_t r;
+    report_record_init(&r, event, test, side);
+    r.direction = direction;
+    report_set_bytes(&r, now->bytes - prev->bytes, start, end);
+    report_set_udp(&r, now, prev);
+    report_emit(&r);
+}
+
+// Fills `r` from the server's own account of a test, as sent in its results block
+void report_set_results(report_record_t *r, const control_results_t *results, int udp) {
+    report_set_bytes(r, (long)results->bytes, 0.0, results->duration_us / 1e6);
+    if (udp || results->packets > 0) {
+        r->fields |= REPORT_F_PACKETS;
+        r->packets = (long)results->packets;
+    }
+    if (udp) {
+        r->fields |= REPORT_F_UDP;
+        r->received = (long)results->packets;
+        r->lost = (long)results->lost;
+        r->out_of_order = (long)results->out_of_order;
+        r->duplicates = (long)results->duplicates;
+        r->jitter_ns = (int64_t)results->jitter_ns;
+    }
+    if (results->tcp.samples > 0) {
+        // Means stand in for the state fields; the counters cover the whole connection
+        tcpinfo_t tcp = results->tcp.last;
+        tcp.cwnd = (uint32_t)(results->tcp.cwnd_sum / results->tcp.samples);
+        tcp.srtt_us = (uint32_t)(results->tcp.srtt_sum_us / results->tcp.samples);
+        report_set_tcp(r, &tcp, NULL);
+    }
+    if (results->integrity.blocks > 0) report_set_integrity(r, &results->integrity);
+}
+
+void report_results(const char *test, int stream, const control_results_t *results, int udp) {
+    if (format == REPORT_TEXT) return;
+    report_record_t r;
+    report_record_init(&r, "summary", test, "server");
+    r.stream = stream;
+    // Each block of a bidirectional test is tagged with the direction it measures
+    if (strstr(test, "bidir")) r.direction = results->test == CONTROL_TEST_DOWNLOAD ? "down" : "up";
+    report_set_results(&r, results, udp);
+    report_emit(&r);
+}
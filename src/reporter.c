@@ -0,0 +1,113 @@
+#include "../include/reporter.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/timerfd.h>
+#include <sys/eventfd.h>
+
+double reporter_elapsed(const reporter_t *r) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - r->start.tv_sec) + (now.tv_nsec - r->start.tv_nsec) / 1e9;
+}
+
+static void arm_at(reporter_t *r, double offset) {
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    long ns = r->start.tv_nsec + (long)((offset - (long)offset) * 1e9);
+    its.it_value.tv_sec = r->start.tv_sec + (long)offset + ns / 1000000000L;
+    its.it_value.tv_nsec = ns % 1000000000L;
+    timerfd_settime(r->timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+/*
+ * Each boundary is armed as an absolute one-shot, so wakeup latency never
+ * accumulates into drift. A wakeup that oversleeps one or more boundaries
+ * folds them into a single longer interval instead of reporting empty ones.
+ */
+static void *reporter_thread(void *arg) {
+    reporter_t *r = (reporter_t*)arg;
+    double last = 0;
+    long tick = 0;
+    int index = 1;
+
+    while (1) {
+        double next = (tick + 1) * r->interval;
+        if (next > r->duration) next = r->duration;
+        arm_at(r, next);
+
+        struct pollfd pfd[2] = { { r->timer_fd, POLLIN, 0 }, { r->wake_fd, POLLIN, 0 } };
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("Reporter poll failed");
+            break;
+        }
+        int stopped = (pfd[1].revents & POLLIN) != 0;
+        if (!stopped && !(pfd[0].revents & POLLIN)) continue;
+
+        uint64_t expirations;
+        if (read(r->timer_fd, &expirations, sizeof(expirations)) < 0 && !stopped) continue;
+
+        double now = reporter_elapsed(r);
+        while ((tick + 1) * r->interval <= now) tick++;
+        if (now > last) r->report(r->arg, index++, last, now);
+        last = now;
+        if (stopped || now >= r->duration) break;
+    }
+
+    r->elapsed = last;
+    __atomic_store_n(r->stop, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+/*
+ * Starts timing now. `interval` is clamped to REPORTER_MIN_INTERVAL; the
+ * caller's counters must be zero before this point so that the first
+ * interval starts from the same instant as the clock.
+ */
+int reporter_start(reporter_t *r, double interval, double duration, reporter_fn report, void *arg,
+                   volatile int *stop) {
+    memset(r, 0, sizeof(*r));
+    r->interval = interval < REPORTER_MIN_INTERVAL ? REPORTER_MIN_INTERVAL : interval;
+    r->duration = duration;
+    r->report = report;
+    r->arg = arg;
+    r->stop = stop;
+
+    r->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    r->wake_fd = eventfd(0, EFD_CLOEXEC);
+    if (r->timer_fd < 0 || r->wake_fd < 0) {
+        perror("Failed to create reporter timer");
+        if (r->timer_fd >= 0) close(r->timer_fd);
+        if (r->wake_fd >= 0) close(r->wake_fd);
+        return -1;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &r->start);
+    if (pthread_create(&r->thread, NULL, reporter_thread, r) != 0) {
+        perror("Failed to create reporter thread");
+        close(r->timer_fd);
+        close(r->wake_fd);
+        return -1;
+    }
+    return 0;
+}
+
+// Ends the test before its duration, reporting the partial interval
+void reporter_stop(reporter_t *r) {
+    uint64_t one = 1;
+    if (write(r->wake_fd, &one, sizeof(one)) < 0) {
+        perror("Failed to stop reporter");
+    }
+}
+
+// Waits for the test to end and returns its wall-clock length in seconds
+double reporter_join(reporter_t *r) {
+    pthread_join(r->thread, NULL);
+    close(r->timer_fd);
+    close(r->wake_fd);
+    return r->elapsed;
+}
@@ -1,5 +1,8 @@
+#define _GNU_SOURCE
 #include "../include/server.h"
 #include "../include/shared.h"
+#include "../include/metrics.h"
+#include "../include/log.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -13,7 +16,35 @@
 #include <sys/socket.h>
 #include <signal.h>
 
-int create_socket(int type, int port) {
+#define PING_ECHO_BATCH 64
+#define HEADER_TIMEOUT_SECONDS 1    // a TCP client must send its header this soon after connecting
+
+static server_options_t server_options;
+
+// Sessions that outlive their admission deadline are cut off
+static int past_deadline(const struct timeval *start, const control_header_t *header) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    long elapsed_ms = (now.tv_sec - start->tv_sec) * 1000L + (now.tv_usec - start->tv_usec) / 1000L;
+    return elapsed_ms >= admission_deadline_ms(header);
+}
+
+static double seconds_since(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Bounds blocking calls so a silent or stalled client cannot outlive its deadline
+static void set_socket_timeout(int sock, int option, int seconds) {
+    struct timeval timeout;
+    timeout.tv_sec = seconds;
+    timeout.tv_usec = 0;
+    setsockopt(sock, SOL_SOCKET, option, &timeout, sizeof(timeout));
+}
+
+// Pass a cpu of -1 for a plain socket; otherwise the socket joins the port's SO_REUSEPORT group
+static int open_server_socket(int type, int port, int cpu) {
     int server_sock;
     struct sockaddr_in server_addr;
 
@@ -29,6 +60,17 @@ int create_socket(int type, int port) {
         close(server_sock);
         exit(EXIT_FAILURE);
     }
+    if (cpu >= 0) {
+        if (setsockopt(server_sock, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) < 0) {
+            perror("setsockopt SO_REUSEPORT failed");
+            close(server_sock);
+            exit(EXIT_FAILURE);
+        }
+        // The kernel prefers the group member whose CPU took the packet off the wire
+        if (setsockopt(server_sock, SOL_SOCKET, SO_INCOMING_CPU, &cpu, sizeof(cpu)) < 0) {
+            perror("setsockopt SO_INCOMING_CPU failed");
+        }
+    }
 
     memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
@@ -44,56 +86,144 @@ int create_socket(int type, int port) {
     return server_sock;
 }
 
+int create_socket(int type, int port) {
+    return open_server_socket(type, port, -1);
+}
+
+int create_reuseport_socket(int type, int port, int cpu) {
+    return open_server_socket(type, port, cpu);
+}
+
+// ICMP counters are printed at most this often, and only when something changed
+#define ICMP_SUMMARY_SECONDS 10
+
+/*
+ * Answers echo requests without printing each one, so a high-rate prober is
+ * not slowed by the server's stdout. Replies and failures are counted and
+ * logged as one line per ICMP_SUMMARY_SECONDS; at debug level every reply is
+ * logged as well, which only costs a record in this thread's log ring.
+ */
 void handle_icmp_ping(int icmp_sock) {
     char buffer[BUFFER_SIZE];
     struct sockaddr_in client_addr;
-    socklen_t addr_len = sizeof(client_addr);
+    socklen_t addr_len;
+    long replies = 0, failures = 0;
+    int last_error = 0;
+    struct timespec last_summary, now;
+
+    // Wake up now and then so the summary goes out after the traffic stops
+    struct timeval timeout = { 1, 0 };
+    setsockopt(icmp_sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    clock_gettime(CLOCK_MONOTONIC, &last_summary);
 
     while (1) {
         // Receive ICMP Echo Request
+        addr_len = sizeof(client_addr);
         int bytes_received = recvfrom(icmp_sock, buffer, sizeof(buffer), 0,
                                       (struct sockaddr *)&client_addr, &addr_len);
-        if (bytes_received < 0) {
-            if (errno == EINTR) continue; // Handle interrupt signal gracefully
-            perror("ICMP Receive failed");
-            continue;
+        if (bytes_received < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+            log_error("ICMP Receive failed: %m");
         }
 
-        struct iphdr *ip_hdr = (struct iphdr *)buffer;
-        int ip_header_len = ip_hdr->ihl * 4;
-        struct icmphdr *icmp_hdr = (struct icmphdr *)(buffer + ip_header_len);
-
-        if (icmp_hdr->type == ICMP_ECHO) {
-            // Prepare ICMP Echo Reply
-            icmp_hdr->type = ICMP_ECHOREPLY;
-            icmp_hdr->checksum = 0;
-            icmp_hdr->checksum = calculate_checksum((unsigned short *)icmp_hdr, bytes_received - ip_header_len);
+        if (bytes_received > 0) {
+            struct iphdr *ip_hdr = (struct iphdr *)buffer;
+            int ip_header_len = ip_hdr->ihl * 4;
+            struct icmphdr *icmp_hdr = (struct icmphdr *)(buffer + ip_header_len);
+
+            if (bytes_received >= ip_header_len + (int)sizeof(struct icmphdr) && icmp_hdr->type == ICMP_ECHO) {
+                metrics_packets(METRICS_ICMP, 1, 0);
+                metrics_bytes(METRICS_ICMP, bytes_received - ip_header_len, 0);
+                // Prepare ICMP Echo Reply; only the type changes, so patch the checksum for it
+                uint16_t old_word, new_word;
+                memcpy(&old_word, icmp_hdr, sizeof(old_word));
+                icmp_hdr->type = ICMP_ECHOREPLY;
+                memcpy(&new_word, icmp_hdr, sizeof(new_word));
+                icmp_hdr->checksum = checksum_update16(icmp_hdr->checksum, old_word, new_word);
+
+                // Send ICMP Echo Reply
+                if (sendto(icmp_sock, icmp_hdr, bytes_received - ip_header_len, 0,
+                           (struct sockaddr *)&client_addr, addr_len) < 0) {
+                    failures++;
+                    last_error = errno;
+                } else {
+                    replies++;
+                    log_debug("ICMP: echo reply to %s, %d bytes", inet_ntoa(client_addr.sin_addr),
+                              bytes_received - ip_header_len);
+                    metrics_packets(METRICS_ICMP, 0, 1);
+                    metrics_bytes(METRICS_ICMP, 0, bytes_received - ip_header_len);
+                }
+            }
+        }
 
-            // Send ICMP Echo Reply
-            if (sendto(icmp_sock, icmp_hdr, bytes_received - ip_header_len, 0,
-                       (struct sockaddr *)&client_addr, addr_len) < 0) {
-                perror("ICMP Send failed");
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (now.tv_sec - last_summary.tv_sec < ICMP_SUMMARY_SECONDS) continue;
+        if (replies > 0 || failures > 0) {
+            if (failures > 0) {
+                log_info("ICMP: %ld echo replies sent, %ld failed (%s) in the last %ld s", replies, failures,
+                         strerror(last_error), (long)(now.tv_sec - last_summary.tv_sec));
             } else {
-                printf("ICMP Echo Reply sent to %s\n", inet_ntoa(client_addr.sin_addr));
+                log_info("ICMP: %ld echo replies sent in the last %ld s", replies,
+                         (long)(now.tv_sec - last_summary.tv_sec));
             }
+            replies = failures = 0;
         }
+        last_summary = now;
     }
 }
 
-void handle_tcp_upload(int client_sock) {
-    char buffer[BUFFER_SIZE/4];
+// Reads one TCP stream until EOF or the deadline and fills `results` with what arrived
+static void tcp_receive(int client_sock, const control_header_t *header, const char *label,
+                        control_results_t *results) {
+    memset(results, 0, sizeof(*results));
+    int size = tuning_write_size(header);
+    char *buffer = malloc(size);
+    if (!buffer) {
+        perror("Malloc failed");
+        return;
+    }
     long total_bytes = 0;
     struct timeval start, end;
+    tcpinfo_summary_t tcp;
+    long next_sample_ms = 0;
+    memset(&tcp, 0, sizeof(tcp));
+    // Verified payload is read with recv so every byte passes through the checker
+    int verify = (header->flags & CONTROL_FLAG_VERIFY) != 0;
+    int use_uring = server_options.io.engine == IO_ENGINE_URING && !verify;
+    integrity_rx_t *rx = verify ? malloc(sizeof(integrity_rx_t)) : NULL;
+    if (verify && !rx) {
+        perror("Malloc failed");
+        free(buffer);
+        return;
+    }
+    if (rx) integrity_rx_init(rx);
 
+    uring_stats_t uring_stats;
+    struct timespec cpu_start, cpu_end;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_start);
+    set_socket_timeout(client_sock, SO_RCVTIMEO, 1);
     gettimeofday(&start, NULL);
-    while (1) {
-        int bytes = recv(client_sock, buffer, sizeof(buffer), 0);
+    if (use_uring) {
+        uring_stream_t stream = { client_sock, 1, size, 0, 0, 0, 0 };
+        uring_limits_t limits = { NULL, 0, admission_deadline_ms(header) };
+        uring_drive_streams(&stream, 1, &server_options.io, &limits, NULL, NULL, &uring_stats);
+        total_bytes = stream.bytes;
+        metrics_bytes(METRICS_TCP, total_bytes, 0);
+    }
+    while (!use_uring && !past_deadline(&start, header)) {
+        int bytes = recv(client_sock, buffer, size, 0);
+        if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) continue;
         if (bytes <= 0) {
             break; // End of data or error
         }
+        if (rx) integrity_rx_feed(rx, buffer, bytes);
         total_bytes += bytes;
+        metrics_bytes(METRICS_TCP, bytes, 0);
+        tcpinfo_sample_due(client_sock, &tcp, &next_sample_ms);
     }
     gettimeofday(&end, NULL);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_end);
+    tcpinfo_sample(client_sock, &tcp);
+    free(buffer);
 
     long time_diff = (end.tv_sec - start.tv_sec)*1000000L+(end.tv_usec - start.tv_usec);
     double mbps = 0.0;
@@ -101,163 +231,613 @@ void handle_tcp_upload(int client_sock) {
         mbps = (total_bytes * 8.0) / time_diff;
     }
 
-    printf("TCP Upload Test: Received %ld bytes in %ld microseconds (~%.2f Mbps)\n",
-           total_bytes, time_diff, mbps);
+    printf("%s: Received %ld bytes in %ld microseconds (~%.2f Mbps%s)\n", label, total_bytes, time_diff, mbps,
+           verify ? ", verified" : "");
+    if (use_uring) {
+        char usage[64];
+        snprintf(usage, sizeof(usage), "%s: io_uring engine", label);
+        double cpu_seconds = (cpu_end.tv_sec - cpu_start.tv_sec) + (cpu_end.tv_nsec - cpu_start.tv_nsec) / 1e9;
+        io_engine_print_usage(usage, uring_stats.enters, cpu_seconds, time_diff / 1e6);
+    }
+
+    results->test = CONTROL_TEST_UPLOAD;
+    results->bytes = total_bytes;
+    results->duration_us = time_diff;
+    results->tcp = tcp;
+    if (rx) {
+        char integrity[64];
+        snprintf(integrity, sizeof(integrity), "%s: Integrity", label);
+        integrity_print(integrity, &rx->stats);
+        results->integrity = rx->stats;
+        free(rx);
+    }
 }
 
-void handle_tcp_download(int client_sock) {
-    char *data = malloc(BUFFER_SIZE);
-    memset(data, 'A', BUFFER_SIZE);
+// Completes the block under way, so the trailer after a verified download starts on a boundary
+static int tcp_finish_block(int client_sock, integrity_tx_t *tx, long *total_bytes) {
+    int stalls = 0;
+    size_t left;
+    while ((left = integrity_tx_block_left(tx)) > 0) {
+        size_t len;
+        const char *data = integrity_tx_data(tx, left, &len);
+        long bytes = send(client_sock, data, len, MSG_NOSIGNAL);
+        if (bytes < 0 && errno == EINTR) continue;
+        // SO_SNDTIMEO is 1 s; a client that stops reading for longer gets no trailer
+        if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) && stalls++ < 3) continue;
+        if (bytes <= 0) return -1;
+        integrity_tx_advance(tx, bytes);
+        *total_bytes += bytes;
+        metrics_bytes(METRICS_TCP, 0, bytes);
+    }
+    return 0;
+}
+
+// Sends on one TCP stream for the requested duration; returns 1 if it ran to the end
+static int tcp_send(int client_sock, const control_header_t *header, const char *label,
+                    control_results_t *results) {
+    memset(results, 0, sizeof(*results));
+    // Verified payload is restamped for every pass, so it goes out with plain sends
+    int verify = (header->flags & CONTROL_FLAG_VERIFY) != 0;
+    int use_uring = server_options.io.engine == IO_ENGINE_URING && !verify;
+    integrity_tx_t tx;
+    if (verify && integrity_tx_init(&tx, tuning_write_size(header), (uint64_t)header->stream_id << 32) < 0) {
+        return 0;
+    }
+    zerocopy_sender_t sender;
+    if (zerocopy_sender_init(&sender, verify ? ZC_COPY : server_options.download_mode, client_sock) < 0) {
+        if (verify) integrity_tx_free(&tx);
+        return 0;
+    }
 
+    long total_bytes = 0;
     struct timeval start, end;
+    struct timespec cpu_start, cpu_end;
+    tcpinfo_summary_t tcp;
+    long next_sample_ms = 0;
+    memset(&tcp, 0, sizeof(tcp));
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_start);
     gettimeofday(&start, NULL);
-    while (1) {
-        if (send(client_sock, data, BUFFER_SIZE, 0) < 0) {
-            perror("Data send failed");
+    long limit = header->duration * 1000000L;
+    int finished = 0;
+    uring_stats_t uring_stats;
+    set_socket_timeout(client_sock, SO_SNDTIMEO, 1);
+    if (use_uring) {
+        // The ring sends the registered payload; the -z sender is not involved
+        uring_stream_t stream = { client_sock, 0, tuning_write_size(header), 0, 0, 0, 0 };
+        uring_limits_t limits = { NULL, limit / 1000, admission_deadline_ms(header) };
+        finished = uring_drive_streams(&stream, 1, &server_options.io, &limits, NULL, NULL, &uring_stats) == 0 &&
+                   !stream.failed;
+        total_bytes = stream.bytes;
+        metrics_bytes(METRICS_TCP, 0, total_bytes);
+    }
+    while (!use_uring) {
+        long bytes;
+        if (verify) {
+            size_t len;
+            const char *data = integrity_tx_data(&tx, tuning_write_size(header), &len);
+            bytes = send(client_sock, data, len, MSG_NOSIGNAL);
+            if (bytes > 0) integrity_tx_advance(&tx, bytes);
+        } else {
+            bytes = zerocopy_send(&sender, client_sock, tuning_write_size(header));
+        }
+        if (bytes < 0) {
+            if (errno == EINTR) continue;
+            if ((errno == EAGAIN || errno == EWOULDBLOCK) && !past_deadline(&start, header)) continue;
+            log_error("Data send failed: %m");
             break;
         }
+        total_bytes += bytes;
+        metrics_bytes(METRICS_TCP, 0, bytes);
+        tcpinfo_sample_due(client_sock, &tcp, &next_sample_ms);
+
+        gettimeofday(&end, NULL);
+        if (limit > 0 && (end.tv_sec - start.tv_sec) * 1000000L + (end.tv_usec - start.tv_usec) >= limit) {
+            finished = 1;
+            break;
+        }
+    }
+    if (verify) {
+        if (finished && tcp_finish_block(client_sock, &tx, &total_bytes) < 0) finished = 0;
+        integrity_tx_free(&tx);
     }
     gettimeofday(&end, NULL);
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_end);
+    tcpinfo_sample(client_sock, &tcp);
 
     long time_diff = (end.tv_sec - start.tv_sec) * 1000000L + (end.tv_usec - start.tv_usec);
-    printf("Download Test: Sent %ld bytes for %ld seconds\n", (long)BUFFER_SIZE * time_diff, time_diff);
+    double cpu_seconds = (cpu_end.tv_sec - cpu_start.tv_sec) + (cpu_end.tv_nsec - cpu_start.tv_nsec) / 1e9;
+    double mbps = time_diff > 0 ? (total_bytes * 8.0) / time_diff : 0.0;
+    printf("%s: Sent %ld bytes in %ld microseconds (~%.2f Mbps, %s, %.3f CPU s/GB)\n",
+           label, total_bytes, time_diff, mbps, use_uring ? io_engine_name(&server_options.io)
+           : verify ? "verified" : zerocopy_mode_name(server_options.download_mode),
+           zerocopy_cpu_per_gb(cpu_seconds, total_bytes));
+    if (use_uring) {
+        char usage[64];
+        snprintf(usage, sizeof(usage), "%s: io_uring engine", label);
+        io_engine_print_usage(usage, uring_stats.enters, cpu_seconds, time_diff / 1e6);
+    }
 
-    free(data);
+    zerocopy_sender_close(&sender, client_sock);
+
+    results->test = CONTROL_TEST_DOWNLOAD;
+    results->bytes = total_bytes;
+    results->duration_us = time_diff;
+    results->tcp = tcp;
+    return finished;
 }
 
-void handle_udp_upload(client_data_t* data) {
-    char buffer[BUFFER_SIZE];
-    long total_bytes = 0;
-    struct timeval start, end;
+void handle_tcp_upload(int client_sock, const control_header_t *header) {
+    control_results_t results;
+    tcp_receive(client_sock, header, "TCP Upload Test", &results);
+    tcpinfo_print_summary("TCP Upload Test: TCP_INFO", &results.tcp, results.duration_us / 1e6);
+    report_results("tcp_upload", header->stream_id, &results, 0);
+
+    // The client half-closed after its last write and is waiting for this
+    if (header->flags & CONTROL_FLAG_RESULTS) {
+        if (control_send_results(client_sock, &results, NULL, 0) < 0) {
+            log_error("Failed to send results: %m");
+        }
+    }
+}
+
+void handle_tcp_download(int client_sock, const control_header_t *header) {
+    control_results_t results;
+    int finished = tcp_send(client_sock, header, "Download Test", &results);
+    tcpinfo_print_summary("Download Test: TCP_INFO", &results.tcp, results.duration_us / 1e6);
+    report_results("tcp_download", header->stream_id, &results, 0);
+
+    // Trailer after the payload; the client reads up to EOF and keeps the tail
+    if (finished && (header->flags & CONTROL_FLAG_RESULTS)) {
+        if (control_send_results(client_sock, &results, NULL, 0) < 0) {
+            log_error("Failed to send results: %m");
+        }
+    }
+}
+
+typedef struct {
+    int sock;
+    const control_header_t *header;
+    int finished;
+    control_results_t results;
+} tcp_bidir_sender_t;
+
+static void *tcp_bidir_sender(void *arg) {
+    tcp_bidir_sender_t *sender = (tcp_bidir_sender_t*)arg;
+    sender->finished = tcp_send(sender->sock, sender->header, "TCP Bidir Test", &sender->results);
+    return NULL;
+}
+
+/*
+ * Both directions at once on one connection: a second thread sends for the
+ * requested duration while this one reads until the client half-closes.
+ * The trailer follows once both are done and carries the upload results;
+ * the client counts the download itself.
+ */
+void handle_tcp_bidir(int client_sock, const control_header_t *header) {
+    tcp_bidir_sender_t sender = { client_sock, header, 0, { 0 } };
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, tcp_bidir_sender, &sender) != 0) {
+        perror("Failed to create sender thread");
+        return;
+    }
+    control_results_t received;
+    tcp_receive(client_sock, header, "TCP Bidir Test", &received);
+    pthread_join(thread, NULL);
+
+    // Both threads sampled the same connection; the sender's view has the cwnd that matters
+    received.tcp = sender.results.tcp;
+    tcpinfo_print_summary("TCP Bidir Test: TCP_INFO", &sender.results.tcp, sender.results.duration_us / 1e6);
+    report_results("tcp_bidir", header->stream_id, &sender.results, 0);
+    report_results("tcp_bidir", header->stream_id, &received, 0);
+
+    if (sender.finished && (header->flags & CONTROL_FLAG_RESULTS)) {
+        if (control_send_results(client_sock, &received, NULL, 0) < 0) {
+            log_error("Failed to send results: %m");
+        }
+    }
+}
+
+// Counts datagrams until the client falls silent and fills `results` with what arrived
+static void udp_receive(client_data_t *data, udp_batch_t *batch, const char *label, const char *test,
+                        const char *direction, control_results_t *results) {
+    // The client signals nothing when it stops sending, so silence ends the
+    // test: 2 seconds of it, or a short drain once the announced duration is up
+    struct timeval timeout;
+    timeout.tv_sec = 0;
+    timeout.tv_usec = CONTROL_UDP_DRAIN_MS * 1000L;
+    setsockopt(data->sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    udp_seq_stats_t seq, prev;
+    udp_seq_init(&seq);
+    udp_seq_init(&prev);
+
+    struct timeval start, end, last_report;
     gettimeofday(&start, NULL);
+    last_report = end = start;
+    int iteration = 1;
 
     while (1) {
-        int bytes = recvfrom(data->sockfd, buffer, sizeof(buffer), 0,
-                             (struct sockaddr *)&data->client_addr, &data->addr_len);
-        if (bytes <= 0) {
-            // possibly timeout or client done
-            break;
+        long bytes = batch->bytes, packets = batch->packets;
+        if (udp_batch_recv(batch, data->sockfd, &seq) < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) break;
+
+            struct timeval now;
+            gettimeofday(&now, NULL);
+            long idle = (now.tv_sec - end.tv_sec)*1000000L+(now.tv_usec - end.tv_usec);
+            long elapsed = (now.tv_sec - start.tv_sec)*1000000L+(now.tv_usec - start.tv_usec);
+            if (idle >= 2000000L || elapsed >= data->header.duration * 1000000L) break;
+            continue;
+        }
+        metrics_bytes(METRICS_UDP, batch->bytes - bytes, 0);
+        metrics_packets(METRICS_UDP, batch->packets - packets, 0);
+        if (past_deadline(&start, &data->header)) break;
+        gettimeofday(&end, NULL);
+        long since = (end.tv_sec - last_report.tv_sec)*1000000L+(end.tv_usec - last_report.tv_usec);
+        if (since >= 1000000L) {
+            char interval[48];
+            snprintf(interval, sizeof(interval), "UDP Interval %d", iteration++);
+            report_udp("interval", test, "server", direction,
+                       ((last_report.tv_sec - start.tv_sec)*1000000L + (last_report.tv_usec - start.tv_usec)) / 1e6,
+                       ((end.tv_sec - start.tv_sec)*1000000L + (end.tv_usec - start.tv_usec)) / 1e6, &seq, &prev);
+            udp_seq_report(interval, &seq, &prev, since / 1e6);
+            last_report = end;
         }
-        total_bytes += bytes;
     }
 
-    gettimeofday(&end, NULL);
+    // `end` is the last arrival, so the idle timeout is not counted
     long time_diff = (end.tv_sec - start.tv_sec)*1000000L+(end.tv_usec - start.tv_usec);
     double mbps = 0.0;
     if (time_diff > 0) {
-        mbps = (total_bytes * 8.0) / time_diff;
+        mbps = (batch->bytes * 8.0) / time_diff;
     }
-    printf("UDP Upload Test: Received %ld bytes in %ld microseconds (~%.2f Mbps)\n",
-           total_bytes, time_diff, mbps);
-    free(data);
+    printf("%s: Received %ld bytes in %ld microseconds (~%.2f Mbps, %.0f packets/s, %.0f syscalls/s)\n",
+           label, batch->bytes, time_diff, mbps,
+           time_diff > 0 ? batch->packets * 1e6 / time_diff : 0.0,
+           time_diff > 0 ? batch->syscalls * 1e6 / time_diff : 0.0);
+    udp_seq_init(&prev);
+    udp_seq_report(label, &seq, &prev, time_diff / 1e6);
+
+    memset(results, 0, sizeof(*results));
+    results->test = CONTROL_TEST_UPLOAD;
+    results->duration_us = time_diff;
+    control_results_from_seq(results, &seq);
 }
 
-void handle_udp_download(client_data_t* data) {
-    char *packet = malloc(BUFFER_SIZE);
-    memset(packet, 'A', BUFFER_SIZE);
+// Sends paced datagrams to the client for the requested duration
+static void udp_send(client_data_t *data, udp_batch_t *batch, const char *label, control_results_t *results) {
+    udp_pacer_t pacer;
+    udp_pacer_init(&pacer, batch->opt.rate, udp_batch_bytes(batch));
+    uint64_t sequence = 0;
 
     struct timeval start, now;
     gettimeofday(&start, NULL);
+    long elapsed = 0;
     while (1) {
-        if (sendto(data->sockfd, packet, BUFFER_SIZE, 0,
-                   (struct sockaddr*)&data->client_addr, data->addr_len) < 0) {
-            perror("UDP send failed");
+        udp_pacer_wait(&pacer, udp_batch_bytes(batch));
+        long bytes = batch->bytes, packets = batch->packets;
+        if (udp_batch_send(batch, data->sockfd, &data->client_addr, data->addr_len, &sequence) < 0) {
+            log_error("UDP send failed: %m");
             break;
         }
+        metrics_bytes(METRICS_UDP, 0, batch->bytes - bytes);
+        metrics_packets(METRICS_UDP, 0, batch->packets - packets);
         gettimeofday(&now, NULL);
-        long elapsed = (now.tv_sec - start.tv_sec)*1000000L+(now.tv_usec - start.tv_usec);
-        if (elapsed > 5000000L) { // 5 seconds
+        elapsed = (now.tv_sec - start.tv_sec)*1000000L+(now.tv_usec - start.tv_usec);
+        if (elapsed > data->header.duration * 1000000L) {
             break;
         }
     }
 
-    printf("UDP Download Test completed sending.\n");
-    free(packet);
+    printf("%s completed sending (%.0f packets/s, %.0f syscalls/s).\n", label,
+           elapsed > 0 ? batch->packets * 1e6 / elapsed : 0.0,
+           elapsed > 0 ? batch->syscalls * 1e6 / elapsed : 0.0);
+
+    memset(results, 0, sizeof(*results));
+    results->test = CONTROL_TEST_DOWNLOAD;
+    results->bytes = batch->bytes;
+    results->packets = sequence;
+    results->duration_us = elapsed;
+}
+
+void handle_udp_upload(client_data_t* data) {
+    udp_batch_t batch;
+    if (udp_batch_init(&batch, &server_options.udp, 1) < 0 ||
+        udp_batch_configure_socket(data->sockfd, &server_options.udp, 1) < 0) {
+        free(data);
+        return;
+    }
+
+    control_results_t results;
+    udp_receive(data, &batch, "UDP Upload Test", "udp_upload", NULL, &results);
+    report_results("udp_upload", 0, &results, 1);
+
+    if (data->header.flags & CONTROL_FLAG_RESULTS) {
+        if (control_send_results(data->sockfd, &results, (struct sockaddr*)&data->client_addr, data->addr_len) < 0) {
+            log_error("Failed to send results: %m");
+        }
+    }
+    udp_batch_free(&batch);
+    free(data);
+}
+
+void handle_udp_download(client_data_t* data) {
+    udp_batch_options_t opt;
+    udp_batch_options_for(&opt, &server_options.udp, &data->header);
+    udp_batch_t batch;
+    if (udp_batch_init(&batch, &opt, 0) < 0 ||
+        udp_batch_configure_socket(data->sockfd, &opt, 0) < 0) {
+        free(data);
+        return;
+    }
+
+    control_results_t results;
+    udp_send(data, &batch, "UDP Download Test", &results);
+    report_results("udp_download", 0, &results, 0);
+
+    if (data->header.flags & CONTROL_FLAG_RESULTS) {
+        // Sent after a pause so it trails the data the client is still counting
+        struct timespec drain = { 0, CONTROL_UDP_DRAIN_MS * 1000000L };
+        nanosleep(&drain, NULL);
+
+        if (control_send_results(data->sockfd, &results, (struct sockaddr*)&data->client_addr, data->addr_len) < 0) {
+            log_error("Failed to send results: %m");
+        }
+    }
+    udp_batch_free(&batch);
+    free(data);
+}
+
+typedef struct {
+    client_data_t *data;
+    udp_batch_t batch;
+    control_results_t results;
+} udp_bidir_sender_t;
+
+static void *udp_bidir_sender(void *arg) {
+    udp_bidir_sender_t *sender = (udp_bidir_sender_t*)arg;
+    udp_send(sender->data, &sender->batch, "UDP Bidir Test", &sender->results);
+    return NULL;
+}
+
+/*
+ * Both directions at once on one session socket: a second thread sends
+ * while this one counts the client's datagrams. Once the client falls
+ * silent both results blocks go back, the download's first; each is tagged
+ * with the direction it measures.
+ */
+void handle_udp_bidir(client_data_t* data) {
+    udp_batch_t batch;
+    udp_bidir_sender_t sender;
+    sender.data = data;
+    udp_batch_options_t opt;
+    udp_batch_options_for(&opt, &server_options.udp, &data->header);
+    if (udp_batch_init(&batch, &server_options.udp, 1) < 0) {
+        free(data);
+        return;
+    }
+    if (udp_batch_init(&sender.batch, &opt, 0) < 0 ||
+        udp_batch_configure_socket(data->sockfd, &opt, 0) < 0 ||
+        udp_batch_configure_socket(data->sockfd, &server_options.udp, 1) < 0) {
+        udp_batch_free(&batch);
+        free(data);
+        return;
+    }
+
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, udp_bidir_sender, &sender) != 0) {
+        perror("Failed to create sender thread");
+        udp_batch_free(&sender.batch);
+        udp_batch_free(&batch);
+        free(data);
+        return;
+    }
+    control_results_t received;
+    udp_receive(data, &batch, "UDP Bidir Test", "udp_bidir", "up", &received);
+    pthread_join(thread, NULL);
+    report_results("udp_bidir", 0, &sender.results, 0);
+    report_results("udp_bidir", 0, &received, 1);
+
+    if (data->header.flags & CONTROL_FLAG_RESULTS) {
+        if (control_send_results(data->sockfd, &sender.results,
+                                 (struct sockaddr*)&data->client_addr, data->addr_len) < 0 ||
+            control_send_results(data->sockfd, &received,
+                                 (struct sockaddr*)&data->client_addr, data->addr_len) < 0) {
+            log_error("Failed to send results: %m");
+        }
+    }
+    udp_batch_free(&sender.batch);
+    udp_batch_free(&batch);
     free(data);
 }
 
 void handle_ping(client_data_t* data) {
-    int packet_size;
-    int len = recvfrom(data->sockfd, &packet_size, sizeof(packet_size), 0,
-                       (struct sockaddr *)&data->client_addr, &data->addr_len);
-    if (len < 0) {
-        perror("Receive failed");
+    int packet_size = data->header.buffer_size;
+    if (packet_size <= 0 || packet_size > BUFFER_SIZE) {
+        log_warn("Invalid ping packet size: %d", packet_size);
+        free(data);
+        return;
+    }
+    // Room for a results request even when probes are smaller than one
+    if (packet_size < (int)sizeof(struct control_header)) packet_size = sizeof(struct control_header);
+
+    // Pipelined clients normally end with a results request; silence ends the rest
+    long idle_ms = control_ping_idle_ms(&data->header);
+    struct timeval timeout;
+    timeout.tv_sec = idle_ms / 1000;
+    timeout.tv_usec = idle_ms % 1000 * 1000;
+    setsockopt(data->sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    // Echo whatever has queued up in one recvmmsg/sendmmsg pair so the echo
+    // keeps pace with clients that have many probes in flight
+    struct mmsghdr msgs[PING_ECHO_BATCH];
+    struct iovec iov[PING_ECHO_BATCH];
+    struct sockaddr_in peers[PING_ECHO_BATCH];
+    char *buffers = malloc((size_t)packet_size * PING_ECHO_BATCH);
+    if (!buffers) {
+        perror("Malloc failed");
         free(data);
         return;
     }
+    memset(msgs, 0, sizeof(msgs));
 
-    char buffer[packet_size];
-    while (1) {
-        memset(buffer, 0, packet_size);
-        len = recvfrom(data->sockfd, buffer, packet_size, 0,
-                       (struct sockaddr *)&data->client_addr, &data->addr_len);
-        if (len <= 0) {
+    control_results_t results;
+    memset(&results, 0, sizeof(results));
+    results.test = CONTROL_TEST_PING;
+    int done = 0;
+    struct timeval start;
+    gettimeofday(&start, NULL);
+
+    while (!done && !past_deadline(&start, &data->header)) {
+        for (int i = 0; i < PING_ECHO_BATCH; i++) {
+            iov[i].iov_base = buffers + (size_t)i * packet_size;
+            iov[i].iov_len = packet_size;
+            msgs[i].msg_hdr.msg_iov = &iov[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+            msgs[i].msg_hdr.msg_name = &peers[i];
+            msgs[i].msg_hdr.msg_namelen = sizeof(peers[i]);
+        }
+
+        int count = recvmmsg(data->sockfd, msgs, PING_ECHO_BATCH, MSG_WAITFORONE, NULL);
+        if (count <= 0) {
+            if (count < 0 && errno == EINTR) continue;
             break;
         }
 
-        if (sendto(data->sockfd, buffer, len, 0,
-                   (struct sockaddr *)&data->client_addr, data->addr_len) < 0) {
-            perror("Send failed");
+        // A results request ends the test; nothing after it needs an echo
+        control_header_t request;
+        metrics_packets(METRICS_UDP, count, 0);
+        long echoed = 0;
+        for (int i = 0; i < count; i++) {
+            if (control_decode_header(iov[i].iov_base, msgs[i].msg_len, &request) == 0 &&
+                request.test == CONTROL_TEST_RESULTS) {
+                count = i;
+                done = 1;
+                break;
+            }
+            iov[i].iov_len = msgs[i].msg_len;
+            echoed += msgs[i].msg_len;
+        }
+        results.bytes += echoed;
+        results.packets += count;
+        metrics_bytes(METRICS_UDP, echoed, 0);
+        if (count > 0 && sendmmsg(data->sockfd, msgs, count, 0) < 0) {
+            log_error("Send failed: %m");
             break;
         }
+        metrics_bytes(METRICS_UDP, 0, echoed);
+        metrics_packets(METRICS_UDP, 0, count);
     }
 
-    printf("Ping test ended.\n");
+    if (done) {
+        if (control_send_results(data->sockfd, &results, (struct sockaddr*)&data->client_addr, data->addr_len) < 0) {
+            log_error("Failed to send results: %m");
+        }
+    }
+    printf("Ping test ended (%llu probes echoed).\n", (unsigned long long)results.packets);
+    report_results("ping", 0, &results, 0);
+    free(buffers);
     free(data);
 }
 
 static void *handle_udp_client(void* arg) {
     client_data_t* client_data = (client_data_t*)arg;
-    printf("Client connected (UDP dedicated socket)\n");
+    int ticket = client_data->ticket;
+    int sock = client_data->sockfd;
+    log_info("Client connected (UDP dedicated socket)");
 
     // Now we can safely send ack from this dedicated socket
-    if (sendto(client_data->sockfd, "ack", 4, 0, 
-               (struct sockaddr*)&client_data->client_addr, client_data->addr_len) < 0) {
-        perror("Send Ack failed");
+    if (control_send_reply(client_data->sockfd, CONTROL_ACCEPT, 0,
+                           (struct sockaddr*)&client_data->client_addr, client_data->addr_len) < 0) {
+        log_error("Send Ack failed: %m");
+        metrics_failure(METRICS_FAIL_SETUP);
+        close(sock);
         free(client_data);
+        admission_release(ticket);
         return NULL;
     }
 
-    if (strcmp(client_data->test, "upload") == 0) {
-        handle_udp_upload(client_data);
-    } else if (strcmp(client_data->test, "download") == 0) {
-        handle_udp_download(client_data);
-    } else if (strcmp(client_data->test, "ping") == 0) {
-        handle_ping(client_data);
-    } else {
-        printf("Unknown test type: %s\n", client_data->test);
-        free(client_data);
+    // The handlers free client_data
+    control_test_t test = client_data->header.test;
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    metrics_session_start(METRICS_UDP, test);
+    switch (test) {
+        case CONTROL_TEST_UPLOAD: handle_udp_upload(client_data); break;
+        case CONTROL_TEST_DOWNLOAD: handle_udp_download(client_data); break;
+        case CONTROL_TEST_PING: handle_ping(client_data); break;
+        case CONTROL_TEST_BIDIR: handle_udp_bidir(client_data); break;
+        default:
+            log_warn("Unknown test type: %s", control_test_name(client_data->header.test));
+            free(client_data);
     }
 
+    // The handlers free client_data but leave the session socket to us
+    metrics_session_end(METRICS_UDP, test, seconds_since(&start));
+    close(sock);
+    admission_release(ticket);
     return NULL; 
 }
 
 static void *handle_tcp_client(void* arg) {
     int client_sock = *((int*)arg);
     free(arg);
-    printf("TCP Client connected\n");
-
-    char test_type[32]; 
-    memset(test_type, 0, sizeof(test_type));
-    int bytes_received = recv(client_sock, test_type, sizeof(test_type) - 1, 0);
-    if (bytes_received <= 0) {
-        perror("Error reading test type");
+    log_info("TCP Client connected");
+
+    // No deadline or ticket covers a session yet, so bound the wait for its header
+    control_header_t header;
+    set_socket_timeout(client_sock, SO_RCVTIMEO, HEADER_TIMEOUT_SECONDS);
+    errno = 0;
+    if (control_recv_header(client_sock, &header) < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            log_warn("No control header within %d s", HEADER_TIMEOUT_SECONDS);
+        } else {
+            log_warn("Invalid control header");
+        }
+        metrics_failure(METRICS_FAIL_HEADER);
         close(client_sock);
         return NULL;
     }
-
-    test_type[bytes_received] = '\0';
-
-    if (strcmp(test_type, "upload") == 0) {
-        handle_tcp_upload(client_sock);
-    } else if (strcmp(test_type, "download") == 0) {
-        handle_tcp_download(client_sock);
+    set_socket_timeout(client_sock, SO_RCVTIMEO, 0);
+    if (header.test != CONTROL_TEST_UPLOAD && header.test != CONTROL_TEST_DOWNLOAD &&
+        header.test != CONTROL_TEST_BIDIR) {
+        log_warn("Unknown TCP test type: %s", control_test_name(header.test));
+        metrics_failure(METRICS_FAIL_UNSUPPORTED);
+        close(client_sock);
+        return NULL;
+    }
+    tuning_options_t tuning;
+    char description[128];
+    tuning_from_header(&header, &tuning);
+    tuning_describe(&tuning, description, sizeof(description));
+    log_info("TCP %s: stream %d/%d, %d seconds, %s", control_test_name(header.test),
+             header.stream_id, header.streams, header.duration, description);
+    tuning_apply(client_sock, &tuning);
+
+    int retry_after_ms;
+    int ticket = admission_acquire(&header, &retry_after_ms);
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (control_send_reply(client_sock, ticket ? CONTROL_ACCEPT : CONTROL_BUSY, retry_after_ms, NULL, 0) < 0) {
+        log_error("Failed to send reply: %m");
+        metrics_failure(METRICS_FAIL_SETUP);
+    } else if (!ticket) {
+        metrics_failure(METRICS_FAIL_BUSY);
     } else {
-        printf("Unknown TCP test type: %s\n", test_type);
+        metrics_session_start(METRICS_TCP, header.test);
+        if (header.test == CONTROL_TEST_UPLOAD) {
+            handle_tcp_upload(client_sock, &header);
+        } else if (header.test == CONTROL_TEST_BIDIR) {
+            handle_tcp_bidir(client_sock, &header);
+        } else {
+            handle_tcp_download(client_sock, &header);
+        }
+        metrics_session_end(METRICS_TCP, header.test, seconds_since(&start));
     }
+    admission_release(ticket);
 
     close(client_sock);
-    printf("TCP Client disconnected\n");
+    log_info("TCP Client disconnected");
     return NULL;
 }
 
@@ -284,7 +864,7 @@ static void *start_tcp_thread(void* arg) {
     while (1) {
         int client_sock = accept(server_sock, (struct sockaddr*)&client_addr, &addr_size);
         if (client_sock < 0) {
-            perror("Accept failed");
+            log_error("Accept failed: %m");
             continue;
         }
 
@@ -316,22 +896,35 @@ static void *start_udp_thread(void* arg) {
         client_data->sockfd = server_sock; // temporarily
         client_data->addr_len = sizeof(client_data->client_addr);
 
-        memset(client_data->test, 0, sizeof(client_data->test));
-        int len = recvfrom(server_sock, client_data->test, sizeof(client_data->test)-1, 0,
+        struct control_header request;
+        int len = recvfrom(server_sock, &request, sizeof(request), 0,
                            (struct sockaddr *)&client_data->client_addr, &client_data->addr_len);
         if (len < 0) {
-            perror("Receive failed");
+            log_error("Receive failed: %m");
+            free(client_data);
+            continue;
+        }
+        if (control_decode_header(&request, len, &client_data->header) < 0) {
+            log_warn("Invalid control header");
+            metrics_failure(METRICS_FAIL_HEADER);
+            free(client_data);
+            continue;
+        }
+        log_info("UDP request: %s", control_test_name(client_data->header.test));
+        control_test_t test = client_data->header.test;
+        if (test != CONTROL_TEST_UPLOAD && test != CONTROL_TEST_DOWNLOAD && test != CONTROL_TEST_PING &&
+            test != CONTROL_TEST_BIDIR) {
+            log_warn("Unknown test type: %s", control_test_name(test));
+            metrics_failure(METRICS_FAIL_UNSUPPORTED);
             free(client_data);
             continue;
         }
-
-        client_data->test[len] = '\0';
-        printf("UDP request: %s\n", client_data->test);
 
         // Create a new socket for this client
         int client_sock = socket(AF_INET, SOCK_DGRAM, 0);
         if (client_sock < 0) {
-            perror("Failed to create client-specific UDP socket");
+            log_error("Failed to create client-specific UDP socket: %m");
+            metrics_failure(METRICS_FAIL_SETUP);
             free(client_data);
             continue;
         }
@@ -343,7 +936,8 @@ static void *start_udp_thread(void* arg) {
         temp_addr.sin_addr.s_addr = INADDR_ANY;
 
         if (bind(client_sock, (struct sockaddr*)&temp_addr, sizeof(temp_addr)) < 0) {
-            perror("Bind failed for client-specific socket");
+            log_error("Bind failed for client-specific socket: %m");
+            metrics_failure(METRICS_FAIL_SETUP);
             close(client_sock);
             free(client_data);
             continue;
@@ -351,7 +945,8 @@ static void *start_udp_thread(void* arg) {
 
         socklen_t temp_len = sizeof(temp_addr);
         if (getsockname(client_sock, (struct sockaddr*)&temp_addr, &temp_len) < 0) {
-            perror("getsockname failed");
+            log_error("getsockname failed: %m");
+            metrics_failure(METRICS_FAIL_SETUP);
             close(client_sock);
             free(client_data);
             continue;
@@ -359,10 +954,24 @@ static void *start_udp_thread(void* arg) {
 
         unsigned short new_port = ntohs(temp_addr.sin_port);
 
+        // Over a limit the busy reply takes the place of the port
+        int retry_after_ms;
+        client_data->ticket = admission_acquire(&client_data->header, &retry_after_ms);
+        if (!client_data->ticket) {
+            control_send_reply(server_sock, CONTROL_BUSY, retry_after_ms,
+                               (struct sockaddr*)&client_data->client_addr, client_data->addr_len);
+            metrics_failure(METRICS_FAIL_BUSY);
+            close(client_sock);
+            free(client_data);
+            continue;
+        }
+
         // Send the new port number to the client so it knows where to send subsequent packets
         if (sendto(server_sock, &new_port, sizeof(new_port), 0,
                    (struct sockaddr*)&client_data->client_addr, client_data->addr_len) < 0) {
-            perror("Failed to send new port");
+            log_error("Failed to send new port: %m");
+            metrics_failure(METRICS_FAIL_SETUP);
+            admission_release(client_data->ticket);
             close(client_sock);
             free(client_data);
             continue;
@@ -374,6 +983,8 @@ static void *start_udp_thread(void* arg) {
         pthread_t thread_id;
         if (pthread_create(&thread_id, NULL, &handle_udp_client, client_data) != 0) {
             perror("Thread creation failed");
+            metrics_failure(METRICS_FAIL_SETUP);
+            admission_release(client_data->ticket);
             close(client_sock);
             free(client_data);
             continue;
@@ -385,7 +996,19 @@ static void *start_udp_thread(void* arg) {
     return NULL;
 }
 
-void start_server(int port) {
+void start_server(const server_options_t *options) {
+    server_options = *options;
+    admission_init(&options->admission);
+    int port = options->port;
+    if (zerocopy_init_payload(TUNING_MAX_WRITE) < 0) {
+        exit(EXIT_FAILURE);
+    }
+    // sendfile and splice have no MSG_NOSIGNAL; a client hanging up must not kill the server
+    signal(SIGPIPE, SIG_IGN);
+    if (options->metrics_port > 0 && metrics_start(options->metrics_port) < 0) {
+        exit(EXIT_FAILURE);
+    }
+
     int udp_sock = create_socket(SOCK_DGRAM, port);
     int tcp_sock = create_socket(SOCK_STREAM, port);
 
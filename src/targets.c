@@ -0,0 +1,861 @@
+#include "../include/targets.h"
+#include "../include/control.h"
+#include "../include/histogram.h"
+#include "../include/probe.h"
+#include "../include/report.h"
+#include "../include/shared.h"
+#include "../include/udp_flow.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <endian.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+/*
+ * Multi-target runs: one client measuring many servers from a single thread.
+ * Targets are split into waves of at most `parallel`. Every target in a wave
+ * is connected and admitted first, then all of them start on one clock and
+ * are driven from one epoll loop with non-blocking sockets, so no target gets
+ * a head start and a slow one cannot hold the others up. A timerfd in the
+ * same loop ticks the shared report interval. Each wave ends when its last
+ * target finishes or gives up; the next wave starts after it.
+ */
+
+#define TARGET_EVENTS 256
+#define TARGET_IO_BURST 16          // send/recv calls per readiness event, so no target starves the rest
+#define TARGET_PING_RING 4096       // ping probes in flight per target, power of two
+#define TARGET_MAX_PROBE 65507      // the UDP payload limit
+#define TARGET_RECV_SIZE 65536      // at least the largest ping datagram
+
+typedef enum {
+    CONN_SENDING,               // upload payload until the target's end time
+    CONN_RESULTS,               // half-closed, reading the server's results block
+    CONN_RECEIVING,             // download payload until the server closes after its trailer
+    CONN_PING,                  // probes out, echoes and then the results block in
+    CONN_DONE
+} conn_state_t;
+
+typedef struct target target_t;
+
+typedef struct {
+    target_t *target;
+    int fd;
+    conn_state_t state;
+    long bytes;                 // payload sent or received; a download's includes the trailer
+    char tail[sizeof(struct control_results)];
+    size_t tail_fill;           // upload: results bytes read so far
+    int have_results;
+    control_results_t results;
+} target_conn_t;
+
+typedef struct {
+    uint64_t seq;
+    int64_t sent_ns;            // 0 once answered
+} target_probe_t;
+
+struct target {
+    target_spec_t spec;
+    int id;                     // 1-based, in file order
+    char name[32];              // address:port, the record's target field
+    char label[64];             // prefix of every text line
+    target_conn_t *conn;
+    int conns;
+    int active;                 // connections not yet done
+    int opened;                 // connected and admitted
+    int failed;
+    int64_t start_ns;
+    int64_t end_ns;             // upload: when senders stop; ping: when the last probe is due
+    int64_t deadline_ns;        // whatever is still open then is abandoned
+    int64_t finish_ns;
+    long last_bytes;            // at the previous interval
+
+    // Ping only
+    char *probe;
+    target_probe_t *ring;
+    long sent, received, late, duplicates;
+    long last_received;
+    double interval_rtt_sum;
+    int64_t interval_ns;
+    int64_t next_send_ns;
+    int64_t results_ns;         // when to ask for the results block
+    int results_requested;
+    histogram_t *rtt;
+};
+
+typedef struct {
+    char *send_buffer;
+    char *recv_buffer;
+    int epfd;
+    int64_t start_ns;
+    double last_report;
+} target_loop_t;
+
+static const char *tests[] = { "tcp_upload", "tcp_download", "ping" };
+
+static int64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+const char *target_test_name(target_test_t test) {
+    static const char *names[] = { "upload", "download", "ping" };
+    return names[test];
+}
+
+static int parse_key(target_spec_t *spec, const char *key, const char *value) {
+    char *end;
+    if (strcmp(key, "duration") == 0) {
+        spec->duration = (int)strtol(value, &end, 10);
+        return *end || spec->duration < 1 ? -1 : 0;
+    }
+    if (strcmp(key, "streams") == 0) {
+        spec->streams = (int)strtol(value, &end, 10);
+        return *end || spec->streams < 1 || spec->streams > TARGET_MAX_STREAMS ? -1 : 0;
+    }
+    if (strcmp(key, "write") == 0) {
+        spec->write_size = tuning_parse_size(value);
+        return spec->write_size < 1 || spec->write_size > TUNING_MAX_WRITE ? -1 : 0;
+    }
+    if (strcmp(key, "count") == 0) {
+        spec->count = strtol(value, &end, 10);
+        return *end || spec->count < 1 ? -1 : 0;
+    }
+    if (strcmp(key, "interval") == 0) {
+        spec->interval = strtod(value, &end);
+        return *end || spec->interval <= 0 ? -1 : 0;
+    }
+    if (strcmp(key, "size") == 0) {
+        spec->size = (int)strtol(value, &end, 10);
+        return *end || spec->size < 1 || spec->size > TARGET_MAX_PROBE ? -1 : 0;
+    }
+    return -1;
+}
+
+static int parse_line(char *line, const target_spec_t *defaults, target_spec_t *spec) {
+    char *save;
+    char *where = strtok_r(line, " \t\r\n", &save);
+    char *test = strtok_r(NULL, " \t\r\n", &save);
+    if (!test) return -1;
+
+    *spec = *defaults;
+    char *colon = strrchr(where, ':');
+    if (colon) {
+        *colon = '\0';
+        char *end;
+        spec->port = (int)strtol(colon + 1, &end, 10);
+        if (*end || spec->port < 1 || spec->port > 65535) return -1;
+    }
+    struct in_addr addr;
+    if (inet_pton(AF_INET, where, &addr) <= 0) return -1;
+    snprintf(spec->address, sizeof(spec->address), "%s", where);
+
+    if (strcasecmp(test, "upload") == 0) spec->test = TARGET_UPLOAD;
+    else if (strcasecmp(test, "download") == 0) spec->test = TARGET_DOWNLOAD;
+    else if (strcasecmp(test, "ping") == 0) spec->test = TARGET_PING;
+    else return -1;
+
+    for (char *item = strtok_r(NULL, " \t\r\n", &save); item; item = strtok_r(NULL, " \t\r\n", &save)) {
+        char *eq = strchr(item, '=');
+        if (!eq) return -1;
+        *eq = '\0';
+        if (parse_key(spec, item, eq + 1) < 0) return -1;
+    }
+    // Probes carry a struct packet header, so they cannot be smaller than it
+    if (spec->size < (int)sizeof(struct packet)) spec->size = sizeof(struct packet);
+    return 0;
+}
+
+// Returns the number of targets read into a malloc'd *specs, or -1 with a message
+int targets_parse_file(const char *path, const target_spec_t *defaults, target_spec_t **specs) {
+    FILE *file = fopen(path, "r");
+    if (!file) {
+        perror("Failed to open target file");
+        return -1;
+    }
+
+    int count = 0, capacity = 0, line_number = 0, ok = 1;
+    target_spec_t *list = NULL;
+    char line[512];
+    while (ok && fgets(line, sizeof(line), file)) {
+        line_number++;
+        char *comment = strchr(line, '#');
+        if (comment) *comment = '\0';
+        if (strspn(line, " \t\r\n") == strlen(line)) continue;
+
+        if (count == TARGETS_MAX) {
+            fprintf(stderr, "%s:%d: more than %d targets\n", path, line_number, TARGETS_MAX);
+            ok = 0;
+        } else if (count == capacity) {
+            capacity = capacity ? 2 * capacity : 16;
+            target_spec_t *grown = realloc(list, capacity * sizeof(*list));
+            if (!grown) perror("Malloc failed");
+            else list = grown;
+            ok = grown != NULL;
+        }
+        if (ok && parse_line(line, defaults, &list[count]) < 0) {
+            fprintf(stderr, "%s:%d: expected \"address[:port] upload|download|ping [key=value ...]\"\n",
+                    path, line_number);
+            ok = 0;
+        }
+        if (ok) list[count++].line = line_number;
+    }
+    fclose(file);
+    if (ok && count == 0) {
+        fprintf(stderr, "%s: no targets\n", path);
+        ok = 0;
+    }
+    if (!ok) {
+        free(list);
+        return -1;
+    }
+    *specs = list;
+    return count;
+}
+
+static void target_fail(target_t *t, const char *what) {
+    if (!t->failed) printf("%s failed: %s\n", t->label, what);
+    t->failed = 1;
+}
+
+static int set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags < 0 ? -1 : fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+static int socket_with_timeouts(int type) {
+    int sock = socket(AF_INET, type, 0);
+    if (sock < 0) return -1;
+    struct timeval timeout = { TARGET_CONNECT_TIMEOUT_MS / 1000, (TARGET_CONNECT_TIMEOUT_MS % 1000) * 1000 };
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    return sock;
+}
+
+static void target_address(const target_t *t, struct sockaddr_in *addr) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(t->spec.port);
+    inet_pton(AF_INET, t->spec.address, &addr->sin_addr);
+}
+
+// Connects every stream and sends its header, then waits for every admission
+static int target_open_tcp(target_t *t, const tuning_options_t *base) {
+    tuning_options_t tuning = *base;
+    tuning.write_size = t->spec.write_size;
+    struct sockaddr_in addr;
+    target_address(t, &addr);
+
+    for (int i = 0; i < t->conns; i++) {
+        target_conn_t *c = &t->conn[i];
+        c->fd = socket_with_timeouts(SOCK_STREAM);
+        if (c->fd < 0) {
+            target_fail(t, strerror(errno));
+            return -1;
+        }
+        tuning_apply(c->fd, &tuning);
+        if (connect(c->fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+            target_fail(t, strerror(errno));
+            return -1;
+        }
+        control_header_t header;
+        control_header_init(&header, t->spec.test == TARGET_UPLOAD ? CONTROL_TEST_UPLOAD : CONTROL_TEST_DOWNLOAD,
+                             t->spec.duration, BUFFER_SIZE);
+        tuning_to_header(&tuning, &header);
+        header.streams = t->conns;
+        header.stream_id = i + 1;
+        if (control_send_header(c->fd, &header, NULL, 0) < 0) {
+            target_fail(t, "could not send the test header");
+            return -1;
+        }
+    }
+    for (int i = 0; i < t->conns; i++) {
+        int retry_after_ms;
+        int status = control_recv_reply(t->conn[i].fd, &retry_after_ms);
+        if (status == CONTROL_BUSY) {
+            char what[64];
+            snprintf(what, sizeof(what), "server busy, retry after %d ms", retry_after_ms);
+            target_fail(t, what);
+            return -1;
+        } else if (status == CONTROL_UNSUPPORTED) {
+            target_fail(t, "server does not support this test");
+            return -1;
+        } else if (status != CONTROL_ACCEPT) {
+            target_fail(t, "no reply from server");
+            return -1;
+        }
+        t->conn[i].state = t->spec.test == TARGET_UPLOAD ? CONN_SENDING : CONN_RECEIVING;
+    }
+    return 0;
+}
+
+// The UDP handshake: header to the listener, session port back, then the session's ack
+static int target_open_ping(target_t *t) {
+    target_conn_t *c = &t->conn[0];
+    struct sockaddr_in addr;
+    target_address(t, &addr);
+    c->fd = socket_with_timeouts(SOCK_DGRAM);
+    if (c->fd < 0) {
+        target_fail(t, strerror(errno));
+        return -1;
+    }
+
+    control_header_t header;
+    control_header_init(&header, CONTROL_TEST_PING, (int)t->spec.count, t->spec.size);
+    control_header_set_interval(&header, t->spec.interval);
+    if (control_send_header(c->fd, &header, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        target_fail(t, strerror(errno));
+        return -1;
+    }
+
+    struct control_reply reply;
+    int retry_after_ms;
+    unsigned short new_port;
+    long len = recv(c->fd, &reply, sizeof(reply), 0);
+    if (len <= 0) {
+        target_fail(t, "no reply from server");
+        return -1;
+    }
+    if (control_decode_reply(&reply, len, &retry_after_ms) == CONTROL_BUSY) {
+        char what[64];
+        snprintf(what, sizeof(what), "server busy, retry after %d ms", retry_after_ms);
+        target_fail(t, what);
+        return -1;
+    }
+    if (len != sizeof(new_port)) {
+        target_fail(t, "unexpected reply from server");
+        return -1;
+    }
+    memcpy(&new_port, &reply, sizeof(new_port));
+    addr.sin_port = htons(new_port);
+    if (connect(c->fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        target_fail(t, strerror(errno));
+        return -1;
+    }
+    len = recv(c->fd, &reply, sizeof(reply), 0);
+    if (len <= 0 || control_decode_reply(&reply, len, &retry_after_ms) != CONTROL_ACCEPT) {
+        target_fail(t, "no ack from server");
+        return -1;
+    }
+
+    t->probe = calloc(1, t->spec.size);
+    t->ring = calloc(TARGET_PING_RING, sizeof(target_probe_t));
+    t->rtt = malloc(sizeof(histogram_t));
+    if (!t->probe || !t->ring || !t->rtt) {
+        target_fail(t, "out of memory");
+        return -1;
+    }
+    histogram_reset(t->rtt);
+    c->state = CONN_PING;
+    return 0;
+}
+
+static int target_init(target_t *t, const target_spec_t *spec, int id) {
+    memset(t, 0, sizeof(*t));
+    t->spec = *spec;
+    t->id = id;
+    snprintf(t->name, sizeof(t->name), "%s:%d", spec->address, spec->port);
+    snprintf(t->label, sizeof(t->label), "[T%d %s %s]", id, t->name, target_test_name(spec->test));
+    t->conns = spec->test == TARGET_PING ? 1 : spec->streams;
+    t->conn = calloc(t->conns, sizeof(target_conn_t));
+    if (!t->conn) {
+        perror("Malloc failed");
+        return -1;
+    }
+    for (int i = 0; i < t->conns; i++) {
+        t->conn[i].target = t;
+        t->conn[i].fd = -1;
+        t->conn[i].state = CONN_DONE;
+    }
+    return 0;
+}
+
+static void target_free(target_t *t) {
+    for (int i = 0; i < t->conns; i++) {
+        if (t->conn[i].fd >= 0) close(t->conn[i].fd);
+    }
+    free(t->conn);
+    free(t->probe);
+    free(t->ring);
+    free(t->rtt);
+}
+
+static void conn_close(target_loop_t *loop, target_conn_t *c) {
+    if (c->state == CONN_DONE) return;
+    target_t *t = c->target;
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->fd = -1;
+    c->state = CONN_DONE;
+    if (--t->active == 0) t->finish_ns = now_ns();
+}
+
+static void conn_upload_ready(target_loop_t *loop, target_conn_t *c) {
+    target_t *t = c->target;
+    if (c->state == CONN_SENDING) {
+        for (int i = 0; i < TARGET_IO_BURST; i++) {
+            long n = send(c->fd, loop->send_buffer, t->spec.write_size, MSG_NOSIGNAL);
+            if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+            if (n <= 0) {
+                target_fail(t, strerror(n < 0 ? errno : EPIPE));
+                conn_close(loop, c);
+                return;
+            }
+            c->bytes += n;
+        }
+        return;
+    }
+
+    // The results block after our half-close, perhaps split across reads
+    while (c->tail_fill < sizeof(c->tail)) {
+        long n = recv(c->fd, c->tail + c->tail_fill, sizeof(c->tail) - c->tail_fill, 0);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        if (n <= 0) break;
+        c->tail_fill += n;
+    }
+    c->have_results = c->tail_fill == sizeof(c->tail) &&
+                      control_decode_results(c->tail, sizeof(c->tail), &c->results) == 0;
+    conn_close(loop, c);
+}
+
+static void conn_keep_tail(target_conn_t *c, const char *data, long n) {
+    const long tail_size = sizeof(c->tail);
+    if (n >= tail_size) {
+        memcpy(c->tail, data + n - tail_size, tail_size);
+    } else {
+        memmove(c->tail, c->tail + n, tail_size - n);
+        memcpy(c->tail + tail_size - n, data, n);
+    }
+    c->bytes += n;
+}
+
+// Downloads read until the server closes; the last bytes are its results trailer
+static void conn_download_ready(target_loop_t *loop, target_conn_t *c) {
+    target_t *t = c->target;
+    for (int i = 0; i < TARGET_IO_BURST; i++) {
+        long n = recv(c->fd, loop->recv_buffer, t->spec.write_size, 0);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        if (n < 0) target_fail(t, strerror(errno));
+        if (n <= 0) break;
+        conn_keep_tail(c, loop->recv_buffer, n);
+        if (i == TARGET_IO_BURST - 1) return;
+    }
+    if (c->bytes >= (long)sizeof(c->tail) &&
+        control_decode_results(c->tail, sizeof(c->tail), &c->results) == 0) {
+        c->have_results = 1;
+        c->bytes -= sizeof(c->tail);
+    }
+    conn_close(loop, c);
+}
+
+// Echoes are matched to their send time by sequence; the results block ends the session
+static void conn_ping_ready(target_loop_t *loop, target_conn_t *c) {
+    target_t *t = c->target;
+    for (int i = 0; i < TARGET_IO_BURST; i++) {
+        long n = recv(c->fd, loop->recv_buffer, TARGET_RECV_SIZE, 0);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+        if (n < 0 && errno == ECONNREFUSED) {
+            target_fail(t, "server port unreachable");
+            conn_close(loop, c);
+            return;
+        }
+        if (n < 0) continue;
+        int64_t now = now_ns();
+
+        if (t->results_requested && n == (long)sizeof(struct control_results) &&
+            control_decode_results(loop->recv_buffer, n, &c->results) == 0) {
+            c->have_results = 1;
+            conn_close(loop, c);
+            return;
+        }
+        if (n < (long)sizeof(struct packet)) continue;
+        uint64_t seq = be64toh(((const struct packet*)loop->recv_buffer)->sequence);
+        target_probe_t *slot = &t->ring[seq & (TARGET_PING_RING - 1)];
+        if (slot->seq != seq || seq >= (uint64_t)t->sent) continue;
+        if (slot->sent_ns == 0) {
+            t->duplicates++;
+            continue;
+        }
+        int64_t rtt = now - slot->sent_ns;
+        slot->sent_ns = 0;
+        if (rtt > PROBE_TIMEOUT_MS * 1000000LL) {
+            t->late++;
+            continue;
+        }
+        histogram_record(t->rtt, (uint64_t)rtt);
+        t->received++;
+        t->interval_rtt_sum += rtt / 1e6;
+    }
+}
+
+static void target_send_probes(target_t *t, int64_t now) {
+    target_conn_t *c = &t->conn[0];
+    for (int burst = 0; burst < TARGET_IO_BURST && t->sent < t->spec.count && t->next_send_ns <= now; burst++) {
+        target_probe_t *slot = &t->ring[t->sent & (TARGET_PING_RING - 1)];
+        slot->seq = t->sent;
+        slot->sent_ns = now_ns();
+        udp_flow_stamp(t->probe, t->spec.size, t->sent, udp_flow_now_ns());
+        // A full socket buffer drops the probe, which then counts as lost
+        send(c->fd, t->probe, t->spec.size, 0);
+        c->bytes += t->spec.size;
+        t->sent++;
+        t->next_send_ns += t->interval_ns;
+    }
+    if (t->sent == t->spec.count && t->results_ns == 0) {
+        t->results_ns = now + PROBE_TIMEOUT_MS * 1000000LL;
+    }
+}
+
+/*
+ * Time-driven work: upload senders stop at the end time, pings go out on
+ * schedule and ask for results once the last echo is due, and anything past
+ * its deadline is abandoned. Returns the earliest time something is due.
+ */
+static int64_t target_service(target_loop_t *loop, target_t *t, int64_t now) {
+    if (t->active == 0) return INT64_MAX;
+    if (now >= t->deadline_ns) {
+        target_fail(t, "timed out");
+        for (int i = 0; i < t->conns; i++) conn_close(loop, &t->conn[i]);
+        return INT64_MAX;
+    }
+
+    int64_t due = t->deadline_ns;
+    if (t->spec.test == TARGET_UPLOAD) {
+        if (now < t->end_ns) return t->end_ns;
+        for (int i = 0; i < t->conns; i++) {
+            target_conn_t *c = &t->conn[i];
+            if (c->state != CONN_SENDING) continue;
+            // Half-close so the server sees the end and answers with its results
+            shutdown(c->fd, SHUT_WR);
+            c->state = CONN_RESULTS;
+            struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+            epoll_ctl(loop->epfd, EPOLL_CTL_MOD, c->fd, &ev);
+        }
+    } else if (t->spec.test == TARGET_PING) {
+        target_send_probes(t, now);
+        if (t->sent < t->spec.count) return t->next_send_ns;
+        if (!t->results_requested) {
+            if (now < t->results_ns) return t->results_ns;
+            control_header_t request;
+            control_header_init(&request, CONTROL_TEST_RESULTS, 0, 0);
+            control_send_header(t->conn[0].fd, &request, NULL, 0);
+            t->results_requested = 1;
+            t->deadline_ns = now + PROBE_TIMEOUT_MS * 1000000LL;
+            return t->deadline_ns;
+        }
+    }
+    return due;
+}
+
+static double megabytes(long bytes) {
+    return bytes / (1024.0 * 1024.0);
+}
+
+static void report_interval(target_loop_t *loop, target_t *targets, int count, double now) {
+    double start = loop->last_report, seconds = now - start;
+    if (seconds <= 0) return;
+    long sum = 0;
+    int moving = 0;
+    report_record_t record;
+
+    for (int i = 0; i < count; i++) {
+        target_t *t = &targets[i];
+        if (!t->opened) continue;
+        long bytes = 0;
+        for (int j = 0; j < t->conns; j++) bytes += t->conn[j].bytes;
+        long delta = bytes - t->last_bytes;
+        t->last_bytes = bytes;
+        report_record_init(&record, "interval", tests[t->spec.test], "client");
+        record.target = t->name;
+
+        if (t->spec.test == TARGET_PING) {
+            long replies = t->received - t->last_received;
+            printf("%s %.2f-%.2f s: %ld replies, mean RTT %.3f ms\n", t->label, start, now, replies,
+                   replies > 0 ? t->interval_rtt_sum / replies : 0.0);
+            record.fields |= REPORT_F_PACKETS;
+            record.packets = replies;
+            t->last_received = t->received;
+            t->interval_rtt_sum = 0;
+        } else {
+            printf("%s %.2f-%.2f s: %.2f MB (%.2f Mbps)\n", t->label, start, now, megabytes(delta),
+                   delta * 8 / seconds / 1e6);
+            sum += delta;
+            moving++;
+        }
+        report_set_bytes(&record, delta, start, now);
+        report_emit(&record);
+    }
+
+    if (moving > 1) {
+        printf("[SUM] %.2f-%.2f s: %.2f MB (%.2f Mbps) across %d targets\n", start, now, megabytes(sum),
+               sum * 8 / seconds / 1e6, moving);
+    }
+    report_record_init(&record, "interval", "targets", "client");
+    report_set_bytes(&record, sum, start, now);
+    report_emit(&record);
+    loop->last_report = now;
+}
+
+static void arm_reporter(int timer_fd, int64_t start_ns, double interval) {
+    int64_t step = (int64_t)(interval * 1e9);
+    int64_t first = start_ns + step;
+    struct itimerspec its;
+    its.it_value.tv_sec = first / 1000000000LL;
+    its.it_value.tv_nsec = first % 1000000000LL;
+    its.it_interval.tv_sec = step / 1000000000LL;
+    its.it_interval.tv_nsec = step % 1000000000LL;
+    timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+// Connects a wave, runs it on one clock and returns its wall time in seconds
+static double run_wave(target_loop_t *loop, target_t *targets, int count, const targets_options_t *opt) {
+    for (int i = 0; i < count; i++) {
+        target_t *t = &targets[i];
+        int ok = t->spec.test == TARGET_PING ? target_open_ping(t) : target_open_tcp(t, &opt->tuning);
+        for (int j = 0; j < t->conns; j++) {
+            target_conn_t *c = &t->conn[j];
+            if (ok == 0 && set_nonblocking(c->fd) == 0) {
+                t->active++;
+                continue;
+            }
+            if (c->fd >= 0) close(c->fd);
+            c->fd = -1;
+            c->state = CONN_DONE;
+        }
+        t->opened = ok == 0;
+    }
+
+    loop->epfd = epoll_create1(0);
+    int timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK);
+    if (loop->epfd < 0 || timer_fd < 0) {
+        perror("Failed to create the event loop");
+        if (loop->epfd >= 0) close(loop->epfd);
+        if (timer_fd >= 0) close(timer_fd);
+        return 0;
+    }
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };
+    epoll_ctl(loop->epfd, EPOLL_CTL_ADD, timer_fd, &ev);
+
+    int64_t start = now_ns();
+    loop->start_ns = start;
+    loop->last_report = 0;
+    for (int i = 0; i < count; i++) {
+        target_t *t = &targets[i];
+        t->start_ns = start;
+        t->finish_ns = start;
+        if (t->spec.test == TARGET_PING) {
+            t->interval_ns = (int64_t)(t->spec.interval * 1e9);
+            t->next_send_ns = start;
+            t->end_ns = start + t->spec.count * t->interval_ns;
+            t->deadline_ns = t->end_ns + (PROBE_TIMEOUT_MS + TARGET_GRACE_MS) * 1000000LL;
+        } else {
+            t->end_ns = start + t->spec.duration * 1000000000LL;
+            t->deadline_ns = t->end_ns + TARGET_GRACE_MS * 1000000LL;
+        }
+        for (int j = 0; j < t->conns; j++) {
+            target_conn_t *c = &t->conn[j];
+            if (c->state == CONN_DONE) continue;
+            struct epoll_event cev = { .events = c->state == CONN_SENDING ? EPOLLOUT : EPOLLIN, .data.ptr = c };
+            epoll_ctl(loop->epfd, EPOLL_CTL_ADD, c->fd, &cev);
+        }
+    }
+    arm_reporter(timer_fd, start, opt->report_interval);
+
+    struct epoll_event events[TARGET_EVENTS];
+    while (1) {
+        int64_t now = now_ns(), due = INT64_MAX;
+        int running = 0;
+        for (int i = 0; i < count; i++) {
+            int64_t next = target_service(loop, &targets[i], now);
+            if (next < due) due = next;
+            running += targets[i].active > 0;
+        }
+        if (!running) break;
+
+        int timeout_ms = 0;
+        if (due > now) timeout_ms = (int)((due - now + 999999) / 1000000);
+        if (timeout_ms > 1000) timeout_ms = 1000;
+        int n = epoll_wait(loop->epfd, events, TARGET_EVENTS, timeout_ms);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait failed");
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            target_conn_t *c = events[i].data.ptr;
+            if (!c) {
+                uint64_t expirations;
+                if (read(timer_fd, &expirations, sizeof(expirations)) > 0) {
+                    report_interval(loop, targets, count, (now_ns() - start) / 1e9);
+                }
+                continue;
+            }
+            switch (c->state) {
+                case CONN_SENDING:
+                case CONN_RESULTS: conn_upload_ready(loop, c); break;
+                case CONN_RECEIVING: conn_download_ready(loop, c); break;
+                case CONN_PING: conn_ping_ready(loop, c); break;
+                case CONN_DONE: break;
+            }
+        }
+    }
+
+    double elapsed = (now_ns() - start) / 1e9;
+    if (elapsed - loop->last_report >= 0.05) report_interval(loop, targets, count, elapsed);
+    close(timer_fd);
+    close(loop->epfd);
+    return elapsed;
+}
+
+// One target's client and server view; returns the payload bytes it moved
+static long target_summary(const target_t *t) {
+    report_record_t record;
+    const char *test = tests[t->spec.test];
+    double seconds = (t->finish_ns - t->start_ns) / 1e9;
+    if (t->spec.test == TARGET_UPLOAD && seconds > t->spec.duration) seconds = t->spec.duration;
+
+    if (t->spec.test == TARGET_PING) {
+        long lost = t->sent - t->received - t->late;
+        const histogram_t *h = t->rtt;
+        if (t->sent > 0 && h) {
+            printf("%s %ld sent, %ld replies, %ld late, %ld duplicates, loss %.2f%%", t->label, t->sent,
+                   t->received, t->late, t->duplicates, lost * 100.0 / t->sent);
+            if (h->total > 0) {
+                printf(", RTT min/p50/p99/max %.3f/%.3f/%.3f/%.3f ms", h->min / 1e6,
+                       histogram_percentile(h, 50.0) / 1e6, histogram_percentile(h, 99.0) / 1e6, h->max / 1e6);
+            }
+            if (t->conn[0].have_results) printf("; server echoed %llu", (unsigned long long)t->conn[0].results.packets);
+            printf("\n");
+
+            report_record_init(&record, "summary", test, "client");
+            record.target = t->name;
+            report_set_rtt(&record, h);
+            record.fields |= REPORT_F_PACKETS;
+            record.packets = t->sent;
+            record.lost = lost;
+            record.duplicates = t->duplicates;
+            report_emit(&record);
+        } else {
+            printf("%s no probes sent\n", t->label);
+        }
+        if (t->conn[0].have_results) {
+            report_record_init(&record, "summary", test, "server");
+            record.target = t->name;
+            report_set_results(&record, &t->conn[0].results, 1);
+            report_emit(&record);
+        }
+        return 0;
+    }
+
+    long bytes = 0, server_bytes = 0;
+    double server_seconds = 0;
+    int with_results = 0;
+    control_results_t total;
+    memset(&total, 0, sizeof(total));
+    for (int i = 0; i < t->conns; i++) {
+        const target_conn_t *c = &t->conn[i];
+        bytes += c->bytes;
+        if (!c->have_results) continue;
+        with_results++;
+        server_bytes += c->results.bytes;
+        if (c->results.duration_us / 1e6 > server_seconds) server_seconds = c->results.duration_us / 1e6;
+        total.test = c->results.test;
+        total.bytes += c->results.bytes;
+        if (c->results.duration_us > total.duration_us) total.duration_us = c->results.duration_us;
+    }
+
+    const char *verb = t->spec.test == TARGET_UPLOAD ? "sent" : "received";
+    printf("%s %d stream%s: %s %.2f MB in %.2f s (~%.2f Mbps)", t->label, t->conns, t->conns > 1 ? "s" : "",
+           verb, megabytes(bytes), seconds, seconds > 0 ? bytes * 8 / seconds / 1e6 : 0.0);
+    if (with_results > 0) {
+        printf("; server %s %.2f MB (~%.2f Mbps)", t->spec.test == TARGET_UPLOAD ? "received" : "sent",
+               megabytes(server_bytes), server_seconds > 0 ? server_bytes * 8 / server_seconds / 1e6 : 0.0);
+        if (with_results < t->conns) printf(" from %d of %d streams", with_results, t->conns);
+    }
+    printf("\n");
+
+    report_record_init(&record, "summary", test, "client");
+    record.target = t->name;
+    report_set_bytes(&record, bytes, 0.0, seconds);
+    report_emit(&record);
+    if (with_results > 0) {
+        report_record_init(&record, "summary", test, "server");
+        record.target = t->name;
+        report_set_results(&record, &total, 0);
+        report_emit(&record);
+    }
+    return bytes;
+}
+
+void run_targets(const char *path, const targets_options_t *opt) {
+    target_spec_t *specs;
+    int count = targets_parse_file(path, &opt->defaults, &specs);
+    if (count < 0) return;
+
+    target_t *targets = calloc(count, sizeof(target_t));
+    target_loop_t loop;
+    memset(&loop, 0, sizeof(loop));
+    loop.send_buffer = malloc(TUNING_MAX_WRITE);
+    loop.recv_buffer = malloc(TUNING_MAX_WRITE > TARGET_RECV_SIZE ? TUNING_MAX_WRITE : TARGET_RECV_SIZE);
+    if (!targets || !loop.send_buffer || !loop.recv_buffer) {
+        perror("Malloc failed");
+        exit(EXIT_FAILURE);
+    }
+    memset(loop.send_buffer, 'A', TUNING_MAX_WRITE);
+    for (int i = 0; i < count; i++) {
+        if (target_init(&targets[i], &specs[i], i + 1) < 0) exit(EXIT_FAILURE);
+    }
+    free(specs);
+
+    int per_wave = opt->parallel > 0 && opt->parallel < count ? opt->parallel : count;
+    int waves = (count + per_wave - 1) / per_wave;
+    printf("Targets: %d from %s, %d per wave, %d wave%s\n", count, path, per_wave, waves, waves > 1 ? "s" : "");
+
+    double total_seconds = 0;
+    long total_bytes = 0;
+    int completed = 0;
+    for (int w = 0; w < waves; w++) {
+        target_t *wave = &targets[w * per_wave];
+        int in_wave = count - w * per_wave < per_wave ? count - w * per_wave : per_wave;
+        printf("Wave %d: targets %d-%d\n", w + 1, wave[0].id, wave[in_wave - 1].id);
+
+        double seconds = run_wave(&loop, wave, in_wave, opt);
+        long wave_bytes = 0;
+        for (int i = 0; i < in_wave; i++) {
+            if (!wave[i].opened) {
+                printf("%s did not start\n", wave[i].label);
+                continue;
+            }
+            wave_bytes += target_summary(&wave[i]);
+            completed += !wave[i].failed;
+        }
+        if (waves > 1) {
+            printf("Wave %d: %.2f MB in %.2f s (~%.2f Mbps aggregate)\n", w + 1, megabytes(wave_bytes), seconds,
+                   seconds > 0 ? wave_bytes * 8 / seconds / 1e6 : 0.0);
+        }
+        total_bytes += wave_bytes;
+        total_seconds += seconds;
+        for (int i = 0; i < in_wave; i++) target_free(&wave[i]);
+    }
+
+    printf("Overall: %d of %d targets completed in %.2f s; %.2f MB moved (~%.2f Mbps aggregate)\n", completed,
+           count, total_seconds, megabytes(total_bytes),
+           total_seconds > 0 ? total_bytes * 8 / total_seconds / 1e6 : 0.0);
+    report_record_t record;
+    report_record_init(&record, "summary", "targets", "client");
+    report_set_bytes(&record, total_bytes, 0.0, total_seconds);
+    report_emit(&record);
+
+    free(loop.send_buffer);
+    free(loop.recv_buffer);
+    free(targets);
+}
@@ -0,0 +1,87 @@
+#include "../include/tcpinfo.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/tcp.h>
+
+/*
+ * TCP_INFO sampling. One getsockopt copies a snapshot of the socket's state
+ * without touching the data path, so sampling every 100 ms costs nothing
+ * measurable. The kernel headers' struct tcp_info is used rather than
+ * glibc's, which predates the delivery-rate and limited-time fields; an
+ * older kernel returns a shorter struct and those fields simply read as 0.
+ */
+
+int tcpinfo_read(int sock, tcpinfo_t *out) {
+    struct tcp_info ti;
+    socklen_t len = sizeof(ti);
+    memset(&ti, 0, sizeof(ti));
+    if (getsockopt(sock, IPPROTO_TCP, TCP_INFO, &ti, &len) < 0) return -1;
+
+    out->cwnd = ti.tcpi_snd_cwnd;
+    out->mss = ti.tcpi_snd_mss;
+    out->srtt_us = ti.tcpi_rtt;
+    out->rttvar_us = ti.tcpi_rttvar;
+    out->rcv_rtt_us = ti.tcpi_rcv_rtt;
+    out->rcv_space = ti.tcpi_rcv_space;
+    out->retransmits = ti.tcpi_total_retrans;
+    out->delivery_rate = ti.tcpi_delivery_rate;
+    out->pacing_rate = ti.tcpi_pacing_rate;
+    out->busy_us = ti.tcpi_busy_time;
+    out->rwnd_limited_us = ti.tcpi_rwnd_limited;
+    out->sndbuf_limited_us = ti.tcpi_sndbuf_limited;
+    return 0;
+}
+
+void tcpinfo_summary_add(tcpinfo_summary_t *s, const tcpinfo_t *info) {
+    s->samples++;
+    s->cwnd_sum += info->cwnd;
+    s->srtt_sum_us += info->srtt_us;
+    if (info->cwnd > s->cwnd_max) s->cwnd_max = info->cwnd;
+    if (info->srtt_us > s->srtt_max_us) s->srtt_max_us = info->srtt_us;
+    s->last = *info;
+}
+
+int tcpinfo_sample(int sock, tcpinfo_summary_t *s) {
+    tcpinfo_t info;
+    if (tcpinfo_read(sock, &info) < 0) return -1;
+    tcpinfo_summary_add(s, &info);
+    return 0;
+}
+
+// Samples once `*next_ms` (CLOCK_MONOTONIC) has passed and schedules the next sample
+int tcpinfo_sample_due(int sock, tcpinfo_summary_t *s, long *next_ms) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long now_ms = now.tv_sec * 1000L + now.tv_nsec / 1000000L;
+    if (now_ms < *next_ms) return 0;
+    *next_ms = now_ms + TCPINFO_INTERVAL_MS;
+    return tcpinfo_sample(sock, s) == 0;
+}
+
+static double percent(uint64_t part_us, double seconds) {
+    return seconds > 0 ? part_us / 1e4 / seconds : 0.0;
+}
+
+// State now, and counters as the change since `prev` over `seconds`
+void tcpinfo_print_interval(const char *label, const tcpinfo_t *now, const tcpinfo_t *prev, double seconds) {
+    printf("%s: cwnd %u, srtt %.3f ms (var %.3f), rcv rtt %.3f ms, retrans %u, delivery %.2f Mbps, "
+           "busy %.0f%%, rwnd-limited %.0f%%, sndbuf-limited %.0f%%\n",
+           label, now->cwnd, now->srtt_us / 1e3, now->rttvar_us / 1e3, now->rcv_rtt_us / 1e3,
+           now->retransmits - prev->retransmits, now->delivery_rate * 8.0 / 1e6,
+           percent(now->busy_us - prev->busy_us, seconds),
+           percent(now->rwnd_limited_us - prev->rwnd_limited_us, seconds),
+           percent(now->sndbuf_limited_us - prev->sndbuf_limited_us, seconds));
+}
+
+void tcpinfo_print_summary(const char *label, const tcpinfo_summary_t *s, double seconds) {
+    if (s->samples == 0) return;
+    printf("%s: %u samples, cwnd mean %.0f max %u, srtt mean %.3f ms max %.3f ms, retrans %u, "
+           "delivery %.2f Mbps, busy %.0f%%, rwnd-limited %.0f%%, sndbuf-limited %.0f%%\n",
+           label, s->samples, s->cwnd_sum / s->samples, s->cwnd_max,
+           s->srtt_sum_us / s->samples / 1e3, s->srtt_max_us / 1e3, s->last.retransmits,
+           s->last.delivery_rate * 8.0 / 1e6, percent(s->last.busy_us, seconds),
+           percent(s->last.rwnd_limited_us, seconds), percent(s->last.sndbuf_limited_us, seconds));
+}
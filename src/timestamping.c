@@ -0,0 +1,163 @@
+#include "../include/timestamping.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <ifaddrs.h>
+#include <net/if.h>
+#include <netinet/in.h>
+#include <sys/ioctl.h>
+#include <linux/errqueue.h>
+#include <linux/net_tstamp.h>
+#include <linux/sockios.h>
+
+/*
+ * Kernel and NIC packet timestamps via SO_TIMESTAMPING. Receive stamps
+ * arrive as a cmsg on the reply; transmit stamps are queued on the socket
+ * error queue, keyed by a per-socket send counter (SOF_TIMESTAMPING_OPT_ID)
+ * that starts at 0 when timestamping is enabled. Hardware mode also requests
+ * software stamps, so each sample can fall back to them when the device
+ * (loopback, veth) does not stamp in hardware.
+ */
+
+int tstamp_parse_mode(const char *name, tstamp_mode_t *mode) {
+    if (strcmp(name, "sw") == 0) {
+        *mode = TSTAMP_SOFTWARE;
+    } else if (strcmp(name, "hw") == 0) {
+        *mode = TSTAMP_HARDWARE;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+const char *tstamp_mode_name(tstamp_mode_t mode) {
+    switch (mode) {
+        case TSTAMP_SOFTWARE: return "software";
+        case TSTAMP_HARDWARE: return "hardware";
+        default: return "off";
+    }
+}
+
+// Turns on NIC stamping for the interface that owns the socket's local address
+static int enable_device_timestamps(int sock) {
+    struct sockaddr_in local;
+    socklen_t len = sizeof(local);
+    if (getsockname(sock, (struct sockaddr*)&local, &len) < 0) return -1;
+
+    struct ifaddrs *ifs, *ifa;
+    if (getifaddrs(&ifs) < 0) return -1;
+
+    int ret = -1;
+    for (ifa = ifs; ifa; ifa = ifa->ifa_next) {
+        if (!ifa->ifa_addr || ifa->ifa_addr->sa_family != AF_INET) continue;
+        if (((struct sockaddr_in*)ifa->ifa_addr)->sin_addr.s_addr != local.sin_addr.s_addr) continue;
+
+        struct hwtstamp_config config;
+        memset(&config, 0, sizeof(config));
+        config.tx_type = HWTSTAMP_TX_ON;
+        config.rx_filter = HWTSTAMP_FILTER_ALL;
+
+        struct ifreq ifr;
+        memset(&ifr, 0, sizeof(ifr));
+        strncpy(ifr.ifr_name, ifa->ifa_name, sizeof(ifr.ifr_name) - 1);
+        ifr.ifr_data = (void*)&config;
+        ret = ioctl(sock, SIOCSHWTSTAMP, &ifr);
+        break;
+    }
+
+    freeifaddrs(ifs);
+    return ret;
+}
+
+/*
+ * Enables timestamping on a connected socket. Returns the mode actually in
+ * effect: hardware degrades to software when the device refuses, and
+ * TSTAMP_OFF means user-space stamps only.
+ */
+tstamp_mode_t tstamp_enable(int sock, tstamp_mode_t wanted) {
+    if (wanted == TSTAMP_OFF) return TSTAMP_OFF;
+
+    unsigned int flags = SOF_TIMESTAMPING_SOFTWARE | SOF_TIMESTAMPING_TX_SOFTWARE |
+                         SOF_TIMESTAMPING_RX_SOFTWARE | SOF_TIMESTAMPING_OPT_ID |
+                         SOF_TIMESTAMPING_OPT_TSONLY;
+    tstamp_mode_t mode = TSTAMP_SOFTWARE;
+
+    if (wanted == TSTAMP_HARDWARE) {
+        if (enable_device_timestamps(sock) == 0) {
+            flags |= SOF_TIMESTAMPING_TX_HARDWARE | SOF_TIMESTAMPING_RX_HARDWARE |
+                     SOF_TIMESTAMPING_RAW_HARDWARE | SOF_TIMESTAMPING_OPT_TX_SWHW;
+            mode = TSTAMP_HARDWARE;
+        } else {
+            printf("Hardware timestamping unavailable on this interface, using software stamps\n");
+        }
+    }
+
+    if (setsockopt(sock, SOL_SOCKET, SO_TIMESTAMPING, &flags, sizeof(flags)) < 0) {
+        perror("setsockopt SO_TIMESTAMPING failed");
+        return TSTAMP_OFF;
+    }
+    return mode;
+}
+
+static int64_t timespec_ns(const struct timespec *ts) {
+    return (int64_t)ts->tv_sec * 1000000000LL + ts->tv_nsec;
+}
+
+// Extracts an SCM_TIMESTAMPING cmsg; returns 1 if one was present
+int tstamp_from_cmsg(struct msghdr *msg, tstamp_t *ts) {
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(msg); cm; cm = CMSG_NXTHDR(msg, cm)) {
+        if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPING) {
+            struct scm_timestamping stamps;
+            memcpy(&stamps, CMSG_DATA(cm), sizeof(stamps));
+            ts->sw_ns = timespec_ns(&stamps.ts[0]);
+            ts->hw_ns = timespec_ns(&stamps.ts[2]);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * Reads one transmit stamp from the error queue without blocking. Returns 1
+ * with the send counter in `key`, 2 for an entry without a stamp or key
+ * (skip it and read on), 0 if the queue is empty, -1 on error. Software and
+ * hardware stamps for one send may arrive as separate entries.
+ */
+int tstamp_read_tx(int sock, uint32_t *key, tstamp_t *ts) {
+    char control[TSTAMP_CONTROL_LEN];
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    if (recvmsg(sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    }
+
+    int have_stamp = 0, have_key = 0;
+    memset(ts, 0, sizeof(*ts));
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+        if (cm->cmsg_level == SOL_SOCKET && cm->cmsg_type == SCM_TIMESTAMPING) {
+            struct scm_timestamping stamps;
+            memcpy(&stamps, CMSG_DATA(cm), sizeof(stamps));
+            ts->sw_ns = timespec_ns(&stamps.ts[0]);
+            ts->hw_ns = timespec_ns(&stamps.ts[2]);
+            have_stamp = 1;
+        } else {
+            struct sock_extended_err *serr = (struct sock_extended_err*)CMSG_DATA(cm);
+            if (serr->ee_errno == ENOMSG && serr->ee_origin == SO_EE_ORIGIN_TIMESTAMPING) {
+                *key = serr->ee_data;
+                have_key = 1;
+            }
+        }
+    }
+    return have_stamp && have_key ? 1 : 2;
+}
+
+// RTT from kernel stamps, preferring hardware when both ends have it; 0 if unknown
+int64_t tstamp_rtt_ns(const tstamp_t *tx, const tstamp_t *rx) {
+    if (tx->hw_ns && rx->hw_ns) return rx->hw_ns - tx->hw_ns;
+    if (tx->sw_ns && rx->sw_ns) return rx->sw_ns - tx->sw_ns;
+    return 0;
+}
@@ -0,0 +1,200 @@
+#include "../include/tuning.h"
+#include "../include/shared.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+/*
+ * TCP socket tuning negotiated per test. The client applies its options
+ * before connecting, so the receive buffer also shapes the window scale it
+ * offers; the server applies the same options to the accepted socket as soon
+ * as the control header names them. The kernel clamps SO_SNDBUF/SO_RCVBUF to
+ * net.core.wmem_max/rmem_max unless we hold CAP_NET_ADMIN, so the effective
+ * values are read back rather than assumed.
+ */
+
+#define CONGESTION_AVAILABLE "/proc/sys/net/ipv4/tcp_available_congestion_control"
+
+// Parses a byte count such as "65536", "64K" or "4M" (binary units); -1 if invalid
+int tuning_parse_size(const char *text) {
+    if (strcasecmp(text, "default") == 0) return 0;
+    char *end;
+    double size = strtod(text, &end);
+    if (end == text || size < 0) return -1;
+    switch (*end) {
+        case 'k': case 'K': size *= 1024; end++; break;
+        case 'm': case 'M': size *= 1024 * 1024; end++; break;
+        case 'g': case 'G': size *= 1024 * 1024 * 1024; end++; break;
+        default: break;
+    }
+    if (*end != '\0' || size > 0x7fffffff) return -1;
+    return (int)size;
+}
+
+// Appends a comma-separated list of sizes; -1 on a bad entry or too many
+int tuning_grid_add_sizes(int *values, int *count, const char *list) {
+    char copy[256];
+    snprintf(copy, sizeof(copy), "%s", list);
+
+    char *save;
+    for (char *item = strtok_r(copy, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+        int size = tuning_parse_size(item);
+        if (size < 0 || *count >= TUNING_GRID_MAX) return -1;
+        values[(*count)++] = size;
+    }
+    return 0;
+}
+
+int tuning_grid_add_names(tuning_grid_t *grid, const char *list) {
+    char copy[256];
+    snprintf(copy, sizeof(copy), "%s", list);
+
+    char *save;
+    for (char *item = strtok_r(copy, ", \n", &save); item; item = strtok_r(NULL, ", \n", &save)) {
+        if (strlen(item) >= CONTROL_CC_NAME || grid->congestion_count >= TUNING_GRID_MAX) return -1;
+        strcpy(grid->congestion[grid->congestion_count++], item);
+    }
+    return 0;
+}
+
+// Fills the dimensions left empty: a few write and buffer sizes, every available algorithm
+void tuning_grid_defaults(tuning_grid_t *grid) {
+    static const int writes[] = { 8 * 1024, 32 * 1024, 128 * 1024 };
+    static const int buffers[] = { 0, 256 * 1024, 4 * 1024 * 1024 };
+
+    if (grid->write_count == 0) {
+        memcpy(grid->write_sizes, writes, sizeof(writes));
+        grid->write_count = sizeof(writes) / sizeof(writes[0]);
+    }
+    if (grid->buffer_count == 0) {
+        memcpy(grid->buffers, buffers, sizeof(buffers));
+        grid->buffer_count = sizeof(buffers) / sizeof(buffers[0]);
+    }
+    if (grid->congestion_count == 0) {
+        char names[256];
+        FILE *f = fopen(CONGESTION_AVAILABLE, "r");
+        if (f && fgets(names, sizeof(names), f)) tuning_grid_add_names(grid, names);
+        if (f) fclose(f);
+    }
+    if (grid->congestion_count == 0) {
+        grid->congestion[0][0] = '\0';
+        grid->congestion_count = 1;
+    }
+}
+
+int tuning_is_default(const tuning_options_t *t) {
+    return t->write_size == 0 && t->socket_buffer == 0 && t->mss == 0 && !t->nodelay && !t->congestion[0];
+}
+
+// A single test takes the first value given for each dimension
+void tuning_from_grid(tuning_options_t *t, const tuning_grid_t *grid) {
+    if (grid->write_count > 0) t->write_size = grid->write_sizes[0];
+    if (grid->buffer_count > 0) t->socket_buffer = grid->buffers[0];
+    if (grid->congestion_count > 0) strcpy(t->congestion, grid->congestion[0]);
+}
+
+void tuning_to_header(const tuning_options_t *t, control_header_t *h) {
+    h->buffer_size = t->write_size > 0 ? t->write_size : BUFFER_SIZE;
+    h->socket_buffer = t->socket_buffer;
+    h->mss = t->mss;
+    if (t->nodelay) h->flags |= CONTROL_FLAG_NODELAY;
+    if (t->verify) h->flags |= CONTROL_FLAG_VERIFY;
+    memcpy(h->congestion, t->congestion, sizeof(h->congestion));
+}
+
+void tuning_from_header(const control_header_t *h, tuning_options_t *t) {
+    memset(t, 0, sizeof(*t));
+    t->write_size = tuning_write_size(h);
+    t->socket_buffer = h->socket_buffer;
+    t->mss = h->mss;
+    t->nodelay = (h->flags & CONTROL_FLAG_NODELAY) != 0;
+    t->verify = (h->flags & CONTROL_FLAG_VERIFY) != 0;
+    memcpy(t->congestion, h->congestion, sizeof(t->congestion));
+}
+
+// The write size a TCP session asked for, clamped to what the server will allocate
+int tuning_write_size(const control_header_t *h) {
+    if (h->buffer_size <= 0) return BUFFER_SIZE;
+    return h->buffer_size > TUNING_MAX_WRITE ? TUNING_MAX_WRITE : h->buffer_size;
+}
+
+static int set_buffer(int sock, int force_option, int option, int size, const char *name) {
+    // The FORCE variants ignore the sysctl ceiling but need CAP_NET_ADMIN
+    if (setsockopt(sock, SOL_SOCKET, force_option, &size, sizeof(size)) == 0) return 0;
+    if (setsockopt(sock, SOL_SOCKET, option, &size, sizeof(size)) == 0) return 0;
+    fprintf(stderr, "setsockopt %s %d failed: %s\n", name, size, strerror(errno));
+    return -1;
+}
+
+// Applies every option that differs from the default; returns -1 if any was refused
+int tuning_apply(int sock, const tuning_options_t *t) {
+    int ret = 0;
+    if (t->socket_buffer > 0) {
+        ret |= set_buffer(sock, SO_SNDBUFFORCE, SO_SNDBUF, t->socket_buffer, "SO_SNDBUF");
+        ret |= set_buffer(sock, SO_RCVBUFFORCE, SO_RCVBUF, t->socket_buffer, "SO_RCVBUF");
+    }
+    if (t->nodelay) {
+        int one = 1;
+        if (setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one)) < 0) {
+            perror("setsockopt TCP_NODELAY failed");
+            ret = -1;
+        }
+    }
+    if (t->mss > 0 && setsockopt(sock, IPPROTO_TCP, TCP_MAXSEG, &t->mss, sizeof(t->mss)) < 0) {
+        fprintf(stderr, "setsockopt TCP_MAXSEG %d failed: %s\n", t->mss, strerror(errno));
+        ret = -1;
+    }
+    if (t->congestion[0] &&
+        setsockopt(sock, IPPROTO_TCP, TCP_CONGESTION, t->congestion, strlen(t->congestion)) < 0) {
+        fprintf(stderr, "setsockopt TCP_CONGESTION %s failed: %s\n", t->congestion, strerror(errno));
+        ret = -1;
+    }
+    return ret ? -1 : 0;
+}
+
+static void format_size(int size, char *buf, size_t len) {
+    if (size == 0) {
+        snprintf(buf, len, "default");
+    } else if (size % (1024 * 1024) == 0) {
+        snprintf(buf, len, "%dM", size / (1024 * 1024));
+    } else if (size % 1024 == 0) {
+        snprintf(buf, len, "%dK", size / 1024);
+    } else {
+        snprintf(buf, len, "%d", size);
+    }
+}
+
+// "write 32K, buffer 256K, congestion cubic" plus MSS and nodelay when set
+void tuning_describe(const tuning_options_t *t, char *buf, size_t len) {
+    char write_size[16], buffer[16];
+    format_size(t->write_size > 0 ? t->write_size : BUFFER_SIZE, write_size, sizeof(write_size));
+    format_size(t->socket_buffer, buffer, sizeof(buffer));
+    int n = snprintf(buf, len, "write %s, buffer %s, congestion %s", write_size, buffer,
+                     t->congestion[0] ? t->congestion : "default");
+    if (t->mss > 0 && n > 0 && (size_t)n < len) n += snprintf(buf + n, len - n, ", MSS %d", t->mss);
+    if (t->nodelay && n > 0 && (size_t)n < len) snprintf(buf + n, len - n, ", nodelay");
+}
+
+// Reads back what the kernel actually granted
+void tuning_print_effective(const char *label, int sock) {
+    int sndbuf = 0, rcvbuf = 0, mss = 0, nodelay = 0;
+    char congestion[CONTROL_CC_NAME] = "";
+    socklen_t len = sizeof(int);
+    getsockopt(sock, SOL_SOCKET, SO_SNDBUF, &sndbuf, &len);
+    len = sizeof(int);
+    getsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, &len);
+    len = sizeof(int);
+    getsockopt(sock, IPPROTO_TCP, TCP_MAXSEG, &mss, &len);
+    len = sizeof(int);
+    getsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &nodelay, &len);
+    len = sizeof(congestion) - 1;
+    getsockopt(sock, IPPROTO_TCP, TCP_CONGESTION, congestion, &len);
+
+    printf("%s: SO_SNDBUF %d, SO_RCVBUF %d, MSS %d, %s%s\n", label, sndbuf, rcvbuf, mss,
+           congestion[0] ? congestion : "unknown", nodelay ? ", nodelay" : "");
+}
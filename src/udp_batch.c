@@ -0,0 +1,219 @@
+#define _GNU_SOURCE
+#include "../include/udp_batch.h"
+#include "../include/shared.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <netinet/udp.h>
+
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+
+/*
+ * UDP datapath shared by the client and both servers. With batch == 0 it
+ * behaves like the original one-datagram-per-syscall loops; otherwise each
+ * call moves up to `batch` messages with sendmmsg/recvmmsg. With offload on,
+ * every sent message is a UDP_SEGMENT super-buffer that the kernel splits
+ * into datagram_size datagrams, and received messages may be UDP_GRO
+ * coalesced runs whose segment size arrives in a cmsg.
+ *
+ * Every datagram, including each GSO segment, is stamped with its own
+ * sequence number and send time, and receivers split GRO runs back into
+ * datagrams before handing them to the sequence accounting.
+ */
+
+/*
+ * Sender options for datagrams a server sends to a client: the datagram
+ * size and rate come from the client's header when it sets them, batching
+ * and offload from the server's own options.
+ */
+void udp_batch_options_for(udp_batch_options_t *opt, const udp_batch_options_t *server,
+                           const control_header_t *header) {
+    *opt = *server;
+    if (header->buffer_size >= (int)sizeof(struct packet) && header->buffer_size <= UDP_MAX_DATAGRAM) {
+        opt->datagram_size = header->buffer_size;
+    }
+    if (header->rate > 0) opt->rate = header->rate;
+}
+
+int udp_batch_init(udp_batch_t *b, const udp_batch_options_t *opt, int receive) {
+    memset(b, 0, sizeof(*b));
+    b->opt = *opt;
+    b->receive = receive;
+    if (b->opt.datagram_size <= 0) {
+        b->opt.datagram_size = (opt->batch > 0 || opt->offload) ? UDP_MTU_DATAGRAM : BUFFER_SIZE;
+    }
+    if (b->opt.batch > UDP_MAX_BATCH) b->opt.batch = UDP_MAX_BATCH;
+
+    int count = b->opt.batch > 0 ? b->opt.batch : 1;
+    b->segments = 1;
+    if (receive) {
+        // The receiver cannot know the sender's datagram size up front
+        b->msg_bytes = opt->offload ? UDP_GRO_BUFFER :
+                       (size_t)(b->opt.datagram_size > BUFFER_SIZE ? b->opt.datagram_size : BUFFER_SIZE);
+    } else {
+        if (opt->offload) {
+            b->segments = UDP_GSO_MAX_BYTES / b->opt.datagram_size;
+            if (b->segments > UDP_GSO_MAX_SEGMENTS) b->segments = UDP_GSO_MAX_SEGMENTS;
+            if (b->segments < 1) b->segments = 1;
+        }
+        b->msg_bytes = (size_t)b->opt.datagram_size * b->segments;
+    }
+
+    b->msgs = calloc(count, sizeof(struct mmsghdr));
+    b->iov = calloc(count, sizeof(struct iovec));
+    b->buffers = malloc(b->msg_bytes * count);
+    b->control = calloc(count, CMSG_SPACE(sizeof(int)));
+    if (!b->msgs || !b->iov || !b->buffers || !b->control) {
+        perror("Malloc failed");
+        udp_batch_free(b);
+        return -1;
+    }
+    memset(b->buffers, 'A', b->msg_bytes * count);
+
+    for (int i = 0; i < count; i++) {
+        b->iov[i].iov_base = b->buffers + i * b->msg_bytes;
+        b->iov[i].iov_len = b->msg_bytes;
+        b->msgs[i].msg_hdr.msg_iov = &b->iov[i];
+        b->msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+    return 0;
+}
+
+int udp_batch_configure_socket(int sock, const udp_batch_options_t *opt, int receive) {
+    if (!opt->offload) return 0;
+
+    if (receive) {
+        int one = 1;
+        if (setsockopt(sock, SOL_UDP, UDP_GRO, &one, sizeof(one)) < 0) {
+            perror("setsockopt UDP_GRO failed");
+            return -1;
+        }
+    } else {
+        int size = opt->datagram_size > 0 ? opt->datagram_size : UDP_MTU_DATAGRAM;
+        if (setsockopt(sock, SOL_UDP, UDP_SEGMENT, &size, sizeof(size)) < 0) {
+            perror("setsockopt UDP_SEGMENT failed");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Segment size of a UDP_GRO coalesced message, or 0 for a single datagram
+static long gro_segment_size(struct msghdr *msg) {
+    for (struct cmsghdr *cm = CMSG_FIRSTHDR(msg); cm; cm = CMSG_NXTHDR(msg, cm)) {
+        if (cm->cmsg_level == SOL_UDP && cm->cmsg_type == UDP_GRO) {
+            return *(int*)CMSG_DATA(cm);
+        }
+    }
+    return 0;
+}
+
+size_t udp_batch_bytes(const udp_batch_t *b) {
+    return b->msg_bytes * (b->opt.batch > 0 ? b->opt.batch : 1);
+}
+
+/*
+ * Sends one batch. Returns the payload bytes accepted, or -1 with errno set.
+ * `peer` may be NULL on a connected socket. `sequence` is the next sequence
+ * number to stamp and is advanced past every datagram actually sent.
+ */
+long udp_batch_send(udp_batch_t *b, int sock, const struct sockaddr_in *peer, socklen_t peer_len,
+                    uint64_t *sequence) {
+    int count = b->opt.batch > 0 ? b->opt.batch : 1;
+    int64_t now_ns = udp_flow_now_ns();
+    for (int i = 0; i < count; i++) {
+        b->msgs[i].msg_hdr.msg_name = (void*)peer;
+        b->msgs[i].msg_hdr.msg_namelen = peer ? peer_len : 0;
+        for (int k = 0; k < b->segments; k++) {
+            udp_flow_stamp(b->buffers + i * b->msg_bytes + k * b->opt.datagram_size,
+                           b->opt.datagram_size, *sequence + i * b->segments + k, now_ns);
+        }
+    }
+
+    long sent;
+    if (b->opt.batch > 0) {
+        sent = sendmmsg(sock, b->msgs, count, MSG_NOSIGNAL);
+    } else {
+        sent = sendmsg(sock, &b->msgs[0].msg_hdr, MSG_NOSIGNAL) < 0 ? -1 : 1;
+    }
+    b->syscalls++;
+    if (sent < 0) return -1;
+
+    long bytes = sent * (long)b->msg_bytes;
+    *sequence += sent * b->segments;
+    b->bytes += bytes;
+    b->packets += sent * b->segments;
+    return bytes;
+}
+
+/*
+ * Receives up to one batch. Returns the payload bytes received, or -1 with
+ * errno set (EAGAIN when a non-blocking socket has nothing queued). Each
+ * datagram is recorded in `seq` when it is not NULL; control results blocks
+ * are stored in b->results instead.
+ */
+long udp_batch_recv(udp_batch_t *b, int sock, udp_seq_stats_t *seq) {
+    int count = b->opt.batch > 0 ? b->opt.batch : 1;
+    size_t control_len = CMSG_SPACE(sizeof(int));
+    for (int i = 0; i < count; i++) {
+        b->msgs[i].msg_hdr.msg_name = NULL;
+        b->msgs[i].msg_hdr.msg_namelen = 0;
+        b->msgs[i].msg_hdr.msg_control = b->opt.offload ? b->control + i * control_len : NULL;
+        b->msgs[i].msg_hdr.msg_controllen = b->opt.offload ? control_len : 0;
+    }
+
+    long received;
+    if (b->opt.batch > 0) {
+        received = recvmmsg(sock, b->msgs, count, MSG_WAITFORONE, NULL);
+    } else {
+        long len = recvmsg(sock, &b->msgs[0].msg_hdr, 0);
+        b->msgs[0].msg_len = len;
+        received = len < 0 ? -1 : 1;
+    }
+    b->syscalls++;
+    if (received < 0) return -1;
+
+    int64_t arrival_ns = udp_flow_now_ns();
+    long bytes = 0;
+    for (int i = 0; i < received; i++) {
+        long len = b->msgs[i].msg_len;
+        long segment = b->opt.offload ? gro_segment_size(&b->msgs[i].msg_hdr) : 0;
+        if (segment <= 0 || segment > len) segment = len;
+        bytes += len;
+        if (len == 0) {
+            b->packets++;
+            continue;
+        }
+
+        char *data = b->iov[i].iov_base;
+        for (long off = 0; off < len; off += segment) {
+            long seg_len = len - off < segment ? len - off : segment;
+            // The server's results blocks trail the test data on the same socket
+            control_results_t results;
+            if (seg_len == (long)sizeof(struct control_results) &&
+                control_decode_results(data + off, seg_len, &results) == 0) {
+                if (b->have_results < UDP_BATCH_RESULTS) b->results[b->have_results++] = results;
+                bytes -= seg_len;
+                continue;
+            }
+            if (seq) udp_seq_record(seq, data + off, seg_len, arrival_ns);
+            b->packets++;
+        }
+    }
+    b->bytes += bytes;
+    return bytes;
+}
+
+void udp_batch_free(udp_batch_t *b) {
+    free(b->msgs);
+    free(b->iov);
+    free(b->buffers);
+    free(b->control);
+    b->msgs = NULL;
+    b->iov = NULL;
+    b->buffers = NULL;
+    b->control = NULL;
+}
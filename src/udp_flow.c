@@ -0,0 +1,187 @@
+#include "../include/udp_flow.h"
+#include "../include/shared.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <endian.h>
+
+/*
+ * Sender pacing and receiver-side sequence accounting for UDP tests. Every
+ * datagram starts with a struct packet header carrying its sequence number
+ * and CLOCK_REALTIME send time; the receiver derives loss, reordering,
+ * duplication and RFC 3550 jitter from those headers alone.
+ */
+
+static double timespec_ns(const struct timespec *ts) {
+    return ts->tv_sec * 1e9 + ts->tv_nsec;
+}
+
+// Parses a bit rate such as "800K", "100M" or "2.5G" into bits per second
+double udp_parse_rate(const char *text) {
+    char *end;
+    double rate = strtod(text, &end);
+    switch (*end) {
+        case 'k': case 'K': rate *= 1e3; break;
+        case 'm': case 'M': rate *= 1e6; break;
+        case 'g': case 'G': rate *= 1e9; break;
+        default: break;
+    }
+    return rate > 0 ? rate : 0;
+}
+
+/*
+ * `burst_bytes` is what one send carries. The first send goes out at once
+ * and each later one is due a send's worth of time after the previous due
+ * time, so the schedule is absolute rather than relative to when the
+ * sender actually woke.
+ */
+void udp_pacer_init(udp_pacer_t *p, double bits_per_sec, size_t burst_bytes) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    p->rate = bits_per_sec / 8.0;
+    p->next_ns = timespec_ns(&now);
+    p->catchup_ns = UDP_PACER_CATCHUP_NS;
+    if (p->rate > 0 && burst_bytes * UDP_PACER_CATCHUP_SENDS / p->rate * 1e9 > p->catchup_ns) {
+        p->catchup_ns = burst_bytes * UDP_PACER_CATCHUP_SENDS / p->rate * 1e9;
+    }
+}
+
+/*
+ * Returns 0 and books `bytes` on the schedule if they may be sent now,
+ * otherwise the nanoseconds until they are due. A sender that wakes late,
+ * from sleep overshoot or a slow syscall, is due again at once until it has
+ * made up the time; lateness beyond catchup_ns is forgiven instead, so a
+ * long stall does not turn into a burst.
+ */
+long udp_pacer_delay_ns(udp_pacer_t *p, size_t bytes) {
+    if (p->rate <= 0) return 0;
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    double now = timespec_ns(&ts);
+    if (now < p->next_ns) {
+        long delay = (long)(p->next_ns - now);
+        return delay > 0 ? delay : 1;
+    }
+    if (p->next_ns < now - p->catchup_ns) p->next_ns = now - p->catchup_ns;
+    p->next_ns += bytes / p->rate * 1e9;
+    return 0;
+}
+
+// Blocks until `bytes` may be sent: sleeps for long waits, spins for short ones
+void udp_pacer_wait(udp_pacer_t *p, size_t bytes) {
+    long delay;
+    while ((delay = udp_pacer_delay_ns(p, bytes)) > 0) {
+        if (delay > UDP_PACER_MAX_SPIN_NS) {
+            struct timespec ts;
+            long sleep_ns = delay - UDP_PACER_MAX_SPIN_NS / 2;
+            ts.tv_sec = sleep_ns / 1000000000L;
+            ts.tv_nsec = sleep_ns % 1000000000L;
+            clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, NULL);
+        }
+    }
+}
+
+int64_t udp_flow_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void udp_flow_stamp(void *datagram, size_t len, uint64_t sequence, int64_t now_ns) {
+    if (len < sizeof(struct packet)) return;
+    struct packet *pkt = (struct packet*)datagram;
+    pkt->sequence = htobe64(sequence);
+    pkt->timestamp_ns = htobe64((uint64_t)now_ns);
+    pkt->length = htonl((uint32_t)len);
+}
+
+void udp_seq_init(udp_seq_stats_t *st) {
+    memset(st, 0, sizeof(*st));
+}
+
+static int window_test_and_set(udp_seq_stats_t *st, uint64_t seq) {
+    uint64_t bit = seq % UDP_SEQ_WINDOW;
+    uint64_t mask = 1ULL << (bit % 64);
+    int was_set = (st->window[bit / 64] & mask) != 0;
+    st->window[bit / 64] |= mask;
+    return was_set;
+}
+
+static void window_clear(udp_seq_stats_t *st, uint64_t from, uint64_t to) {
+    if (to - from >= UDP_SEQ_WINDOW) {
+        memset(st->window, 0, sizeof(st->window));
+        return;
+    }
+    for (uint64_t seq = from; seq <= to; seq++) {
+        uint64_t bit = seq % UDP_SEQ_WINDOW;
+        st->window[bit / 64] &= ~(1ULL << (bit % 64));
+    }
+}
+
+void udp_seq_record(udp_seq_stats_t *st, const void *datagram, size_t len, int64_t arrival_ns) {
+    if (len < sizeof(struct packet)) return;
+    const struct packet *pkt = (const struct packet*)datagram;
+    uint64_t seq = be64toh(pkt->sequence);
+    int64_t sent_ns = (int64_t)be64toh(pkt->timestamp_ns);
+
+    if (seq >= st->next) {
+        window_clear(st, st->next, seq);
+        window_test_and_set(st, seq);
+        st->lost += seq - st->next;
+        st->next = seq + 1;
+    } else if (st->next - seq > UDP_SEQ_WINDOW) {
+        // Too old to tell apart from a duplicate; count it as a late arrival
+        st->out_of_order++;
+        st->lost--;
+    } else if (window_test_and_set(st, seq)) {
+        st->duplicates++;
+        return;
+    } else {
+        st->out_of_order++;
+        st->lost--;
+    }
+
+    st->received++;
+    st->bytes += len;
+
+    // RFC 3550 section 6.4.1: the clock offset between hosts cancels out
+    int64_t transit = arrival_ns - sent_ns;
+    if (st->have_transit) {
+        int64_t d = transit - st->last_transit_ns;
+        if (d < 0) d = -d;
+        st->jitter_ns += (d - st->jitter_ns) / 16.0;
+    }
+    st->last_transit_ns = transit;
+    st->have_transit = 1;
+}
+
+/*
+ * Copies the counters, not the reorder window, with relaxed atomic loads and
+ * stores. The receiving thread publishes into a shared copy after each batch
+ * and a reporter thread snapshots from it, so neither sees a torn value.
+ */
+void udp_seq_publish(udp_seq_stats_t *dst, const udp_seq_stats_t *src) {
+    double jitter;
+    __atomic_store_n(&dst->received, __atomic_load_n(&src->received, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    __atomic_store_n(&dst->bytes, __atomic_load_n(&src->bytes, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    __atomic_store_n(&dst->lost, __atomic_load_n(&src->lost, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    __atomic_store_n(&dst->out_of_order, __atomic_load_n(&src->out_of_order, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    __atomic_store_n(&dst->duplicates, __atomic_load_n(&src->duplicates, __ATOMIC_RELAXED), __ATOMIC_RELAXED);
+    __atomic_load(&src->jitter_ns, &jitter, __ATOMIC_RELAXED);
+    __atomic_store(&dst->jitter_ns, &jitter, __ATOMIC_RELAXED);
+}
+
+// Prints the change since `prev` and then advances `prev` to `now`
+void udp_seq_report(const char *label, const udp_seq_stats_t *now, udp_seq_stats_t *prev, double seconds) {
+    long received = now->received - prev->received;
+    long lost = now->lost - prev->lost;
+    long expected = received + lost;
+
+    printf("%s: %.2f Mbps, %ld/%ld lost (%.2f%%), %ld out-of-order, %ld duplicates, jitter %.3f ms\n",
+           label, seconds > 0 ? (now->bytes - prev->bytes) * 8.0 / seconds / 1e6 : 0.0,
+           lost, expected, expected > 0 ? lost * 100.0 / expected : 0.0,
+           now->out_of_order - prev->out_of_order, now->duplicates - prev->duplicates,
+           now->jitter_ns / 1e6);
+    *prev = *now;
+}
@@ -0,0 +1,418 @@
+#include "../include/uring.h"
+#include "../include/shared.h"
+#include "../include/log.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+
+/*
+ * io_uring data path for TCP streams, spoken through the raw system calls so
+ * the build needs nothing beyond the kernel headers. One ring drives every
+ * stream of a test: senders keep `depth` writes of a registered payload
+ * buffer in flight, receivers keep one read (or one multishot receive) armed.
+ * Sockets are registered as fixed files so no submission takes a file
+ * reference, and a single io_uring_enter both submits new work and waits for
+ * completions, which is what the syscall counter measures.
+ */
+
+typedef struct {
+    int fd;
+    unsigned entries;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_flags;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    unsigned sqe_tail;          // next free SQE, made visible to the kernel on submit
+    unsigned submitted;         // SQEs already made visible
+    void *sq_map, *cq_map;
+    size_t sq_map_size, cq_map_size, sqes_size;
+    int sqpoll;
+    long enters;
+} ring_t;
+
+int io_engine_parse(const char *text, io_engine_options_t *opt) {
+    char copy[64];
+    snprintf(copy, sizeof(copy), "%s", text);
+
+    char *save = NULL;
+    char *name = strtok_r(copy, ",", &save);
+    if (!name) return -1;
+    if (strcmp(name, "socket") == 0) {
+        opt->engine = IO_ENGINE_SOCKET;
+    } else if (strcmp(name, "uring") == 0) {
+        opt->engine = IO_ENGINE_URING;
+    } else {
+        return -1;
+    }
+
+    for (char *flag = strtok_r(NULL, ",", &save); flag; flag = strtok_r(NULL, ",", &save)) {
+        if (opt->engine != IO_ENGINE_URING) return -1;
+        if (strcmp(flag, "sqpoll") == 0) {
+            opt->sqpoll = 1;
+        } else if (strcmp(flag, "multishot") == 0) {
+            opt->multishot = 1;
+        } else {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+const char *io_engine_name(const io_engine_options_t *opt) {
+    if (opt->engine != IO_ENGINE_URING) return "socket";
+    if (opt->sqpoll && opt->multishot) return "io_uring (sqpoll, multishot)";
+    if (opt->sqpoll) return "io_uring (sqpoll)";
+    if (opt->multishot) return "io_uring (multishot)";
+    return "io_uring";
+}
+
+void io_engine_print_usage(const char *label, long syscalls, double cpu_seconds, double seconds) {
+    printf("%s: %ld syscalls (%.0f/s), %.1f%% CPU\n", label, syscalls,
+           seconds > 0 ? syscalls / seconds : 0.0, seconds > 0 ? cpu_seconds * 100.0 / seconds : 0.0);
+}
+
+static void ring_close(ring_t *r) {
+    if (r->sqes) munmap(r->sqes, r->sqes_size);
+    if (r->cq_map && r->cq_map != r->sq_map) munmap(r->cq_map, r->cq_map_size);
+    if (r->sq_map) munmap(r->sq_map, r->sq_map_size);
+    if (r->fd >= 0) close(r->fd);
+    r->fd = -1;
+}
+
+static void *ring_map(int fd, size_t size, off_t offset) {
+    void *p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, offset);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+static int ring_init(ring_t *r, unsigned entries, int sqpoll) {
+    struct io_uring_params p;
+    memset(r, 0, sizeof(*r));
+    memset(&p, 0, sizeof(p));
+    if (sqpoll) {
+        p.flags = IORING_SETUP_SQPOLL;
+        p.sq_thread_idle = 1000;
+    }
+
+    r->fd = syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0) {
+        perror("io_uring_setup failed");
+        return -1;
+    }
+    r->sqpoll = sqpoll;
+    r->entries = p.sq_entries;
+
+    r->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_map_size > r->sq_map_size) r->sq_map_size = r->cq_map_size;
+        r->cq_map_size = r->sq_map_size;
+    }
+    r->sq_map = ring_map(r->fd, r->sq_map_size, IORING_OFF_SQ_RING);
+    r->cq_map = !r->sq_map ? NULL : (p.features & IORING_FEAT_SINGLE_MMAP)
+                ? r->sq_map : ring_map(r->fd, r->cq_map_size, IORING_OFF_CQ_RING);
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = ring_map(r->fd, r->sqes_size, IORING_OFF_SQES);
+    if (!r->sq_map || !r->cq_map || !r->sqes) {
+        perror("io_uring mmap failed");
+        ring_close(r);
+        return -1;
+    }
+
+    char *sq = r->sq_map;
+    r->sq_head = (unsigned*)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    r->sq_flags = (unsigned*)(sq + p.sq_off.flags);
+    // SQEs are filled in ring order, so the indirection array is the identity
+    unsigned *array = (unsigned*)(sq + p.sq_off.array);
+    for (unsigned i = 0; i < p.sq_entries; i++) array[i] = i;
+
+    char *cq = r->cq_map;
+    r->cq_head = (unsigned*)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    return 0;
+}
+
+static struct io_uring_sqe *ring_get_sqe(ring_t *r) {
+    unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    if (r->sqe_tail - head >= r->entries) return NULL;
+    struct io_uring_sqe *sqe = &r->sqes[r->sqe_tail & *r->sq_mask];
+    r->sqe_tail++;
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+static struct io_uring_cqe *ring_peek_cqe(ring_t *r) {
+    unsigned head = *r->cq_head;
+    if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) return NULL;
+    return &r->cqes[head & *r->cq_mask];
+}
+
+static void ring_cqe_seen(ring_t *r) {
+    __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Publishes queued SQEs and, unless completions are already waiting, blocks
+ * for at least one for up to timeout_ms. Under SQPOLL the kernel thread picks
+ * submissions up by itself, so the call is skipped unless that thread has
+ * gone idle or there is nothing to do but wait.
+ */
+static int ring_submit_and_wait(ring_t *r, long timeout_ms) {
+    unsigned to_submit = r->sqe_tail - r->submitted;
+    unsigned flags = 0;
+    if (to_submit) {
+        __atomic_store_n(r->sq_tail, r->sqe_tail, __ATOMIC_RELEASE);
+        r->submitted = r->sqe_tail;
+    }
+
+    int wait = ring_peek_cqe(r) == NULL;
+    if (r->sqpoll) {
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(r->sq_flags, __ATOMIC_RELAXED) & IORING_SQ_NEED_WAKEUP) {
+            flags |= IORING_ENTER_SQ_WAKEUP;
+        }
+        if (!flags && !wait) return 0;
+    } else if (!to_submit && !wait) {
+        return 0;
+    }
+
+    struct __kernel_timespec ts;
+    struct io_uring_getevents_arg arg;
+    memset(&arg, 0, sizeof(arg));
+    if (wait) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+        arg.ts = (__u64)(uintptr_t)&ts;
+        flags |= IORING_ENTER_GETEVENTS;
+    }
+    flags |= IORING_ENTER_EXT_ARG;
+
+    r->enters++;
+    long ret = syscall(__NR_io_uring_enter, r->fd, to_submit, wait ? 1 : 0, flags, &arg, sizeof(arg));
+    if (ret < 0 && errno != ETIME && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+        perror("io_uring_enter failed");
+        return -1;
+    }
+    return 0;
+}
+
+// Hands buffer `bid` of the provided-buffer ring back to the kernel
+static void buf_ring_recycle(struct io_uring_buf_ring *br, char *base, size_t size, unsigned short bid) {
+    unsigned short tail = br->tail;
+    struct io_uring_buf *buf = &br->bufs[tail & (URING_BUF_RING - 1)];
+    buf->addr = (__u64)(uintptr_t)(base + (size_t)bid * size);
+    buf->len = size;
+    buf->bid = bid;
+    __atomic_store_n(&br->tail, (unsigned short)(tail + 1), __ATOMIC_RELEASE);
+}
+
+static long elapsed_ms(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000L + (now.tv_nsec - start->tv_nsec) / 1000000L;
+}
+
+/*
+ * Runs every stream to completion on one io_uring. Senders write until the
+ * stop flag or the duration ends them and then wait out their in-flight
+ * writes; receivers read until EOF. Streams still busy at the deadline, or
+ * senders whose writes outlive URING_DRAIN_MS, are shut down and marked
+ * failed. Returns 0, or -1 if the ring could not be set up.
+ */
+int uring_drive_streams(uring_stream_t *streams, int count, const io_engine_options_t *opt,
+                        const uring_limits_t *limits, uring_data_fn on_data, void *arg,
+                        uring_stats_t *stats) {
+    int depth = opt->depth > 0 ? opt->depth : URING_DEFAULT_DEPTH;
+    if (depth > URING_MAX_DEPTH) depth = URING_MAX_DEPTH;
+    memset(stats, 0, sizeof(*stats));
+
+    int senders = 0, receivers = 0;
+    size_t slot = BUFFER_SIZE;
+    for (int i = 0; i < count; i++) {
+        if (streams[i].receive) receivers++;
+        else senders++;
+        if (streams[i].size <= 0) streams[i].size = BUFFER_SIZE;
+        if ((size_t)streams[i].size > slot) slot = streams[i].size;
+        streams[i].inflight = 0;
+        streams[i].done = 0;
+        streams[i].failed = 0;
+    }
+    int multishot = opt->multishot && receivers > 0;
+
+    ring_t ring;
+    if (ring_init(&ring, senders * depth + receivers + 1, opt->sqpoll) < 0) return -1;
+
+    // Buffer 0 is the shared send payload, 1 + i is stream i's read buffer
+    int nbufs = 1 + (multishot ? 0 : count);
+    char *buffers = malloc((size_t)nbufs * slot);
+    struct iovec *iov = calloc(nbufs, sizeof(struct iovec));
+    int *fds = calloc(count, sizeof(int));
+    char *provided = NULL;
+    struct io_uring_buf_ring *br = NULL;
+    size_t br_size = URING_BUF_RING * sizeof(struct io_uring_buf);
+    int result = -1;
+    if (!buffers || !iov || !fds) {
+        perror("Malloc failed");
+        goto out;
+    }
+    memset(buffers, 'A', slot);
+    for (int i = 0; i < nbufs; i++) {
+        iov[i].iov_base = buffers + (size_t)i * slot;
+        iov[i].iov_len = slot;
+    }
+    for (int i = 0; i < count; i++) fds[i] = streams[i].sock;
+
+    if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_BUFFERS, iov, nbufs) < 0) {
+        perror("io_uring buffer registration failed");
+        goto out;
+    }
+    if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_FILES, fds, count) < 0) {
+        perror("io_uring file registration failed");
+        goto out;
+    }
+
+    if (multishot) {
+        provided = malloc((size_t)URING_BUF_RING * slot);
+        br = mmap(NULL, br_size, PROT_READ | PROT_WRITE, MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+        if (br == MAP_FAILED) br = NULL;
+        if (!provided || !br) {
+            perror("Malloc failed");
+            goto out;
+        }
+        struct io_uring_buf_reg reg;
+        memset(&reg, 0, sizeof(reg));
+        reg.ring_addr = (__u64)(uintptr_t)br;
+        reg.ring_entries = URING_BUF_RING;
+        reg.bgid = 0;
+        if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+            perror("io_uring buffer ring registration failed");
+            goto out;
+        }
+        for (int i = 0; i < URING_BUF_RING; i++) {
+            buf_ring_recycle(br, provided, slot, i);
+        }
+    }
+
+    struct timespec begin;
+    clock_gettime(CLOCK_MONOTONIC, &begin);
+    int stopping = 0, drained = 0, cut = 0;
+    long stop_at = 0;
+
+    while (1) {
+        long elapsed = elapsed_ms(&begin);
+        if (!stopping && ((limits->stop && *limits->stop) ||
+                          (limits->duration_ms > 0 && elapsed >= limits->duration_ms))) {
+            stopping = 1;
+            stop_at = elapsed;
+        }
+        // Cutting a stream off shuts its socket down, which completes whatever it has in flight
+        if (!cut && limits->deadline_ms > 0 && elapsed >= limits->deadline_ms) {
+            cut = stopping = 1;
+            for (int i = 0; i < count; i++) {
+                if (streams[i].done && streams[i].inflight == 0) continue;
+                shutdown(streams[i].sock, SHUT_RDWR);
+                streams[i].failed = 1;
+            }
+        }
+        if (stopping && !drained && elapsed - stop_at >= URING_DRAIN_MS) {
+            drained = 1;
+            for (int i = 0; i < count; i++) {
+                if (streams[i].receive || streams[i].inflight == 0) continue;
+                shutdown(streams[i].sock, SHUT_RDWR);
+                streams[i].failed = 1;
+            }
+        }
+
+        int active = 0;
+        for (int i = 0; i < count; i++) {
+            uring_stream_t *s = &streams[i];
+            struct io_uring_sqe *sqe;
+            if (!s->done && s->receive && s->inflight == 0 && (sqe = ring_get_sqe(&ring))) {
+                sqe->fd = i;
+                sqe->flags = IOSQE_FIXED_FILE;
+                sqe->user_data = i;
+                if (multishot) {
+                    sqe->opcode = IORING_OP_RECV;
+                    sqe->flags |= IOSQE_BUFFER_SELECT;
+                    sqe->buf_group = 0;
+                    sqe->ioprio = IORING_RECV_MULTISHOT;
+                } else {
+                    sqe->opcode = IORING_OP_READ_FIXED;
+                    sqe->addr = (__u64)(uintptr_t)iov[1 + i].iov_base;
+                    sqe->len = s->size;
+                    sqe->buf_index = 1 + i;
+                }
+                s->inflight++;
+                stats->submitted++;
+            }
+            while (!s->done && !s->receive && !stopping && s->inflight < depth &&
+                   (sqe = ring_get_sqe(&ring))) {
+                sqe->opcode = IORING_OP_WRITE_FIXED;
+                sqe->fd = i;
+                sqe->flags = IOSQE_FIXED_FILE;
+                sqe->addr = (__u64)(uintptr_t)buffers;
+                sqe->len = s->size;
+                sqe->buf_index = 0;
+                sqe->user_data = i;
+                s->inflight++;
+                stats->submitted++;
+            }
+            if (!s->receive && stopping && s->inflight == 0) s->done = 1;
+            if (!s->done || s->inflight > 0) active = 1;
+        }
+        if (!active) break;
+
+        if (ring_submit_and_wait(&ring, URING_WAIT_MS) < 0) goto out;
+
+        struct io_uring_cqe *cqe;
+        while ((cqe = ring_peek_cqe(&ring))) {
+            int i = (int)cqe->user_data;
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            ring_cqe_seen(&ring);
+            stats->completed++;
+
+            uring_stream_t *s = &streams[i];
+            if (!(multishot && s->receive && (flags & IORING_CQE_F_MORE))) s->inflight--;
+            if (res > 0) {
+                if (s->receive && on_data) {
+                    const char *data = multishot
+                        ? provided + (size_t)(flags >> IORING_CQE_BUFFER_SHIFT) * slot
+                        : iov[1 + i].iov_base;
+                    on_data(arg, i, data, res);
+                }
+                __atomic_store_n(&s->bytes, s->bytes + res, __ATOMIC_RELAXED);
+            } else if (!(multishot && res == -ENOBUFS)) {
+                // A multishot receive that ran out of buffers is simply re-armed
+                if (res < 0 && !s->failed && !stopping && !(limits->stop && *limits->stop)) {
+                    log_error("%s: %s", s->receive ? "Data recieve failed" : "Data send failed", strerror(-res));
+                    s->failed = 1;
+                }
+                s->done = 1;
+            }
+            if (multishot && (flags & IORING_CQE_F_BUFFER)) {
+                buf_ring_recycle(br, provided, slot, flags >> IORING_CQE_BUFFER_SHIFT);
+            }
+        }
+    }
+    result = 0;
+
+out:
+    stats->enters = ring.enters;
+    ring_close(&ring);
+    if (br) munmap(br, br_size);
+    free(provided);
+    free(fds);
+    free(iov);
+    free(buffers);
+    return result;
+}
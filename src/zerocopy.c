@@ -0,0 +1,179 @@
+#define _GNU_SOURCE
+#include "../include/zerocopy.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <linux/errqueue.h>
+
+/*
+ * Download payload sources. Every mode sends the same constant 'A' payload;
+ * sendfile and splice read it from a memfd so the bytes never cross into
+ * user space, MSG_ZEROCOPY pins the user-space copy instead. The payload is
+ * never written after zerocopy_init_payload, so MSG_ZEROCOPY completions only
+ * need reaping to bound the pinned-page accounting, not to reuse the buffer.
+ */
+
+static char *payload;
+static int payload_fd = -1;
+static size_t payload_size;
+
+int zerocopy_parse_mode(const char *name, zerocopy_mode_t *mode) {
+    if (strcmp(name, "copy") == 0) {
+        *mode = ZC_COPY;
+    } else if (strcmp(name, "sendfile") == 0) {
+        *mode = ZC_SENDFILE;
+    } else if (strcmp(name, "splice") == 0) {
+        *mode = ZC_SPLICE;
+    } else if (strcmp(name, "zerocopy") == 0) {
+        *mode = ZC_MSG_ZEROCOPY;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+const char *zerocopy_mode_name(zerocopy_mode_t mode) {
+    switch (mode) {
+        case ZC_SENDFILE: return "sendfile";
+        case ZC_SPLICE: return "splice";
+        case ZC_MSG_ZEROCOPY: return "zerocopy";
+        default: return "copy";
+    }
+}
+
+int zerocopy_init_payload(size_t size) {
+    payload_size = size;
+    payload = malloc(size);
+    if (!payload) {
+        perror("Malloc failed");
+        return -1;
+    }
+    memset(payload, 'A', size);
+
+    payload_fd = memfd_create("lan_speed_payload", 0);
+    if (payload_fd < 0) {
+        perror("memfd_create failed");
+        return -1;
+    }
+    if (write(payload_fd, payload, size) != (ssize_t)size) {
+        perror("Failed to fill payload memfd");
+        close(payload_fd);
+        payload_fd = -1;
+        return -1;
+    }
+    return 0;
+}
+
+int zerocopy_sender_init(zerocopy_sender_t *zs, zerocopy_mode_t mode, int sock) {
+    memset(zs, 0, sizeof(*zs));
+    zs->mode = mode;
+    zs->pipe_fd[0] = zs->pipe_fd[1] = -1;
+
+    if (mode == ZC_SPLICE) {
+        if (pipe2(zs->pipe_fd, O_NONBLOCK) < 0) {
+            perror("pipe failed");
+            return -1;
+        }
+        fcntl(zs->pipe_fd[1], F_SETPIPE_SZ, (int)payload_size);
+    } else if (mode == ZC_MSG_ZEROCOPY) {
+        int one = 1;
+        if (setsockopt(sock, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0) {
+            perror("setsockopt SO_ZEROCOPY failed");
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// Drains MSG_ZEROCOPY completion notifications from the socket error queue
+static void reap_completions(zerocopy_sender_t *zs, int sock, int wait) {
+    int retries = 1000;
+    while (zs->zc_completed != zs->zc_issued) {
+        char control[128];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if (recvmsg(sock, &msg, MSG_ERRQUEUE | (wait ? 0 : MSG_DONTWAIT)) < 0) {
+            if (errno == EINTR) continue;
+            if (wait && retries-- > 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                usleep(100);
+                continue;
+            }
+            return;
+        }
+
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            struct sock_extended_err *serr = (struct sock_extended_err*)CMSG_DATA(cm);
+            if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+            // ee_info..ee_data is an inclusive range of completed send calls
+            unsigned int count = serr->ee_data - serr->ee_info + 1;
+            zs->zc_completed += count;
+            if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) zs->zc_copied += count;
+        }
+    }
+}
+
+/*
+ * Sends up to `len` bytes of the payload, at most its full size. Returns the
+ * bytes accepted by the socket, or -1 with errno set (EAGAIN on a
+ * non-blocking socket that is full).
+ */
+long zerocopy_send(zerocopy_sender_t *zs, int sock, size_t len) {
+    off_t offset = 0;
+    long n;
+
+    if (len == 0 || len > payload_size) len = payload_size;
+
+    switch (zs->mode) {
+        case ZC_SENDFILE:
+            return sendfile(sock, payload_fd, &offset, len);
+        case ZC_SPLICE:
+            if (zs->pipe_bytes == 0) {
+                n = splice(payload_fd, &offset, zs->pipe_fd[1], NULL, len, SPLICE_F_MOVE);
+                if (n < 0) return -1;
+                zs->pipe_bytes = n;
+            }
+            n = splice(zs->pipe_fd[0], NULL, sock, NULL, zs->pipe_bytes, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (n > 0) zs->pipe_bytes -= n;
+            return n;
+        case ZC_MSG_ZEROCOPY:
+            if (zs->zc_issued - zs->zc_completed >= ZEROCOPY_MAX_INFLIGHT) {
+                reap_completions(zs, sock, 0);
+            }
+            n = send(sock, payload, len, MSG_ZEROCOPY | MSG_NOSIGNAL);
+            if (n < 0 && errno == ENOBUFS) {
+                // Out of optmem for pinned pages: wait for the kernel to release some
+                reap_completions(zs, sock, 1);
+                n = send(sock, payload, len, MSG_ZEROCOPY | MSG_NOSIGNAL);
+            }
+            if (n >= 0) zs->zc_issued++;
+            return n;
+        default:
+            return send(sock, payload, len, MSG_NOSIGNAL);
+    }
+}
+
+void zerocopy_sender_close(zerocopy_sender_t *zs, int sock) {
+    if (zs->mode == ZC_MSG_ZEROCOPY) {
+        reap_completions(zs, sock, 0);
+        if (zs->zc_issued > 0) {
+            printf("MSG_ZEROCOPY: %u sends, %u completions, %u fell back to copy\n",
+                   zs->zc_issued, zs->zc_completed, zs->zc_copied);
+        }
+    }
+    if (zs->pipe_fd[0] >= 0) close(zs->pipe_fd[0]);
+    if (zs->pipe_fd[1] >= 0) close(zs->pipe_fd[1]);
+    zs->pipe_fd[0] = zs->pipe_fd[1] = -1;
+}
+
+double zerocopy_cpu_per_gb(double cpu_seconds, long bytes) {
+    return bytes > 0 ? cpu_seconds / (bytes / 1e9) : 0.0;
+}